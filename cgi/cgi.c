@@ -28,6 +28,10 @@
 #include "util/neo_err.h"
 #include "util/neo_hdf.h"
 #include "util/neo_str.h"
+#include "util/neo_hash.h"
+#ifdef HAVE_PTHREADS
+#include "util/ulocks.h"
+#endif
 #include "cgi.h"
 #include "cgiwrap.h"
 #include "html.h"
@@ -1012,6 +1016,13 @@ static NEOERR *render_cb (void *ctx, char *buf)
   return err;
 }
 
+static NEOERR *render_write_cb (void *ctx, const char *buf, size_t len)
+{
+  STRING *str = (STRING *)ctx;
+
+  return nerr_pass(string_appendn(str, buf, len));
+}
+
 static NEOERR *cgi_headers (CGI *cgi)
 {
   NEOERR *err = STATUS_OK;
@@ -1257,30 +1268,16 @@ static void _log_clear_error (NEOERR **err)
   nerr_ignore(err);
 }
 
-NEOERR *cgi_output (CGI *cgi, STRING *str)
+/* Decide whether the output can be compressed, and if so add the
+ * Content-Encoding header to cgiout */
+static NEOERR *cgi_output_encoding (CGI *cgi, int is_html, int *use_deflate,
+                                   int *use_gzip)
 {
   NEOERR *err = STATUS_OK;
-  double dis;
-  int is_html = 0;
-  int use_deflate = 0;
-  int use_gzip = 0;
-  int do_debug = 0;
-  int do_timefooter = 0;
-  int ws_strip_level = 0;
   char *s, *e;
 
-  s = hdf_get_value (cgi->hdf, "Query.debug", NULL);
-  e = hdf_get_value (cgi->hdf, "Config.DebugPassword", NULL);
-  if (hdf_get_int_value(cgi->hdf, "Config.DebugEnabled", 0) && 
-      s && e && !strcmp(s, e)) do_debug = 1;
-  do_timefooter = hdf_get_int_value (cgi->hdf, "Config.TimeFooter", 1);
-  ws_strip_level = hdf_get_int_value (cgi->hdf, "Config.WhiteSpaceStrip", 1);
-
-  dis = ne_timef();
-  s = hdf_get_value (cgi->hdf, "cgiout.ContentType", "text/html");
-  if (!strcasecmp(s, "text/html"))
-    is_html = 1;
-
+  *use_deflate = 0;
+  *use_gzip = 0;
 #if defined(HTML_COMPRESSION)
   /* Determine whether or not we can compress the output */
   if (is_html && hdf_get_int_value (cgi->hdf, "Config.CompressionEnabled", 0))
@@ -1292,15 +1289,15 @@ NEOERR *cgi_output (CGI *cgi, STRING *str)
       char *next = NULL;
 
       e = strtok_r (s, ",", &next);
-      while (e && !use_deflate)
+      while (e && !*use_deflate)
       {
 	if (strstr(e, "deflate") != NULL)
 	{
-	  use_deflate = 1;
-	  use_gzip = 0;
+	  *use_deflate = 1;
+	  *use_gzip = 0;
 	}
 	else if (strstr(e, "gzip") != NULL)
-	  use_gzip = 1;
+	  *use_gzip = 1;
 	e = strtok_r (NULL, ",", &next);
       }
       free (s);
@@ -1313,37 +1310,103 @@ NEOERR *cgi_output (CGI *cgi, STRING *str)
 	e = hdf_get_value (cgi->hdf, "HTTP.Accept", NULL);
 	if (e && !strcmp(e, "*/*"))
 	{
-	  use_deflate = 0;
-	  use_gzip = 0;
+	  *use_deflate = 0;
+	  *use_gzip = 0;
 	}
       }
       else
       {
 	if (strncasecmp(s, "mozilla/5.", 10))
 	{
-	  use_deflate = 0;
-	  use_gzip = 0;
+	  *use_deflate = 0;
+	  *use_gzip = 0;
 	}
       }
     }
     else
     {
-      use_deflate = 0;
-      use_gzip = 0;
+      *use_deflate = 0;
+      *use_gzip = 0;
     }
-    if (use_deflate)
+    if (*use_deflate)
     {
       err = hdf_set_value (cgi->hdf, "cgiout.other.encoding",
 	  "Content-Encoding: deflate");
     }
-    else if (use_gzip)
+    else if (*use_gzip)
     {
       err = hdf_set_value (cgi->hdf, "cgiout.other.encoding",
 	  "Content-Encoding: gzip");
     }
-    if (err != STATUS_OK) return nerr_pass(err);
   }
 #endif
+  return nerr_pass(err);
+}
+
+/* The Query.debug output: the environment and the HDF, minus cookies */
+static NEOERR *cgi_debug_dump (CGI *cgi, STRING *str)
+{
+  NEOERR *err;
+  int x;
+
+  err = string_append (str, "<hr>");
+  if (err != STATUS_OK) return nerr_pass(err);
+  x = 0;
+  while (1)
+  {
+    char *k, *v;
+    err = cgiwrap_iterenv (x, &k, &v);
+    if (err != STATUS_OK) return nerr_pass(err);
+    if (k == NULL) break;
+    err =string_appendf (str, "%s = %s<br>", k, v);
+    if (err != STATUS_OK) return nerr_pass(err);
+    free(k);
+    free(v);
+    x++;
+  }
+  err = string_append (str, "<pre>");
+  if (err != STATUS_OK) return nerr_pass(err);
+  err = hdf_remove_tree (cgi->hdf, "Cookie");
+  if (err != STATUS_OK) return nerr_pass(err);
+  err = hdf_remove_tree (cgi->hdf, "HTTP.Cookie");
+  if (err != STATUS_OK) return nerr_pass(err);
+  err = hdf_dump_str (cgi->hdf, NULL, 0, str);
+  return nerr_pass(err);
+}
+
+static int cgi_do_debug (CGI *cgi)
+{
+  char *s, *e;
+
+  s = hdf_get_value (cgi->hdf, "Query.debug", NULL);
+  e = hdf_get_value (cgi->hdf, "Config.DebugPassword", NULL);
+  return (hdf_get_int_value(cgi->hdf, "Config.DebugEnabled", 0) &&
+          s && e && !strcmp(s, e));
+}
+
+NEOERR *cgi_output (CGI *cgi, STRING *str)
+{
+  NEOERR *err = STATUS_OK;
+  double dis;
+  int is_html = 0;
+  int use_deflate = 0;
+  int use_gzip = 0;
+  int do_debug = 0;
+  int do_timefooter = 0;
+  int ws_strip_level = 0;
+  char *s;
+
+  do_debug = cgi_do_debug(cgi);
+  do_timefooter = hdf_get_int_value (cgi->hdf, "Config.TimeFooter", 1);
+  ws_strip_level = hdf_get_int_value (cgi->hdf, "Config.WhiteSpaceStrip", 1);
+
+  dis = ne_timef();
+  s = hdf_get_value (cgi->hdf, "cgiout.ContentType", "text/html");
+  if (!strcasecmp(s, "text/html"))
+    is_html = 1;
+
+  err = cgi_output_encoding(cgi, is_html, &use_deflate, &use_gzip);
+  if (err != STATUS_OK) return nerr_pass(err);
 
   err = cgi_headers(cgi);
   if (err != STATUS_OK) return nerr_pass(err);
@@ -1351,7 +1414,6 @@ NEOERR *cgi_output (CGI *cgi, STRING *str)
   if (is_html)
   {
     char buf[50];
-    int x;
 
     if (do_timefooter)
     {
@@ -1368,28 +1430,7 @@ NEOERR *cgi_output (CGI *cgi, STRING *str)
 
     if (do_debug)
     {
-      err = string_append (str, "<hr>");
-      if (err != STATUS_OK) return nerr_pass(err);
-      x = 0;
-      while (1)
-      {
-	char *k, *v;
-	err = cgiwrap_iterenv (x, &k, &v);
-	if (err != STATUS_OK) return nerr_pass(err);
-	if (k == NULL) break;
-	err =string_appendf (str, "%s = %s<br>", k, v);
-	if (err != STATUS_OK) return nerr_pass(err);
-	free(k);
-	free(v);
-	x++;
-      }
-      err = string_append (str, "<pre>");
-      if (err != STATUS_OK) return nerr_pass(err);
-      err = hdf_remove_tree (cgi->hdf, "Cookie");
-      if (err != STATUS_OK) return nerr_pass(err);
-      err = hdf_remove_tree (cgi->hdf, "HTTP.Cookie");
-      if (err != STATUS_OK) return nerr_pass(err);
-      err = hdf_dump_str (cgi->hdf, NULL, 0, str);
+      err = cgi_debug_dump (cgi, str);
       if (err != STATUS_OK) return nerr_pass(err);
     }
   }
@@ -1541,13 +1582,546 @@ NEOERR *cgi_cs_init(CGI *cgi, CSPARSE **cs)
   return nerr_pass(err);
 }
 
+static NEOERR *_cs_cache_init(void *ctx, CSPARSE *cs)
+{
+  return nerr_pass(cgi_register_strfuncs(cs));
+}
+
+/* With Config.StreamBufferSize, cgi_display doesn't render the whole page
+ * into memory first.  Output is collected in a buffer of about that many
+ * bytes, and whenever it fills (or the template says <?cs flush ?>) it is
+ * whitespace stripped, compressed and written out.  No Content-Length is
+ * sent, so the server is free to use a chunked response.  The headers go
+ * out with the first write: anything the template sets in cgiout after
+ * that is too late, and so is a 500 if the render fails. */
+typedef struct _cgi_stream
+{
+  CGI *cgi;
+  STRING buf;
+  int size;
+  int threshold;      /* Buffer length at which to try a partial flush */
+  int started;        /* The headers have been sent */
+  int is_html;
+  int ws_strip_level;
+  int use_deflate;
+  int use_gzip;
+#if defined(HTML_COMPRESSION)
+  z_stream zs;
+  int zs_init;
+  unsigned int crc;
+  unsigned int total;
+#endif
+} CGI_STREAM;
+
+typedef enum
+{
+  STREAM_PARTIAL,     /* Send what can be whitespace stripped so far */
+  STREAM_ALL,         /* Send everything */
+  STREAM_FLUSH,       /* Send everything, and flush the compressor */
+  STREAM_FINISH       /* Send everything and end the compressed stream */
+} STREAM_FLUSH_MODE;
+
+/* Returns the length of the start of buf which cgi_html_ws_strip can be run
+ * on by itself without changing its result: up to the last line which
+ * starts with something other than white space, and isn't in a tag, pre
+ * or textarea.  0 if there is no such line. */
+static int ws_strip_split (const char *buf, int len)
+{
+  const char *p = buf, *end = buf + len;
+  const char *close;
+  int split = 0, l;
+
+  while (p < end)
+  {
+    if (*p == '<')
+    {
+      p++;
+      if (end - p < 8) break;
+      if (!strncasecmp(p, "textarea", 8))
+	close = "</textarea>";
+      else if (!strncasecmp(p, "pre", 3))
+	close = "</pre>";
+      else
+	close = ">";
+      l = strlen(close);
+      while (end - p >= l && strncasecmp(p, close, l)) p++;
+      if (end - p < l) break;
+      p += l;
+    }
+    else if (*p == '\n')
+    {
+      p++;
+      if (p < end && !isspace(*p)) split = p - buf;
+    }
+    else
+    {
+      p++;
+    }
+  }
+  return split;
+}
+
+static NEOERR *stream_start (CGI_STREAM *stream)
+{
+  NEOERR *err;
+  CGI *cgi = stream->cgi;
+  char *s;
+
+  s = hdf_get_value (cgi->hdf, "cgiout.ContentType", "text/html");
+  stream->is_html = !strcasecmp(s, "text/html");
+  if (stream->is_html)
+    stream->ws_strip_level = hdf_get_int_value (cgi->hdf,
+                                                "Config.WhiteSpaceStrip", 1);
+
+  err = cgi_output_encoding(cgi, stream->is_html, &(stream->use_deflate),
+                            &(stream->use_gzip));
+  if (err != STATUS_OK) return nerr_pass(err);
+  err = cgi_headers(cgi);
+  if (err != STATUS_OK) return nerr_pass(err);
+  stream->started = 1;
+
+#if defined(HTML_COMPRESSION)
+  if (stream->use_deflate || stream->use_gzip)
+  {
+    int ret;
+
+    ret = deflateInit2(&(stream->zs), Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                       -MAX_WBITS, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK)
+      return nerr_raise(NERR_SYSTEM, "deflateInit2 returned %d", ret);
+    stream->zs_init = 1;
+    if (stream->use_gzip)
+    {
+      char gz_buf[10] = {0x1f, 0x8b, Z_DEFLATED, 0 /*flags*/, 0,0,0,0 /*time*/,
+                         0 /*xflags*/, OS_CODE};
+
+      stream->crc = crc32(0L, Z_NULL, 0);
+      err = cgiwrap_write(gz_buf, 10);
+      if (err != STATUS_OK) return nerr_pass(err);
+    }
+  }
+#endif
+  return STATUS_OK;
+}
+
+static NEOERR *stream_send (CGI_STREAM *stream, const char *buf, int len,
+                            STREAM_FLUSH_MODE mode)
+{
+#if defined(HTML_COMPRESSION)
+  if (stream->zs_init)
+  {
+    NEOERR *err;
+    char out[8192];
+    int ret, zflush;
+
+    if (mode == STREAM_FINISH)
+      zflush = Z_FINISH;
+    else if (mode == STREAM_FLUSH)
+      zflush = Z_SYNC_FLUSH;
+    else
+      zflush = Z_NO_FLUSH;
+
+    if (stream->use_gzip)
+      stream->crc = crc32(stream->crc, (const Bytef *)buf, len);
+    stream->total += len;
+    stream->zs.next_in = (Bytef *)buf;
+    stream->zs.avail_in = len;
+    do
+    {
+      stream->zs.next_out = (Bytef *)out;
+      stream->zs.avail_out = sizeof(out);
+      ret = deflate(&(stream->zs), zflush);
+      if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+	return nerr_raise(NERR_SYSTEM, "deflate returned %d", ret);
+      if (stream->zs.avail_out < sizeof(out))
+      {
+	err = cgiwrap_write(out, sizeof(out) - stream->zs.avail_out);
+	if (err != STATUS_OK) return nerr_pass(err);
+      }
+    } while (stream->zs.avail_out == 0);
+    return STATUS_OK;
+  }
+#endif
+  if (len == 0) return STATUS_OK;
+  return nerr_pass(cgiwrap_write(buf, len));
+}
+
+static NEOERR *stream_flush (CGI_STREAM *stream, STREAM_FLUSH_MODE mode)
+{
+  NEOERR *err;
+  STRING part;
+  int len;
+  char save;
+
+  if (!stream->started)
+  {
+    err = stream_start(stream);
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+
+  len = stream->buf.len;
+  if (mode == STREAM_PARTIAL && stream->ws_strip_level)
+  {
+    len = ws_strip_split(stream->buf.buf, stream->buf.len);
+    if (len == 0)
+    {
+      /* Nowhere to split yet, don't rescan until there's twice as much */
+      stream->threshold = stream->buf.len * 2;
+      return STATUS_OK;
+    }
+  }
+  stream->threshold = stream->size;
+  if (len == 0)
+    return nerr_pass(stream_send(stream, NULL, 0, mode));
+
+  /* cgi_html_ws_strip NUL terminates what it strips, which clobbers the
+   * first character of whatever is left */
+  part = stream->buf;
+  part.len = len;
+  save = part.buf[len];
+  if (stream->ws_strip_level)
+    cgi_html_ws_strip(&part, stream->ws_strip_level);
+  err = stream_send(stream, part.buf, part.len, mode);
+  stream->buf.buf[len] = save;
+
+  stream->buf.len -= len;
+  memmove(stream->buf.buf, stream->buf.buf + len, stream->buf.len + 1);
+  return nerr_pass(err);
+}
+
+static NEOERR *stream_write_cb (void *ctx, const char *buf, size_t len)
+{
+  CGI_STREAM *stream = (CGI_STREAM *)ctx;
+  NEOERR *err;
+
+  /* <?cs flush ?> */
+  if (buf == NULL)
+    return nerr_pass(stream_flush(stream, STREAM_FLUSH));
+
+  err = string_appendn(&(stream->buf), buf, len);
+  if (err != STATUS_OK) return nerr_pass(err);
+  if (stream->buf.len >= stream->threshold)
+    return nerr_pass(stream_flush(stream, STREAM_PARTIAL));
+  return STATUS_OK;
+}
+
+/* The end of cgi_output, for a stream */
+static NEOERR *stream_finish (CGI_STREAM *stream)
+{
+  NEOERR *err;
+  CGI *cgi = stream->cgi;
+  STRING str;
+  double dis;
+  char buf[50];
+
+  dis = ne_timef();
+  if (!stream->started)
+  {
+    err = stream_start(stream);
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+
+  if (stream->is_html && hdf_get_int_value (cgi->hdf, "Config.TimeFooter", 1))
+  {
+    snprintf (buf, sizeof(buf), "\n<!-- %5.3f:%d -->\n",
+	dis - cgi->time_start, stream->use_deflate || stream->use_gzip);
+    err = string_append (&(stream->buf), buf);
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+  err = stream_flush(stream, STREAM_ALL);
+  if (err != STATUS_OK) return nerr_pass(err);
+
+  if (stream->is_html && cgi_do_debug(cgi))
+  {
+    string_init(&str);
+    err = cgi_debug_dump (cgi, &str);
+    if (err == STATUS_OK)
+      err = stream_send(stream, str.buf, str.len, STREAM_ALL);
+    string_clear(&str);
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+
+  err = stream_send(stream, NULL, 0, STREAM_FINISH);
+  if (err != STATUS_OK) return nerr_pass(err);
+#if defined(HTML_COMPRESSION)
+  if (stream->zs_init && stream->use_gzip)
+  {
+    /* write crc and len in network order */
+    char gz_buf[8];
+
+    gz_buf[0] = 0xff & (stream->crc >> 0);
+    gz_buf[1] = 0xff & (stream->crc >> 8);
+    gz_buf[2] = 0xff & (stream->crc >> 16);
+    gz_buf[3] = 0xff & (stream->crc >> 24);
+    gz_buf[4] = 0xff & (stream->total >> 0);
+    gz_buf[5] = 0xff & (stream->total >> 8);
+    gz_buf[6] = 0xff & (stream->total >> 16);
+    gz_buf[7] = 0xff & (stream->total >> 24);
+    err = cgiwrap_write(gz_buf, 8);
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+#endif
+  return STATUS_OK;
+}
+
+static NEOERR *cgi_display_stream (CGI *cgi, CS_TEMPLATE *tmpl, int size)
+{
+  NEOERR *err;
+  CGI_STREAM stream;
+
+  memset(&stream, 0, sizeof(stream));
+  stream.cgi = cgi;
+  stream.size = size;
+  stream.threshold = size;
+  string_init(&(stream.buf));
+
+  err = cs_render_ctx_write (tmpl, cgi->hdf, &stream, stream_write_cb);
+  if (err == STATUS_OK)
+    err = stream_finish(&stream);
+
+#if defined(HTML_COMPRESSION)
+  if (stream.zs_init) deflateEnd(&(stream.zs));
+#endif
+  string_clear(&(stream.buf));
+  return nerr_pass(err);
+}
+
+/* With Config.PageCacheSize, cgi_display keeps the pages it renders in a
+ * process-wide CS_FRAGCACHE of at most that many bytes, keyed by the
+ * template and the digest of the HDF the render read (see
+ * cs_readset_digest).  The reads of the last render of each template are
+ * kept as well, and replayed against the HDF of the next request to get
+ * its key, so a page whose inputs haven't changed is sent without
+ * rendering the template.  Only the output is cached, so templates which
+ * set cgiout or other HDF values used after the render don't get those
+ * on a hit. */
+typedef struct _page_reads
+{
+  char *key;            /* template file and Config.TemplateVersion */
+  CS_READSET *reads;    /* of the last render of the template */
+} PAGE_READS;
+
+static CS_FRAGCACHE *Pages = NULL;
+static NE_HASH *PageReads = NULL;
+#ifdef HAVE_PTHREADS
+static pthread_mutex_t PageLock = PTHREAD_MUTEX_INITIALIZER;
+#define PAGE_LOCK() mLock(&PageLock)
+#define PAGE_UNLOCK() mUnlock(&PageLock)
+#else
+#define PAGE_LOCK() STATUS_OK
+#define PAGE_UNLOCK() STATUS_OK
+#endif
+
+static NEOERR *page_cache_init (size_t max_bytes)
+{
+  NEOERR *err = STATUS_OK;
+
+  if (Pages == NULL)
+    err = cs_fragcache_init(&Pages, max_bytes);
+  if (err == STATUS_OK && PageReads == NULL)
+    err = ne_hash_init(&PageReads, ne_hash_str_hash, ne_hash_str_comp);
+  return nerr_pass(err);
+}
+
+/* Look for a cached page for the template key, appending it to str.  The
+ * digest of the request is set whenever it could be worked out. */
+static NEOERR *page_cache_get (CS_TEMPLATE *tmpl, HDF *hdf, const char *key,
+                               STRING *str, char *digest, int *hit)
+{
+  NEOERR *err;
+  PAGE_READS *page_reads;
+  CS_FRAGMENT *frag = NULL;
+  char *page_key;
+  int replayed = 0;
+
+  *hit = 0;
+  digest[0] = '\0';
+  err = PAGE_LOCK();
+  if (err) return nerr_pass(err);
+  page_reads = PageReads ? (PAGE_READS *) ne_hash_lookup(PageReads,
+                                                         (void *)key) : NULL;
+  if (page_reads != NULL)
+    replayed = cs_readset_replay(page_reads->reads, hdf,
+                                 tmpl->parse->global_hdf, digest);
+  PAGE_UNLOCK();
+  if (!replayed) return STATUS_OK;
+
+  page_key = sprintf_alloc("%s\n%s", key, digest);
+  if (page_key == NULL)
+    return nerr_raise(NERR_NOMEM, "Unable to allocate memory for page key");
+  err = cs_fragcache_get(Pages, page_key, &frag);
+  free(page_key);
+  if (err) return nerr_pass(err);
+  if (frag == NULL) return STATUS_OK;
+  err = string_appendn(str, frag->buf, frag->len);
+  cs_fragment_destroy(&frag);
+  if (err) return nerr_pass(err);
+  *hit = 1;
+  return STATUS_OK;
+}
+
+/* Store a rendered page, and reads as the ones to replay for key */
+static NEOERR *page_cache_put (const char *key, CS_READSET **reads,
+                               STRING *str, const char *digest)
+{
+  NEOERR *err;
+  PAGE_READS *page_reads;
+  CS_FRAGMENT *frag;
+  char *page_key;
+
+  page_key = sprintf_alloc("%s\n%s", key, digest);
+  if (page_key == NULL)
+    return nerr_raise(NERR_NOMEM, "Unable to allocate memory for page key");
+  err = cs_fragment_create(str->buf ? str->buf : "", str->len, NULL, &frag);
+  if (err == STATUS_OK)
+  {
+    err = cs_fragcache_put(Pages, page_key, frag, 0);
+    cs_fragment_destroy(&frag);
+  }
+  free(page_key);
+  if (err) return nerr_pass(err);
+
+  err = PAGE_LOCK();
+  if (err) return nerr_pass(err);
+  page_reads = (PAGE_READS *) ne_hash_lookup(PageReads, (void *)key);
+  if (page_reads == NULL)
+  {
+    page_reads = (PAGE_READS *) calloc(1, sizeof(PAGE_READS));
+    if (page_reads == NULL || (page_reads->key = strdup(key)) == NULL)
+    {
+      free(page_reads);
+      PAGE_UNLOCK();
+      return nerr_raise(NERR_NOMEM, "Unable to allocate memory for page");
+    }
+    err = ne_hash_insert(PageReads, page_reads->key, page_reads);
+    if (err)
+    {
+      free(page_reads->key);
+      free(page_reads);
+      PAGE_UNLOCK();
+      return nerr_pass(err);
+    }
+  }
+  cs_readset_destroy(&(page_reads->reads));
+  page_reads->reads = *reads;
+  *reads = NULL;
+  PAGE_UNLOCK();
+  return STATUS_OK;
+}
+
+void cgi_page_cache_stats (CS_FRAGCACHE_STATS *stats)
+{
+  if (Pages == NULL)
+    memset(stats, 0, sizeof(CS_FRAGCACHE_STATS));
+  else
+    cs_fragcache_stats(Pages, stats);
+}
+
+/* Whether the If-None-Match header lists etag, comparing weakly */
+static int etag_match (const char *header, const char *etag)
+{
+  const char *p, *end;
+  size_t len;
+
+  if (header == NULL) return 0;
+  if (!strncmp(etag, "W/", 2)) etag += 2;
+  len = strlen(etag);
+  for (p = header; *p; p = end)
+  {
+    while (*p == ' ' || *p == '\t' || *p == ',') p++;
+    if (*p == '*') return 1;
+    if (!strncmp(p, "W/", 2)) p += 2;
+    end = p;
+    while (*end && *end != ',') end++;
+    if ((size_t)(end - p) >= len && !strncmp(p, etag, len))
+    {
+      p += len;
+      while (*p == ' ' || *p == '\t') p++;
+      if (p == end) return 1;
+    }
+  }
+  return 0;
+}
+
+/* cgi_display with Config.ETag or Config.PageCacheSize: the render
+ * records what it reads, and its digest is the ETag of the page.  If the
+ * request already has it, only the headers are sent, with a 304. */
+static NEOERR *cgi_display_tracked (CGI *cgi, const char *cs_file,
+                                    CS_TEMPLATE *tmpl, STRING *str)
+{
+  NEOERR *err = STATUS_OK;
+  CS_READSET *reads = NULL;
+  char digest[CS_DIGEST_LEN];
+  char etag[CS_DIGEST_LEN + 16];
+  char *key, *version;
+  int use_etag, cache_size, hit = 0;
+
+  use_etag = hdf_get_int_value(cgi->hdf, "Config.ETag", 0);
+  cache_size = hdf_get_int_value(cgi->hdf, "Config.PageCacheSize", 0);
+  version = hdf_get_value(cgi->hdf, "Config.TemplateVersion", "");
+  key = sprintf_alloc("%s\n%s", cs_file, version);
+  if (key == NULL)
+    return nerr_raise(NERR_NOMEM, "Unable to allocate memory for page key");
+
+  digest[0] = '\0';
+  do
+  {
+    if (cache_size > 0)
+    {
+      err = PAGE_LOCK();
+      if (err) break;
+      err = page_cache_init(cache_size);
+      PAGE_UNLOCK();
+      if (err) break;
+      err = page_cache_get(tmpl, cgi->hdf, key, str, digest, &hit);
+      if (err) break;
+    }
+    if (!hit)
+    {
+      err = cs_readset_init(&reads);
+      if (err) break;
+      err = cs_render_ctx_reads(tmpl, cgi->hdf, reads, str, render_write_cb);
+      if (err) break;
+      if (!cs_readset_digest(reads, digest)) digest[0] = '\0';
+      if (digest[0] && cache_size > 0)
+      {
+        err = page_cache_put(key, &reads, str, digest);
+        if (err) break;
+      }
+    }
+    if (use_etag && digest[0])
+    {
+      snprintf(etag, sizeof(etag), "W/\"%08x%s\"",
+               ne_crc((UINT8 *)key, strlen(key)), digest);
+      err = hdf_set_valuef(cgi->hdf, "cgiout.other.etag=ETag: %s", etag);
+      if (err) break;
+      if (etag_match(hdf_get_value(cgi->hdf, "HTTP.IfNoneMatch", NULL),
+                     etag))
+      {
+        err = hdf_set_value(cgi->hdf, "cgiout.Status", "304");
+        if (err) break;
+        err = cgi_headers(cgi);
+        break;
+      }
+    }
+    err = cgi_output(cgi, str);
+  } while (0);
+
+  cs_readset_destroy(&reads);
+  free(key);
+  return nerr_pass(err);
+}
+
 NEOERR *cgi_display (CGI *cgi, const char *cs_file)
 {
   NEOERR *err = STATUS_OK;
   char *debug;
-  CSPARSE *cs = NULL;
+  CS_TEMPLATE *tmpl = NULL;
+  CS_CACHE *cache = NULL;
   STRING str;
   int do_dump = 0;
+  int cache_size;
+  int stream_size;
   char *t;
 
   string_init(&str);
@@ -1557,39 +2131,61 @@ NEOERR *cgi_display (CGI *cgi, const char *cs_file)
   if (hdf_get_int_value(cgi->hdf, "Config.DebugEnabled", 0) &&
       debug && t && !strcmp (debug, t)) do_dump = 1;
 
+  /* Config.TemplateCacheSize is the memory cap in bytes of the process-wide
+   * compiled template cache, which is only created on the first use */
+  cache_size = hdf_get_int_value(cgi->hdf, "Config.TemplateCacheSize", 0);
+  stream_size = hdf_get_int_value(cgi->hdf, "Config.StreamBufferSize", 0);
+
   do
   {
-    err = cs_init (&cs, cgi->hdf);
-    if (err != STATUS_OK) break;
-    err = cgi_register_strfuncs(cs);
-    if (err != STATUS_OK) break;
-    err = cs_parse_file (cs, cs_file);
+    if (cache_size > 0)
+    {
+      err = cs_cache_shared (cache_size, &cache);
+      if (err != STATUS_OK) break;
+      if (hdf_get_int_value(cgi->hdf, "Config.TemplateWatch", 0))
+      {
+        /* Without inotify, the templates are still checked by mtime */
+        err = cs_cache_watch (cache, _cs_cache_init, NULL);
+        nerr_ignore(&err);
+      }
+    }
+    err = cs_cache_get (cache, cgi->hdf, cs_file,
+                        hdf_get_value(cgi->hdf, "Config.TemplateVersion", NULL),
+                        _cs_cache_init, cgi, &tmpl);
     if (err != STATUS_OK) break;
     if (do_dump)
     {
       err = cgiwrap_writef("Content-Type: text/plain\n\n");
       if (err != STATUS_OK) break;
       err = hdf_remove_tree (cgi->hdf, "Cookie");
-      if (err != STATUS_OK) return nerr_pass(err);
+      if (err != STATUS_OK) break;
       err = hdf_remove_tree (cgi->hdf, "HTTP.Cookie");
-      if (err != STATUS_OK) return nerr_pass(err);
+      if (err != STATUS_OK) break;
       err = hdf_dump_str(cgi->hdf, "", 0, &str);
       if (err != STATUS_OK) break;
-      err = cs_dump(cs, &str, render_cb);
+      err = cs_dump(tmpl->parse, &str, render_cb);
       if (err != STATUS_OK) break;
       err = cgiwrap_writef("%s", str.buf);
       break;
     }
-    else
+    if (stream_size > 0)
     {
-      err = cs_render (cs, &str, render_cb);
-      if (err != STATUS_OK) break;
+      err = cgi_display_stream (cgi, tmpl, stream_size);
+      break;
     }
+    if (hdf_get_int_value(cgi->hdf, "Config.ETag", 0) ||
+        hdf_get_int_value(cgi->hdf, "Config.PageCacheSize", 0) > 0)
+    {
+      err = cgi_display_tracked (cgi, cs_file, tmpl, &str);
+      break;
+    }
+    err = cs_render_ctx_write (tmpl, cgi->hdf, &str, render_write_cb);
+    if (err != STATUS_OK) break;
     err = cgi_output(cgi, &str);
     if (err != STATUS_OK) break;
   } while (0);
 
-  cs_destroy(&cs);
+  cs_template_destroy(&tmpl);
   string_clear (&str);
   return nerr_pass(err);
 }
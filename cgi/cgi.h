@@ -222,6 +222,29 @@ NEOERR *cgi_cs_init(CGI *cgi, CSPARSE **cs);
  *              cs_file using the CGI's HDF data set, and send the
  *              output to the user.  Note that the output is actually
  *              rendered into memory first.
+ *              If Config.TemplateCacheSize is set, the compiled template
+ *              is kept in a process-wide cache (see cs_cache_get) using
+ *              at most that many bytes, and reused by later calls until
+ *              the file changes, or Config.TemplateVersion does.
+ *              With Config.TemplateWatch as well, the cache is watched
+ *              (see cs_cache_watch), so changed templates are reparsed
+ *              in the background instead of each request checking
+ *              their mtimes.
+ *              If Config.StreamBufferSize is set, the output is instead
+ *              sent as it is rendered, buffering about that many bytes
+ *              at a time, and whenever the template says <?cs flush ?>.
+ *              The headers are sent with the first write, so the
+ *              template can't change them after that.
+ *              If Config.ETag is set, the render records the HDF it
+ *              reads, and the digest of those reads is sent as the
+ *              ETag of the page.  A request whose If-None-Match has it
+ *              gets a 304 and no body.
+ *              If Config.PageCacheSize is set, rendered pages are kept
+ *              in a process-wide cache of at most that many bytes, and
+ *              a request which would read the same HDF values as a
+ *              cached page gets it without rendering the template.
+ *              Only the output is cached, so this is only for templates
+ *              which don't set the cgiout headers.
  * Input: cgi - a pointer a CGI struct allocated with cgi_init
  *        cs_file - a ClearSilver template file
  * Output: None
@@ -230,6 +253,17 @@ NEOERR *cgi_cs_init(CGI *cgi, CSPARSE **cs);
  */
 NEOERR *cgi_display (CGI *cgi, const char *cs_file);
 
+/*
+ * Function: cgi_page_cache_stats - get page cache statistics
+ * Description: cgi_page_cache_stats fills in the counters of the cache
+ *              cgi_display uses with Config.PageCacheSize, which are all
+ *              0 until it is first used.
+ * Input: None
+ * Output: stats - the statistics
+ * Return: None
+ */
+void cgi_page_cache_stats (CS_FRAGCACHE_STATS *stats);
+
 /*
  * Function: cgi_output - display the CGI output to the user
  * Description: Normally, this is called by cgi_display, but some
@@ -15,6 +15,7 @@
 #include "ClearSilver.h"
 
 #include <string.h>
+#include <unistd.h>
 
 
 /* Used by test_http_headers, this is the old hard-coded list of environment
@@ -265,6 +266,307 @@ NEOERR *test_content_type_parsing() {
   return STATUS_OK;
 }
 
+static int capture_writef (void *data, const char *fmt, va_list ap)
+{
+  NEOERR *err = string_appendvf ((STRING *)data, fmt, ap);
+  if (err) {
+    nerr_ignore(&err);
+    return -1;
+  }
+  return 0;
+}
+
+static int capture_write (void *data, const char *buf, int len)
+{
+  NEOERR *err = string_appendn ((STRING *)data, buf, len);
+  if (err) {
+    nerr_ignore(&err);
+    return -1;
+  }
+  return len;
+}
+
+static NEOERR *display_with (int stream_size, STRING *out)
+{
+  NEOERR *err;
+  CGI *cgi;
+  char **argv;
+  char **envp;
+
+  argv = (char **) malloc (2 * sizeof(char *));
+  argv[0] = strdup("cgi_test");
+  argv[1] = NULL;
+  envp = (char **) malloc (sizeof(char *));
+  envp[0] = NULL;
+  cgiwrap_init_std(1, argv, envp);
+
+  err = cgi_init(&cgi, NULL);
+  if (err) return nerr_pass(err);
+  cgiwrap_init_emu(out, NULL, capture_writef, capture_write, NULL, NULL, NULL);
+
+  err = hdf_set_int_value(cgi->hdf, "Config.StreamBufferSize", stream_size);
+  if (err == STATUS_OK)
+    err = hdf_set_value(cgi->hdf, "Config.TimeFooter", "0");
+  if (err == STATUS_OK)
+    err = hdf_set_value(cgi->hdf, "Config.WhiteSpaceStrip", "2");
+  if (err == STATUS_OK)
+    err = cgi_display(cgi, "test_cgi_stream.cs");
+  cgi_destroy(&cgi);
+  cgiwrap_init_emu(NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+  return nerr_pass(err);
+}
+
+/* Streamed output, in pieces as small as a few bytes, should be the same
+ * as rendering the whole page first */
+NEOERR *test_stream_output() {
+  NEOERR *err;
+  STRING whole, streamed;
+  int sizes[] = {1, 7, 64, 100000, 0};
+  int x;
+
+  ne_warn("test_stream_output");
+
+  string_init(&whole);
+  err = display_with(0, &whole);
+  for (x = 0; err == STATUS_OK && sizes[x]; x++) {
+    string_init(&streamed);
+    err = display_with(sizes[x], &streamed);
+    if (err == STATUS_OK && (streamed.len != whole.len ||
+                             memcmp(streamed.buf, whole.buf, whole.len))) {
+      fprintf(stderr, "-E- whole:\n%s\n-E- streamed:\n%s\n",
+              whole.buf, streamed.buf);
+      err = nerr_raise(NERR_ASSERT,
+                       "Output streamed with a %d byte buffer differs",
+                       sizes[x]);
+    }
+    string_clear(&streamed);
+  }
+  string_clear(&whole);
+  return nerr_pass(err);
+}
+
+/* Display test_cgi_etag.cs with Config.ETag and Config.PageCacheSize */
+static NEOERR *display_tracked (const char *title, const char *unread,
+                                const char *if_none_match, STRING *out)
+{
+  NEOERR *err;
+  CGI *cgi;
+  char **argv;
+  char **envp;
+
+  argv = (char **) malloc (2 * sizeof(char *));
+  argv[0] = strdup("cgi_test");
+  argv[1] = NULL;
+  envp = (char **) malloc (sizeof(char *));
+  envp[0] = NULL;
+  cgiwrap_init_std(1, argv, envp);
+
+  err = cgi_init(&cgi, NULL);
+  if (err) return nerr_pass(err);
+  cgiwrap_init_emu(out, NULL, capture_writef, capture_write, NULL, NULL, NULL);
+
+  err = hdf_set_value(cgi->hdf, "Config.ETag", "1");
+  if (err == STATUS_OK)
+    err = hdf_set_value(cgi->hdf, "Config.PageCacheSize", "100000");
+  if (err == STATUS_OK)
+    err = hdf_set_value(cgi->hdf, "Config.TimeFooter", "0");
+  if (err == STATUS_OK)
+    err = hdf_set_value(cgi->hdf, "Page.Title", title);
+  if (err == STATUS_OK)
+    err = hdf_set_value(cgi->hdf, "Page.Items.0", "x");
+  if (err == STATUS_OK)
+    err = hdf_set_value(cgi->hdf, "Page.Items.1", "y");
+  if (err == STATUS_OK)
+    err = hdf_set_value(cgi->hdf, "Unread", unread);
+  if (err == STATUS_OK && if_none_match)
+    err = hdf_set_value(cgi->hdf, "HTTP.IfNoneMatch", if_none_match);
+  if (err == STATUS_OK)
+    err = cgi_display(cgi, "test_cgi_etag.cs");
+  cgi_destroy(&cgi);
+  cgiwrap_init_emu(NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+  return nerr_pass(err);
+}
+
+/* The value of the ETag header in out, in a static buffer */
+static char *find_etag (STRING *out)
+{
+  static char etag[64];
+  char *p, *e;
+
+  etag[0] = '\0';
+  p = out->buf ? strstr(out->buf, "ETag: ") : NULL;
+  if (p == NULL) return etag;
+  p += 6;
+  e = strchr(p, '\r');
+  if (e != NULL && e - p < (int) sizeof(etag))
+  {
+    memcpy(etag, p, e - p);
+    etag[e - p] = '\0';
+  }
+  return etag;
+}
+
+/* Pages are cached by what the template reads: a change to anything
+ * else gets the cached page, a change to what it reads doesn't, and a
+ * request with the ETag of the page gets a 304 */
+NEOERR *test_etag_page_cache() {
+  NEOERR *err;
+  STRING first, out;
+  CS_FRAGCACHE_STATS stats;
+  char etag[64];
+
+  ne_warn("test_etag_page_cache");
+
+  string_init(&first);
+  string_init(&out);
+  do {
+    err = display_tracked("A", "1", NULL, &first);
+    if (err) break;
+    strcpy(etag, find_etag(&first));
+    if (!etag[0] || !strstr(first.buf, "A: x y ")) {
+      err = nerr_raise(NERR_ASSERT, "Unexpected page:\n%s", first.buf);
+      break;
+    }
+
+    err = display_tracked("A", "2", NULL, &out);
+    if (err) break;
+    cgi_page_cache_stats(&stats);
+    if (strcmp(out.buf, first.buf) || stats.hits != 1 || stats.stores != 1) {
+      err = nerr_raise(NERR_ASSERT, "Expected a cached page (%ld hits, "
+                       "%ld stores):\n%s", stats.hits, stats.stores, out.buf);
+      break;
+    }
+
+    out.len = 0;
+    err = display_tracked("B", "1", NULL, &out);
+    if (err) break;
+    if (!strstr(out.buf, "B: x y ") || !strcmp(find_etag(&out), etag)) {
+      err = nerr_raise(NERR_ASSERT, "Expected a new page:\n%s", out.buf);
+      break;
+    }
+
+    out.len = 0;
+    err = display_tracked("A", "3", etag, &out);
+    if (err) break;
+    if (!strstr(out.buf, "Status: 304") || strstr(out.buf, "<html>")) {
+      err = nerr_raise(NERR_ASSERT, "Expected a 304 for %s:\n%s", etag,
+                       out.buf);
+      break;
+    }
+  } while (0);
+  string_clear(&first);
+  string_clear(&out);
+  return nerr_pass(err);
+}
+
+static NEOERR *render_to (void *ctx, char *s)
+{
+  return nerr_pass(string_append((STRING *)ctx, s));
+}
+
+static NEOERR *write_file (const char *dir, const char *name,
+                           const char *content)
+{
+  char path[256], tmp[256];
+  FILE *fp;
+
+  /* Like an editor, write a new file and rename it over the old one */
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  snprintf(tmp, sizeof(tmp), "%s/.%s.tmp", dir, name);
+  fp = fopen(tmp, "w");
+  if (fp == NULL)
+    return nerr_raise_errno(NERR_IO, "Unable to open %s", tmp);
+  fputs(content, fp);
+  fclose(fp);
+  if (rename(tmp, path) == -1)
+    return nerr_raise_errno(NERR_IO, "Unable to rename %s", tmp);
+  return STATUS_OK;
+}
+
+static NEOERR *watch_render (CS_CACHE *cache, HDF *hdf, STRING *out)
+{
+  NEOERR *err;
+  CS_TEMPLATE *tmpl;
+
+  out->len = 0;
+  if (out->buf) out->buf[0] = '\0';
+  err = cs_cache_get(cache, hdf, "watch.cs", NULL, NULL, NULL, &tmpl);
+  if (err) return nerr_pass(err);
+  err = cs_render_ctx(tmpl, hdf, out, render_to);
+  cs_template_destroy(&tmpl);
+  return nerr_pass(err);
+}
+
+/* A watched template cache picks up a change to an included file without
+ * a stat on each hit, and without the next request parsing it */
+NEOERR *test_template_watch() {
+  NEOERR *err;
+  CS_CACHE *cache = NULL;
+  CS_CACHE_STATS stats;
+  HDF *hdf = NULL;
+  STRING out;
+  char dir[] = "/tmp/cs_watchXXXXXX";
+  char path[256];
+  double start;
+
+  ne_warn("test_template_watch");
+
+  if (mkdtemp(dir) == NULL)
+    return nerr_raise_errno(NERR_IO, "Unable to create %s", dir);
+  string_init(&out);
+  do {
+    err = write_file(dir, "watch.cs", "[<?cs include:\"watch_inc.cs\" ?>]");
+    if (err) break;
+    err = write_file(dir, "watch_inc.cs", "one");
+    if (err) break;
+    err = hdf_init(&hdf);
+    if (err) break;
+    err = hdf_set_value(hdf, "hdf.loadpaths.0", dir);
+    if (err) break;
+    err = cs_cache_init(&cache, 0);
+    if (err) break;
+    err = cs_cache_watch(cache, NULL, NULL);
+    if (nerr_handle(&err, NERR_ASSERT)) {
+      ne_warn("cs_cache_watch isn't supported, skipping");
+      break;
+    }
+    if (err) break;
+
+    err = watch_render(cache, hdf, &out);
+    if (err) break;
+    if (strcmp(out.buf, "[one]")) {
+      err = nerr_raise(NERR_ASSERT, "Unexpected output: %s", out.buf);
+      break;
+    }
+
+    err = write_file(dir, "watch_inc.cs", "two");
+    if (err) break;
+    start = ne_timef();
+    while (err == STATUS_OK && strcmp(out.buf, "[two]") &&
+           ne_timef() - start < 10) {
+      usleep(10000);
+      err = watch_render(cache, hdf, &out);
+    }
+    if (err) break;
+    cs_cache_stats(cache, &stats);
+    if (strcmp(out.buf, "[two]") || stats.reloads != 1 || stats.misses != 1) {
+      err = nerr_raise(NERR_ASSERT, "Expected a reload (%ld reloads, %ld "
+                       "misses): %s", stats.reloads, stats.misses, out.buf);
+      break;
+    }
+  } while (0);
+
+  cs_cache_destroy(&cache);
+  hdf_destroy(&hdf);
+  string_clear(&out);
+  snprintf(path, sizeof(path), "%s/watch.cs", dir);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/watch_inc.cs", dir);
+  unlink(path);
+  rmdir(dir);
+  return nerr_pass(err);
+}
+
 int main(int argc, char **argv, char **envp) {
   NEOERR *err;
 
@@ -283,6 +585,21 @@ int main(int argc, char **argv, char **envp) {
     nerr_log_error(err);
     return -1;
   }
+  err = test_stream_output();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+  err = test_etag_page_cache();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+  err = test_template_watch();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
 
   return 0;
 }
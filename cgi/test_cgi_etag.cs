@@ -0,0 +1 @@
+<html><body><?cs var:Page.Title ?>: <?cs each:i = Page.Items ?><?cs var:i ?> <?cs /each ?></body></html>
@@ -0,0 +1,23 @@
+<html>
+<head>   <title> Streaming   test </title>   
+
+</head>
+<?cs flush ?><body>
+  <p>   some    text
+  </p>
+
+
+<pre>
+  keep    this
+     as is
+</pre>
+<textarea name="t">
+   and   this
+</textarea>
+<?cs loop:x = 1, 40 ?>  <div class="row   <?cs var:x ?>">  row   <?cs var:x ?>  </div>
+
+<?cs /loop ?>
+<a
+  href="split tag">  link </a>
+</body>
+</html>
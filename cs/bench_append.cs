@@ -0,0 +1,10 @@
+<?cs # Builds a string of Bench.Count pieces with set:Out = Out + ..., which
+     used to copy all of Out for every +, so it took time quadratic in
+     Bench.Count.  Time it with, for instance:
+       echo "Bench.Count = 40000" > /tmp/bench.hdf
+       time ./cstest /tmp/bench.hdf bench_append.cs ?><?cs
+set:Out = "" ?><?cs
+loop:x = #1, Bench.Count ?><?cs
+  set:Out = Out + "item " + x + ", " ?><?cs
+/loop ?><?cs
+var:string.length(Out) ?>
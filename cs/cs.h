@@ -16,7 +16,7 @@
  * CS_OPEN     := <?cs
  * CS_CLOSE    := ?>
  * COMMAND     := (CMD_IF | CMD_VAR | CMD_EVAR | CMD_INCLUDE | CMD_EACH
- *                 | CMD_DEF | CMD_CALL | CMD_SET | CMD_LOOP )
+ *                 | CMD_DEF | CMD_CALL | CMD_SET | CMD_LOOP | CMD_FLUSH )
  * CMD_IF      := CS_OPEN IF CS_CLOSE CS CMD_ENDIF
  * CMD_ENDIF   := CS_OPEN ENDIF CS_CLOSE
  * CMD_INCLUDE := CS_OPEN INCLUDE CS_CLOSE
@@ -24,6 +24,7 @@
  * CMD_CALL    := CS_OPEN CALL CS_CLOSE
  * CMD_SET     := CS_OPEN SET CS_CLOSE
  * CMD_LOOP    := CS_OPEN LOOP CS_CLOSE
+ * CMD_FLUSH   := CS_OPEN flush CS_CLOSE
  * LOOP        := loop:VAR = EXPR, EXPR, EXPR
  * SET         := set:VAR = EXPR
  * EXPR        := (ARG | ARG OP EXPR)
@@ -47,7 +48,9 @@
 #include "util/ulist.h"
 #include "util/neo_hdf.h"
 #include "util/neo_str.h"
+#include "util/neo_hash.h"
 #include "util/neo_auto.h"
+#include "util/neo_arena.h"
 
 __BEGIN_DECLS
 
@@ -117,6 +120,15 @@ typedef enum
   CS_ES_MIXED = 2,
 } CSESCAPE_STATUS;
 
+/* A variable name split into its segments at parse time, so rendering
+ * doesn't have to tokenize and hash it on every lookup.  Allocated in
+ * parse->alloc. */
+typedef struct _var_path
+{
+  int nsegs;
+  HDF_SEG segs[1];
+} CS_VARPATH;
+
 typedef struct _arg
 {
   CSTOKEN_TYPE op_type;
@@ -125,6 +137,7 @@ typedef struct _arg
   long int n;
   int alloc;
   CSESCAPE_STATUS escape_status;
+  CS_VARPATH *path;  /* for a CS_TYPE_VAR from the template, or NULL */
   struct _funct *function;
   struct _macro *macro;
   struct _arg *expr1;
@@ -141,6 +154,18 @@ typedef struct _arg
  * execution times, especially if you're running untrusted templates. */
 #define DEFAULT_MAX_LOOP_ITERATIONS 40000000
 
+/* <?cs each_parallel:item = List ?> ... <?cs /each ?> is an each whose
+ * iterations may be rendered at the same time on several threads, up to
+ * Config.RenderThreads of them (default the number of CPUs, at most 16).
+ * The output is the same as an each, the iterations are written out in
+ * order.  Only bodies which don't change anything but their own output
+ * are run in parallel: ones which use (or call macros which use) set,
+ * lvar, linclude, cache or content-type are rendered as a plain each, as
+ * are renders with Config.EnableProfile or a read set, and with auto
+ * escaping, lists entered anywhere but plain HTML text.  Functions
+ * registered with cs_register_function which the body calls must be
+ * thread safe. */
+
 typedef struct _tree
 {
   int cmd;
@@ -159,8 +184,46 @@ typedef struct _tree
   struct _tree *case_0;
   struct _tree *case_1;
   struct _tree *next;
+
+  /* Bytecode for the list this node heads, see Config.EnableBytecode */
+  struct _program *prog;
+
+  /* For auto escaped literals: the parser state after this literal, when
+     it starts in plain HTML text.  NULL if that's plain text too.  Only
+     valid if auto_text is set, see neos_auto_parse_text */
+  int auto_text;
+  NEOS_AUTO_CTX *auto_exit;
 } CSTREE;
 
+/* With Config.EnableBytecode, each list of CSTREE nodes is also lowered
+ * into a flat array of instructions.  Control flow (if/elif/else, alt,
+ * escape) becomes jumps within the array, text and variables are output
+ * directly, and everything else calls the command's eval_handler. */
+typedef enum
+{
+  CS_INSN_END,      /* return */
+  CS_INSN_LITERAL,  /* output node's literal text */
+  CS_INSN_VAR,      /* output node's var */
+  CS_INSN_TEST,     /* jump to target if node's if condition is false */
+  CS_INSN_ALT,      /* output node's alt var and jump to target if true */
+  CS_INSN_JUMP,     /* jump to target */
+  CS_INSN_NODE      /* run the node's eval_handler */
+} CS_INSN_OP;
+
+typedef struct _insn
+{
+  CS_INSN_OP op;
+  int target;
+  struct _tree *node;
+} CS_INSN;
+
+typedef struct _program
+{
+  int len;
+  int size;
+  CS_INSN *code;
+} CS_PROGRAM;
+
 typedef struct _local_map
 {
   CSTOKEN_TYPE type;
@@ -171,12 +234,23 @@ typedef struct _local_map
   char *s;
   long int n;
   HDF *h;
+  /* The string value of n, s points here once it has been asked for */
+  char nbuf[24];
   /* Store escaping status for local variables,
    * used when a string or number is stored in the map.
    * hdf objects keep track of their own escape status.
    */
   CSESCAPE_STATUS escape_status;
 
+  /* The full HDF name of h, set while recording reads (NULL if it isn't
+   * known), so reads through the local can be replayed */
+  char *path;
+
+  /* When s was built up by set:x = x + ..., its length and the size of
+   * its buffer, so appends can go in place (s_cap is 0 otherwise) */
+  size_t s_len;
+  size_t s_cap;
+
   int first;  /* This local is the "first" item in an each/loop */
   int last;   /* This local is the "last" item in an loop, each is calculated
                explicitly based on hdf_obj_next() in _builtin_last() */
@@ -202,6 +276,21 @@ typedef struct _macro
  * would break existing code. */
 typedef NEOERR* (*CSOUTFUNC)(void *, char *);
 
+/* CSWRITEFUNC is the length aware version of CSOUTFUNC, used with
+ * cs_render_write and cs_render_ctx_write.  The renderer already knows
+ * the length of everything it outputs, so the callback doesn't need to
+ * strlen it again.  The string is only valid during the call.
+ * <?cs flush ?> calls it with a NULL string and 0 length, as a hint that
+ * a buffering callback should send what it has so far. */
+typedef NEOERR* (*CSWRITEFUNC)(void *ctx, const char *s, size_t len);
+
+/* CSBATCHFUNC receives the output of one item of cs_render_batch, item is
+ * its index in the datasets.  The whole output is passed at once, and is
+ * only valid during the call.  With more than one thread it is called
+ * from several threads at once. */
+typedef NEOERR* (*CSBATCHFUNC)(void *ctx, int item, const char *s,
+                               size_t len);
+
 /* CSFUNCTION is a callback function used for handling a function made
  * available inside the template.  Used by cs_register_function.  Exposed
  * here as part of the experimental extension framework, this may change
@@ -227,6 +316,42 @@ typedef NEOERR* (*CSSTRFUNC)(const char *str, char **ret);
 typedef NEOERR* (*CSFILELOAD)(void *ctx, HDF *hdf, const char *filename,
                               char **contents);
 
+/* The output of a <?cs cache:key ttl ?> block, kept in a fragment store
+ * and written out instead of rendering the block again.  With
+ * auto-escaping, auto_exit is the parser state after the output, so the
+ * rest of the page is escaped the same way as when it was rendered (NULL
+ * if it ends in plain HTML text).  Fragments are read-only and reference
+ * counted, see cs_fragment_ref and cs_fragment_destroy. */
+typedef struct _fragment
+{
+  char *buf;        /* NUL terminated */
+  size_t len;
+  NEOS_AUTO_CTX *auto_exit;
+  int refcount;
+} CS_FRAGMENT;
+
+/* CSFRAGGET and CSFRAGPUT are the two halves of a fragment store, see
+ * cs_register_fragments.  CSFRAGGET looks up key, and sets frag to a new
+ * reference to the fragment, or NULL if it isn't stored.  CSFRAGPUT is
+ * given each newly rendered fragment, to keep for at most ttl seconds
+ * (0 for no limit); the store takes its own reference if it keeps it. */
+typedef NEOERR* (*CSFRAGGET)(void *ctx, const char *key, CS_FRAGMENT **frag);
+typedef NEOERR* (*CSFRAGPUT)(void *ctx, const char *key, CS_FRAGMENT *frag,
+                             int ttl);
+
+/* The HDF values a render read, see cs_track_reads */
+typedef struct _cs_readset CS_READSET;
+
+typedef enum
+{
+  CS_READ_VALUE = 'v',      /* a variable's value */
+  CS_READ_CHILDREN = 'c',   /* the names of a variable's children */
+  CS_READ_FRAGMENT = 'f'    /* the output of a cache: block */
+} CS_READ_KIND;
+
+/* Length of a read-set digest: 16 hex digits and the NUL */
+#define CS_DIGEST_LEN 17
+
 struct _funct
 {
   char *name;
@@ -297,6 +422,23 @@ struct _error {
   struct _error *next;
 };
 
+/* A file read while parsing, recorded so a cached parse tree can tell
+ * when it has gone stale.  mtime is -1 if the file was supplied by a
+ * CSFILELOAD callback and can't be checked.
+ */
+typedef struct _depend {
+  char *path;
+  time_t mtime;
+  off_t size;
+} CS_DEPEND;
+
+/* How much scratch memory a render used, see cs_render_stats() */
+typedef struct _render_stats {
+  size_t allocs;    /* Number of allocations from the render arena */
+  size_t peak;      /* Most bytes allocated from it at once */
+  size_t reserved;  /* Bytes of memory the arena held for them */
+} CS_RENDER_STATS;
+
 struct _parse
 {
   const char *context;   /* A string identifying where the parser is parsing */
@@ -307,6 +449,16 @@ struct _parse
   int cur_file_idx;
 
   int audit_mode;        /* If in audit_mode, gather some extra information */
+  int bytecode;          /* Config.EnableBytecode, render with CS_PROGRAMs */
+  int bytecode_ready;    /* The tree's CS_PROGRAMs are up to date */
+  int pin_config;        /* Config.PinConfig, see pin_config_vars */
+  int profile_mode;      /* Config.EnableProfile, record node positions */
+
+  /* Parse-time optimizations, reported by cs_dump */
+  int opt_folded;        /* Constant expressions evaluated */
+  int opt_pinned;        /* Config.* variables replaced by their value */
+  int opt_branches;      /* if/elif branches which can never render */
+  int opt_literals;      /* Text nodes merged into the previous one */
   CS_POSITION pos;       /* Container for current position in CS file */
   CS_ERROR *err_list;    /* List of non-fatal errors encountered */
 
@@ -341,10 +493,16 @@ struct _parse
   /* Output */
   void *output_ctx;
   CSOUTFUNC output_cb;
+  CSWRITEFUNC output_write;  /* Used instead of output_cb if set */
 
   void *fileload_ctx;
   CSFILELOAD fileload;
 
+  /* Where cache: blocks keep their output, see cs_register_fragments */
+  void *fragment_ctx;
+  CSFRAGGET fragment_get;
+  CSFRAGPUT fragment_put;
+
   /* Global hdf struct */
   /* smarti:  Added for support for global hdf under local hdf */
   HDF *global_hdf;
@@ -356,8 +514,64 @@ struct _parse
 
   /* Javascript template for csdebug=1 */
   char *csdebug_js_template;
+
+  /* If non-NULL, every file loaded during parse is appended as a
+     CS_DEPEND.  Set by the template cache, see cs_cache_get() */
+  ULIST *depends;
+  /* Number of evar/include commands which read the HDF at parse time,
+     making the resulting parse tree specific to this HDF */
+  int hdf_parse_reads;
+
+  /* The CSPARSE which owns the functions (the top of the parent chain, or
+     the compiled template for a cs_render_ctx render). */
+  struct _parse *owner;
+  /* Parse trees of linclude targets, compiled once and reused by every
+     render.  Only set on the owner. */
+  NE_HASH *lincludes;
+  /* Identifies the current cs_render call, so linclude targets are only
+     checked for changes once per render */
+  long int render_serial;
+
+  /* The file cs_load_compiled read the tree from.  Strings in the tree
+     point into it, so it is released with the parse. */
+  char *compiled_map;
+  size_t compiled_len;
+
+  /* Scratch memory for the current render (expression results, macro
+     arguments), released all at once when the render returns.  Points at
+     render_arena of the top level parse and is shared with its children.
+     NULL outside of a render, so nothing kept by the tree comes from it */
+  NE_ARENA *arena;
+  NE_ARENA render_arena;
+  CS_RENDER_STATS render_stats;
+  /* Buffer variables are escaped into before they are output, shared
+     with the children the same way as arena */
+  STRING *escape_buf;
+  /* Timings collected while rendering with Config.EnableProfile, shared
+     with the children the same way as arena */
+  struct _cs_profile *profile;
+  /* Where the HDF reads of the render are recorded, see cs_track_reads.
+     Shared with the children the same way as arena */
+  CS_READSET *reads;
+  /* Set on the copies each_parallel renders its iterations with, so an
+     each_parallel inside one is rendered as a plain each */
+  int in_parallel;
 };
 
+/* A compiled template, created by cs_compile from a parsed CSPARSE.  The
+ * parse tree is read-only from then on, so one CS_TEMPLATE can be rendered
+ * by any number of threads at once with cs_render_ctx.
+ */
+typedef struct _template
+{
+  CSPARSE *parse;   /* The parsed template, do not modify */
+  ULIST *depends;   /* CS_DEPEND list of the files it was parsed from,
+                       if known.  Freed with the template */
+  char *tag;        /* Copy of parse->tag */
+  int refcount;
+  CS_RENDER_STATS render_stats;  /* of the last cs_render_ctx to finish */
+} CS_TEMPLATE;
+
 /*
  * Function: cs_init - create and initialize a CS context
  * Description: cs_init will create a CSPARSE structure and initialize
@@ -440,6 +654,228 @@ NEOERR *cs_parse_string (CSPARSE *parse, char *buf, size_t blen);
  */
 NEOERR *cs_render (CSPARSE *parse, void *ctx, CSOUTFUNC cb);
 
+/*
+ * Function: cs_render_write - render a CS parse tree to a CSWRITEFUNC
+ * Description: cs_render_write is the same as cs_render, but output is
+ *              passed to cb along with its length.
+ * Input: parse - the CSPARSE structure containing the CS parse tree
+ *        ctx - user data passed as the first argument to cb
+ *        cb - a CSWRITEFUNC called to render the output
+ * Output: None
+ * Return: as for cs_render
+ */
+NEOERR *cs_render_write (CSPARSE *parse, void *ctx, CSWRITEFUNC cb);
+
+/*
+ * Function: cs_compile - turn a parsed CSPARSE into a compiled template
+ * Description: cs_compile takes ownership of a CSPARSE you are done
+ *              parsing into, and wraps it in a reference counted,
+ *              read-only CS_TEMPLATE.  The template no longer refers
+ *              to the HDF passed to cs_init, but does keep the
+ *              functions, fileload and global_hdf of the CSPARSE, so
+ *              those must outlive it.
+ * Input: parse - a pointer to a CSPARSE with a parsed template
+ * Output: parse - will be NULL
+ *         tmpl - the compiled template, release with cs_template_destroy
+ * Return: NERR_ASSERT - if there is no parse tree
+ *         NERR_NOMEM
+ */
+NEOERR *cs_compile (CSPARSE **parse, CS_TEMPLATE **tmpl);
+
+/*
+ * Function: cs_render_ctx - render a compiled template
+ * Description: cs_render_ctx renders tmpl against hdf, the same way
+ *              cs_render would.  All render time state (locals, the
+ *              auto escape parser, loop counters) is kept in a
+ *              temporary context, so several threads may render the
+ *              same template at once, as long as each uses its own HDF.
+ * Input: tmpl - a CS_TEMPLATE from cs_compile
+ *        hdf - the HDF dataset to render with
+ *        ctx - user data passed to the CSOUTFUNC
+ *        cb - a CSOUTFUNC called to render the output
+ * Output: None
+ * Return: as for cs_render
+ */
+NEOERR *cs_render_ctx (CS_TEMPLATE *tmpl, HDF *hdf, void *ctx, CSOUTFUNC cb);
+
+/*
+ * Function: cs_render_ctx_write - render a compiled template to a
+ *           CSWRITEFUNC
+ * Description: cs_render_ctx_write is the same as cs_render_ctx, but
+ *              output is passed to cb along with its length.
+ * Input: tmpl - a CS_TEMPLATE from cs_compile
+ *        hdf - the HDF dataset to render with
+ *        ctx - user data passed to the CSWRITEFUNC
+ *        cb - a CSWRITEFUNC called to render the output
+ * Output: None
+ * Return: as for cs_render
+ */
+NEOERR *cs_render_ctx_write (CS_TEMPLATE *tmpl, HDF *hdf, void *ctx,
+                             CSWRITEFUNC cb);
+
+/*
+ * Function: cs_render_ctx_reads - render a compiled template, recording
+ *           what it reads
+ * Description: cs_render_ctx_reads is the same as cs_render_ctx_write,
+ *              and records the HDF the render reads in reads, the way
+ *              cs_track_reads does for cs_render.
+ * Input: tmpl - a CS_TEMPLATE from cs_compile
+ *        hdf - the HDF dataset to render with
+ *        reads - a CS_READSET, cleared before the render starts
+ *        ctx - user data passed to the CSWRITEFUNC
+ *        cb - a CSWRITEFUNC called to render the output
+ * Output: reads - the reads made by the render
+ * Return: as for cs_render
+ */
+NEOERR *cs_render_ctx_reads (CS_TEMPLATE *tmpl, HDF *hdf, CS_READSET *reads,
+                             void *ctx, CSWRITEFUNC cb);
+
+/*
+ * Function: cs_render_batch - render a compiled template against many
+ *           HDF datasets
+ * Description: cs_render_batch renders tmpl once for each of the n
+ *              datasets, as cs_render_ctx would, and passes each output
+ *              to cb.  The work is spread over nthreads threads, each of
+ *              which keeps its render context, arena and output buffer
+ *              from one item to the next, so rendering a large number of
+ *              small datasets costs little more than the renders
+ *              themselves.  Items may be rendered and passed to cb in any
+ *              order.  The first item which fails to render, or for
+ *              which cb fails, stops the batch, though items already
+ *              being rendered on other threads are finished.
+ * Input: tmpl - a CS_TEMPLATE from cs_compile
+ *        datasets - the n HDF datasets to render with
+ *        n - the number of datasets
+ *        ctx - user data passed to the CSBATCHFUNC
+ *        cb - a CSBATCHFUNC called with the output of each item
+ *        nthreads - the number of threads to render on, 0 for the
+ *                   number of CPUs.  1 renders every item on the
+ *                   calling thread, as does a library built without
+ *                   pthreads.
+ * Output: None
+ * Return: the error which stopped the batch, with the item number added
+ *         to its context
+ */
+NEOERR *cs_render_batch (CS_TEMPLATE *tmpl, HDF **datasets, int n,
+                         void *ctx, CSBATCHFUNC cb, int nthreads);
+
+/*
+ * Function: cs_template_ref - take a reference to a compiled template
+ * Description: cs_template_ref increments the reference count of tmpl,
+ *              each reference is dropped with cs_template_destroy.
+ * Input: tmpl - a CS_TEMPLATE
+ * Output: None
+ * Return: tmpl
+ */
+CS_TEMPLATE *cs_template_ref (CS_TEMPLATE *tmpl);
+
+/*
+ * Function: cs_template_destroy - release a compiled template
+ * Description: cs_template_destroy drops a reference to tmpl, and frees
+ *              it when the last one is gone.  It is safe to call this
+ *              with a NULL pointer.
+ * Input: tmpl - a pointer to a CS_TEMPLATE
+ * Output: tmpl - will be NULL
+ * Return: None
+ */
+void cs_template_destroy (CS_TEMPLATE **tmpl);
+
+/*
+ * Function: cs_template_changed - check a template's files for changes
+ * Description: cs_template_changed stats each of the files recorded in
+ *              tmpl->depends and compares them with the mtime and size
+ *              they had when the template was parsed.
+ * Input: tmpl - a CS_TEMPLATE
+ * Output: None
+ * Return: 1 if any file changed or can't be checked, 0 otherwise
+ */
+int cs_template_changed (CS_TEMPLATE *tmpl);
+
+/*
+ * Function: cs_render_stats - report the scratch memory used by a render
+ * Description: Strings and macro arguments created while rendering are
+ *              allocated from an arena which is released in one go when
+ *              the render returns.  cs_render_stats reports how much of
+ *              it the last cs_render or cs_render_write on parse used,
+ *              cs_template_render_stats does the same for the last
+ *              cs_render_ctx of tmpl to finish.
+ * Input: parse - a CSPARSE which has been rendered
+ *        tmpl - a CS_TEMPLATE which has been rendered
+ * Output: stats - the allocation count, peak and reserved bytes
+ * Return: None
+ */
+void cs_render_stats (CSPARSE *parse, CS_RENDER_STATS *stats);
+void cs_template_render_stats (CS_TEMPLATE *tmpl, CS_RENDER_STATS *stats);
+
+/*
+ * Profiling: if Config.EnableProfile is set when a template is parsed,
+ * each node records the file and line it came from.  If it is set in
+ * the HDF a template is rendered with, the render times every node and
+ * afterwards replaces CS.Profile in that HDF with:
+ *   CS.Profile.Time          - the whole render, in microseconds
+ *   CS.Profile.Nodes.N.*     - for each node rendered, in the order they
+ *                              were first reached: File, Line, Command,
+ *                              Count, Time (including the nodes it
+ *                              rendered, ie an each's body), SelfTime,
+ *                              and the Bytes output and variable Lookups
+ *                              done by the node itself
+ *   CS.Profile.Macros.N.*    - Name, Count and Time for each macro called
+ *   CS.Profile.Stacks        - the SelfTime of each chain of nodes, one
+ *                              "frame;frame;frame microseconds" line each,
+ *                              which is the "folded" input of flame graph
+ *                              tools
+ * Rendering without Config.EnableProfile costs nothing extra.
+ */
+
+/*
+ * Function: cs_compile_to_file - save a compiled template to a file
+ * Description: cs_compile_to_file writes tmpl to path in a binary form
+ *              which cs_load_compiled can load without parsing the
+ *              template again.  Along with the tree, the file records
+ *              the Config values of hdf which affect parsing, and the
+ *              mtime and size of the files the template was parsed
+ *              from (tmpl->depends, which cs_cache_get records), so
+ *              the loader can tell when it is out of date.  The file
+ *              is written under a temporary name and renamed into
+ *              place, so it is safe to replace one while other
+ *              processes load it.
+ * Input: tmpl - a CS_TEMPLATE
+ *        hdf - the HDF the template was parsed with
+ *        path - the file to write
+ * Output: None
+ * Return: NERR_ASSERT - if the template read the HDF at parse time (evar:
+ *                       or include: of a variable)
+ *         NERR_IO - unable to write the file
+ *         NERR_NOMEM
+ */
+NEOERR *cs_compile_to_file (CS_TEMPLATE *tmpl, HDF *hdf, const char *path);
+
+/*
+ * Function: cs_load_compiled - load a template saved by cs_compile_to_file
+ * Description: cs_load_compiled maps the file at path and turns it back
+ *              into a compiled template, as cs_compile would have.  Text
+ *              in the template is used straight from the mapped file.
+ *              parse is used the same way as for cs_compile: create it
+ *              with cs_init using the HDF you will parse with, and
+ *              register any functions and fileload the template needs
+ *              before loading, since these aren't saved.  If the file
+ *              doesn't exist, was written by a different version of the
+ *              library, with different Config values, uses functions
+ *              which aren't registered, or any of its source files have
+ *              changed, tmpl is set to NULL and parse is left as it was,
+ *              so you can go on to cs_parse_file it instead.
+ * Input: parse - a pointer to a CSPARSE from cs_init which hasn't parsed
+ *                anything yet
+ *        path - the file written by cs_compile_to_file
+ * Output: parse - will be NULL if the template was loaded
+ *         tmpl - the compiled template, or NULL if the file can't be used
+ * Return: NERR_ASSERT - if parse already has a parse tree
+ *         NERR_IO - unable to read the file
+ *         NERR_NOMEM
+ */
+NEOERR *cs_load_compiled (CSPARSE **parse, const char *path,
+                          CS_TEMPLATE **tmpl);
+
 /*
  * Function: cs_dump - dump the cs parse tree
  * Description: cs_dump will dump the CS parse tree in the parse struct.
@@ -492,6 +928,30 @@ void cs_destroy (CSPARSE **parse);
 
 void cs_register_fileload(CSPARSE *parse, void *ctx, CSFILELOAD fileload);
 
+/*
+ * Function: cs_register_fragments - register a fragment store
+ * Description: cs_register_fragments sets the store used by the
+ *              <?cs cache:key ttl ?> command.  The first time a cache
+ *              block is rendered with a given key, its output is passed
+ *              to put; after that, get returns it and the block's body
+ *              isn't rendered at all.  Without a store, cache blocks
+ *              just render their body.  The key is the value of the
+ *              key expression, prefixed with "auto:" when the template
+ *              is auto-escaped.  Keys are not specific to a template,
+ *              so blocks using the same key should render the same
+ *              output.  Use cs_register_fragcache for the built in
+ *              in-memory store.  Like the fileload function, the store
+ *              is inherited by cs_compile and include/linclude.
+ * Input: parse - a pointer to an initialized CSPARSE structure
+ *        ctx - pointer that is passed to get and put
+ *        get - a CSFRAGGET function
+ *        put - a CSFRAGPUT function
+ * Output: None
+ * Return: None
+ */
+void cs_register_fragments(CSPARSE *parse, void *ctx, CSFRAGGET get,
+                           CSFRAGPUT put);
+
 /*
  * Function: cs_register_strfunc - register a string handling function
  * Description: cs_register_strfunc will register a string function that
@@ -563,6 +1023,351 @@ NEOERR *cs_register_function(CSPARSE *parse, const char *funcname,
 NEOERR *cs_register_esc_function(CSPARSE *parse, const char *funcname,
                                  int n_args, CSFUNCTION function);
 
+/* **** Template Cache ******************************************** */
+
+typedef struct _cs_cache CS_CACHE;
+
+/* CSINITFUNC is called by cs_cache_get on a cache miss, after cs_init and
+ * before the template is parsed.  Use it to register functions, fileload
+ * handlers or a global_hdf needed by the template. */
+typedef NEOERR* (*CSINITFUNC)(void *ctx, CSPARSE *parse);
+
+typedef struct _cs_cache_stats
+{
+  long int hits;        /* lookups served from the cache */
+  long int misses;      /* lookups which had to parse the template */
+  long int evictions;   /* entries dropped for the memory cap or staleness */
+  long int uncacheable; /* parses which could not be cached (evar, etc) */
+  long int reloads;     /* templates recompiled by the watcher */
+  int entries;          /* templates currently held by the cache */
+  size_t bytes;         /* estimated memory held by the cache */
+  size_t max_bytes;     /* the memory cap, 0 for unlimited */
+} CS_CACHE_STATS;
+
+/*
+ * Function: cs_cache_init - create a compiled template cache
+ * Description: cs_cache_init creates a cache of compiled CS templates.
+ *              Entries are keyed by the resolved path of the template
+ *              and the Config values that affect parsing, and are
+ *              validated against the mtime of every file read during
+ *              the parse (or an explicit version string).  When the
+ *              estimated memory used by the cache exceeds max_bytes,
+ *              the least recently used entries are evicted.  If the
+ *              library was built with pthreads, the cache may be
+ *              shared between threads.
+ * Input: cache - a pointer to a CS_CACHE pointer
+ *        max_bytes - the memory cap for the cache, 0 for unlimited
+ * Output: cache - an allocated CS_CACHE, free with cs_cache_destroy
+ * Return: NERR_NOMEM
+ */
+NEOERR *cs_cache_init (CS_CACHE **cache, size_t max_bytes);
+
+/*
+ * Function: cs_cache_shared - return the process-wide template cache
+ * Description: cs_cache_shared returns a single CS_CACHE shared by the
+ *              whole process, creating it with max_bytes on the first
+ *              call.  The shared cache is never destroyed.
+ * Input: max_bytes - the memory cap used if the cache is created
+ * Output: cache - the shared cache
+ * Return: NERR_NOMEM
+ */
+NEOERR *cs_cache_shared (size_t max_bytes, CS_CACHE **cache);
+
+/*
+ * Function: cs_cache_destroy - free a template cache
+ * Description: cs_cache_destroy drops the cache's references to its
+ *              templates and frees the cache.
+ * Input: cache - a pointer to a CS_CACHE
+ * Output: cache - will be NULL
+ * Return: None
+ */
+void cs_cache_destroy (CS_CACHE **cache);
+
+/*
+ * Function: cs_cache_get - get a compiled template from the cache
+ * Description: cs_cache_get returns a reference to the compiled template
+ *              for path, ready for cs_render_ctx.  On a miss, a new
+ *              CSPARSE is created with cs_init, passed to init (if not
+ *              NULL), the template is parsed with cs_parse_file and
+ *              compiled with cs_compile.  Templates which read the HDF
+ *              at parse time (evar:, or include: of a variable) or use
+ *              a CSFILELOAD without a version are compiled but not
+ *              cached.  If cache is NULL, the template is always
+ *              parsed.
+ * Input: cache - a CS_CACHE, or NULL
+ *        hdf - the HDF dataset to use for parsing
+ *        path - the path to the template, as for cs_parse_file
+ *        version - if not NULL, a version string for the template;
+ *                  cached entries with a different version are
+ *                  replaced and file mtimes are not checked
+ *        init - a CSINITFUNC called before parsing, or NULL
+ *        ctx - passed to init
+ * Output: tmpl - the template, release with cs_template_destroy
+ * Return: any error from cs_init, init or cs_parse_file
+ */
+NEOERR *cs_cache_get (CS_CACHE *cache, HDF *hdf, const char *path,
+                      const char *version, CSINITFUNC init, void *ctx,
+                      CS_TEMPLATE **tmpl);
+
+/*
+ * Function: cs_cache_watch - reload cached templates when they change
+ * Description: cs_cache_watch starts a thread which watches the
+ *              directories of the files the cached templates were read
+ *              from (with inotify), so cs_cache_get no longer stats
+ *              those files on every hit.  When a file changes, the
+ *              templates read from it are parsed again by the thread
+ *              and replace the cached ones, renders in progress finish
+ *              with the template they started with.  Only templates
+ *              cached after this call are watched, others are still
+ *              checked by mtime, as are templates with a version.  If
+ *              a template no longer parses, it is checked by mtime
+ *              again, so the next cs_cache_get reports the error.
+ *              Calling it again for the same cache does nothing.
+ * Input: cache - a CS_CACHE
+ *        init - a CSINITFUNC called before each reparse, or NULL
+ *        ctx - passed to init, must be valid until cs_cache_destroy
+ * Output: None
+ * Return: NERR_SYSTEM if the watch can't be set up, NERR_ASSERT if the
+ *         platform has no inotify or the library has no pthreads
+ */
+NEOERR *cs_cache_watch (CS_CACHE *cache, CSINITFUNC init, void *ctx);
+
+/*
+ * Function: cs_config_key - describe the Config values used by parsing
+ * Description: cs_config_key returns a string made up of the Config
+ *              values in hdf which change the parse tree (Config.TagStart,
+ *              Config.AutoEscape, etc, and with Config.PinConfig, all
+ *              of Config).  Templates parsed with HDFs that give the
+ *              same string have the same parse tree.
+ * Input: hdf - the HDF dataset
+ * Output: key - an allocated string, free it with free()
+ * Return: NERR_NOMEM
+ */
+NEOERR *cs_config_key (HDF *hdf, char **key);
+
+/*
+ * Function: cs_cache_clear - drop all cached templates
+ * Description: cs_cache_clear evicts all entries from the cache.
+ *              Templates still referenced elsewhere are freed when
+ *              their last reference is released.
+ * Input: cache - a CS_CACHE
+ * Output: None
+ * Return: None
+ */
+void cs_cache_clear (CS_CACHE *cache);
+
+/*
+ * Function: cs_cache_stats - get cache statistics
+ * Description: cs_cache_stats fills in the hit/miss/eviction counters
+ *              and current memory use of the cache.
+ * Input: cache - a CS_CACHE
+ * Output: stats - the statistics
+ * Return: None
+ */
+void cs_cache_stats (CS_CACHE *cache, CS_CACHE_STATS *stats);
+
+/* **** Fragment Cache ******************************************** */
+
+/*
+ * Function: cs_fragment_create - create a fragment
+ * Description: cs_fragment_create makes a fragment holding a copy of
+ *              len bytes of buf, and of the parser state in auto_exit.
+ *              This is what the cache: command stores, and can also be
+ *              used by a fragment store to rebuild fragments it keeps
+ *              elsewhere.
+ * Input: buf - the rendered output
+ *        len - the length of buf
+ *        auto_exit - the auto escape parser state after buf, or NULL
+ * Output: frag - the new fragment, with one reference
+ * Return: NERR_NOMEM
+ */
+NEOERR *cs_fragment_create (const char *buf, size_t len,
+                            NEOS_AUTO_CTX *auto_exit, CS_FRAGMENT **frag);
+
+/* Add a reference to frag, and return it */
+CS_FRAGMENT *cs_fragment_ref (CS_FRAGMENT *frag);
+
+/* Release a reference to *frag, freeing it with the last one, and set
+ * *frag to NULL */
+void cs_fragment_destroy (CS_FRAGMENT **frag);
+
+typedef struct _cs_fragcache CS_FRAGCACHE;
+
+typedef struct _cs_fragcache_stats
+{
+  long int hits;        /* lookups which found the fragment */
+  long int misses;      /* lookups which didn't, including expired ones */
+  long int stores;      /* fragments added */
+  long int expired;     /* entries dropped because their ttl ran out */
+  long int evictions;   /* entries dropped for the memory cap */
+  int entries;          /* fragments currently held by the cache */
+  size_t bytes;         /* estimated memory held by the cache */
+  size_t max_bytes;     /* the memory cap, 0 for unlimited */
+} CS_FRAGCACHE_STATS;
+
+/*
+ * Function: cs_fragcache_init - create an in-memory fragment store
+ * Description: cs_fragcache_init creates a fragment store which keeps
+ *              fragments in memory until their ttl runs out.  When the
+ *              estimated memory used exceeds max_bytes, the least
+ *              recently used fragments are evicted.  If the library was
+ *              built with pthreads, the store may be shared between
+ *              threads.
+ * Input: cache - a pointer to a CS_FRAGCACHE pointer
+ *        max_bytes - the memory cap for the cache, 0 for unlimited
+ * Output: cache - an allocated CS_FRAGCACHE, free with cs_fragcache_destroy
+ * Return: NERR_NOMEM
+ */
+NEOERR *cs_fragcache_init (CS_FRAGCACHE **cache, size_t max_bytes);
+
+/*
+ * Function: cs_fragcache_destroy - free a fragment cache
+ * Description: cs_fragcache_destroy releases the cached fragments and
+ *              frees the cache.  Renders using it must have finished.
+ * Input: cache - a pointer to a CS_FRAGCACHE
+ * Output: cache - will be NULL
+ * Return: None
+ */
+void cs_fragcache_destroy (CS_FRAGCACHE **cache);
+
+/* The CSFRAGGET and CSFRAGPUT of a CS_FRAGCACHE, ctx is the cache */
+NEOERR *cs_fragcache_get (void *ctx, const char *key, CS_FRAGMENT **frag);
+NEOERR *cs_fragcache_put (void *ctx, const char *key, CS_FRAGMENT *frag,
+                          int ttl);
+
+/* Use cache as the fragment store of parse, see cs_register_fragments */
+void cs_register_fragcache (CSPARSE *parse, CS_FRAGCACHE *cache);
+
+/*
+ * Function: cs_fragcache_clear - drop all cached fragments
+ * Description: cs_fragcache_clear evicts all entries from the cache.
+ * Input: cache - a CS_FRAGCACHE
+ * Output: None
+ * Return: None
+ */
+void cs_fragcache_clear (CS_FRAGCACHE *cache);
+
+/*
+ * Function: cs_fragcache_stats - get fragment cache statistics
+ * Description: cs_fragcache_stats fills in the hit/miss/eviction
+ *              counters and current memory use of the cache.
+ * Input: cache - a CS_FRAGCACHE
+ * Output: stats - the statistics
+ * Return: None
+ */
+void cs_fragcache_stats (CS_FRAGCACHE *cache, CS_FRAGCACHE_STATS *stats);
+
+/* **** Read Sets ************************************************* */
+
+/*
+ * Function: cs_readset_init - create a read-set
+ * Description: cs_readset_init creates an empty CS_READSET, which
+ *              records the HDF a render reads when given to
+ *              cs_track_reads or cs_render_ctx_reads.  A read-set is
+ *              for one render at a time.
+ * Input: None
+ * Output: reads - the new read-set, release with cs_readset_destroy
+ * Return: NERR_NOMEM
+ */
+NEOERR *cs_readset_init (CS_READSET **reads);
+
+/* Free a read-set.  It is safe to call this with a NULL pointer. */
+void cs_readset_destroy (CS_READSET **reads);
+
+/* Forget all the reads recorded so far */
+void cs_readset_clear (CS_READSET *reads);
+
+/*
+ * Function: cs_track_reads - record what cs_render reads
+ * Description: cs_track_reads makes the following renders of parse
+ *              record the HDF they read in reads: the value of every
+ *              variable, the children of every each: and subcount(), and
+ *              the output of cache: blocks which aren't rendered.
+ *              Variables are recorded by their full name, so the reads
+ *              can be checked against another HDF with
+ *              cs_readset_replay.  Each render clears reads first.
+ *              Config.* values read when the template is parsed, and
+ *              anything user functions look at directly, aren't
+ *              included.  Pass NULL to stop recording.
+ * Input: parse - a CSPARSE
+ *        reads - a CS_READSET, or NULL
+ * Output: None
+ * Return: None
+ */
+void cs_track_reads (CSPARSE *parse, CS_READSET *reads);
+
+/*
+ * Function: cs_readset_digest - fingerprint the reads of a render
+ * Description: cs_readset_digest hashes the reads recorded in reads,
+ *              in the order they were first made.  Renders of the
+ *              same template which read the same values get the same
+ *              digest, and since they can only differ in what they
+ *              read, the same output, so the digest can be used as an
+ *              ETag or the key of a page cache.  The digest is the
+ *              same on every platform and run.
+ * Input: reads - a CS_READSET from a render
+ * Output: digest - CS_DIGEST_LEN bytes, set to a string of hex digits
+ * Return: 1 on success, 0 if not every read could be recorded
+ */
+int cs_readset_digest (CS_READSET *reads, char *digest);
+
+/*
+ * Function: cs_readset_replay - digest another HDF without rendering
+ * Description: cs_readset_replay looks up each of the recorded reads
+ *              in hdf, and computes the digest a render against hdf
+ *              would have if it read the same variables.  If it equals
+ *              the digest of the recorded render, so would the output
+ *              of a render against hdf.  It can't be done if the render
+ *              read variables through a local whose full name isn't
+ *              known, or wrote a cached fragment out.
+ * Input: reads - a CS_READSET from a render
+ *        hdf - the HDF to check
+ *        global_hdf - the global HDF the template was rendered with,
+ *                     or NULL
+ * Output: digest - CS_DIGEST_LEN bytes, set to a string of hex digits
+ * Return: 1 on success, 0 if the reads can't be replayed
+ */
+int cs_readset_replay (CS_READSET *reads, HDF *hdf, HDF *global_hdf,
+                       char *digest);
+
+/*
+ * Function: cs_readset_dump - list the reads of a render
+ * Description: cs_readset_dump outputs one line for each read recorded
+ *              in reads, with its kind and the variable name.
+ * Input: reads - a CS_READSET
+ *        ctx - user data passed to cb
+ *        cb - a CSOUTFUNC called for each line
+ * Output: None
+ * Return: NERR_NOMEM
+ */
+NEOERR *cs_readset_dump (CS_READSET *reads, void *ctx, CSOUTFUNC cb);
+
+/*
+ * Function: cs_readset_add - record a read
+ * Description: cs_readset_add is how the renderer records that it read
+ *              the variable with the full name path, hashing what hdf
+ *              and global_hdf have there.  Repeated reads of a path are
+ *              only recorded once.
+ * Input: reads - a CS_READSET
+ *        kind - CS_READ_VALUE or CS_READ_CHILDREN
+ *        path - the full variable name
+ *        hdf, global_hdf - the HDF the render is reading from
+ * Output: None
+ * Return: None, a read which can't be recorded makes cs_readset_digest
+ *         fail
+ */
+void cs_readset_add (CS_READSET *reads, CS_READ_KIND kind, const char *path,
+                     HDF *hdf, HDF *global_hdf);
+
+/* Record a read of obj, for variables whose full name isn't known.  The
+ * digest still covers it, but the reads can no longer be replayed. */
+void cs_readset_add_node (CS_READSET *reads, CS_READ_KIND kind,
+                          const char *name, HDF *obj);
+
+/* Record that the cache: block with key wrote out frag */
+void cs_readset_add_fragment (CS_READSET *reads, const char *key,
+                              CS_FRAGMENT *frag);
+
 __END_DECLS
 
 #endif /* __CSHDF_H_ */
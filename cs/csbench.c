@@ -0,0 +1,185 @@
+/*
+ * Copyright 2001-2004 Brandon Long
+ * All Rights Reserved.
+ *
+ * ClearSilver Templating System
+ *
+ * This code is made available under the terms of the ClearSilver License.
+ * http://www.clearsilver.net/license.hdf
+ *
+ */
+
+/*
+ * csbench renders one template against many copies of an HDF dataset,
+ * once with a cs_init/cs_parse_file/cs_render/cs_destroy per dataset and
+ * once with cs_render_batch, and prints the throughput of each.  Each
+ * copy has its number in Batch.Item, so templates can vary per item.
+ */
+
+#include "cs_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "util/neo_misc.h"
+#include "util/neo_hdf.h"
+#include "cs.h"
+
+static NEOERR *count_output (void *ctx, const char *s, size_t len)
+{
+  *((size_t *) ctx) += len;
+  return STATUS_OK;
+}
+
+/* Called from several threads, but each item has its own counter */
+static NEOERR *count_batch_output (void *ctx, int item, const char *s,
+                                   size_t len)
+{
+  ((size_t *) ctx)[item] = len;
+  return STATUS_OK;
+}
+
+static NEOERR *bench_single (HDF **datasets, int n, const char *cs_file,
+                             size_t *bytes)
+{
+  NEOERR *err = STATUS_OK;
+  CSPARSE *parse;
+  int x;
+
+  for (x = 0; err == STATUS_OK && x < n; x++)
+  {
+    err = cs_init(&parse, datasets[x]);
+    if (err) break;
+    err = cs_parse_file(parse, cs_file);
+    if (err == STATUS_OK)
+      err = cs_render_write(parse, bytes, count_output);
+    cs_destroy(&parse);
+  }
+  return nerr_pass(err);
+}
+
+static NEOERR *bench_batch (HDF **datasets, int n, const char *cs_file,
+                            int threads, size_t *bytes)
+{
+  NEOERR *err;
+  CSPARSE *parse;
+  CS_TEMPLATE *tmpl = NULL;
+  size_t *lens;
+  int x;
+
+  lens = (size_t *) calloc (n, sizeof(size_t));
+  if (lens == NULL)
+    return nerr_raise(NERR_NOMEM, "Unable to allocate memory for lengths");
+
+  err = cs_init(&parse, datasets[0]);
+  if (err == STATUS_OK)
+    err = cs_parse_file(parse, cs_file);
+  if (err == STATUS_OK)
+    err = cs_compile(&parse, &tmpl);
+  cs_destroy(&parse);
+  if (err == STATUS_OK)
+    err = cs_render_batch(tmpl, datasets, n, lens, count_batch_output,
+                          threads);
+  cs_template_destroy(&tmpl);
+
+  for (x = 0; x < n; x++)
+    *bytes += lens[x];
+  free(lens);
+  return nerr_pass(err);
+}
+
+int main (int argc, char *argv[])
+{
+  NEOERR *err = STATUS_OK;
+  HDF *hdf;
+  HDF **datasets;
+  size_t single_bytes = 0, batch_bytes = 0;
+  double start, single_time, batch_time;
+  int n = 10000;
+  int threads = 0;
+  int c, x;
+
+  while ((c = getopt(argc, argv, "n:t:")) != EOF)
+  {
+    switch (c)
+    {
+      case 'n':
+        n = atoi(optarg);
+        break;
+      case 't':
+        threads = atoi(optarg);
+        break;
+      default:
+        ne_warn("Usage: %s [-n count] [-t threads] <file.hdf> <file.cs>",
+                argv[0]);
+        return -1;
+    }
+  }
+  if (optind + 2 != argc || n <= 0)
+  {
+    ne_warn("Usage: %s [-n count] [-t threads] <file.hdf> <file.cs>",
+            argv[0]);
+    return -1;
+  }
+
+  err = hdf_init(&hdf);
+  if (err == STATUS_OK)
+    err = hdf_read_file(hdf, argv[optind]);
+  if (err != STATUS_OK)
+  {
+    nerr_warn_error(err);
+    return -1;
+  }
+
+  datasets = (HDF **) calloc (n, sizeof(HDF *));
+  if (datasets == NULL)
+  {
+    ne_warn("Unable to allocate memory for %d datasets", n);
+    return -1;
+  }
+  for (x = 0; err == STATUS_OK && x < n; x++)
+  {
+    err = hdf_init(&datasets[x]);
+    if (err == STATUS_OK)
+      err = hdf_copy(datasets[x], "", hdf);
+    if (err == STATUS_OK)
+      err = hdf_set_int_value(datasets[x], "Batch.Item", x);
+  }
+
+  if (err == STATUS_OK)
+  {
+    start = ne_timef();
+    err = bench_single(datasets, n, argv[optind + 1], &single_bytes);
+    single_time = ne_timef() - start;
+  }
+  if (err == STATUS_OK)
+  {
+    start = ne_timef();
+    err = bench_batch(datasets, n, argv[optind + 1], threads, &batch_bytes);
+    batch_time = ne_timef() - start;
+  }
+  if (err != STATUS_OK)
+  {
+    nerr_warn_error(err);
+    return -1;
+  }
+
+  printf("%d renders of %s\n", n, argv[optind + 1]);
+  printf("cs_render:       %10.0f renders/sec, %lu bytes\n",
+         n / single_time, (unsigned long) single_bytes);
+  printf("cs_render_batch: %10.0f renders/sec, %lu bytes, ",
+         n / batch_time, (unsigned long) batch_bytes);
+  if (threads > 0)
+    printf("%d threads\n", threads);
+  else
+    printf("a thread per CPU\n");
+  if (single_bytes != batch_bytes)
+    ne_warn("Output differs between cs_render and cs_render_batch");
+
+  for (x = 0; x < n; x++)
+    hdf_destroy(&datasets[x]);
+  free(datasets);
+  hdf_destroy(&hdf);
+  return single_bytes == batch_bytes ? 0 : -1;
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright 2001-2004 Brandon Long
+ * All Rights Reserved.
+ *
+ * ClearSilver Templating System
+ *
+ * This code is made available under the terms of the ClearSilver License.
+ * http://www.clearsilver.net/license.hdf
+ *
+ */
+
+/*
+ * csc precompiles a CS template with cs_compile_to_file, so a server can
+ * cs_load_compiled it instead of parsing it on startup.  Functions the
+ * application registers have to be named with -f, so the template parses;
+ * they are only looked up by name when the file is loaded.
+ */
+
+#include "cs_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cs.h"
+#include "util/neo_misc.h"
+#include "util/neo_hdf.h"
+
+#define MAX_FUNCTIONS 100
+
+static struct _csc_function {
+  char *name;
+  int n_args;
+} Functions[MAX_FUNCTIONS];
+static int NumFunctions = 0;
+
+static NEOERR *stub_function (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
+                              CSARG *result)
+{
+  return nerr_raise(NERR_ASSERT, "Function %s isn't available in csc",
+                    csf->name);
+}
+
+static NEOERR *init_parse (void *ctx, CSPARSE *parse)
+{
+  NEOERR *err;
+  int x;
+
+  for (x = 0; x < NumFunctions; x++)
+  {
+    err = cs_register_function(parse, Functions[x].name, Functions[x].n_args,
+                               stub_function);
+    if (err) return nerr_pass(err);
+  }
+  return STATUS_OK;
+}
+
+static void usage (char *argv0)
+{
+  fprintf(stderr, "Usage: %s [-v] [-h <file.hdf>] [-f <name>[:<nargs>]] "
+          "[-o <file.csc>] -c <file.cs>\n", argv0);
+  fprintf(stderr, "     -h <file.hdf>   load hdf file file.hdf (multiple allowed)\n");
+  fprintf(stderr, "     -f <name>:<n>   the template may call function name with n\n");
+  fprintf(stderr, "                     arguments, default 1 (multiple allowed)\n");
+  fprintf(stderr, "     -o <file.csc>   output file, default file.cs with .csc\n");
+  fprintf(stderr, "     -c <file.cs>    template to compile\n");
+  fprintf(stderr, "     -v              verbose output\n");
+}
+
+int main (int argc, char *argv[])
+{
+  NEOERR *err;
+  HDF *hdf;
+  CS_CACHE *cache = NULL;
+  CS_TEMPLATE *tmpl = NULL;
+  int verbose = 0;
+  char *cs_file = NULL, *out_file = NULL;
+  char out_buf[PATH_BUF_SIZE];
+  char *p;
+  int c, l;
+
+  extern char *optarg;
+
+  err = hdf_init(&hdf);
+  if (err != STATUS_OK)
+  {
+    nerr_warn_error(err);
+    return -1;
+  }
+
+  while ((c = getopt(argc, argv, "Hvh:f:o:c:")) != EOF)
+    switch (c) {
+    case 'h':
+      err = hdf_read_file(hdf, optarg);
+      if (err != STATUS_OK) {
+        nerr_warn_error(err);
+        return -1;
+      }
+      break;
+    case 'f':
+      if (NumFunctions == MAX_FUNCTIONS) {
+        fprintf(stderr, "Too many functions\n");
+        return -1;
+      }
+      Functions[NumFunctions].name = optarg;
+      Functions[NumFunctions].n_args = 1;
+      p = strchr(optarg, ':');
+      if (p != NULL) {
+        *p = '\0';
+        Functions[NumFunctions].n_args = atoi(p + 1);
+      }
+      NumFunctions++;
+      break;
+    case 'o':
+      out_file = optarg;
+      break;
+    case 'c':
+      cs_file = optarg;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+
+  if (cs_file == NULL)
+  {
+    usage(argv[0]);
+    return -1;
+  }
+  if (out_file == NULL)
+  {
+    l = strlen(cs_file);
+    if (l > 3 && !strcmp(cs_file + l - 3, ".cs")) l -= 3;
+    snprintf(out_buf, sizeof(out_buf), "%.*s.csc", l, cs_file);
+    out_file = out_buf;
+  }
+
+  if (verbose)
+    printf("Compiling %s to %s\n", cs_file, out_file);
+
+  /* Through a cache, so the template records the files it was parsed
+   * from */
+  err = cs_cache_init(&cache, 0);
+  if (err == STATUS_OK)
+    err = cs_cache_get(cache, hdf, cs_file, NULL, init_parse, NULL, &tmpl);
+  if (err == STATUS_OK)
+    err = cs_compile_to_file(tmpl, hdf, out_file);
+  if (err != STATUS_OK)
+  {
+    err = nerr_pass(err);
+    nerr_warn_error(err);
+    return -1;
+  }
+
+  cs_template_destroy(&tmpl);
+  cs_cache_destroy(&cache);
+  hdf_destroy(&hdf);
+  return 0;
+}
@@ -0,0 +1,1131 @@
+/*
+ * Copyright 2001-2004 Brandon Long
+ * All Rights Reserved.
+ *
+ * ClearSilver Templating System
+ *
+ * This code is made available under the terms of the ClearSilver License.
+ * http://www.clearsilver.net/license.hdf
+ *
+ */
+
+/*
+ * Compiled template cache.
+ *
+ * Parsing a template (tokenizing and parse_expr) usually costs more than
+ * rendering it, so long running processes can keep the compiled templates
+ * around and only pay the parse cost once per template.  A CS_TEMPLATE is
+ * read-only and reference counted, so a cached template is handed to any
+ * number of callers at once, and an evicted one lives until its last
+ * render is done.
+ *
+ * Cached templates are checked against the mtimes of their files on every
+ * hit, unless the cache is watched (cs_cache_watch).  Then a thread waits
+ * on inotify for the directories holding those files, parses the changed
+ * templates again and swaps them into their entries, and hits don't touch
+ * the filesystem at all.
+ */
+
+#include "cs_config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/neo_misc.h"
+#include "util/neo_err.h"
+#include "util/neo_str.h"
+#include "util/neo_hash.h"
+#include "util/ulist.h"
+#ifdef HAVE_PTHREADS
+#include "util/ulocks.h"
+#endif
+#include "cs.h"
+
+#if defined(HAVE_PTHREADS) && defined(HAVE_SYS_INOTIFY_H)
+#define CACHE_WATCH 1
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
+typedef struct _cs_cache_entry
+{
+  char *key;
+  char *version;
+  CS_TEMPLATE *tmpl;
+  size_t size;
+
+  char *path;           /* as passed to cs_cache_get, for the watcher */
+  HDF *config;          /* the Config and hdf.loadpaths it was parsed with */
+  int watched;          /* hits needn't check the files, the watcher does */
+
+  struct _cs_cache_entry *prev;     /* LRU list, most recent first */
+  struct _cs_cache_entry *next;
+} CS_CACHE_ENTRY;
+
+struct _cs_cache
+{
+#ifdef HAVE_PTHREADS
+  pthread_mutex_t lock;
+#endif
+  NE_HASH *keys;        /* key -> CS_CACHE_ENTRY */
+  CS_CACHE_ENTRY *head;
+  CS_CACHE_ENTRY *tail;
+
+  CS_CACHE_STATS stats;
+
+  struct _cs_cache_watch *watch;    /* set by cs_cache_watch */
+};
+
+#ifdef CACHE_WATCH
+typedef struct _cs_cache_watch
+{
+  int fd;               /* inotify */
+  int wake[2];          /* written to stop the thread */
+  pthread_t thread;
+  NE_HASH *dirs;        /* watched directory -> watch descriptor */
+  ULIST *events;        /* WATCH_EVENTs read but not acted on yet */
+  CSINITFUNC init;
+  void *ctx;
+} CS_CACHE_WATCH;
+
+/* The thread waits this long after an event for the rest of the events of
+ * the same change, since an editor saving a file can make several */
+#define WATCH_SETTLE_MS 50
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | \
+                      IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+/* A file which changed, or with an empty name, a directory which is no
+ * longer watched.  A wd of -1 means events were lost. */
+typedef struct _watch_event
+{
+  int wd;
+  char name[1];
+} WATCH_EVENT;
+
+/* A template being parsed again by the watcher.  The entry's config is
+ * lent to the job, and old is what the entry held when it started. */
+typedef struct _watch_job
+{
+  char *key;
+  char *path;
+  HDF *config;
+  CS_TEMPLATE *old;
+} WATCH_JOB;
+#endif
+
+/* The Config values read by cs_init/cs_parse_file which change the parse
+ * tree, and so are part of the cache key */
+static const char *ParseConfig[] = {
+  "Config.TagStart",
+  "Config.VarEscapeMode",
+  "Config.AutoEscape",
+  "Config.LogAutoEscape",
+  "Config.PropagateEscapeStatus",
+  "Config.EnableAuditMode",
+  "Config.CsTemplateDebug",
+  "Config.CsDebugJsTemplate",
+  "Config.EnableBytecode",
+  "Config.PinConfig",
+  NULL
+};
+
+#ifdef HAVE_PTHREADS
+#define CACHE_LOCK(c) mLock(&((c)->lock))
+#define CACHE_UNLOCK(c) mUnlock(&((c)->lock))
+#else
+#define CACHE_LOCK(c) STATUS_OK
+#define CACHE_UNLOCK(c) STATUS_OK
+#endif
+
+static void dealloc_depend (void *data)
+{
+  CS_DEPEND *dep = (CS_DEPEND *) data;
+
+  free(dep->path);
+  free(dep);
+}
+
+static void dealloc_entry (CS_CACHE_ENTRY **entry)
+{
+  CS_CACHE_ENTRY *my_entry = *entry;
+
+  if (my_entry == NULL) return;
+  cs_template_destroy(&(my_entry->tmpl));
+  if (my_entry->key) free(my_entry->key);
+  if (my_entry->version) free(my_entry->version);
+  if (my_entry->path) free(my_entry->path);
+  hdf_destroy(&(my_entry->config));
+  free(my_entry);
+  *entry = NULL;
+}
+
+/* Rough estimate of the memory held by a template, for the memory cap.
+ * The loaded template buffers are accounted for by the depend sizes. */
+static size_t arg_size (CSARG *arg)
+{
+  size_t size = 0;
+
+  while (arg != NULL)
+  {
+    size += sizeof(CSARG);
+    if (arg->path)
+      size += sizeof(CS_VARPATH) + (arg->path->nsegs - 1) * sizeof(HDF_SEG);
+    if (arg->expr1) size += arg_size(arg->expr1);
+    if (arg->expr2) size += arg_size(arg->expr2);
+    arg = arg->next;
+  }
+  return size;
+}
+
+static size_t tree_size (CSTREE *node)
+{
+  size_t size = 0;
+
+  while (node != NULL)
+  {
+    size += sizeof(CSTREE);
+    size += arg_size(node->arg1.expr1) + arg_size(node->arg1.expr2) +
+            arg_size(node->arg1.next);
+    size += arg_size(node->arg2.expr1) + arg_size(node->arg2.expr2) +
+            arg_size(node->arg2.next);
+    size += arg_size(node->vargs);
+    if (node->fname) size += strlen(node->fname) + 1;
+    if (node->case_0) size += tree_size(node->case_0);
+    if (node->case_1) size += tree_size(node->case_1);
+    node = node->next;
+  }
+  return size;
+}
+
+static size_t entry_size (CS_CACHE_ENTRY *entry)
+{
+  CSPARSE *parse = entry->tmpl->parse;
+  CS_MACRO *macro;
+  CS_FUNCTION *csf;
+  CS_DEPEND *dep;
+  size_t size;
+  int x;
+
+  size = sizeof(CS_CACHE_ENTRY) + sizeof(CS_TEMPLATE) + sizeof(CSPARSE) +
+         strlen(entry->key) + 1;
+  size += tree_size(parse->tree);
+  for (macro = parse->macros; macro; macro = macro->next)
+    size += sizeof(CS_MACRO) + strlen(macro->name) + 1 +
+            arg_size(macro->args);
+  for (csf = parse->functions; csf; csf = csf->next)
+    size += sizeof(CS_FUNCTION) + csf->name_len + 1;
+  for (x = 0; x < uListLength(entry->tmpl->depends); x++)
+  {
+    uListGet(entry->tmpl->depends, x, (void **)&dep);
+    size += sizeof(CS_DEPEND) + strlen(dep->path) + 1 + dep->size + 1;
+  }
+  return size;
+}
+
+static void lru_unlink (CS_CACHE *cache, CS_CACHE_ENTRY *entry)
+{
+  if (entry->prev) entry->prev->next = entry->next;
+  else cache->head = entry->next;
+  if (entry->next) entry->next->prev = entry->prev;
+  else cache->tail = entry->prev;
+  entry->prev = entry->next = NULL;
+}
+
+static void lru_push (CS_CACHE *cache, CS_CACHE_ENTRY *entry)
+{
+  entry->prev = NULL;
+  entry->next = cache->head;
+  if (cache->head) cache->head->prev = entry;
+  cache->head = entry;
+  if (cache->tail == NULL) cache->tail = entry;
+}
+
+
+/* Remove an entry from the cache.  Must hold the lock. */
+static void cache_remove (CS_CACHE *cache, CS_CACHE_ENTRY **entry)
+{
+  ne_hash_remove(cache->keys, (*entry)->key);
+  lru_unlink(cache, *entry);
+  cache->stats.entries--;
+  cache->stats.bytes -= (*entry)->size;
+  cache->stats.evictions++;
+  dealloc_entry(entry);
+}
+
+/* Evict least recently used entries until we're under the memory cap.
+ * Must hold the lock. */
+static void cache_trim (CS_CACHE *cache)
+{
+  CS_CACHE_ENTRY *entry;
+
+  if (cache->stats.max_bytes == 0) return;
+
+  while (cache->tail != NULL && cache->stats.bytes > cache->stats.max_bytes)
+  {
+    entry = cache->tail;
+    cache_remove(cache, &entry);
+  }
+}
+
+/* Check the files the template was read from against the filesystem. */
+static int template_valid (CS_TEMPLATE *tmpl, const char *tmpl_version,
+                           const char *version)
+{
+  if (version != NULL || tmpl_version != NULL)
+  {
+    if (version == NULL || tmpl_version == NULL) return 0;
+    return !strcmp(version, tmpl_version);
+  }
+  return !cs_template_changed(tmpl);
+}
+
+NEOERR *cs_config_key (HDF *hdf, char **key)
+{
+  NEOERR *err = STATUS_OK;
+  STRING str;
+  int x;
+
+  *key = NULL;
+  string_init(&str);
+  for (x = 0; err == STATUS_OK && ParseConfig[x] != NULL; x++)
+  {
+    err = string_appendf(&str, "%s\n",
+                         hdf_get_value(hdf, ParseConfig[x], ""));
+  }
+  /* With Config.PinConfig, the tree holds the Config.* values it tested */
+  if (err == STATUS_OK && hdf_get_int_value(hdf, "Config.PinConfig", 0))
+  {
+    char *config = NULL;
+    HDF *obj = hdf_get_obj(hdf, "Config");
+
+    if (obj != NULL) err = hdf_write_string(obj, &config);
+    if (err == STATUS_OK && config != NULL)
+    {
+      err = string_append(&str, config);
+      free(config);
+    }
+  }
+  if (err)
+  {
+    string_clear(&str);
+    return nerr_pass(err);
+  }
+  *key = str.buf;
+  return STATUS_OK;
+}
+
+static NEOERR *cache_key (HDF *hdf, const char *path, char **key)
+{
+  NEOERR *err;
+  STRING str;
+  char fpath[PATH_BUF_SIZE];
+  char *config;
+
+  *key = NULL;
+  if (path[0] != '/')
+  {
+    err = hdf_search_path(hdf, path, fpath, sizeof(fpath));
+    if (err) return nerr_pass(err);
+    path = fpath;
+  }
+
+  err = cs_config_key(hdf, &config);
+  if (err) return nerr_pass(err);
+
+  string_init(&str);
+  err = string_appendf(&str, "%s\n%s", path, config);
+  free(config);
+  if (err)
+  {
+    string_clear(&str);
+    return nerr_pass(err);
+  }
+  *key = str.buf;
+  return STATUS_OK;
+}
+
+/* Parse and compile the template for a cache miss.  If depends is set, the
+ * files read are recorded in the template. */
+static NEOERR *cache_compile (HDF *hdf, const char *path, CSINITFUNC init,
+                              void *ctx, int depends, CS_TEMPLATE **tmpl)
+{
+  NEOERR *err;
+  CSPARSE *parse = NULL;
+  ULIST *depend_list = NULL;
+
+  *tmpl = NULL;
+  do
+  {
+    err = cs_init(&parse, hdf);
+    if (err) break;
+    if (init != NULL)
+    {
+      err = init(ctx, parse);
+      if (err) break;
+    }
+    if (depends)
+    {
+      err = uListInit(&depend_list, 5, 0);
+      if (err) break;
+      parse->depends = depend_list;
+    }
+    err = cs_parse_file(parse, path);
+    parse->depends = NULL;
+    if (err) break;
+    err = cs_compile(&parse, tmpl);
+    if (err) break;
+    (*tmpl)->depends = depend_list;
+    depend_list = NULL;
+  } while (0);
+
+  cs_destroy(&parse);
+  if (depend_list != NULL)
+    uListDestroyFunc(&depend_list, dealloc_depend);
+  return nerr_pass(err);
+}
+
+/* Templates which looked at the HDF while parsing are specific to that
+ * HDF, and ones from a custom fileload can only be checked by version */
+static int template_cacheable (CS_TEMPLATE *tmpl, const char *version)
+{
+  CS_DEPEND *dep;
+  int x;
+
+  if (tmpl->parse->hdf_parse_reads) return 0;
+  for (x = 0; version == NULL && x < uListLength(tmpl->depends); x++)
+  {
+    uListGet(tmpl->depends, x, (void **)&dep);
+    if (dep->mtime == -1) return 0;
+  }
+  return 1;
+}
+
+/* The parts of hdf which cs_cache_get's parse depends on, so the watcher
+ * can parse the template again after the request is gone */
+static NEOERR *config_copy (HDF *hdf, HDF **config)
+{
+  NEOERR *err;
+  HDF *obj;
+
+  err = hdf_init(config);
+  if (err) return nerr_pass(err);
+  obj = hdf_get_obj(hdf, "Config");
+  if (obj != NULL)
+    err = hdf_copy(*config, "Config", obj);
+  obj = hdf_get_obj(hdf, "hdf.loadpaths");
+  if (err == STATUS_OK && obj != NULL)
+    err = hdf_copy(*config, "hdf.loadpaths", obj);
+  if (err) hdf_destroy(config);
+  return nerr_pass(err);
+}
+
+/* **** Watching ************************************************** */
+
+#ifdef CACHE_WATCH
+
+/* The directory part of path, up to and including the last '/', which
+ * is what the names in its events are relative to */
+static int path_dir (const char *path, char *dir, size_t size)
+{
+  const char *slash = strrchr(path, '/');
+  size_t len = slash ? slash - path + 1 : 0;
+
+  if (len >= size) return 0;
+  memcpy(dir, path, len);
+  dir[len] = '\0';
+  return 1;
+}
+
+/* The watch descriptor of the directory of path, or 0 */
+static int dir_wd (CS_CACHE_WATCH *watch, const char *path)
+{
+  char dir[PATH_BUF_SIZE];
+
+  if (!path_dir(path, dir, sizeof(dir))) return 0;
+  return (int)(long) ne_hash_lookup(watch->dirs, dir);
+}
+
+/* Watch the directory of path, if it isn't already.  Must hold the lock.
+ * Returns 0 if it can't be watched. */
+static int watch_dir (CS_CACHE_WATCH *watch, const char *path)
+{
+  NEOERR *err;
+  char dir[PATH_BUF_SIZE];
+  char *key;
+  int wd;
+
+  if (!path_dir(path, dir, sizeof(dir))) return 0;
+  wd = (int)(long) ne_hash_lookup(watch->dirs, dir);
+  if (wd) return wd;
+
+  wd = inotify_add_watch(watch->fd, dir[0] ? dir : ".", WATCH_EVENTS);
+  if (wd <= 0) return 0;
+  key = strdup(dir);
+  if (key == NULL) return 0;
+  err = ne_hash_insert(watch->dirs, key, (void *)(long) wd);
+  if (err)
+  {
+    nerr_ignore(&err);
+    free(key);
+    return 0;
+  }
+  return wd;
+}
+
+/* Drop the directories with watch descriptor wd, or all if wd is 0.
+ * Must hold the lock. */
+static void forget_dirs (CS_CACHE_WATCH *watch, int wd)
+{
+  void *key = NULL;
+  void *value;
+
+  /* Start over after each removal, ne_hash_next can't go on from it */
+  while ((value = ne_hash_next(watch->dirs, &key)) != NULL)
+  {
+    if (wd && (int)(long) value != wd) continue;
+    ne_hash_remove(watch->dirs, key);
+    free(key);
+    key = NULL;
+  }
+}
+
+/* Watch the files entry was read from, so hits needn't check them.  Must
+ * hold the lock. */
+static void entry_watch (CS_CACHE *cache, CS_CACHE_ENTRY *entry)
+{
+  CS_DEPEND *dep;
+  int x;
+
+  entry->watched = 0;
+  if (cache->watch == NULL || entry->config == NULL) return;
+  for (x = 0; x < uListLength(entry->tmpl->depends); x++)
+  {
+    uListGet(entry->tmpl->depends, x, (void **)&dep);
+    if (!watch_dir(cache->watch, dep->path)) return;
+  }
+  /* A change made before the watches were set up went unseen */
+  entry->watched = !cs_template_changed(entry->tmpl);
+}
+
+/* Whether events touch a file entry was read from.  Must hold the lock. */
+static int entry_changed (CS_CACHE_WATCH *watch, CS_CACHE_ENTRY *entry)
+{
+  WATCH_EVENT *ev;
+  CS_DEPEND *dep;
+  const char *name;
+  int x, y, wd;
+
+  for (x = 0; x < uListLength(entry->tmpl->depends); x++)
+  {
+    uListGet(entry->tmpl->depends, x, (void **)&dep);
+    wd = dir_wd(watch, dep->path);
+    name = strrchr(dep->path, '/');
+    name = name ? name + 1 : dep->path;
+    for (y = 0; y < uListLength(watch->events); y++)
+    {
+      uListGet(watch->events, y, (void **)&ev);
+      if (ev->wd == -1) return 1;
+      if (ev->wd == wd && (!ev->name[0] || !strcmp(ev->name, name)))
+        return 1;
+    }
+  }
+  return 0;
+}
+
+static NEOERR *add_event (ULIST *events, int wd, const char *name)
+{
+  NEOERR *err;
+  WATCH_EVENT *ev;
+  size_t len = strlen(name);
+  int x;
+
+  for (x = 0; x < uListLength(events); x++)
+  {
+    uListGet(events, x, (void **)&ev);
+    if (ev->wd == wd && !strcmp(ev->name, name)) return STATUS_OK;
+  }
+  ev = (WATCH_EVENT *) malloc (sizeof(WATCH_EVENT) + len);
+  if (ev == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for event");
+  ev->wd = wd;
+  memcpy(ev->name, name, len + 1);
+  err = uListAppend(events, ev);
+  if (err) free(ev);
+  return nerr_pass(err);
+}
+
+/* Read the pending inotify events into watch->events.  If one can't be
+ * kept, it is recorded as lost events. */
+static void watch_read (CS_CACHE_WATCH *watch)
+{
+  NEOERR *err;
+  union
+  {
+    struct inotify_event ev;
+    char buf[4096];
+  } u;
+  struct inotify_event *ev;
+  ssize_t len, off;
+
+  while ((len = read(watch->fd, u.buf, sizeof(u.buf))) > 0)
+  {
+    for (off = 0; off < len; off += sizeof(struct inotify_event) + ev->len)
+    {
+      ev = (struct inotify_event *) (u.buf + off);
+      if (ev->mask & IN_Q_OVERFLOW)
+        err = add_event(watch->events, -1, "");
+      else if (ev->mask & IN_IGNORED)
+        err = add_event(watch->events, ev->wd, "");
+      else if (ev->len && ev->name[0])
+        err = add_event(watch->events, ev->wd, ev->name);
+      else
+        continue;
+      if (err)
+      {
+        nerr_ignore(&err);
+        err = add_event(watch->events, -1, "");
+        nerr_ignore(&err);
+      }
+    }
+  }
+}
+
+/* Parse the template of job again, and swap it into its entry if nothing
+ * else replaced the entry meanwhile */
+static void watch_job_run (CS_CACHE *cache, WATCH_JOB *job)
+{
+  NEOERR *err;
+  CS_CACHE_WATCH *watch = cache->watch;
+  CS_CACHE_ENTRY *entry;
+  CS_TEMPLATE *tmpl = NULL;
+
+  err = cache_compile(job->config, job->path, watch->init, watch->ctx, 1,
+                      &tmpl);
+  nerr_ignore(&err);
+
+  err = CACHE_LOCK(cache);
+  if (err == STATUS_OK)
+  {
+    entry = (CS_CACHE_ENTRY *) ne_hash_lookup(cache->keys, job->key);
+    if (entry != NULL && entry->tmpl == job->old)
+    {
+      entry->config = job->config;
+      job->config = NULL;
+      if (tmpl != NULL && template_cacheable(tmpl, NULL))
+      {
+        cache->stats.bytes -= entry->size;
+        cs_template_destroy(&(entry->tmpl));
+        entry->tmpl = tmpl;
+        tmpl = NULL;
+        entry->size = entry_size(entry);
+        cache->stats.bytes += entry->size;
+        cache->stats.reloads++;
+        entry_watch(cache, entry);
+        cache_trim(cache);
+      }
+      else
+      {
+        /* Leave it to cs_cache_get to find the change and report it */
+        entry->watched = 0;
+      }
+    }
+    CACHE_UNLOCK(cache);
+  }
+  nerr_ignore(&err);
+
+  cs_template_destroy(&tmpl);
+  cs_template_destroy(&(job->old));
+  hdf_destroy(&(job->config));
+  free(job->key);
+  free(job->path);
+  free(job);
+}
+
+/* Parse again every template the events in watch->events touch */
+static void watch_reload (CS_CACHE *cache)
+{
+  NEOERR *err;
+  CS_CACHE_WATCH *watch = cache->watch;
+  CS_CACHE_ENTRY *entry;
+  WATCH_EVENT *ev;
+  WATCH_JOB *job;
+  ULIST *jobs = NULL;
+  int x;
+
+  err = uListInit(&jobs, 8, 0);
+  if (err == STATUS_OK)
+    err = CACHE_LOCK(cache);
+  if (err)
+  {
+    nerr_ignore(&err);
+    uListDestroy(&jobs, 0);
+    return;
+  }
+  for (entry = cache->head; entry; entry = entry->next)
+  {
+    if (entry->config == NULL || !entry_changed(watch, entry)) continue;
+    job = (WATCH_JOB *) calloc (1, sizeof (WATCH_JOB));
+    if (job != NULL)
+    {
+      job->key = strdup(entry->key);
+      job->path = strdup(entry->path);
+    }
+    if (job == NULL || job->key == NULL || job->path == NULL ||
+        (err = uListAppend(jobs, job)) != STATUS_OK)
+    {
+      /* Fall back to checking the files on each hit */
+      nerr_ignore(&err);
+      if (job != NULL)
+      {
+        if (job->key) free(job->key);
+        if (job->path) free(job->path);
+        free(job);
+      }
+      entry->watched = 0;
+      continue;
+    }
+    job->config = entry->config;
+    entry->config = NULL;
+    job->old = cs_template_ref(entry->tmpl);
+  }
+  /* Directories which went away aren't watched any more, the reparse
+   * watches them again if they're back */
+  for (x = 0; x < uListLength(watch->events); x++)
+  {
+    uListGet(watch->events, x, (void **)&ev);
+    if (!ev->name[0])
+      forget_dirs(watch, ev->wd == -1 ? 0 : ev->wd);
+  }
+  CACHE_UNLOCK(cache);
+
+  while (uListLength(watch->events))
+  {
+    uListPop(watch->events, (void **)&ev);
+    free(ev);
+  }
+  for (x = 0; x < uListLength(jobs); x++)
+  {
+    uListGet(jobs, x, (void **)&job);
+    watch_job_run(cache, job);
+  }
+  uListDestroy(&jobs, 0);
+}
+
+static void *watch_thread (void *arg)
+{
+  CS_CACHE *cache = (CS_CACHE *) arg;
+  CS_CACHE_WATCH *watch = cache->watch;
+  struct pollfd fds[2];
+  int r;
+
+  fds[0].fd = watch->fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = watch->wake[0];
+  fds[1].events = POLLIN;
+  while (1)
+  {
+    r = poll(fds, 2, -1);
+    if (r == -1 && errno == EINTR) continue;
+    if (r == -1 || fds[1].revents) break;
+
+    /* Gather events until they stop for a moment */
+    do
+    {
+      watch_read(watch);
+      r = poll(fds, 2, WATCH_SETTLE_MS);
+    } while (r > 0 && !fds[1].revents);
+    if (r > 0) break;
+
+    watch_reload(cache);
+  }
+  return NULL;
+}
+
+static void watch_destroy (CS_CACHE_WATCH **watch)
+{
+  CS_CACHE_WATCH *my_watch = *watch;
+  WATCH_EVENT *ev;
+
+  if (my_watch == NULL) return;
+  if (my_watch->fd != -1) close(my_watch->fd);
+  if (my_watch->wake[0] != -1) close(my_watch->wake[0]);
+  if (my_watch->wake[1] != -1) close(my_watch->wake[1]);
+  if (my_watch->dirs)
+  {
+    forget_dirs(my_watch, 0);
+    ne_hash_destroy(&(my_watch->dirs));
+  }
+  while (my_watch->events && uListLength(my_watch->events))
+  {
+    uListPop(my_watch->events, (void **)&ev);
+    free(ev);
+  }
+  uListDestroy(&(my_watch->events), 0);
+  free(my_watch);
+  *watch = NULL;
+}
+
+/* Stop the thread and free the watch */
+static void watch_stop (CS_CACHE *cache)
+{
+  if (cache->watch == NULL) return;
+  while (write(cache->watch->wake[1], "", 1) == -1 && errno == EINTR);
+  pthread_join(cache->watch->thread, NULL);
+  watch_destroy(&(cache->watch));
+}
+
+#else
+
+static void entry_watch (CS_CACHE *cache, CS_CACHE_ENTRY *entry)
+{
+  entry->watched = 0;
+}
+
+#endif /* CACHE_WATCH */
+
+NEOERR *cs_cache_watch (CS_CACHE *cache, CSINITFUNC init, void *ctx)
+{
+#ifdef CACHE_WATCH
+  NEOERR *err;
+  CS_CACHE_WATCH *watch;
+  int r;
+
+  err = CACHE_LOCK(cache);
+  if (err) return nerr_pass(err);
+  if (cache->watch != NULL)
+  {
+    CACHE_UNLOCK(cache);
+    return STATUS_OK;
+  }
+
+  watch = (CS_CACHE_WATCH *) calloc (1, sizeof (CS_CACHE_WATCH));
+  if (watch == NULL)
+  {
+    CACHE_UNLOCK(cache);
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for watch");
+  }
+  watch->wake[0] = watch->wake[1] = -1;
+  watch->init = init;
+  watch->ctx = ctx;
+
+  watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watch->fd == -1)
+    err = nerr_raise_errno (NERR_SYSTEM, "Unable to initialize inotify");
+  if (err == STATUS_OK && pipe(watch->wake) == -1)
+    err = nerr_raise_errno (NERR_SYSTEM, "Unable to create pipe");
+  if (err == STATUS_OK)
+    err = ne_hash_init(&(watch->dirs), ne_hash_str_hash, ne_hash_str_comp);
+  if (err == STATUS_OK)
+    err = uListInit(&(watch->events), 16, 0);
+  if (err == STATUS_OK)
+  {
+    cache->watch = watch;
+    r = pthread_create(&(watch->thread), NULL, watch_thread, cache);
+    if (r)
+    {
+      cache->watch = NULL;
+      err = nerr_raise (NERR_SYSTEM, "Unable to start watch thread: %s",
+                        strerror(r));
+    }
+  }
+  if (err) watch_destroy(&watch);
+  CACHE_UNLOCK(cache);
+  return nerr_pass(err);
+#else
+  return nerr_raise (NERR_ASSERT, "cs_cache_watch is not supported here");
+#endif
+}
+
+NEOERR *cs_cache_init (CS_CACHE **cache, size_t max_bytes)
+{
+  NEOERR *err;
+  CS_CACHE *my_cache;
+
+  my_cache = (CS_CACHE *) calloc (1, sizeof (CS_CACHE));
+  if (my_cache == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for CS_CACHE");
+
+  my_cache->stats.max_bytes = max_bytes;
+
+  err = ne_hash_init(&(my_cache->keys), ne_hash_str_hash, ne_hash_str_comp);
+#ifdef HAVE_PTHREADS
+  if (err == STATUS_OK)
+    err = mCreate(&(my_cache->lock));
+#endif
+  if (err)
+  {
+    ne_hash_destroy(&(my_cache->keys));
+    free(my_cache);
+    return nerr_pass(err);
+  }
+
+  *cache = my_cache;
+  return STATUS_OK;
+}
+
+NEOERR *cs_cache_shared (size_t max_bytes, CS_CACHE **cache)
+{
+  static CS_CACHE *Shared = NULL;
+#ifdef HAVE_PTHREADS
+  static pthread_mutex_t SharedLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+  NEOERR *err = STATUS_OK;
+
+#ifdef HAVE_PTHREADS
+  err = mLock(&SharedLock);
+  if (err) return nerr_pass(err);
+#endif
+  if (Shared == NULL)
+    err = cs_cache_init(&Shared, max_bytes);
+  *cache = Shared;
+#ifdef HAVE_PTHREADS
+  mUnlock(&SharedLock);
+#endif
+  return nerr_pass(err);
+}
+
+void cs_cache_destroy (CS_CACHE **cache)
+{
+  CS_CACHE *my_cache = *cache;
+  CS_CACHE_ENTRY *entry, *next;
+
+  if (my_cache == NULL) return;
+
+#ifdef CACHE_WATCH
+  watch_stop(my_cache);
+#endif
+  for (entry = my_cache->head; entry; entry = next)
+  {
+    next = entry->next;
+    dealloc_entry(&entry);
+  }
+  ne_hash_destroy(&(my_cache->keys));
+#ifdef HAVE_PTHREADS
+  mDestroy(&(my_cache->lock));
+#endif
+  free(my_cache);
+  *cache = NULL;
+}
+
+NEOERR *cs_cache_get (CS_CACHE *cache, HDF *hdf, const char *path,
+                      const char *version, CSINITFUNC init, void *ctx,
+                      CS_TEMPLATE **tmpl)
+{
+  NEOERR *err;
+  CS_CACHE_ENTRY *entry;
+  CS_TEMPLATE *my_tmpl = NULL;
+  char *key = NULL;
+  char *tmpl_version = NULL;
+  int watched = 0, watching = 0;
+
+  *tmpl = NULL;
+  if (path == NULL)
+    return nerr_raise (NERR_ASSERT, "path is NULL");
+
+  if (cache == NULL)
+    return nerr_pass(cache_compile(hdf, path, init, ctx, 0, tmpl));
+
+  /* If we can't find it on the hdf loadpaths, let cs_parse_file fail or
+   * find it on the global_hdf; either way it isn't cached */
+  err = cache_key(hdf, path, &key);
+  if (nerr_handle(&err, NERR_NOT_FOUND))
+    return nerr_pass(cache_compile(hdf, path, init, ctx, 0, tmpl));
+  if (err) return nerr_pass(err);
+
+  err = CACHE_LOCK(cache);
+  if (err)
+  {
+    free(key);
+    return nerr_pass(err);
+  }
+  watching = (cache->watch != NULL);
+  entry = (CS_CACHE_ENTRY *) ne_hash_lookup(cache->keys, key);
+  if (entry != NULL)
+  {
+    my_tmpl = cs_template_ref(entry->tmpl);
+    watched = entry->watched && version == NULL;
+    if (entry->version)
+    {
+      tmpl_version = strdup(entry->version);
+      if (tmpl_version == NULL)
+        cs_template_destroy(&my_tmpl);
+    }
+  }
+  CACHE_UNLOCK(cache);
+
+  if (my_tmpl != NULL)
+  {
+    /* Validate outside the lock, this may stat several files.  Our
+     * reference keeps the template alive if it is evicted meanwhile.
+     * Watched templates are kept current by the watcher instead. */
+    if (watched || template_valid(my_tmpl, tmpl_version, version))
+    {
+      err = CACHE_LOCK(cache);
+      if (err == STATUS_OK)
+      {
+        entry = (CS_CACHE_ENTRY *) ne_hash_lookup(cache->keys, key);
+        if (entry != NULL && entry->tmpl == my_tmpl)
+        {
+          lru_unlink(cache, entry);
+          lru_push(cache, entry);
+        }
+        cache->stats.hits++;
+        CACHE_UNLOCK(cache);
+      }
+      free(key);
+      if (tmpl_version) free(tmpl_version);
+      if (err)
+      {
+        cs_template_destroy(&my_tmpl);
+        return nerr_pass(err);
+      }
+      *tmpl = my_tmpl;
+      return STATUS_OK;
+    }
+
+    /* Stale, drop it unless someone already replaced it */
+    err = CACHE_LOCK(cache);
+    if (err == STATUS_OK)
+    {
+      entry = (CS_CACHE_ENTRY *) ne_hash_lookup(cache->keys, key);
+      if (entry != NULL && entry->tmpl == my_tmpl)
+        cache_remove(cache, &entry);
+      CACHE_UNLOCK(cache);
+    }
+    cs_template_destroy(&my_tmpl);
+    if (tmpl_version) free(tmpl_version);
+    if (err)
+    {
+      free(key);
+      return nerr_pass(err);
+    }
+  }
+
+  err = cache_compile(hdf, path, init, ctx, 1, &my_tmpl);
+  if (err)
+  {
+    free(key);
+    return nerr_pass(err);
+  }
+
+  if (!template_cacheable(my_tmpl, version))
+  {
+    free(key);
+    key = NULL;
+  }
+
+  entry = NULL;
+  if (key != NULL)
+  {
+    entry = (CS_CACHE_ENTRY *) calloc (1, sizeof (CS_CACHE_ENTRY));
+    if (entry == NULL)
+    {
+      free(key);
+      cs_template_destroy(&my_tmpl);
+      return nerr_raise (NERR_NOMEM,
+          "Unable to allocate memory for cache entry");
+    }
+    entry->key = key;
+    entry->tmpl = cs_template_ref(my_tmpl);
+    if (version)
+    {
+      entry->version = strdup(version);
+      if (entry->version == NULL)
+      {
+        dealloc_entry(&entry);
+        cs_template_destroy(&my_tmpl);
+        return nerr_raise (NERR_NOMEM,
+            "Unable to allocate memory for cache entry");
+      }
+    }
+    else if (watching)
+    {
+      /* Keep what the watcher needs to parse it again */
+      entry->path = strdup(path);
+      if (entry->path == NULL)
+        err = nerr_raise (NERR_NOMEM,
+            "Unable to allocate memory for cache entry");
+      else
+        err = config_copy(hdf, &(entry->config));
+      if (err)
+      {
+        dealloc_entry(&entry);
+        cs_template_destroy(&my_tmpl);
+        return nerr_pass(err);
+      }
+    }
+    entry->size = entry_size(entry);
+  }
+
+  err = CACHE_LOCK(cache);
+  if (err)
+  {
+    dealloc_entry(&entry);
+    cs_template_destroy(&my_tmpl);
+    return nerr_pass(err);
+  }
+  cache->stats.misses++;
+  if (entry == NULL)
+  {
+    cache->stats.uncacheable++;
+  }
+  else
+  {
+    /* Another thread may have compiled it at the same time */
+    CS_CACHE_ENTRY *old;
+    old = (CS_CACHE_ENTRY *) ne_hash_lookup(cache->keys, entry->key);
+    if (old != NULL)
+      cache_remove(cache, &old);
+    err = ne_hash_insert(cache->keys, entry->key, entry);
+    if (err)
+    {
+      dealloc_entry(&entry);
+    }
+    else
+    {
+      lru_push(cache, entry);
+      entry_watch(cache, entry);
+      cache->stats.entries++;
+      cache->stats.bytes += entry->size;
+      cache_trim(cache);
+    }
+  }
+  CACHE_UNLOCK(cache);
+  if (err)
+  {
+    cs_template_destroy(&my_tmpl);
+    return nerr_pass(err);
+  }
+
+  *tmpl = my_tmpl;
+  return STATUS_OK;
+}
+
+void cs_cache_clear (CS_CACHE *cache)
+{
+  CS_CACHE_ENTRY *entry;
+
+  if (CACHE_LOCK(cache) != STATUS_OK) return;
+  while (cache->head != NULL)
+  {
+    entry = cache->head;
+    cache_remove(cache, &entry);
+  }
+  CACHE_UNLOCK(cache);
+}
+
+void cs_cache_stats (CS_CACHE *cache, CS_CACHE_STATS *stats)
+{
+  if (CACHE_LOCK(cache) != STATUS_OK)
+  {
+    memset(stats, 0, sizeof(CS_CACHE_STATS));
+    return;
+  }
+  *stats = cache->stats;
+  CACHE_UNLOCK(cache);
+}
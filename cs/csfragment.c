@@ -0,0 +1,354 @@
+/*
+ * Copyright 2001-2004 Brandon Long
+ * All Rights Reserved.
+ *
+ * ClearSilver Templating System
+ *
+ * This code is made available under the terms of the ClearSilver License.
+ * http://www.clearsilver.net/license.hdf
+ *
+ */
+
+/*
+ * Fragment cache, the store behind the cache: command.
+ *
+ * A cache: block renders its body once per key and keeps the output as a
+ * CS_FRAGMENT, which later renders write out instead of rendering the
+ * body again.  The store is whatever was registered with
+ * cs_register_fragments, this file has the fragments themselves and
+ * CS_FRAGCACHE, an in-memory store with a memory cap and per entry
+ * expiry.  Like CS_TEMPLATE, a fragment is read-only and reference
+ * counted, so a render can keep writing one out after it is evicted.
+ */
+
+#include "cs_config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "util/neo_misc.h"
+#include "util/neo_err.h"
+#include "util/neo_hash.h"
+#ifdef HAVE_PTHREADS
+#include "util/ulocks.h"
+#endif
+#include "cs.h"
+
+/* Rough size of an htmlparser snapshot, for the memory cap */
+#define FRAGMENT_AUTO_SIZE 2048
+
+typedef struct _cs_fragcache_entry
+{
+  char *key;
+  CS_FRAGMENT *frag;
+  time_t expires;       /* 0 for never */
+  size_t size;
+
+  struct _cs_fragcache_entry *prev;     /* LRU list, most recent first */
+  struct _cs_fragcache_entry *next;
+} CS_FRAGCACHE_ENTRY;
+
+struct _cs_fragcache
+{
+#ifdef HAVE_PTHREADS
+  pthread_mutex_t lock;
+#endif
+  NE_HASH *keys;        /* key -> CS_FRAGCACHE_ENTRY */
+  CS_FRAGCACHE_ENTRY *head;
+  CS_FRAGCACHE_ENTRY *tail;
+
+  CS_FRAGCACHE_STATS stats;
+};
+
+#ifdef HAVE_PTHREADS
+/* Protects fragment reference counts */
+static pthread_mutex_t FragmentLock = PTHREAD_MUTEX_INITIALIZER;
+#define FRAGMENT_LOCK() pthread_mutex_lock(&FragmentLock)
+#define FRAGMENT_UNLOCK() pthread_mutex_unlock(&FragmentLock)
+#define CACHE_LOCK(c) mLock(&((c)->lock))
+#define CACHE_UNLOCK(c) mUnlock(&((c)->lock))
+#else
+#define FRAGMENT_LOCK()
+#define FRAGMENT_UNLOCK()
+#define CACHE_LOCK(c) STATUS_OK
+#define CACHE_UNLOCK(c) STATUS_OK
+#endif
+
+/* **** Fragments ************************************************** */
+
+NEOERR *cs_fragment_create (const char *buf, size_t len,
+                            NEOS_AUTO_CTX *auto_exit, CS_FRAGMENT **frag)
+{
+  NEOERR *err;
+  CS_FRAGMENT *my_frag;
+
+  *frag = NULL;
+  my_frag = (CS_FRAGMENT *) calloc (1, sizeof (CS_FRAGMENT));
+  if (my_frag == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for fragment");
+  my_frag->buf = (char *) malloc (len + 1);
+  if (my_frag->buf == NULL)
+  {
+    free(my_frag);
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for fragment");
+  }
+  if (len) memcpy(my_frag->buf, buf, len);
+  my_frag->buf[len] = '\0';
+  my_frag->len = len;
+  my_frag->refcount = 1;
+
+  if (auto_exit != NULL)
+  {
+    err = neos_auto_init(&(my_frag->auto_exit));
+    if (err)
+    {
+      cs_fragment_destroy(&my_frag);
+      return nerr_pass(err);
+    }
+    neos_auto_copy(my_frag->auto_exit, auto_exit);
+  }
+  *frag = my_frag;
+  return STATUS_OK;
+}
+
+CS_FRAGMENT *cs_fragment_ref (CS_FRAGMENT *frag)
+{
+  FRAGMENT_LOCK();
+  frag->refcount++;
+  FRAGMENT_UNLOCK();
+  return frag;
+}
+
+void cs_fragment_destroy (CS_FRAGMENT **frag)
+{
+  CS_FRAGMENT *my_frag = *frag;
+  int refcount;
+
+  if (my_frag == NULL) return;
+  *frag = NULL;
+
+  FRAGMENT_LOCK();
+  refcount = --my_frag->refcount;
+  FRAGMENT_UNLOCK();
+  if (refcount > 0) return;
+
+  if (my_frag->auto_exit) neos_auto_destroy(&(my_frag->auto_exit));
+  free(my_frag->buf);
+  free(my_frag);
+}
+
+/* **** In-memory store ******************************************** */
+
+static void dealloc_entry (CS_FRAGCACHE_ENTRY **entry)
+{
+  CS_FRAGCACHE_ENTRY *my_entry = *entry;
+
+  if (my_entry == NULL) return;
+  cs_fragment_destroy(&(my_entry->frag));
+  if (my_entry->key) free(my_entry->key);
+  free(my_entry);
+  *entry = NULL;
+}
+
+static void lru_unlink (CS_FRAGCACHE *cache, CS_FRAGCACHE_ENTRY *entry)
+{
+  if (entry->prev) entry->prev->next = entry->next;
+  else cache->head = entry->next;
+  if (entry->next) entry->next->prev = entry->prev;
+  else cache->tail = entry->prev;
+  entry->prev = entry->next = NULL;
+}
+
+static void lru_push (CS_FRAGCACHE *cache, CS_FRAGCACHE_ENTRY *entry)
+{
+  entry->prev = NULL;
+  entry->next = cache->head;
+  if (cache->head) cache->head->prev = entry;
+  cache->head = entry;
+  if (cache->tail == NULL) cache->tail = entry;
+}
+
+/* Remove an entry from the cache.  Must hold the lock. */
+static void cache_remove (CS_FRAGCACHE *cache, CS_FRAGCACHE_ENTRY **entry)
+{
+  ne_hash_remove(cache->keys, (*entry)->key);
+  lru_unlink(cache, *entry);
+  cache->stats.entries--;
+  cache->stats.bytes -= (*entry)->size;
+  dealloc_entry(entry);
+}
+
+/* Evict least recently used entries until we're under the memory cap.
+ * Must hold the lock. */
+static void cache_trim (CS_FRAGCACHE *cache)
+{
+  CS_FRAGCACHE_ENTRY *entry;
+
+  if (cache->stats.max_bytes == 0) return;
+
+  while (cache->tail != NULL && cache->stats.bytes > cache->stats.max_bytes)
+  {
+    entry = cache->tail;
+    cache_remove(cache, &entry);
+    cache->stats.evictions++;
+  }
+}
+
+NEOERR *cs_fragcache_init (CS_FRAGCACHE **cache, size_t max_bytes)
+{
+  NEOERR *err;
+  CS_FRAGCACHE *my_cache;
+
+  my_cache = (CS_FRAGCACHE *) calloc (1, sizeof (CS_FRAGCACHE));
+  if (my_cache == NULL)
+    return nerr_raise (NERR_NOMEM,
+        "Unable to allocate memory for CS_FRAGCACHE");
+
+  my_cache->stats.max_bytes = max_bytes;
+
+  err = ne_hash_init(&(my_cache->keys), ne_hash_str_hash, ne_hash_str_comp);
+#ifdef HAVE_PTHREADS
+  if (err == STATUS_OK)
+    err = mCreate(&(my_cache->lock));
+#endif
+  if (err)
+  {
+    ne_hash_destroy(&(my_cache->keys));
+    free(my_cache);
+    return nerr_pass(err);
+  }
+
+  *cache = my_cache;
+  return STATUS_OK;
+}
+
+void cs_fragcache_destroy (CS_FRAGCACHE **cache)
+{
+  CS_FRAGCACHE *my_cache = *cache;
+  CS_FRAGCACHE_ENTRY *entry, *next;
+
+  if (my_cache == NULL) return;
+
+  for (entry = my_cache->head; entry; entry = next)
+  {
+    next = entry->next;
+    dealloc_entry(&entry);
+  }
+  ne_hash_destroy(&(my_cache->keys));
+#ifdef HAVE_PTHREADS
+  mDestroy(&(my_cache->lock));
+#endif
+  free(my_cache);
+  *cache = NULL;
+}
+
+NEOERR *cs_fragcache_get (void *ctx, const char *key, CS_FRAGMENT **frag)
+{
+  NEOERR *err;
+  CS_FRAGCACHE *cache = (CS_FRAGCACHE *) ctx;
+  CS_FRAGCACHE_ENTRY *entry;
+
+  *frag = NULL;
+  err = CACHE_LOCK(cache);
+  if (err) return nerr_pass(err);
+  entry = (CS_FRAGCACHE_ENTRY *) ne_hash_lookup(cache->keys, (void *)key);
+  if (entry != NULL && entry->expires && entry->expires <= time(NULL))
+  {
+    cache_remove(cache, &entry);
+    cache->stats.expired++;
+  }
+  if (entry != NULL)
+  {
+    lru_unlink(cache, entry);
+    lru_push(cache, entry);
+    *frag = cs_fragment_ref(entry->frag);
+    cache->stats.hits++;
+  }
+  else
+  {
+    cache->stats.misses++;
+  }
+  CACHE_UNLOCK(cache);
+  return STATUS_OK;
+}
+
+NEOERR *cs_fragcache_put (void *ctx, const char *key, CS_FRAGMENT *frag,
+                          int ttl)
+{
+  NEOERR *err;
+  CS_FRAGCACHE *cache = (CS_FRAGCACHE *) ctx;
+  CS_FRAGCACHE_ENTRY *entry, *old;
+
+  entry = (CS_FRAGCACHE_ENTRY *) calloc (1, sizeof (CS_FRAGCACHE_ENTRY));
+  if (entry == NULL)
+    return nerr_raise (NERR_NOMEM,
+        "Unable to allocate memory for fragment cache entry");
+  entry->key = strdup(key);
+  if (entry->key == NULL)
+  {
+    free(entry);
+    return nerr_raise (NERR_NOMEM,
+        "Unable to allocate memory for fragment cache entry");
+  }
+  entry->frag = cs_fragment_ref(frag);
+  entry->expires = ttl > 0 ? time(NULL) + ttl : 0;
+  entry->size = sizeof(CS_FRAGCACHE_ENTRY) + sizeof(CS_FRAGMENT) +
+                strlen(key) + 1 + frag->len + 1 +
+                (frag->auto_exit ? FRAGMENT_AUTO_SIZE : 0);
+
+  err = CACHE_LOCK(cache);
+  if (err)
+  {
+    dealloc_entry(&entry);
+    return nerr_pass(err);
+  }
+  /* Another render may have stored the same key meanwhile */
+  old = (CS_FRAGCACHE_ENTRY *) ne_hash_lookup(cache->keys, entry->key);
+  if (old != NULL)
+    cache_remove(cache, &old);
+  err = ne_hash_insert(cache->keys, entry->key, entry);
+  if (err)
+  {
+    dealloc_entry(&entry);
+  }
+  else
+  {
+    lru_push(cache, entry);
+    cache->stats.stores++;
+    cache->stats.entries++;
+    cache->stats.bytes += entry->size;
+    cache_trim(cache);
+  }
+  CACHE_UNLOCK(cache);
+  return nerr_pass(err);
+}
+
+void cs_fragcache_clear (CS_FRAGCACHE *cache)
+{
+  CS_FRAGCACHE_ENTRY *entry;
+
+  if (CACHE_LOCK(cache) != STATUS_OK) return;
+  while (cache->head != NULL)
+  {
+    entry = cache->head;
+    cache_remove(cache, &entry);
+  }
+  CACHE_UNLOCK(cache);
+}
+
+void cs_fragcache_stats (CS_FRAGCACHE *cache, CS_FRAGCACHE_STATS *stats)
+{
+  if (CACHE_LOCK(cache) != STATUS_OK)
+  {
+    memset(stats, 0, sizeof(CS_FRAGCACHE_STATS));
+    return;
+  }
+  *stats = cache->stats;
+  CACHE_UNLOCK(cache);
+}
+
+void cs_register_fragcache (CSPARSE *parse, CS_FRAGCACHE *cache)
+{
+  cs_register_fragments(parse, cache, cs_fragcache_get, cs_fragcache_put);
+}
@@ -36,10 +36,19 @@
 #include <libintl.h>
 #endif
 
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
 #include "util/neo_misc.h"
 #include "util/neo_err.h"
 #include "util/neo_files.h"
 #include "util/neo_str.h"
+#include "util/neo_arena.h"
 #include "util/ulist.h"
 #include "cs.h"
 
@@ -61,9 +70,31 @@ typedef enum
   ST_LOOP =  1<<7,
   ST_ALT = 1<<8,
   ST_ESCAPE = 1<<9,
+  ST_CACHE = 1<<10,
 } CS_STATE;
 
-#define ST_ANYWHERE (ST_EACH | ST_WITH | ST_ELSE | ST_IF | ST_GLOBAL | ST_DEF | ST_LOOP | ST_ALT | ST_ESCAPE )
+#define ST_ANYWHERE (ST_EACH | ST_WITH | ST_ELSE | ST_IF | ST_GLOBAL | ST_DEF | ST_LOOP | ST_ALT | ST_ESCAPE | ST_CACHE )
+
+/* Protects template reference counts, the linclude memo and RenderSerial,
+ * all of which can be touched by concurrent cs_render_ctx calls */
+#ifdef HAVE_PTHREADS
+static pthread_mutex_t TemplateLock = PTHREAD_MUTEX_INITIALIZER;
+#define TEMPLATE_LOCK() pthread_mutex_lock(&TemplateLock)
+#define TEMPLATE_UNLOCK() pthread_mutex_unlock(&TemplateLock)
+#else
+#define TEMPLATE_LOCK()
+#define TEMPLATE_UNLOCK()
+#endif
+
+static long int RenderSerial = 0;
+
+/* A compiled linclude target, see linclude_eval */
+typedef struct _linclude
+{
+  char *key;
+  CS_TEMPLATE *tmpl;
+  long int checked;   /* render_serial the depends were last checked at */
+} CS_LINCLUDE;
 
 typedef struct _stack_entry
 {
@@ -91,6 +122,8 @@ static NEOERR *elif_parse (CSPARSE *parse, int cmd, char *arg);
 static NEOERR *endif_parse (CSPARSE *parse, int cmd, char *arg);
 static NEOERR *each_with_parse (CSPARSE *parse, int cmd, char *arg);
 static NEOERR *each_eval (CSPARSE *parse, CSTREE *node, CSTREE **next);
+static NEOERR *each_parallel_eval (CSPARSE *parse, CSTREE *node,
+                                   CSTREE **next);
 static NEOERR *with_eval (CSPARSE *parse, CSTREE *node, CSTREE **next);
 static NEOERR *end_parse (CSPARSE *parse, int cmd, char *arg);
 static NEOERR *include_parse (CSPARSE *parse, int cmd, char *arg);
@@ -110,15 +143,31 @@ static NEOERR *escape_parse (CSPARSE *parse, int cmd, char *arg);
 static NEOERR *escape_eval (CSPARSE *parse, CSTREE *node, CSTREE **next);
 static NEOERR *contenttype_parse (CSPARSE *parse, int cmd, char *arg);
 static NEOERR *contenttype_eval (CSPARSE *parse, CSTREE *node, CSTREE **next);
+static NEOERR *flush_parse (CSPARSE *parse, int cmd, char *arg);
+static NEOERR *flush_eval (CSPARSE *parse, CSTREE *node, CSTREE **next);
+static NEOERR *cache_parse (CSPARSE *parse, int cmd, char *arg);
+static NEOERR *cache_eval (CSPARSE *parse, CSTREE *node, CSTREE **next);
 
 static NEOERR *render_node (CSPARSE *parse, CSTREE *node);
 static NEOERR *increase_stack_depth (CSPARSE *parse);
 static NEOERR *decrease_stack_depth (CSPARSE *parse);
 static NEOERR *cs_init_internal (CSPARSE **parse, HDF *hdf, CSPARSE *parent);
-static NEOERR *cs_render_internal (CSPARSE *parse, void *ctx, CSOUTFUNC cb);
+static NEOERR *cs_render_internal (CSPARSE *parse, void *ctx, CSOUTFUNC cb,
+                                   CSWRITEFUNC wcb);
 static NEOERR *cs_parse_string_internal (CSPARSE *parse, char *ibuf,
                                          size_t ibuf_len);
 static NEOERR *add_csdebug(CSPARSE *parse);
+static NEOERR *compile_var_path (CSPARSE *parse, CSARG *arg);
+static NEOERR *eval_expr (CSPARSE *parse, CSARG *expr, CSARG *result);
+static void fold_expr (CSPARSE *parse, CSARG *arg);
+long int arg_eval_bool (CSPARSE *parse, CSARG *arg);
+static void dealloc_program (CS_PROGRAM **prog);
+static void dealloc_programs (CSTREE *node);
+static NEOERR *compile_parse (CSPARSE **parse, CS_TEMPLATE **tmpl);
+static void init_render_parse (CSPARSE *render, CSPARSE *compiled);
+static void dealloc_depend (void *data);
+static void dealloc_linclude (CS_LINCLUDE **memo);
+static void csc_unmap (char *map, size_t len);
 static int rearrange_for_call(CSARG **args);
 
 #define ATTR_PROPAGATE_STATUS "escape_status"
@@ -194,6 +243,14 @@ CS_CMDS Commands[] = {
     end_parse, skip_eval, 1},
   {"content-type",    sizeof("content-type")-1,    ST_ANYWHERE,     ST_SAME,
     contenttype_parse, contenttype_eval, 1},
+  {"flush",    sizeof("flush")-1,    ST_ANYWHERE,     ST_SAME,
+    flush_parse, flush_eval, 0},
+  {"cache",    sizeof("cache")-1,    ST_ANYWHERE,     ST_CACHE,
+    cache_parse, cache_eval, 1},
+  {"/cache",    sizeof("/cache")-1,    ST_CACHE,     ST_POP,
+    end_parse, skip_eval, 0},
+  {"each_parallel", sizeof("each_parallel")-1, ST_ANYWHERE, ST_EACH,
+    each_with_parse, each_parallel_eval, 1},
   {NULL, 0, 0, 0, NULL, NULL, 0},
 };
 
@@ -216,6 +273,42 @@ CS_ESCAPE_MODES EscapeModes[] = {
 /* Template for csdebug javascript UI */
 #define DBCSTEMPL "dbcstempl.js"
 
+/* With Config.EnableProfile, render_node times each node it renders.
+ * A node is counted separately for each chain of nodes which led to it,
+ * which gives the folded stacks for CS.Profile.Stacks, and the entries
+ * are added up per node and per macro when they're written out.  Nodes
+ * parsed during the render (lvar, evar, linclude) are gone by then, so
+ * each entry keeps its own copy of what it reports about the node. */
+typedef struct _cs_prof_entry
+{
+  struct _cs_prof_entry *caller;
+  CSTREE *node;
+  char *name;         /* "cmd (file:line)", or "call macro (file:line)" */
+  char *fname;
+  int linenum;
+  int cmd;
+  char *macro;        /* the macro called, for call nodes */
+  long count;
+  double time;        /* seconds, including the nodes it rendered */
+  double self;        /* seconds, excluding them */
+  long bytes;         /* output by the node itself */
+  long lookups;       /* variable lookups done by the node itself */
+} CS_PROF_ENTRY;
+
+typedef struct _cs_profile
+{
+  NE_HASH *entries;         /* CS_PROF_ENTRY keyed by caller and node */
+  ULIST *order;             /* the same entries, in the order first seen */
+  CS_PROF_ENTRY *current;   /* the node being rendered */
+  /* What the nodes rendered by the current one have used so far */
+  double child_time;
+  long child_bytes;
+  long child_lookups;
+  /* Running totals, counted by output_string and var_lookup */
+  long bytes;
+  long lookups;
+} CS_PROFILE;
+
 /* **** CS alloc/dealloc ******************************************** */
 
 static void init_node_pos(CSTREE *node, CSPARSE *parse)
@@ -285,7 +378,7 @@ static NEOERR *alloc_node (CSTREE **node, CSPARSE *parse)
 
   *node = my_node;
 
-  if (parse->audit_mode) {
+  if (parse->audit_mode || parse->profile_mode) {
     init_node_pos(my_node, parse);
   }
 
@@ -307,6 +400,46 @@ static void dealloc_arg_internal (CSARG *arg)
   if (arg->alloc) free(arg->s);
 }
 
+/* Strings made while evaluating an expression during a render come from
+ * the render arena, and are never freed on their own, so arg->alloc is
+ * left 0.  Without an arena (constant folding at parse time, where the
+ * tree may keep the result) they are malloc'd and arg->alloc is set. */
+static char *arg_alloc_string (CSPARSE *parse, CSARG *arg, size_t len)
+{
+  if (parse->arena)
+  {
+    arg->s = (char *) ne_arena_alloc(parse->arena, len + 1);
+    arg->alloc = 0;
+  }
+  else
+  {
+    arg->s = (char *) malloc(len + 1);
+    arg->alloc = (arg->s != NULL);
+  }
+  return arg->s;
+}
+
+static char *arg_set_sprintf (CSPARSE *parse, CSARG *arg, const char *fmt, ...)
+                              ATTRIBUTE_PRINTF(3,4);
+static char *arg_set_sprintf (CSPARSE *parse, CSARG *arg, const char *fmt, ...)
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  if (parse->arena)
+  {
+    arg->s = ne_arena_vsprintf(parse->arena, fmt, ap);
+    arg->alloc = 0;
+  }
+  else
+  {
+    arg->s = vsprintf_alloc(fmt, ap);
+    arg->alloc = (arg->s != NULL);
+  }
+  va_end(ap);
+  return arg->s;
+}
+
 static void dealloc_arg (CSARG **arg)
 {
   if (*arg == NULL) return;
@@ -328,11 +461,33 @@ static void dealloc_node (CSTREE **node)
   dealloc_arg_internal (&(my_node->arg1));
   dealloc_arg_internal (&(my_node->arg2));
   if (my_node->fname) free(my_node->fname);
+  dealloc_program(&(my_node->prog));
+  if (my_node->auto_exit) neos_auto_destroy(&(my_node->auto_exit));
 
   free(my_node);
   *node = NULL;
 }
 
+static void dealloc_program (CS_PROGRAM **prog)
+{
+  if (*prog == NULL) return;
+  free((*prog)->code);
+  free(*prog);
+  *prog = NULL;
+}
+
+/* Drop the bytecode for a tree, it no longer matches the tree */
+static void dealloc_programs (CSTREE *node)
+{
+  while (node != NULL)
+  {
+    dealloc_program(&(node->prog));
+    dealloc_programs(node->case_0);
+    dealloc_programs(node->case_1);
+    node = node->next;
+  }
+}
+
 static void dealloc_macro (CS_MACRO **macro)
 {
   CS_MACRO *my_macro;
@@ -365,7 +520,8 @@ static int find_open_delim (CSPARSE *parse, char *buf, int x, int len)
 
   while (x < len)
   {
-    p = strchr (&(buf[x]), '<');
+    /* memchr is bounded by len and is vectorized by the C library */
+    p = (char *) memchr (&(buf[x]), '<', len - x);
     if (p == NULL) return -1;
     if (p[1] == '?' && !strncasecmp(&p[2], parse->tag, parse->taglen) &&
 	(p[ws_index] == ' ' || p[ws_index] == '\n' || p[ws_index] == '\t' || p[ws_index] == '\r'))
@@ -412,6 +568,44 @@ static NEOERR *_store_error (CSPARSE *parse, NEOERR *err)
 
 }
 
+/* Record a file read during parse in parse->depends.  If buf is NULL, the
+ * file is stat'd before it is loaded, so a change racing with the load
+ * will still show up as a newer mtime. */
+static NEOERR *add_depend (CSPARSE *parse, const char *path, const char *buf)
+{
+  NEOERR *err;
+  CS_DEPEND *dep;
+  struct stat s;
+
+  dep = (CS_DEPEND *) calloc (1, sizeof (CS_DEPEND));
+  if (dep == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for depend");
+  dep->path = strdup(path);
+  if (dep->path == NULL)
+  {
+    free(dep);
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for depend");
+  }
+  dep->mtime = -1;
+  if (buf != NULL)
+  {
+    dep->size = strlen(buf);
+  }
+  else if (stat(path, &s) == 0)
+  {
+    dep->mtime = s.st_mtime;
+    dep->size = s.st_size;
+  }
+  err = uListAppend(parse->depends, dep);
+  if (err)
+  {
+    free(dep->path);
+    free(dep);
+    return nerr_pass(err);
+  }
+  return STATUS_OK;
+}
+
 static NEOERR *cs_load_file (CSPARSE *parse, const char **path, char *fpath,
                              char **ibuf)
 {
@@ -428,6 +622,12 @@ static NEOERR *cs_load_file (CSPARSE *parse, const char **path, char *fpath,
     *path = fpath;
   }
 
+  if (parse->depends)
+  {
+    err = add_depend(parse, *path, NULL);
+    if (err) return nerr_pass(err);
+  }
+
   return nerr_pass(ne_load_file(*path, ibuf));
 }
 
@@ -446,6 +646,11 @@ static NEOERR *cs_parse_file_internal (CSPARSE *parse, const char *path)
 
   if (parse->fileload) {
     err = parse->fileload(parse->fileload_ctx, parse->hdf, path, &ibuf);
+    if (err == STATUS_OK && parse->depends)
+    {
+      err = add_depend(parse, path, ibuf);
+      if (err) free(ibuf);
+    }
   } else {
     err = cs_load_file(parse, &path, fpath, &ibuf);
   }
@@ -477,7 +682,7 @@ static NEOERR *cs_parse_file_internal (CSPARSE *parse, const char *path)
     parse->cur_file_idx = uListLength(parse->file_list) - 1;
   }
 
-  if (parse->audit_mode) {
+  if (parse->audit_mode || parse->profile_mode) {
     /* Save previous position before parsing the new file */
     memcpy(&pos, &parse->pos, sizeof(CS_POSITION));
 
@@ -487,9 +692,15 @@ static NEOERR *cs_parse_file_internal (CSPARSE *parse, const char *path)
   }
 
   err = cs_parse_string_internal(parse, ibuf, strlen(ibuf));
-  if (err) return nerr_pass (err);
+  if (err)
+  {
+    /* path may be fpath, which is gone once we return */
+    parse->in_file = save_infile;
+    parse->context = save_context;
+    return nerr_pass (err);
+  }
 
-  if (parse->audit_mode) {
+  if (parse->audit_mode || parse->profile_mode) {
     memcpy(&parse->pos, &pos, sizeof(CS_POSITION));
   }
 
@@ -698,6 +909,8 @@ static char *expand_state (CS_STATE state)
     return "ALT";
   else if (state & ST_ESCAPE)
     return "ESCAPE";
+  else if (state & ST_CACHE)
+    return "CACHE";
 
   snprintf(buf, sizeof(buf), "Unknown state %d", state);
   return buf;
@@ -725,6 +938,13 @@ static NEOERR *cs_parse_string_internal (CSPARSE *parse, char *ibuf,
     return nerr_pass (err);
   }
 
+  /* The tree is about to change under any bytecode rendered from it */
+  if (parse->bytecode_ready)
+  {
+    dealloc_programs(parse->tree);
+    parse->bytecode_ready = 0;
+  }
+
   initial_stack_depth = uListLength(parse->stack);
   initial_offset = parse->offset;
   initial_context = parse->context_string;
@@ -939,6 +1159,76 @@ static CS_LOCAL_MAP * lookup_map (CSPARSE *parse, char *name, char **rest)
   return scoped_lookup_map (parse->locals, name, rest);
 }
 
+/* Split the name of a CS_TYPE_VAR arg into arg->path.  Names which don't
+ * split cleanly (empty segments) are left to the string lookup. */
+static NEOERR *compile_var_path (CSPARSE *parse, CSARG *arg)
+{
+  NEOERR *err;
+  CS_VARPATH *path;
+  char *n, *s;
+  int nsegs = 1;
+
+  if (arg->s == NULL || arg->s[0] == '\0' || arg->s[0] == '.')
+    return STATUS_OK;
+  for (n = arg->s; *n; n++)
+  {
+    if (*n == '.')
+    {
+      if (n[1] == '.' || n[1] == '\0') return STATUS_OK;
+      nsegs++;
+    }
+  }
+
+  path = (CS_VARPATH *) malloc (sizeof(CS_VARPATH) +
+                                (nsegs - 1) * sizeof(HDF_SEG));
+  if (path == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for var %s",
+                       arg->s);
+  err = uListAppend(parse->alloc, path);
+  if (err)
+  {
+    free(path);
+    return nerr_pass(err);
+  }
+
+  path->nsegs = 0;
+  n = arg->s;
+  while (1)
+  {
+    s = strchr(n, '.');
+    path->segs[path->nsegs].name = n;
+    path->segs[path->nsegs].len = (s == NULL) ? strlen(n) : s - n;
+    path->segs[path->nsegs].hash = hdf_seg_hash(n,
+                                                path->segs[path->nsegs].len);
+    path->nsegs++;
+    if (s == NULL) break;
+    n = s + 1;
+  }
+  arg->path = path;
+  return STATUS_OK;
+}
+
+/* lookup_map for a pre-split name, only the first segment can name a
+ * local.  Locals are dynamically scoped (a macro sees its caller's locals,
+ * an lincluded file the includer's) so this can't be resolved at parse
+ * time, but the list is short and usually empty. */
+static CS_LOCAL_MAP * path_lookup_map (CSPARSE *parse, CS_VARPATH *path)
+{
+  CS_LOCAL_MAP *map;
+  const char *n = path->segs[0].name;
+  int len = path->segs[0].len;
+
+  for (map = parse->locals; map != NULL; map = map->next)
+  {
+    if (map->name && !strncmp(map->name, n, len) &&
+        (map->name[len] == '\0' || map->name[len] == '.'))
+    {
+      return map;
+    }
+  }
+  return NULL;
+}
+
 /* Note: Check that the map argument passed to this function is either
    parse->locals or (CS_LOCAL_MAP*)->next_scope.  If not one of those two then
    there is probably a bug.
@@ -1019,9 +1309,94 @@ static NEOERR *scoped_var_lookup_or_create_obj (CSPARSE *parse, char *name,
   }
 }
 
-static HDF *var_lookup_obj (CSPARSE *parse, char *name)
+/* The full HDF name of the variable name (pre-split as path, if it is),
+ * for parse->reads.  Names which start with a local are rebased on the
+ * local's path, in buf if it fits.  Returns NULL if the name goes through
+ * a local whose path isn't known, and sets hdf_var to 0 if it names a
+ * local string or number, which isn't a read of the HDF at all. */
+static char *read_path (CSPARSE *parse, char *name, CS_VARPATH *path,
+                        char *buf, size_t len, int *hdf_var)
+{
+  CS_LOCAL_MAP *map;
+  char *rest;
+  size_t need;
+
+  *hdf_var = 1;
+  if (path != NULL)
+  {
+    map = path_lookup_map (parse, path);
+    rest = (path->nsegs > 1) ? (char *) path->segs[1].name - 1 : NULL;
+  }
+  else
+  {
+    map = lookup_map (parse, name, &rest);
+  }
+  if (map == NULL) return name;
+  if (map->type != CS_TYPE_VAR)
+  {
+    *hdf_var = 0;
+    return NULL;
+  }
+  if (map->path == NULL) return NULL;
+  if (rest == NULL) return map->path;
+  need = strlen(map->path) + strlen(rest) + 1;
+  if (need > len)
+  {
+    buf = (char *) ne_arena_alloc(parse->arena, need);
+    if (buf == NULL) return NULL;
+  }
+  snprintf(buf, need, "%s%s", map->path, rest);
+  return buf;
+}
+
+/* The path of a local bound to the variable name, see read_path */
+static char *local_path (CSPARSE *parse, char *name, CS_VARPATH *path)
+{
+  char buf[256];
+  char *full;
+  int hdf_var;
+
+  if (name == NULL) return NULL;
+  full = read_path(parse, name, path, buf, sizeof(buf), &hdf_var);
+  return full ? ne_arena_strdup(parse->arena, full) : NULL;
+}
+
+static void record_read (CSPARSE *parse, CS_READ_KIND kind, char *name,
+                         CS_VARPATH *path)
+{
+  char buf[256];
+  char *full;
+  int hdf_var;
+  HDF *obj;
+
+  if (name == NULL || name[0] == '\0') return;
+  full = read_path(parse, name, path, buf, sizeof(buf), &hdf_var);
+  if (full != NULL)
+  {
+    cs_readset_add(parse->reads, kind, full, parse->hdf, parse->global_hdf);
+  }
+  else if (hdf_var)
+  {
+    scoped_var_lookup_or_create_obj (parse, name, FALSE, parse->locals, &obj);
+    cs_readset_add_node(parse->reads, kind, name, obj);
+  }
+}
+
+static HDF *var_lookup_obj (CSPARSE *parse, char *name, CS_VARPATH *path)
 {
   HDF *ret_hdf;
+
+  if (parse->profile)
+    parse->profile->lookups++;
+  if (parse->reads)
+    record_read(parse, CS_READ_VALUE, name, path);
+  if (path != NULL && path_lookup_map(parse, path) == NULL)
+  {
+    ret_hdf = hdf_get_obj_segs (parse->hdf, path->segs, path->nsegs);
+    if (ret_hdf == NULL && parse->global_hdf != NULL)
+      ret_hdf = hdf_get_obj_segs (parse->global_hdf, path->segs, path->nsegs);
+    return ret_hdf;
+  }
         /* NOTE: We ignore the return value as it can only be STATUS_OK. That
            is what we always return from scoped_var_lookup_or_create_obj when
            create == FALSE */
@@ -1029,8 +1404,47 @@ static HDF *var_lookup_obj (CSPARSE *parse, char *name)
   return ret_hdf;
 }
 
-static NEOERR *var_set_value (CSPARSE *parse, char *name,
-                              char *value, int escape_status)
+/* Append add to the string value of a local built up by set:x = x + ...,
+ * in place once it has a buffer of its own */
+static NEOERR *map_append (CS_LOCAL_MAP *map, const char *add)
+{
+  size_t len = strlen(add);
+  size_t cap;
+  char *buf;
+
+  if (map->s_cap == 0)
+  {
+    map->s_len = map->s ? strlen(map->s) : 0;
+    cap = (map->s_len + len + 1) * 2;
+    buf = (char *) malloc (cap);
+    if (buf == NULL)
+      return nerr_raise (NERR_NOMEM, "Unable to allocate memory to set var");
+    if (map->s_len) memcpy(buf, map->s, map->s_len);
+    if (map->map_alloc) free(map->s);
+    map->s = buf;
+    map->map_alloc = 1;
+    map->s_cap = cap;
+  }
+  else if (map->s_len + len + 1 > map->s_cap)
+  {
+    cap = map->s_cap * 2;
+    if (cap < map->s_len + len + 1) cap = map->s_len + len + 1;
+    buf = (char *) realloc (map->s, cap);
+    if (buf == NULL)
+      return nerr_raise (NERR_NOMEM, "Unable to allocate memory to set var");
+    map->s = buf;
+    map->s_cap = cap;
+  }
+  memcpy(map->s + map->s_len, add, len + 1);
+  map->s_len += len;
+  return STATUS_OK;
+}
+
+/* Set name to value, or with add, to value followed by add, where value
+ * is what name holds now.  Then if the storage of name is the string
+ * value, add is appended to it in place. */
+static NEOERR *var_store (CSPARSE *parse, char *name, char *value,
+                          const char *add, int escape_status)
 {
   HDF *set_hdf;
   NEOERR * err;
@@ -1098,7 +1512,15 @@ static NEOERR *var_set_value (CSPARSE *parse, char *name,
                           "Trying to set sub element '%s' of local variable '%s' which is in global hdf.",
                           name, map->name);
     }
-    return nerr_pass (hdf_set_value (set_hdf, NULL, value));
+    if (add == NULL)
+      return nerr_pass (hdf_set_value (set_hdf, NULL, value));
+    /* value was read through a link or from the global hdf, copy it in */
+    if (value == NULL || set_hdf->value != value || set_hdf->link)
+    {
+      err = hdf_set_value (set_hdf, NULL, value);
+      if (err != STATUS_OK) return nerr_pass(err);
+    }
+    return nerr_pass (hdf_append_value (set_hdf, NULL, add));
   }
   else
   {
@@ -1106,11 +1528,19 @@ static NEOERR *var_set_value (CSPARSE *parse, char *name,
     if (rest == NULL)
     {
       char *tmp = NULL;
+
+      if (add != NULL && map->type == CS_TYPE_STRING && map->s_cap &&
+          map->s == value)
+      {
+        map->escape_status = escape_status;
+        return nerr_pass(map_append(map, add));
+      }
       /* If this is a string, it might be what we're setting,
        * ie <?cs set:value = value ?>
        */
       if (map->s != NULL && map->map_alloc)
         tmp = map->s;
+      map->s_cap = 0;
       map->type = CS_TYPE_STRING;
       if (value) {
         map->map_alloc = 1;
@@ -1124,6 +1554,8 @@ static NEOERR *var_set_value (CSPARSE *parse, char *name,
       if (map->s == NULL && value != NULL)
         return nerr_raise(NERR_NOMEM,
                           "Unable to allocate memory to set var");
+      if (add != NULL)
+        return nerr_pass(map_append(map, add));
 
       return STATUS_OK;
     }
@@ -1134,6 +1566,12 @@ static NEOERR *var_set_value (CSPARSE *parse, char *name,
   }
 }
 
+static NEOERR *var_set_value (CSPARSE *parse, char *name,
+                              char *value, int escape_status)
+{
+  return nerr_pass(var_store(parse, name, value, NULL, escape_status));
+}
+
 /* 
  * Read the escaping status out of an HDF attribute. The escaping status
  * is set in var_set_value()
@@ -1166,7 +1604,9 @@ int get_escape_status(CSPARSE *parse, HDF_ATTR* h)
 }
 
 /* Returns the current escaping status in escape_status */
-static char *var_lookup (CSPARSE *parse, char *name, int *escape_status)
+/* path is the pre-split name, if there is one */
+static char *var_lookup (CSPARSE *parse, char *name, CS_VARPATH *path,
+                         int *escape_status)
 {
   CS_LOCAL_MAP *map;
   char *c;
@@ -1174,7 +1614,19 @@ static char *var_lookup (CSPARSE *parse, char *name, int *escape_status)
   HDF *obj;
 
   *escape_status = CS_ES_UNTRUSTED;
-  map = lookup_map (parse, name, &c);
+  if (parse->profile)
+    parse->profile->lookups++;
+  if (parse->reads)
+    record_read(parse, CS_READ_VALUE, name, path);
+  if (path != NULL)
+  {
+    map = path_lookup_map (parse, path);
+    c = (path->nsegs > 1) ? (char *) path->segs[1].name - 1 : NULL;
+  }
+  else
+  {
+    map = lookup_map (parse, name, &c);
+  }
   if (map)
   {
     if (map->type == CS_TYPE_VAR)
@@ -1200,7 +1652,10 @@ static char *var_lookup (CSPARSE *parse, char *name, int *escape_status)
       else
       {
         HDF_ATTR *h;
-        obj = hdf_get_obj(map->h, c+1);
+        if (path != NULL)
+          obj = hdf_get_obj_segs(map->h, path->segs + 1, path->nsegs - 1);
+        else
+          obj = hdf_get_obj(map->h, c+1);
         if (!obj)
           return NULL;
         h = hdf_obj_attr(obj);
@@ -1221,18 +1676,19 @@ static char *var_lookup (CSPARSE *parse, char *name, int *escape_status)
     }
     else if (map->type == CS_TYPE_NUM)
     {
-      char buf[40];
       *escape_status = CS_ES_TRUSTED;
       if (map->s) return map->s;
-      snprintf (buf, sizeof(buf), "%ld", map->n);
-      map->s = strdup(buf);
-      map->map_alloc = 1;
+      snprintf (map->nbuf, sizeof(map->nbuf), "%ld", map->n);
+      map->s = map->nbuf;
       return map->s;
     }
   }
   /* smarti:  Added support for global hdf under local hdf */
   /* return hdf_get_value (parse->hdf, name, NULL); */
-  obj = hdf_get_obj(parse->hdf, name);
+  if (path != NULL)
+    obj = hdf_get_obj_segs(parse->hdf, path->segs, path->nsegs);
+  else
+    obj = hdf_get_obj(parse->hdf, name);
   if (obj)
   {
     HDF_ATTR *h;
@@ -1249,16 +1705,33 @@ static char *var_lookup (CSPARSE *parse, char *name, int *escape_status)
      for now, treat all values there as untrusted */
   if (retval == NULL && parse->global_hdf != NULL)
   {
-    retval = hdf_get_value (parse->global_hdf, name, NULL);
+    if (path != NULL)
+      retval = hdf_obj_value (hdf_get_obj_segs(parse->global_hdf, path->segs,
+                                               path->nsegs));
+    else
+      retval = hdf_get_value (parse->global_hdf, name, NULL);
   }
   return retval;
 }
 
+static long int var_int_lookup_path (CSPARSE *parse, char *name,
+                                     CS_VARPATH *path)
+{
+  char *vs;
+  int ignore;
+  vs = var_lookup (parse, name, path, &ignore);
+
+  if (vs == NULL)
+    return 0;
+  else
+    return atoi(vs);
+}
+
 long int var_int_lookup (CSPARSE *parse, char *name)
 {
   char *vs;
   int ignore;
-  vs = var_lookup (parse, name, &ignore);
+  vs = var_lookup (parse, name, NULL, &ignore);
 
   if (vs == NULL)
     return 0;
@@ -1571,6 +2044,8 @@ static NEOERR *parse_expr2 (CSPARSE *parse, CSTOKEN *tokens, int ntokens, int lv
 
       if (tokens[x].type == CS_TYPE_NUM)
 	arg->n = strtol(arg->s, NULL, 0);
+      else if (tokens[x].type & CS_TYPES_VAR)
+	return nerr_pass(compile_var_path(parse, arg));
       return STATUS_OK;
     }
     else
@@ -1833,9 +2308,152 @@ static NEOERR *parse_expr (CSPARSE *parse, char *arg, int lvalue, CSARG *expr)
 
   err = parse_expr2 (parse, tokens, ntokens, lvalue, expr);
   if (err) return nerr_pass(err);
+  if (!lvalue) fold_expr(parse, expr);
   return STATUS_OK;
 }
 
+/* Constant folding: evaluate the parts of an expression which can't depend
+ * on the HDF once, at parse time.  Operators whose result names a variable
+ * (. and []) and function calls are left alone, as is anything eval_expr
+ * fails on (ie, overflow), so the error is still raised when rendering. */
+static int is_const_arg (CSARG *arg)
+{
+  return arg != NULL && (arg->op_type & CS_TYPES_CONST) && arg->next == NULL;
+}
+
+static void fold_expr (CSPARSE *parse, CSARG *arg)
+{
+  NEOERR *err;
+  NE_ARENA *arena;
+  CSARG result;
+
+  if (arg->expr1) fold_expr(parse, arg->expr1);
+  if (arg->expr2) fold_expr(parse, arg->expr2);
+  if (arg->next) fold_expr(parse, arg->next);
+
+  if (arg->op_type & (CS_TYPES | CS_TYPE_FUNCTION | CS_TYPE_MACRO |
+                      CS_OP_DOT | CS_OP_LBRACKET | CS_OP_COMMA))
+    return;
+  if (!is_const_arg(arg->expr1)) return;
+  if (!(arg->op_type & CS_OPS_UNARY) && !is_const_arg(arg->expr2)) return;
+
+  /* The result is kept by the tree, so it mustn't come from the arena of
+   * a render which is parsing (ie, lvar or linclude) */
+  arena = parse->arena;
+  parse->arena = NULL;
+  err = eval_expr(parse, arg, &result);
+  parse->arena = arena;
+  if (err != STATUS_OK)
+  {
+    nerr_ignore(&err);
+    return;
+  }
+  if (!(result.op_type & CS_TYPES_CONST))
+  {
+    if (result.alloc) free(result.s);
+    return;
+  }
+  if (result.alloc)
+  {
+    err = uListAppend(parse->alloc, result.s);
+    if (err != STATUS_OK)
+    {
+      nerr_ignore(&err);
+      free(result.s);
+      return;
+    }
+  }
+
+  dealloc_arg(&(arg->expr1));
+  dealloc_arg(&(arg->expr2));
+  arg->op_type = result.op_type;
+  arg->s = (result.op_type & CS_TYPE_NUM) ? NULL : result.s;
+  arg->n = result.n;
+  arg->escape_status = result.escape_status;
+  arg->alloc = 0;
+  arg->path = NULL;
+  parse->opt_folded++;
+}
+
+/* With Config.PinConfig, the Config.* variables in if/elif conditions are
+ * taken from the HDF at parse time.  Only values which read the same as a
+ * string and as a number are pinned, and only where the expression uses
+ * the value rather than the name (not under . [] or a function call). */
+static void pin_config_vars (CSPARSE *parse, CSARG *arg)
+{
+  HDF *obj;
+  char *v;
+
+  if (arg == NULL) return;
+  if (arg->op_type & (CS_TYPE_FUNCTION | CS_TYPE_MACRO | CS_OP_DOT))
+    return;
+  if (arg->op_type & CS_TYPES_VAR)
+  {
+    if (strncmp(arg->s, "Config.", 7)) return;
+    obj = hdf_get_obj(parse->hdf, arg->s);
+    v = obj ? hdf_obj_value(obj) : NULL;
+    if (v == NULL) return;
+    if (arg->op_type == CS_TYPE_VAR_NUM)
+    {
+      arg->op_type = CS_TYPE_NUM;
+      arg->n = atoi(v);
+      arg->s = NULL;
+    }
+    else
+    {
+      if (atoi(v) != strtol(v, NULL, 0)) return;
+      v = strdup(v);
+      if (v == NULL || uListAppend(parse->alloc, v) != STATUS_OK)
+      {
+        free(v);
+        return;
+      }
+      arg->op_type = CS_TYPE_STRING;
+      arg->s = v;
+    }
+    arg->path = NULL;
+    parse->opt_pinned++;
+    return;
+  }
+  if (!(arg->op_type & CS_OP_LBRACKET))
+    pin_config_vars(parse, arg->expr1);
+  pin_config_vars(parse, arg->expr2);
+  pin_config_vars(parse, arg->next);
+}
+
+/* Dead branch elimination, run when an if/elif/else chain is complete.
+ * Branches holding a def are kept, the macro still points at them. */
+static int has_def (CSTREE *node)
+{
+  for (; node != NULL; node = node->next)
+  {
+    if (Commands[node->cmd].parse_handler == def_parse) return 1;
+    if (has_def(node->case_0) || has_def(node->case_1)) return 1;
+  }
+  return 0;
+}
+
+static void fold_if (CSPARSE *parse, CSTREE *node)
+{
+  CSTREE **dead;
+  int eval_true;
+
+  while (node != NULL && Commands[node->cmd].eval_handler == if_eval &&
+         is_const_arg(&(node->arg1)))
+  {
+    eval_true = arg_eval_bool(parse, &(node->arg1));
+    dead = eval_true ? &(node->case_1) : &(node->case_0);
+    if (*dead != NULL && !has_def(*dead))
+    {
+      dealloc_node(dead);
+      parse->opt_branches++;
+    }
+    if (eval_true) break;
+    /* the elif, if there is one */
+    node = node->case_1;
+  }
+}
+
 /*
  * Finds the name of the template file corresponding to this node,
  * and returns it in "pfname". The name can be NULL if
@@ -1856,16 +2474,28 @@ static NEOERR* lookup_node_filename(CSPARSE *parse, CSTREE *node, char **pfname)
   return STATUS_OK;
 }
 
+/* All output goes through here, to whichever of the two callbacks
+ * the render was started with.  s is always NUL terminated. */
+static NEOERR *output_string (CSPARSE *parse, char *s, size_t len)
+{
+  if (parse->profile)
+    parse->profile->bytes += len;
+  if (parse->output_write)
+    return nerr_pass(parse->output_write(parse->output_ctx, s, len));
+  return nerr_pass(parse->output_cb(parse->output_ctx, s));
+}
+
 static NEOERR *output_variable(CSPARSE *parse, CSTREE *node,
-                               char *var_name, char *var)
+                               char *var_name, char *var, size_t len)
 {
   NEOERR *err;
-  err = parse->output_cb (parse->output_ctx, var);
+
+  err = output_string (parse, var, len);
 
   if (err != STATUS_OK) return nerr_pass(err);
 
   if (parse->auto_ctx.global_enabled == 1) {
-    err = neos_auto_parse_var (parse->auto_ctx.parser_ctx, var, strlen(var));
+    err = neos_auto_parse_var (parse->auto_ctx.parser_ctx, var, len);
     if (err != STATUS_OK)
     {
       char *prefix = NULL;
@@ -1886,18 +2516,21 @@ static NEOERR *output_variable(CSPARSE *parse, CSTREE *node,
   return nerr_pass(err);
 }
 
+/* Escaped values are built in parse->escape_buf, which is shared by the
+ * whole render, and values which need no escaping are output as they
+ * are, so neither allocates memory per variable. */
 static NEOERR *escape_and_output_variable(CSPARSE *parse, CSTREE *node,
                                           char *name, char *value,
                                           int escape_status)
 {
   NEOERR *err;
+  STRING *out = parse->escape_buf;
 
   if (value && parse->escaping.current == NEOS_ESCAPE_UNDEF)
   {
     /* no explicit escape */
     char *escaped = NULL;
     NEOS_ESCAPE context;
-    int do_free = 0;
 
     /* Use default escape if escape is UNDEF */
     if (node->escape == NEOS_ESCAPE_UNDEF)
@@ -1905,6 +2538,8 @@ static NEOERR *escape_and_output_variable(CSPARSE *parse, CSTREE *node,
     else
       context = node->escape;
 
+    out->len = 0;
+
     /*
       <?cs escape ?> command takes precedence over auto escaping.
       First check if any <?cs escape ?> mode was specified by looking at
@@ -1918,18 +2553,15 @@ static NEOERR *escape_and_output_variable(CSPARSE *parse, CSTREE *node,
     if ((escape_status != CS_ES_TRUSTED) && (context == NEOS_ESCAPE_UNDEF)
         && (node->do_autoescape == 1))
     {
-      err = neos_auto_escape(parse->auto_ctx.parser_ctx,
-                             value, &escaped, &do_free);
-      if (do_free && parse->auto_ctx.log_changes)
+      err = neos_auto_escape_to(parse->auto_ctx.parser_ctx,
+                                value, out, &escaped);
+      if (err == STATUS_OK && escaped != value && parse->auto_ctx.log_changes)
       {
         char *fname = NULL;
         err = lookup_node_filename(parse, node, &fname);
 
         if (err != STATUS_OK)
-        {
-          free(escaped);
           return nerr_pass(err);
-        }
 
         ne_warn("[%s]: Auto-escape changed variable [%s] from [%s] to [%s]\n",
                 (fname ? fname : "string"), name, value, escaped);
@@ -1947,26 +2579,21 @@ static NEOERR *escape_and_output_variable(CSPARSE *parse, CSTREE *node,
       {
         context = NEOS_ESCAPE_NONE;
       }
-      err = neos_var_escape(context, value, &escaped);
-      do_free = 1;
-    }
-
-    if (err != STATUS_OK) {
-      if (do_free) free(escaped);
-      return nerr_pass(err);
+      err = neos_var_escape_to(context, value, out, &escaped);
     }
 
-    if (escaped)
-    {
-      err = output_variable (parse, node, name, escaped);
-      if (do_free) free(escaped);
+    if (err != STATUS_OK)
       return nerr_pass(err);
-    }
 
+    if (escaped == value)
+      err = output_variable (parse, node, name, value, strlen(value));
+    else
+      err = output_variable (parse, node, name, escaped, out->len);
+    return nerr_pass(err);
   }
   else if (value)
   { /* already explicitly escaped */
-    err = output_variable (parse, node, name, value);
+    err = output_variable (parse, node, name, value, strlen(value));
     return nerr_pass(err);
   }
 
@@ -1974,19 +2601,89 @@ static NEOERR *escape_and_output_variable(CSPARSE *parse, CSTREE *node,
   return STATUS_OK;
 }
 
-static NEOERR *literal_parse (CSPARSE *parse, int cmd, char *arg)
+/* Auto escaped literals are usually entered in plain HTML text, the same
+ * way on every render, so the parse of the literal from there is done once
+ * here, and literal_eval just copies the resulting state.  Literals which
+ * the htmlparser fails on are left to fail at render time. */
+static NEOERR *literal_auto_text (CSPARSE *parse, CSTREE *node)
 {
   NEOERR *err;
-  CSTREE *node;
 
-  /* ne_warn ("literal: %s", arg); */
-  err = alloc_node (&node, parse);
-  if (err) return nerr_pass(err);
-  node->cmd = cmd;
-  node->arg1.op_type = CS_TYPE_STRING;
-  node->arg1.s = arg;
-  node->do_autoescape = parse->auto_ctx.global_enabled;
-  *(parse->next) = node;
+  if (node->auto_exit) neos_auto_destroy(&(node->auto_exit));
+  node->auto_text = 0;
+  if (!node->do_autoescape || node->arg1.s == NULL) return STATUS_OK;
+
+  err = neos_auto_parse_text(node->arg1.s, node->arg1.n, &(node->auto_exit));
+  if (err != STATUS_OK)
+  {
+    if (!nerr_handle(&err, NERR_ASSERT)) return nerr_pass(err);
+    return STATUS_OK;
+  }
+  node->auto_text = 1;
+  return STATUS_OK;
+}
+
+static NEOERR *merge_literal (CSPARSE *parse, CSTREE *node, char *arg)
+{
+  NEOERR *err;
+  char *s;
+  size_t len;
+
+  if (arg == NULL) return STATUS_OK;
+  if (node->arg1.s == NULL)
+  {
+    node->arg1.s = arg;
+    node->arg1.n = strlen(arg);
+    return nerr_pass(literal_auto_text(parse, node));
+  }
+  len = strlen(arg);
+  s = (char *) malloc (node->arg1.n + len + 1);
+  if (s == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for literal");
+  memcpy(s, node->arg1.s, node->arg1.n);
+  memcpy(s + node->arg1.n, arg, len + 1);
+  err = uListAppend(parse->alloc, s);
+  if (err)
+  {
+    free(s);
+    return nerr_pass(err);
+  }
+  node->arg1.s = s;
+  node->arg1.n += len;
+  parse->opt_literals++;
+  return nerr_pass(literal_auto_text(parse, node));
+}
+
+static NEOERR *literal_parse (CSPARSE *parse, int cmd, char *arg)
+{
+  NEOERR *err;
+  CSTREE *node;
+
+  /* ne_warn ("literal: %s", arg); */
+  node = parse->current;
+  if (node != NULL && node->cmd == cmd && parse->next == &(node->next) &&
+      !parse->audit_mode && node->file_idx == parse->cur_file_idx &&
+      node->do_autoescape == parse->auto_ctx.global_enabled)
+  {
+    /* Text right after text (ie, around a comment) is output as one */
+    return nerr_pass(merge_literal(parse, node, arg));
+  }
+
+  err = alloc_node (&node, parse);
+  if (err) return nerr_pass(err);
+  node->cmd = cmd;
+  node->arg1.op_type = CS_TYPE_STRING;
+  node->arg1.s = arg;
+  /* Literals keep their length in n, so rendering doesn't rescan them */
+  node->arg1.n = arg ? strlen(arg) : 0;
+  node->do_autoescape = parse->auto_ctx.global_enabled;
+  err = literal_auto_text(parse, node);
+  if (err)
+  {
+    dealloc_node(&node);
+    return nerr_pass(err);
+  }
+  *(parse->next) = node;
   parse->next = &(node->next);
   parse->current = node;
 
@@ -2003,9 +2700,15 @@ static NEOERR *literal_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
 
   if (node->arg1.s != NULL)
   {
-    if (node->do_autoescape == 1) {
+    if (node->do_autoescape == 1 && node->auto_text &&
+        neos_auto_in_text(parse->auto_ctx.parser_ctx))
+    {
+      if (node->auto_exit)
+        neos_auto_copy(parse->auto_ctx.parser_ctx, node->auto_exit);
+    }
+    else if (node->do_autoescape == 1) {
       err = neos_auto_parse(parse->auto_ctx.parser_ctx,
-			    node->arg1.s, strlen(node->arg1.s));
+			    node->arg1.s, node->arg1.n);
 
       if (err != STATUS_OK)
       {
@@ -2021,7 +2724,7 @@ static NEOERR *literal_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
                              (prefix ? prefix : "error"));
       }
     }
-    err = parse->output_cb (parse->output_ctx, node->arg1.s);
+    err = output_string (parse, node->arg1.s, node->arg1.n);
   }
   *next = node->next;
   return nerr_pass(err);
@@ -2060,6 +2763,12 @@ static NEOERR *name_parse (CSPARSE *parse, int cmd, char *arg)
   node->arg1.s = a;
   node->escape = entry->escape;
   node->do_autoescape = parse->auto_ctx.enabled;
+  err = compile_var_path(parse, &(node->arg1));
+  if (err)
+  {
+    dealloc_node(&node);
+    return nerr_pass(err);
+  }
 
   *(parse->next) = node;
   parse->next = &(node->next);
@@ -2157,12 +2866,86 @@ static NEOERR *contenttype_parse (CSPARSE *parse, int cmd, char *arg)
     return nerr_raise (NERR_PARSE, "%s Invalid argument for content-type: %s",
       find_context(parse, -1, tmp, sizeof(tmp)), arg);
   }
+  /* Strip here rather than in contenttype_eval, the parse tree isn't
+   * modified during render */
+  node->arg1.s = neos_strip(node->arg1.s);
+
+  *(parse->next) = node;
+  parse->next = &(node->next);
+  parse->current = node;
+  return STATUS_OK;
+
+}
+
+static NEOERR *flush_parse (CSPARSE *parse, int cmd, char *arg)
+{
+  NEOERR *err;
+  CSTREE *node;
+
+  /* ne_warn ("flush"); */
+  err = alloc_node (&node, parse);
+  if (err) return nerr_pass(err);
+  node->cmd = cmd;
 
   *(parse->next) = node;
   parse->next = &(node->next);
   parse->current = node;
   return STATUS_OK;
+}
+
+/* cache:key ttl - the ttl is optional, and is a number of seconds after
+ * the key expression.  It's stored in arg2. */
+static NEOERR *cache_parse (CSPARSE *parse, int cmd, char *arg)
+{
+  NEOERR *err;
+  CSTREE *node;
+  char *p, *end;
+
+  /* ne_warn ("cache: %s", arg); */
+  err = alloc_node (&node, parse);
+  if (err) return nerr_pass(err);
+  node->cmd = cmd;
+  if (arg[0] == '!')
+    node->flags |= CSF_REQUIRED;
+  arg++;
+
+  end = arg + strlen(arg);
+  while (end > arg && isspace(end[-1])) end--;
+  p = end;
+  while (p > arg && isdigit(p[-1])) p--;
+  node->arg2.op_type = CS_TYPE_NUM;
+  if (p < end && p > arg && isspace(p[-1]))
+  {
+    node->arg2.n = atol(p);
+    *p = '\0';
+  }
+
+  err = parse_expr (parse, arg, 0, &(node->arg1));
+  if (err)
+  {
+    dealloc_node(&node);
+    return nerr_pass(err);
+  }
+
+  *(parse->next) = node;
+  parse->next = &(node->case_0);
+  parse->current = node;
+  return STATUS_OK;
+}
+
+static NEOERR *flush_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
+{
+  NEOERR *err = STATUS_OK;
 
+#if DEBUG_CMD_EVAL
+  ne_warn("flush");
+#endif
+
+  /* Only a CSWRITEFUNC has a way to be told */
+  if (parse->output_write)
+    err = parse->output_write (parse->output_ctx, NULL, 0);
+  *next = node->next;
+  return nerr_pass(err);
 }
 
 static NEOERR *name_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
@@ -2179,7 +2962,7 @@ static NEOERR *name_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
 
   if (node->arg1.op_type == CS_TYPE_VAR && node->arg1.s != NULL)
   {
-    obj = var_lookup_obj (parse, node->arg1.s);
+    obj = var_lookup_obj (parse, node->arg1.s, node->arg1.path);
     if (obj != NULL)
     {
       v = hdf_obj_name(obj);
@@ -2361,6 +3144,7 @@ static NEOERR *evar_parse (CSPARSE *parse, int cmd, char *arg)
 	a, s[0]);
   }
 
+  parse->hdf_parse_reads++;
   err = hdf_get_copy (parse->hdf, a, &s, NULL);
   if (err)
   {
@@ -2417,6 +3201,11 @@ static NEOERR *if_parse (CSPARSE *parse, int cmd, char *arg)
     dealloc_node(&node);
     return nerr_pass(err);
   }
+  if (parse->pin_config)
+  {
+    pin_config_vars(parse, &(node->arg1));
+    fold_expr(parse, &(node->arg1));
+  }
 
   *(parse->next) = node;
   parse->next = &(node->case_0);
@@ -2435,7 +3224,7 @@ static char *arg_eval_with_escape_status (CSPARSE *parse, CSARG *arg,
       *escape_status = arg->escape_status;
       return arg->s;
     case CS_TYPE_VAR:
-      return var_lookup (parse, arg->s, escape_status);
+      return var_lookup (parse, arg->s, arg->path, escape_status);
     case CS_TYPE_NUM:
     case CS_TYPE_VAR_NUM:
     default:
@@ -2468,7 +3257,7 @@ long int arg_eval_num (CSPARSE *parse, CSARG *arg)
 
     case CS_TYPE_VAR:
     case CS_TYPE_VAR_NUM:
-      v = var_int_lookup (parse, arg->s);
+      v = var_int_lookup_path (parse, arg->s, arg->path);
       break;
     default:
       ne_warn ("Unsupported type %s in arg_eval_num", expand_token_type(arg->op_type, 1));
@@ -2493,7 +3282,7 @@ long int arg_eval_bool (CSPARSE *parse, CSARG *arg)
     case CS_TYPE_STRING:
     case CS_TYPE_VAR:
       if (arg->op_type == CS_TYPE_VAR)
-        s = var_lookup(parse, arg->s, &ignore);
+        s = var_lookup(parse, arg->s, arg->path, &ignore);
       else
 	s = arg->s;
       if (!s || *s == '\0') return 0; /* non existance or empty is false(0) */
@@ -2506,7 +3295,7 @@ long int arg_eval_bool (CSPARSE *parse, CSARG *arg)
     case CS_TYPE_NUM:
       return arg->n;
     case CS_TYPE_VAR_NUM: /* this implies forced numeric evaluation */
-      return var_int_lookup (parse, arg->s);
+      return var_int_lookup_path (parse, arg->s, arg->path);
       break;
     default:
       ne_warn ("Unsupported type %s in arg_eval_bool", expand_token_type(arg->op_type, 1));
@@ -2529,7 +3318,7 @@ char *arg_eval_str_alloc (CSPARSE *parse, CSARG *arg)
       s = arg->s;
       break;
     case CS_TYPE_VAR:
-      s = var_lookup (parse, arg->s, &ignore);
+      s = var_lookup (parse, arg->s, arg->path, &ignore);
       break;
     case CS_TYPE_NUM:
     case CS_TYPE_VAR_NUM:
@@ -2569,7 +3358,7 @@ static void expand_arg (CSPARSE *parse, int depth, char *where, CSARG *arg)
   else if (arg->op_type & CS_TYPE_STRING)
     fprintf(stderr, "'%s'\n", arg->s);
   else if (arg->op_type & CS_TYPE_VAR)
-    fprintf(stderr, "%s = %s\n", arg->s, var_lookup(parse, arg->s, &ignore));
+    fprintf(stderr, "%s = %s\n", arg->s, var_lookup(parse, arg->s, arg->path, &ignore));
   else if (arg->op_type & CS_TYPE_VAR_NUM)
     fprintf(stderr, "%s = %ld\n", arg->s, var_int_lookup(parse, arg->s));
   else
@@ -2577,6 +3366,18 @@ static void expand_arg (CSPARSE *parse, int depth, char *where, CSARG *arg)
 }
 #endif
 
+/* The escape status of the concatenation of two strings */
+static int concat_escape_status (int escape_status1, int escape_status2)
+{
+  if (escape_status1 == CS_ES_TRUSTED && escape_status2 == CS_ES_TRUSTED)
+    return CS_ES_TRUSTED;
+  if (escape_status1 == CS_ES_MIXED && escape_status2 == CS_ES_MIXED)
+    return CS_ES_MIXED;
+  if (escape_status1 == CS_ES_TRUSTED || escape_status2 == CS_ES_TRUSTED)
+    return CS_ES_MIXED;
+  return CS_ES_UNTRUSTED;
+}
+
 static NEOERR *eval_expr_string(CSPARSE *parse, CSARG *arg1, CSARG *arg2, CSTOKEN_TYPE op, CSARG *result)
 {
   char *s1, *s2;
@@ -2621,17 +3422,14 @@ static NEOERR *eval_expr_string(CSPARSE *parse, CSARG *arg1, CSARG *arg2, CSTOKE
           result->alloc = 0;
           result->escape_status = escape_status2;
         }
-        else if (s1 == NULL)
-	{
-	  result->s = strdup(s2);
-          result->alloc = 1;
-          result->escape_status = escape_status2;
-	}
-	else
+        else
 	{
-	  result->s = strdup(s1);
-          result->alloc = 1;
-          result->escape_status = escape_status1;
+          char *s = (s1 == NULL) ? s2 : s1;
+          size_t len = strlen(s);
+          if (arg_alloc_string(parse, result, len) == NULL)
+            return nerr_raise (NERR_NOMEM, "Unable to allocate memory to copy string in expression: %s", s);
+          memcpy(result->s, s, len + 1);
+          result->escape_status = (s1 == NULL) ? escape_status2 : escape_status1;
 	}
 	break;
       default:
@@ -2664,29 +3462,16 @@ static NEOERR *eval_expr_string(CSPARSE *parse, CSARG *arg1, CSARG *arg2, CSTOKE
 	break;
       case CS_OP_ADD:
 	result->op_type = CS_TYPE_STRING;
-	result->alloc = 1;
-        if (escape_status1 == CS_ES_TRUSTED && escape_status2 == CS_ES_TRUSTED)
-        {
-          result->escape_status = CS_ES_TRUSTED;
-        }
-        else if (escape_status1 == CS_ES_MIXED && escape_status2 == CS_ES_MIXED)
-        {
-          result->escape_status = CS_ES_MIXED;
-        }
-        else if (escape_status1 == CS_ES_TRUSTED ||
-                 escape_status2 == CS_ES_TRUSTED)
-        {
-          result->escape_status = CS_ES_MIXED;
-        }
-        else
-        {
-          result->escape_status = CS_ES_UNTRUSTED;
-        }
-	result->s = (char *) calloc ((strlen(s1) + strlen(s2) + 1), sizeof(char));
-	if (result->s == NULL)
-	  return nerr_raise (NERR_NOMEM, "Unable to allocate memory to concatenate strings in expression: %s + %s", s1, s2);
-	strcpy(result->s, s1);
-	strcat(result->s, s2);
+        result->escape_status = concat_escape_status(escape_status1,
+                                                     escape_status2);
+	{
+	  size_t len1 = strlen(s1);
+	  size_t len2 = strlen(s2);
+	  if (arg_alloc_string(parse, result, len1 + len2) == NULL)
+	    return nerr_raise (NERR_NOMEM, "Unable to allocate memory to concatenate strings in expression: %s + %s", s1, s2);
+	  memcpy(result->s, s1, len1);
+	  memcpy(result->s + len1, s2, len2 + 1);
+	}
 	break;
       default:
 	ne_warn ("Unsupported op %s in eval_expr_string", expand_token_type(op, 1));
@@ -2959,7 +3744,7 @@ static NEOERR *eval_expr (CSPARSE *parse, CSARG *expr, CSARG *result)
           {
             char *vs;
             int ignore;
-            vs = var_lookup(parse, arg1.s, &ignore);
+            vs = var_lookup(parse, arg1.s, arg1.path, &ignore);
 
             if (vs == NULL)
               result->n = 0;
@@ -3031,12 +3816,10 @@ static NEOERR *eval_expr (CSPARSE *parse, CSARG *expr, CSARG *result)
         /* This is an HDF lookup, so we will know the escaping status when
            the caller does the actual lookup and fetches the HDF object. */
         result->op_type = CS_TYPE_VAR;
-        result->alloc = 1;
         if (arg2.op_type & (CS_TYPE_VAR_NUM | CS_TYPE_NUM))
         {
           long int n2 = arg_eval_num (parse, &arg2);
-          result->s = sprintf_alloc("%s.%ld", arg1.s, n2);
-          if (result->s == NULL)
+          if (arg_set_sprintf(parse, result, "%s.%ld", arg1.s, n2) == NULL)
           {
             dealloc_arg_internal(&arg1);
             dealloc_arg_internal(&arg2);
@@ -3048,8 +3831,7 @@ static NEOERR *eval_expr (CSPARSE *parse, CSARG *expr, CSARG *result)
           char *s2 = arg_eval (parse, &arg2);
           if (s2 && s2[0])
           {
-            result->s = sprintf_alloc("%s.%s", arg1.s, s2);
-            if (result->s == NULL)
+            if (arg_set_sprintf(parse, result, "%s.%s", arg1.s, s2) == NULL)
             {
               dealloc_arg_internal(&arg1);
               dealloc_arg_internal(&arg2);
@@ -3071,11 +3853,9 @@ static NEOERR *eval_expr (CSPARSE *parse, CSARG *expr, CSARG *result)
         /* This is an HDF lookup, so we will know the escaping status when
            the caller does the actual lookup and fetches the HDF object. */
         result->op_type = CS_TYPE_VAR;
-        result->alloc = 1;
         if (arg2.op_type & CS_TYPES_VAR)
         {
-          result->s = sprintf_alloc("%s.%s", arg1.s, arg2.s);
-          if (result->s == NULL)
+          if (arg_set_sprintf(parse, result, "%s.%s", arg1.s, arg2.s) == NULL)
           {
             dealloc_arg_internal(&arg1);
             dealloc_arg_internal(&arg2);
@@ -3087,8 +3867,7 @@ static NEOERR *eval_expr (CSPARSE *parse, CSARG *expr, CSARG *result)
           if (arg2.op_type & (CS_TYPE_VAR_NUM | CS_TYPE_NUM))
           {
             long int n2 = arg_eval_num (parse, &arg2);
-            result->s = sprintf_alloc("%s.%ld", arg1.s, n2);
-            if (result->s == NULL)
+            if (arg_set_sprintf(parse, result, "%s.%ld", arg1.s, n2) == NULL)
             {
               dealloc_arg_internal(&arg1);
               dealloc_arg_internal(&arg2);
@@ -3100,8 +3879,7 @@ static NEOERR *eval_expr (CSPARSE *parse, CSARG *expr, CSARG *result)
             char *s2 = arg_eval (parse, &arg2);
             if (s2 && s2[0])
             {
-              result->s = sprintf_alloc("%s.%s", arg1.s, s2);
-              if (result->s == NULL)
+              if (arg_set_sprintf(parse, result, "%s.%s", arg1.s, s2) == NULL)
               {
                 dealloc_arg_internal(&arg1);
                 dealloc_arg_internal(&arg2);
@@ -3157,7 +3935,7 @@ static NEOERR *var_eval_helper (CSPARSE *parse, CSTREE *node, CSARG *val,
 
     n_val = arg_eval_num (parse, val);
     snprintf (buf, sizeof(buf), "%ld", n_val);
-    err = output_variable (parse, node, argexpr, buf);
+    err = output_variable (parse, node, argexpr, buf, strlen(buf));
     return nerr_pass(err);
   }
   else
@@ -3207,7 +3985,8 @@ static NEOERR *lvar_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
 
     n_val = arg_eval_num (parse, &val);
     snprintf (buf, sizeof(buf), "%ld", n_val);
-    err = output_variable (parse, node, node->arg1.argexpr, buf);
+    err = output_variable (parse, node, node->arg1.argexpr, buf,
+                           strlen(buf));
   }
   else
   {
@@ -3265,7 +4044,8 @@ static NEOERR *lvar_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
           cs->cur_file_idx = tmp_idx;
         }
 
-        err = cs_render_internal(cs, parse->output_ctx, parse->output_cb);
+        err = cs_render_internal(cs, parse->output_ctx, parse->output_cb,
+                                 parse->output_write);
 	if (err) break;
         /* Update the parent loop iterations based on the updated child. */
         parse->total_loop_iterations = cs->total_loop_iterations;
@@ -3280,6 +4060,189 @@ static NEOERR *lvar_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
   return nerr_pass(err);
 }
 
+/* linclude targets used to be parsed again on every evaluation, which is
+ * most of the cost of an linclude inside a loop.  Each target is now compiled
+ * once and kept with the parse that owns the functions its tree references
+ * (parse->owner), keyed by the resolved path and everything that changes how
+ * it parses.  The files a target was read from are checked once per render.
+ * Returns 0 if this linclude can't be memoized. */
+static int linclude_key (CSPARSE *parse, CSTREE *node, const char *path,
+                         char *key, int klen)
+{
+  NEOERR *err;
+  char fpath[PATH_BUF_SIZE];
+  int r;
+
+  if (parse->owner == NULL || parse->fileload || parse->auto_ctx.log_changes)
+    return 0;
+
+  if (path[0] != '/')
+  {
+    err = hdf_search_path (parse->hdf, path, fpath, sizeof(fpath));
+    if (parse->global_hdf && nerr_handle(&err, NERR_NOT_FOUND))
+      err = hdf_search_path(parse->global_hdf, path, fpath, sizeof(fpath));
+    if (err != STATUS_OK)
+    {
+      nerr_ignore(&err);
+      return 0;
+    }
+    path = fpath;
+  }
+
+  r = snprintf(key, klen, "%d,%d,%d,%d,%d,%d,%d\n%s\n%s\n%s\n%s",
+               node->escape, parse->auto_ctx.enabled,
+               parse->auto_ctx.global_enabled,
+               parse->auto_ctx.propagate_status, parse->audit_mode,
+               hdf_get_int_value(parse->hdf, "Config.EnableProfile", 0),
+               hdf_get_int_value(parse->hdf, "Config.CsTemplateDebug", 0),
+               hdf_get_value(parse->hdf, "Config.TagStart", "cs"),
+               hdf_get_value(parse->hdf, "Config.VarEscapeMode",
+                             EscapeModes[0].mode),
+               hdf_get_value(parse->hdf, "Config.CsDebugJsTemplate", ""),
+               path);
+  return (r > 0 && r < klen);
+}
+
+static CS_TEMPLATE *linclude_lookup (CSPARSE *parse, char *key)
+{
+  CSPARSE *owner = parse->owner;
+  CS_LINCLUDE *memo = NULL;
+  CS_TEMPLATE *tmpl = NULL;
+  int check = 0;
+
+  TEMPLATE_LOCK();
+  if (owner->lincludes)
+    memo = (CS_LINCLUDE *) ne_hash_lookup(owner->lincludes, key);
+  if (memo)
+  {
+    tmpl = memo->tmpl;
+    tmpl->refcount++;
+    check = (memo->checked != parse->render_serial);
+  }
+  TEMPLATE_UNLOCK();
+
+  if (tmpl == NULL || !check) return tmpl;
+
+  if (!cs_template_changed(tmpl))
+  {
+    TEMPLATE_LOCK();
+    memo = (CS_LINCLUDE *) ne_hash_lookup(owner->lincludes, key);
+    if (memo && memo->tmpl == tmpl)
+      memo->checked = parse->render_serial;
+    TEMPLATE_UNLOCK();
+    return tmpl;
+  }
+
+  TEMPLATE_LOCK();
+  memo = (CS_LINCLUDE *) ne_hash_lookup(owner->lincludes, key);
+  if (memo && memo->tmpl == tmpl)
+    ne_hash_remove(owner->lincludes, key);
+  else
+    memo = NULL;
+  TEMPLATE_UNLOCK();
+  dealloc_linclude(&memo);
+  cs_template_destroy(&tmpl);
+  return NULL;
+}
+
+/* Memoize a freshly parsed linclude target.  Targets that read the HDF while
+ * parsing, or whose files can't be checked for changes, are left alone. */
+static NEOERR *linclude_store (CSPARSE *parse, char *key, CSPARSE **cs,
+                               ULIST **depends, CS_TEMPLATE **tmpl)
+{
+  NEOERR *err;
+  CSPARSE *owner = parse->owner;
+  CS_LINCLUDE *memo, *old = NULL;
+  CS_DEPEND *dep;
+  int x;
+
+  *tmpl = NULL;
+  if ((*cs)->hdf_parse_reads || (*cs)->opt_pinned ||
+      uListLength(*depends) == 0)
+    return STATUS_OK;
+  for (x = 0; x < uListLength(*depends); x++)
+  {
+    uListGet(*depends, x, (void **)&dep);
+    if (dep->mtime == -1) return STATUS_OK;
+  }
+
+  memo = (CS_LINCLUDE *) calloc (1, sizeof (CS_LINCLUDE));
+  if (memo == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for linclude");
+  memo->key = strdup(key);
+  if (memo->key == NULL)
+  {
+    free(memo);
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for linclude");
+  }
+  err = compile_parse(cs, &(memo->tmpl));
+  if (err)
+  {
+    dealloc_linclude(&memo);
+    return nerr_pass(err);
+  }
+  memo->tmpl->depends = *depends;
+  *depends = NULL;
+  memo->checked = parse->render_serial;
+  /* One reference for the memo, one for the caller */
+  memo->tmpl->refcount++;
+  *tmpl = memo->tmpl;
+
+  TEMPLATE_LOCK();
+  if (owner->lincludes == NULL)
+    err = ne_hash_init(&(owner->lincludes), ne_hash_str_hash,
+                       ne_hash_str_comp);
+  if (err == STATUS_OK)
+  {
+    old = (CS_LINCLUDE *) ne_hash_remove(owner->lincludes, key);
+    err = ne_hash_insert(owner->lincludes, memo->key, memo);
+  }
+  TEMPLATE_UNLOCK();
+
+  dealloc_linclude(&old);
+  if (err) dealloc_linclude(&memo);
+  return nerr_pass(err);
+}
+
+/* Render a memoized linclude target as a child of parse */
+static NEOERR *linclude_render (CSPARSE *parse, CS_TEMPLATE *tmpl)
+{
+  NEOERR *err;
+  CSPARSE child;
+
+  init_render_parse(&child, tmpl->parse);
+  child.hdf = parse->hdf;
+  child.global_hdf = parse->global_hdf;
+  child.fileload = parse->fileload;
+  child.fileload_ctx = parse->fileload_ctx;
+  child.fragment_ctx = parse->fragment_ctx;
+  child.fragment_get = parse->fragment_get;
+  child.fragment_put = parse->fragment_put;
+  child.locals = parse->locals;
+  child.parent = parse;
+  child.owner = parse->owner;
+  child.stack_depth = parse->stack_depth;
+  child.file_list = parse->file_list;
+  child.cur_file_idx = parse->cur_file_idx;
+  child.audit_mode = parse->audit_mode;
+  child.auto_ctx.parser_ctx = parse->auto_ctx.parser_ctx;
+  child.total_loop_iterations = parse->total_loop_iterations;
+  child.max_loop_iterations = parse->max_loop_iterations;
+  child.render_serial = parse->render_serial;
+  child.arena = parse->arena;
+  child.escape_buf = parse->escape_buf;
+  child.profile = parse->profile;
+  child.reads = parse->reads;
+
+  err = cs_render_internal(&child, parse->output_ctx, parse->output_cb,
+                           parse->output_write);
+  if (err) return nerr_pass(err);
+
+  /* Update the parent loop iterations based on the updated child. */
+  parse->total_loop_iterations = child.total_loop_iterations;
+  return STATUS_OK;
+}
+
 static NEOERR *linclude_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
 {
   NEOERR *err = STATUS_OK;
@@ -3299,7 +4262,8 @@ static NEOERR *linclude_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
 
     n_val = arg_eval_num (parse, &val);
     snprintf (buf, sizeof(buf), "%ld", n_val);
-    err = output_variable (parse, node, node->arg1.argexpr, buf);
+    err = output_variable (parse, node, node->arg1.argexpr, buf,
+                           strlen(buf));
   }
   else
   {
@@ -3308,6 +4272,10 @@ static NEOERR *linclude_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
     if (s)
     {
       CSPARSE *cs = NULL;
+      CS_TEMPLATE *ltmpl = NULL;
+      ULIST *depends = NULL;
+      char key[PATH_BUF_SIZE + 256];
+      int memo_ok;
       do {
   err = increase_stack_depth (parse);
   if (err)
@@ -3319,51 +4287,78 @@ static NEOERR *linclude_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
         s);
     break;
   }
-  err = cs_init_internal(&cs, parse->hdf, parse);
-  if (err) break;
-  if (node->escape != NEOS_ESCAPE_UNDEF)
+  memo_ok = linclude_key(parse, node, s, key, sizeof(key));
+  if (memo_ok)
+    ltmpl = linclude_lookup(parse, key);
+  if (ltmpl == NULL)
   {
-    STACK_ENTRY *entry;
-
-    /* Pass on the currently active escape mode to the
-       linclude tree about to be parsed */
-    err = uListGet (cs->stack, -1, (void *)&entry);
+    err = cs_init_internal(&cs, parse->hdf, parse);
     if (err) break;
-    entry->escape = node->escape;
-    cs->escaping.next_stack = node->escape;
-  }
+    if (node->escape != NEOS_ESCAPE_UNDEF)
+    {
+      STACK_ENTRY *entry;
 
-  err = cs_parse_file_internal(cs, s);
-  if (!(node->flags & CSF_REQUIRED))
-  {
-    nerr_handle(&err, NERR_NOT_FOUND);
+      /* Pass on the currently active escape mode to the
+         linclude tree about to be parsed */
+      err = uListGet (cs->stack, -1, (void *)&entry);
+      if (err) break;
+      entry->escape = node->escape;
+      cs->escaping.next_stack = node->escape;
+    }
+    if (memo_ok)
+    {
+      err = uListInit(&depends, 5, 0);
+      if (err) break;
+      cs->depends = depends;
+    }
+
+    err = cs_parse_file_internal(cs, s);
+    cs->depends = NULL;
+    if (!(node->flags & CSF_REQUIRED))
+    {
+      nerr_handle(&err, NERR_NOT_FOUND);
+    }
+    if (err)
+    {
+      err = nerr_pass_ctx(
+          err,
+          "%s failed to include '%s' while parsing.",
+          find_context(parse, -1, tmp, sizeof(tmp)),
+          s);
+      break;
+    }
+    if (memo_ok)
+    {
+      err = linclude_store(parse, key, &cs, &depends, &ltmpl);
+      if (err) break;
+    }
   }
+  if (ltmpl)
+    err = linclude_render(parse, ltmpl);
+  else
+    err = cs_render_internal(cs, parse->output_ctx, parse->output_cb,
+                                 parse->output_write);
   if (err)
   {
     err = nerr_pass_ctx(
         err,
-        "%s failed to include '%s' while parsing.",
+        "%s failed to include '%s' while rendering.",
         find_context(parse, -1, tmp, sizeof(tmp)),
         s);
     break;
   }
-  if (err) break;
-  err = cs_render_internal(cs, parse->output_ctx, parse->output_cb);
-  if (err)
+  if (cs)
   {
-    err = nerr_pass_ctx(
-        err,
-        "%s failed to include '%s' while rendering.",
-        find_context(parse, -1, tmp, sizeof(tmp)),
-        s);
-    break;
+    /* Update the parent loop iterations based on the updated child. */
+    parse->total_loop_iterations = cs->total_loop_iterations;
   }
-  /* Update the parent loop iterations based on the updated child. */
-  parse->total_loop_iterations = cs->total_loop_iterations;
   err = decrease_stack_depth (parse);
   if (err) break;
       } while (0);
       cs_destroy(&cs);
+      cs_template_destroy(&ltmpl);
+      if (depends)
+        uListDestroyFunc(&depends, dealloc_depend);
     }
   }
   if (val.alloc) free(val.s);
@@ -3419,47 +4414,161 @@ static NEOERR *escape_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
   return nerr_pass(err);
 }
 
-static NEOERR *contenttype_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
+/* The output callback while a cache: block's body is rendered.  Flushes
+ * are dropped, the fragment is written out in one piece afterwards. */
+static NEOERR *fragment_capture (void *ctx, const char *s, size_t len)
 {
-  NEOERR *err = STATUS_OK;
-  char tmp[256];
-
-#if DEBUG_CMD_EVAL
-  ne_warn("contenttype");
-#endif
+  if (s == NULL) return STATUS_OK;
+  return nerr_pass(string_appendn((STRING *) ctx, s, len));
+}
 
-  if (!node->arg1.s)
-    return nerr_raise (NERR_PARSE, "%s Null argument for content-type",
-                       find_context(parse, -1, tmp, sizeof(tmp)));
+/* Render the body of a cache: block into a new fragment, and write it out
+ * with the callbacks the block was entered with */
+static NEOERR *cache_render (CSPARSE *parse, CSTREE *node, CS_FRAGMENT **frag)
+{
+  NEOERR *err;
+  STRING buf;
+  void *ctx = parse->output_ctx;
+  CSOUTFUNC cb = parse->output_cb;
+  CSWRITEFUNC wcb = parse->output_write;
+  NEOS_AUTO_CTX *auto_exit = NULL;
+
+  string_init(&buf);
+  parse->output_ctx = &buf;
+  parse->output_cb = NULL;
+  parse->output_write = fragment_capture;
+  err = render_node (parse, node->case_0);
+  parse->output_ctx = ctx;
+  parse->output_cb = cb;
+  parse->output_write = wcb;
 
-  if (parse->auto_ctx.global_enabled == 1)
-    err = neos_auto_set_content_type(parse->auto_ctx.parser_ctx,
-                                     neos_strip(node->arg1.s));
+  if (err == STATUS_OK)
+  {
+    if (parse->auto_ctx.global_enabled &&
+        !neos_auto_in_text(parse->auto_ctx.parser_ctx))
+      auto_exit = parse->auto_ctx.parser_ctx;
+    err = cs_fragment_create(buf.buf ? buf.buf : "", buf.len, auto_exit,
+                             frag);
+  }
+  string_clear(&buf);
+  if (err) return nerr_pass(err);
 
-  *next = node->next;
+  if (wcb)
+    err = wcb(ctx, (*frag)->buf, (*frag)->len);
+  else
+    err = cb(ctx, (*frag)->buf);
+  if (err) cs_fragment_destroy(frag);
   return nerr_pass(err);
 }
 
-static NEOERR *if_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
+/* Write out the stored output for the key, or render the body and store
+ * it.  A hit skips the body completely, so anything else it does (set:,
+ * etc) only happens when it's rendered. */
+static NEOERR *cache_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
 {
   NEOERR *err = STATUS_OK;
-  int eval_true = 0;
   CSARG val;
+  CS_FRAGMENT *frag = NULL;
+  char *key = NULL;
+  char *s;
 
 #if DEBUG_CMD_EVAL
-  ne_warn("if");
+  ne_warn("cache");
 #endif
 
+  *next = node->next;
+
+  /* The stored output was rendered starting in plain HTML text, so it's
+   * only valid from there */
+  if (parse->fragment_get == NULL ||
+      (parse->auto_ctx.global_enabled &&
+       !neos_auto_in_text(parse->auto_ctx.parser_ctx)))
+    return nerr_pass(render_node (parse, node->case_0));
+
   err = eval_expr(parse, &(node->arg1), &val);
-  if (err) return nerr_pass (err);
-  eval_true = arg_eval_bool(parse, &val);
+  if (err) return nerr_pass(err);
+  s = arg_eval_str_alloc(parse, &val);
   if (val.alloc) free(val.s);
-
-  if (eval_true)
+  if (s != NULL)
   {
-    err = render_node (parse, node->case_0);
+    key = ne_arena_sprintf(parse->arena, "%s%s",
+                           parse->auto_ctx.global_enabled ? "auto:" : "", s);
+    free(s);
+    if (key == NULL)
+      return nerr_raise (NERR_NOMEM,
+                         "Unable to allocate memory for cache key");
   }
-  else if (node->case_1 != NULL)
+
+  /* Without a key there's nothing to store it under */
+  if (key == NULL)
+    return nerr_pass(render_node (parse, node->case_0));
+
+  err = parse->fragment_get(parse->fragment_ctx, key, &frag);
+  if (err) return nerr_pass(err);
+  if (frag != NULL)
+  {
+    /* The body wasn't rendered, so the fragment is what was read */
+    if (parse->reads)
+      cs_readset_add_fragment(parse->reads, key, frag);
+    err = output_string(parse, frag->buf, frag->len);
+    if (err == STATUS_OK && parse->auto_ctx.global_enabled)
+    {
+      if (frag->auto_exit)
+        neos_auto_copy(parse->auto_ctx.parser_ctx, frag->auto_exit);
+    }
+    cs_fragment_destroy(&frag);
+    return nerr_pass(err);
+  }
+
+  err = cache_render(parse, node, &frag);
+  if (err) return nerr_pass(err);
+  if (parse->fragment_put)
+    err = parse->fragment_put(parse->fragment_ctx, key, frag, node->arg2.n);
+  cs_fragment_destroy(&frag);
+  return nerr_pass(err);
+}
+
+static NEOERR *contenttype_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
+{
+  NEOERR *err = STATUS_OK;
+  char tmp[256];
+
+#if DEBUG_CMD_EVAL
+  ne_warn("contenttype");
+#endif
+
+  if (!node->arg1.s)
+    return nerr_raise (NERR_PARSE, "%s Null argument for content-type",
+                       find_context(parse, -1, tmp, sizeof(tmp)));
+
+  if (parse->auto_ctx.global_enabled == 1)
+    err = neos_auto_set_content_type(parse->auto_ctx.parser_ctx,
+                                     node->arg1.s);
+
+  *next = node->next;
+  return nerr_pass(err);
+}
+
+static NEOERR *if_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
+{
+  NEOERR *err = STATUS_OK;
+  int eval_true = 0;
+  CSARG val;
+
+#if DEBUG_CMD_EVAL
+  ne_warn("if");
+#endif
+
+  err = eval_expr(parse, &(node->arg1), &val);
+  if (err) return nerr_pass (err);
+  eval_true = arg_eval_bool(parse, &val);
+  if (val.alloc) free(val.s);
+
+  if (eval_true)
+  {
+    err = render_node (parse, node->case_0);
+  }
+  else if (node->case_1 != NULL)
   {
     err = render_node (parse, node->case_1);
   }
@@ -3509,6 +4618,7 @@ static NEOERR *endif_parse (CSPARSE *parse, int cmd, char *arg)
   err = uListGet (parse->stack, -1, (void *)&entry);
   if (err != STATUS_OK) return nerr_pass(err);
 
+  fold_if(parse, entry->next_tree ? entry->next_tree : entry->tree);
   if (entry->next_tree)
     parse->next = &(entry->next_tree->next);
   else
@@ -3616,12 +4726,48 @@ static NEOERR *check_increment_loop_iterations(CSPARSE *parse, int iters)
   return STATUS_OK;
 }
 
+/* Render the body of an each for one child, with map installed as the
+ * loop variable.  base is the full HDF name of the list while recording
+ * reads. */
+static NEOERR *each_render_item (CSPARSE *parse, CSTREE *node,
+                                 CS_LOCAL_MAP *map, HDF *child,
+                                 const char *base)
+{
+  NEOERR *err;
+  NE_ARENA_MARK mark;
+
+  /* We don't explicitly set map->last here since checking requires a
+   * function call, so we move the check to _builtin_last so it only makes
+   * the call if last() is being used */
+  map->h = child;
+  /* Setting a dummy value. The real escape status is part of map->h and
+     will be read from there */
+  map->escape_status = CS_ES_UNTRUSTED;
+
+  ne_arena_mark(parse->arena, &mark);
+  if (base != NULL)
+    map->path = ne_arena_sprintf(parse->arena, "%s.%s", base,
+                                 hdf_obj_name(child));
+  err = render_node (parse, node->case_0);
+  ne_arena_release(parse->arena, &mark);
+  map->path = NULL;
+  if (map->map_alloc) {
+    free(map->s);
+    map->map_alloc = 0;
+  }
+  map->s = NULL;
+  map->s_cap = 0;
+  if (map->first) map->first = 0;
+  return nerr_pass(err);
+}
+
 static NEOERR *each_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
 {
   NEOERR *err = STATUS_OK;
   CS_LOCAL_MAP each_map;
   CSARG val;
   HDF *var, *child;
+  char *base = NULL;
 
 #if DEBUG_CMD_EVAL
   ne_warn("each");
@@ -3634,7 +4780,12 @@ static NEOERR *each_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
 
   if (val.op_type == CS_TYPE_VAR)
   {
-    var = var_lookup_obj (parse, val.s);
+    var = var_lookup_obj (parse, val.s, val.path);
+    if (parse->reads)
+    {
+      record_read(parse, CS_READ_CHILDREN, val.s, val.path);
+      base = local_path(parse, val.s, val.path);
+    }
     if (var != NULL)
     {
       child = hdf_obj_child (var);
@@ -3659,20 +4810,7 @@ static NEOERR *each_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
             err = check_increment_loop_iterations(parse, 1);
             if (err) return nerr_pass(err);
 
-            /* We don't explicitly set each_map.last here since checking
-             * requires a function call, so we move the check to _builtin_last
-             * so it only makes the call if last() is being used */
-            each_map.h = child;
-            /* Setting a dummy value. The real escape status is part of
-               each_map.h and will be read from there */
-            each_map.escape_status = CS_ES_UNTRUSTED;
-
-            err = render_node (parse, node->case_0);
-            if (each_map.map_alloc) {
-              free(each_map.s);
-              each_map.s = NULL;
-            }
-            if (each_map.first) each_map.first = 0;
+            err = each_render_item (parse, node, &each_map, child, base);
             if (err != STATUS_OK) break;
             child = hdf_obj_next (child);
           }
@@ -3690,6 +4828,361 @@ static NEOERR *each_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
   return nerr_pass (err);
 }
 
+/* each_parallel renders the iterations of an each on several threads, into
+ * a buffer per iteration which are written out in order afterwards.  The
+ * threads share the HDF and the enclosing locals, which is only safe
+ * while nothing changes them, so the body must not set anything; bodies
+ * which might (or when the list is too short to be worth it) are just
+ * rendered as a plain each.  Each thread renders with its own copy of the
+ * CSPARSE, with its own arena, escape buffer and auto escape parser. */
+#ifdef HAVE_PTHREADS
+
+#define PARALLEL_MAX_THREADS 16
+#define PARALLEL_MAX_MACROS 64
+
+typedef struct _each_iter
+{
+  STRING out;
+  NEOERR *err;
+  int done;                 /* rendered by a worker */
+  NEOS_AUTO_CTX *auto_exit; /* parser state after it, unless plain text */
+} CS_EACH_ITER;
+
+typedef struct _each_job
+{
+  CSPARSE *parse;
+  CSTREE *node;
+  HDF **items;
+  CS_EACH_ITER *iters;
+  int count;
+
+  pthread_mutex_t lock;
+  int next;                 /* next item to render */
+  int failed;               /* first item which failed, or count */
+} CS_EACH_JOB;
+
+typedef struct _each_worker
+{
+  CS_EACH_JOB *job;
+  CSPARSE parse;
+  CS_LOCAL_MAP map;
+  STRING escape_buf;
+  pthread_t thread;
+  int started;
+} CS_EACH_WORKER;
+
+/* Whether the list of nodes can only change its own output: no set:,
+ * lvar:, linclude: or cache:, nor content-type: which changes how the
+ * rest of the page is escaped.  The macros it calls are checked as well,
+ * macros lists the ones already seen so each is only checked once. */
+static int each_parallel_safe (CSTREE *node, CS_MACRO **macros, int *nmacros)
+{
+  NEOERR* (*eval)(CSPARSE *, CSTREE *, CSTREE **);
+  CS_MACRO *macro;
+  int x;
+
+  for (; node != NULL; node = node->next)
+  {
+    eval = Commands[node->cmd].eval_handler;
+    if (eval == set_eval || eval == lvar_eval || eval == linclude_eval ||
+        eval == cache_eval || eval == contenttype_eval)
+      return 0;
+    if (eval == call_eval)
+    {
+      macro = node->arg1.macro;
+      for (x = 0; x < *nmacros; x++)
+      {
+        if (macros[x] == macro) break;
+      }
+      if (x == *nmacros)
+      {
+        if (*nmacros == PARALLEL_MAX_MACROS) return 0;
+        macros[(*nmacros)++] = macro;
+        if (!each_parallel_safe(macro->tree->case_0, macros, nmacros))
+          return 0;
+      }
+    }
+    if (!each_parallel_safe(node->case_0, macros, nmacros) ||
+        !each_parallel_safe(node->case_1, macros, nmacros))
+      return 0;
+  }
+  return 1;
+}
+
+/* The number of threads to render the each at node with, 1 if it has to
+ * be rendered as a plain each */
+static int each_parallel_threads (CSPARSE *parse, CSTREE *node)
+{
+  CS_MACRO *macros[PARALLEL_MAX_MACROS];
+  int nmacros = 0;
+  int threads;
+
+  /* Profiles and read sets are collected by one thread, and an each
+   * inside a worker is already running in parallel */
+  if (parse->profile || parse->reads || parse->in_parallel)
+    return 1;
+  /* Each iteration is escaped as if it starts in plain HTML text */
+  if (parse->auto_ctx.global_enabled &&
+      !neos_auto_in_text(parse->auto_ctx.parser_ctx))
+    return 1;
+
+  threads = hdf_get_int_value(parse->hdf, "Config.RenderThreads", -1);
+  if (threads < 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > PARALLEL_MAX_THREADS) threads = PARALLEL_MAX_THREADS;
+  if (threads <= 1) return 1;
+
+  if (!each_parallel_safe(node->case_0, macros, &nmacros))
+    return 1;
+  return threads;
+}
+
+static void *each_worker_run (void *arg)
+{
+  CS_EACH_WORKER *w = (CS_EACH_WORKER *) arg;
+  CS_EACH_JOB *job = w->job;
+  CSPARSE *parse = &(w->parse);
+  CS_EACH_ITER *iter;
+  NEOERR *err;
+  int i;
+
+  while (1)
+  {
+    pthread_mutex_lock(&(job->lock));
+    i = job->next;
+    if (i < job->failed) job->next++;
+    pthread_mutex_unlock(&(job->lock));
+    /* Nothing after a failure is output, so there's no point rendering it */
+    if (i >= job->failed) break;
+
+    iter = &(job->iters[i]);
+    parse->output_ctx = &(iter->out);
+    if (parse->auto_ctx.global_enabled)
+      neos_auto_copy(parse->auto_ctx.parser_ctx,
+                     job->parse->auto_ctx.parser_ctx);
+    w->map.first = (i == 0);
+    err = each_render_item(parse, job->node, &(w->map), job->items[i], NULL);
+    if (err == STATUS_OK && parse->auto_ctx.global_enabled &&
+        !neos_auto_in_text(parse->auto_ctx.parser_ctx))
+    {
+      err = neos_auto_init(&(iter->auto_exit));
+      if (err == STATUS_OK)
+        neos_auto_copy(iter->auto_exit, parse->auto_ctx.parser_ctx);
+    }
+    iter->err = err;
+    iter->done = 1;
+    if (err != STATUS_OK)
+    {
+      pthread_mutex_lock(&(job->lock));
+      if (i < job->failed) job->failed = i;
+      pthread_mutex_unlock(&(job->lock));
+    }
+  }
+  return NULL;
+}
+
+static NEOERR *each_worker_init (CS_EACH_WORKER *w, CS_EACH_JOB *job)
+{
+  CSPARSE *parse = job->parse;
+
+  w->job = job;
+  memcpy(&(w->parse), parse, sizeof(CSPARSE));
+  ne_arena_init(&(w->parse.render_arena), 0);
+  w->parse.arena = &(w->parse.render_arena);
+  string_init(&(w->escape_buf));
+  w->parse.escape_buf = &(w->escape_buf);
+  w->parse.parent = parse;
+  w->parse.in_parallel = 1;
+  w->parse.output_cb = NULL;
+  w->parse.output_write = fragment_capture;
+  w->parse.output_ctx = NULL;
+
+  w->map.type = CS_TYPE_VAR;
+  w->map.name = job->node->arg1.s;
+  w->map.next = parse->locals;
+  w->map.next_scope = parse->locals;
+  w->parse.locals = &(w->map);
+
+  w->parse.auto_ctx.parser_ctx = NULL;
+  if (parse->auto_ctx.global_enabled)
+    return nerr_pass(neos_auto_init(&(w->parse.auto_ctx.parser_ctx)));
+  return STATUS_OK;
+}
+
+static void each_worker_clear (CS_EACH_WORKER *w)
+{
+  ne_arena_destroy(&(w->parse.render_arena));
+  string_clear(&(w->escape_buf));
+  if (w->parse.auto_ctx.parser_ctx)
+    neos_auto_destroy(&(w->parse.auto_ctx.parser_ctx));
+}
+
+/* Render items on up to threads threads, and write them out in order.
+ * The calling thread renders too, and then writes out each item's buffer,
+ * unless the item before left the auto escape parser somewhere other than
+ * plain text, in which case it renders the item again from there. */
+static NEOERR *each_parallel_render (CSPARSE *parse, CSTREE *node,
+                                     HDF **items, int count, int threads)
+{
+  NEOERR *err = STATUS_OK;
+  CS_EACH_JOB job;
+  CS_EACH_WORKER *workers;
+  CS_EACH_ITER *iter;
+  CS_LOCAL_MAP *map, each_map;
+  int x, nworkers, iterations = 0;
+
+  if (threads > count) threads = count;
+
+  /* Numbers in the enclosing locals get their string value the first
+   * time it's asked for, do that now rather than in every thread */
+  for (map = parse->locals; map != NULL; map = map->next)
+  {
+    if (map->type == CS_TYPE_NUM && map->s == NULL)
+    {
+      snprintf (map->nbuf, sizeof(map->nbuf), "%ld", map->n);
+      map->s = map->nbuf;
+    }
+  }
+
+  memset(&job, 0, sizeof(job));
+  job.parse = parse;
+  job.node = node;
+  job.items = items;
+  job.count = count;
+  job.failed = count;
+  if (pthread_mutex_init(&(job.lock), NULL))
+    return nerr_raise (NERR_LOCK, "Unable to create lock for each_parallel");
+  job.iters = (CS_EACH_ITER *) calloc (count, sizeof(CS_EACH_ITER));
+  workers = (CS_EACH_WORKER *) calloc (threads, sizeof(CS_EACH_WORKER));
+  if (job.iters == NULL || workers == NULL)
+  {
+    if (job.iters) free(job.iters);
+    if (workers) free(workers);
+    pthread_mutex_destroy(&(job.lock));
+    return nerr_raise (NERR_NOMEM,
+                       "Unable to allocate memory for each_parallel");
+  }
+  for (x = 0; x < count; x++)
+    string_init(&(job.iters[x].out));
+
+  for (nworkers = 0; err == STATUS_OK && nworkers < threads; nworkers++)
+    err = each_worker_init(&(workers[nworkers]), &job);
+
+  if (err == STATUS_OK)
+  {
+    /* If a thread can't be started, the others do its share */
+    for (x = 1; x < nworkers; x++)
+    {
+      workers[x].started = !pthread_create(&(workers[x].thread), NULL,
+                                           each_worker_run, &(workers[x]));
+    }
+    each_worker_run(&(workers[0]));
+    for (x = 1; x < nworkers; x++)
+    {
+      if (workers[x].started) pthread_join(workers[x].thread, NULL);
+    }
+    /* Loops inside the body were counted by each thread */
+    for (x = 0; x < nworkers; x++)
+      iterations += workers[x].parse.total_loop_iterations -
+                    parse->total_loop_iterations;
+    err = check_increment_loop_iterations(parse, iterations);
+  }
+  for (x = 0; x < nworkers; x++)
+    each_worker_clear(&(workers[x]));
+  free(workers);
+  pthread_mutex_destroy(&(job.lock));
+
+  memset(&each_map, 0, sizeof(each_map));
+  each_map.type = CS_TYPE_VAR;
+  each_map.name = node->arg1.s;
+  each_map.next = parse->locals;
+  each_map.next_scope = parse->locals;
+
+  for (x = 0; x < count && err == STATUS_OK; x++)
+  {
+    iter = &(job.iters[x]);
+    if (!iter->done || (parse->auto_ctx.global_enabled &&
+                        !neos_auto_in_text(parse->auto_ctx.parser_ctx)))
+    {
+      /* Not rendered, or rendered from the wrong parser state */
+      nerr_ignore(&(iter->err));
+      each_map.first = (x == 0);
+      parse->locals = &each_map;
+      err = each_render_item(parse, node, &each_map, items[x], NULL);
+      parse->locals = each_map.next;
+      continue;
+    }
+    err = output_string(parse, iter->out.buf ? iter->out.buf : "",
+                        iter->out.len);
+    if (err == STATUS_OK && iter->auto_exit)
+      neos_auto_copy(parse->auto_ctx.parser_ctx, iter->auto_exit);
+    if (err == STATUS_OK)
+    {
+      err = iter->err;
+      iter->err = STATUS_OK;
+    }
+  }
+
+  for (x = 0; x < count; x++)
+  {
+    iter = &(job.iters[x]);
+    string_clear(&(iter->out));
+    nerr_ignore(&(iter->err));
+    if (iter->auto_exit) neos_auto_destroy(&(iter->auto_exit));
+  }
+  free(job.iters);
+  return nerr_pass(err);
+}
+
+#endif /* HAVE_PTHREADS */
+
+static NEOERR *each_parallel_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
+{
+#ifdef HAVE_PTHREADS
+  NEOERR *err = STATUS_OK;
+  CSARG val;
+  HDF *var, *child;
+  HDF **items;
+  int threads, count = 0;
+
+#if DEBUG_CMD_EVAL
+  ne_warn("each_parallel");
+#endif
+
+  threads = each_parallel_threads(parse, node);
+  if (threads > 1)
+  {
+    err = eval_expr(parse, &(node->arg2), &val);
+    if (err) return nerr_pass(err);
+
+    var = NULL;
+    if (val.op_type == CS_TYPE_VAR)
+      var = var_lookup_obj (parse, val.s, val.path);
+    if (val.alloc) free(val.s);
+    *next = node->next;
+    if (var == NULL) return STATUS_OK;
+
+    for (child = hdf_obj_child(var); child; child = hdf_obj_next(child))
+      count++;
+    if (count == 0) return STATUS_OK;
+    err = check_increment_loop_iterations(parse, count);
+    if (err) return nerr_pass(err);
+
+    items = (HDF **) ne_arena_alloc (parse->arena, count * sizeof(HDF *));
+    if (items == NULL)
+      return nerr_raise (NERR_NOMEM,
+                         "Unable to allocate memory for each_parallel");
+    count = 0;
+    for (child = hdf_obj_child(var); child; child = hdf_obj_next(child))
+      items[count++] = child;
+
+    return nerr_pass(each_parallel_render(parse, node, items, count,
+                                          threads));
+  }
+#endif
+  return nerr_pass(each_eval(parse, node, next));
+}
+
 static NEOERR *with_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
 {
   NEOERR *err = STATUS_OK;
@@ -3708,7 +5201,7 @@ static NEOERR *with_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
 
   if (val.op_type == CS_TYPE_VAR)
   {
-    var = var_lookup_obj (parse, val.s);
+    var = var_lookup_obj (parse, val.s, val.path);
 
     if (var != NULL)
     {
@@ -3717,6 +5210,8 @@ static NEOERR *with_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
       with_map.name = node->arg1.s;
       with_map.next = parse->locals;
       with_map.h = var;
+      if (parse->reads)
+        with_map.path = local_path(parse, val.s, val.path);
       /* Setting a dummy value. The real escape status is part of with_map->h
          and will be read from there */
       with_map.escape_status = CS_ES_UNTRUSTED;
@@ -3766,6 +5261,8 @@ static NEOERR *include_parse (CSPARSE *parse, int cmd, char *arg)
     return nerr_pass(err);
   }
   /* ne_warn ("include: %s", a); */
+  if (arg1.op_type != CS_TYPE_STRING)
+    parse->hdf_parse_reads++;
 
   err = eval_expr(parse, &arg1, &val);
   if (err) {
@@ -4136,7 +5633,8 @@ static NEOERR *call_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
   macro = node->arg1.macro;
   if (macro->n_args)
   {
-    call_map = (CS_LOCAL_MAP *) calloc (macro->n_args, sizeof(CS_LOCAL_MAP));
+    call_map = (CS_LOCAL_MAP *) ne_arena_calloc (parse->arena,
+                                  macro->n_args * sizeof(CS_LOCAL_MAP));
     if (call_map == NULL)
       return nerr_raise (NERR_NOMEM,
                 "Unable to allocate memory for call_map in call_eval of %s",
@@ -4200,9 +5698,11 @@ static NEOERR *call_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
       }
       else
       {
-	var = var_lookup_obj (parse, val.s);
+	var = var_lookup_obj (parse, val.s, val.path);
 	map->h = var;
         map->type = CS_TYPE_VAR;
+        if (parse->reads)
+          map->path = local_path(parse, val.s, val.path);
         /* Setting a dummy value. The real escape status is part of map->h
            and will be read from there */
         map->escape_status = CS_ES_UNTRUSTED;
@@ -4255,7 +5755,6 @@ static NEOERR *call_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
   {
     if (call_map[x].map_alloc) free(call_map[x].s);
   }
-  if (call_map) free (call_map);
 
   parse->escaping.when_undef = saved;
   *next = node->next;
@@ -4305,16 +5804,88 @@ static NEOERR *set_parse (CSPARSE *parse, int cmd, char *arg)
   return STATUS_OK;
 }
 
+/* The most pieces set_append handles in one set */
+#define SET_APPEND_MAX 8
+
+/* set:x = x + a + b, with x a string, appends a and b to x where it is
+ * stored (see var_store) instead of copying all of x for each +, so that
+ * building up a string in a loop is linear rather than quadratic.
+ * Returns with *done = 0 if the set isn't of that form, or one of the
+ * pieces is a number (which makes + numeric). */
+static NEOERR *set_append (CSPARSE *parse, CSTREE *node, int *done)
+{
+  NEOERR *err = STATUS_OK;
+  CSARG *expr = &(node->arg2);
+  CSARG *pieces[SET_APPEND_MAX];
+  CSARG vals[SET_APPEND_MAX];
+  STRING add;
+  char *value, *s;
+  int escape_status, piece_status;
+  int n = 0, x, y;
+
+  *done = 0;
+  if (node->arg1.op_type != CS_TYPE_VAR || node->arg1.s == NULL)
+    return STATUS_OK;
+  while (expr->op_type == CS_OP_ADD)
+  {
+    if (n == SET_APPEND_MAX) return STATUS_OK;
+    pieces[n++] = expr->expr2;
+    expr = expr->expr1;
+  }
+  if (n == 0 || expr->op_type != CS_TYPE_VAR || expr->s == NULL ||
+      strcmp(expr->s, node->arg1.s))
+    return STATUS_OK;
+
+  value = var_lookup(parse, expr->s, expr->path, &escape_status);
+  if (value == NULL) return STATUS_OK;
+
+  /* pieces has them last first */
+  memset(vals, 0, sizeof(vals));
+  for (x = 0; err == STATUS_OK && x < n; x++)
+  {
+    err = eval_expr(parse, pieces[n - 1 - x], &vals[x]);
+    if (vals[x].op_type & (CS_TYPE_NUM | CS_TYPE_VAR_NUM)) break;
+  }
+  if (err == STATUS_OK && x == n)
+  {
+    /* Copied, since a piece may be x itself, which the append moves */
+    string_init(&add);
+    for (y = 0; err == STATUS_OK && y < n; y++)
+    {
+      s = arg_eval_with_escape_status(parse, &vals[y], &piece_status);
+      if (s == NULL) continue;
+      escape_status = concat_escape_status(escape_status, piece_status);
+      err = string_append(&add, s);
+    }
+    if (err == STATUS_OK)
+      err = var_store(parse, node->arg1.s, value, add.buf ? add.buf : "",
+                      escape_status);
+    string_clear(&add);
+    *done = 1;
+  }
+  for (y = 0; y < n; y++)
+    dealloc_arg_internal(&vals[y]);
+  return nerr_pass(err);
+}
+
 static NEOERR *set_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
 {
   NEOERR *err = STATUS_OK;
   CSARG val;
   CSARG set;
+  int done;
 
 #if DEBUG_CMD_EVAL
   ne_warn("set");
 #endif
 
+  err = set_append(parse, node, &done);
+  if (err || done)
+  {
+    *next = node->next;
+    return nerr_pass (err);
+  }
+
   err = eval_expr(parse, &(node->arg1), &set);
   if (err) return nerr_pass (err);
   err = eval_expr(parse, &(node->arg2), &val);
@@ -4481,6 +6052,7 @@ static NEOERR *loop_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
 {
   NEOERR *err = STATUS_OK;
   CS_LOCAL_MAP each_map;
+  NE_ARENA_MARK mark;
   int start = 0, end = 0, step = 1;
   int x, iter = 1;
   CSARG *carg;
@@ -4559,11 +6131,14 @@ static NEOERR *loop_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
       /* Loop arguments are always numerical. In keeping with our
          convention, set escape_status TRUSTED */
       each_map.escape_status = CS_ES_TRUSTED;
+      ne_arena_mark(parse->arena, &mark);
       err = render_node (parse, node->case_0);
+      ne_arena_release(parse->arena, &mark);
       if (each_map.map_alloc) {
         free(each_map.s);
-        each_map.s = NULL;
+        each_map.map_alloc = 0;
       }
+      each_map.s = NULL;
       if (each_map.first) each_map.first = 0;
       if (err != STATUS_OK) break;
     }
@@ -4582,87 +6157,2033 @@ static NEOERR *skip_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
   return STATUS_OK;
 }
 
-static NEOERR *render_node (CSPARSE *parse, CSTREE *node)
+/* **** Bytecode *************************************************** */
+/* With Config.EnableBytecode, render_node runs a CS_PROGRAM instead of
+ * walking the node list.  if/elif/else, alt and escape become jumps within
+ * the program, so they don't recurse, and the nodes which only matter at
+ * parse time (def, evar, include, the end tags) are dropped.  Commands with
+ * their own local scope or iteration (each, loop, call, ...) still run
+ * their eval_handler, which renders its body through render_node, so each
+ * body gets a program of its own. */
+
+static NEOERR *emit_insn (CS_PROGRAM *prog, CS_INSN_OP op, CSTREE *node)
+{
+  CS_INSN *code;
+
+  if (prog->len == prog->size)
+  {
+    code = (CS_INSN *) realloc (prog->code,
+                                (prog->size * 2 + 8) * sizeof(CS_INSN));
+    if (code == NULL)
+      return nerr_raise (NERR_NOMEM, "Unable to allocate memory for bytecode");
+    prog->code = code;
+    prog->size = prog->size * 2 + 8;
+  }
+  prog->code[prog->len].op = op;
+  prog->code[prog->len].target = -1;
+  prog->code[prog->len].node = node;
+  prog->len++;
+  return STATUS_OK;
+}
+
+static NEOERR *compile_program (CSPARSE *parse, CSTREE *node);
+
+static NEOERR *compile_list (CSPARSE *parse, CS_PROGRAM *prog, CSTREE *node)
 {
   NEOERR *err = STATUS_OK;
+  NEOERR* (*eval)(CSPARSE *parse, CSTREE *node, CSTREE **next);
+  int test, jump;
 
-  while (node != NULL)
+  for (; node != NULL && err == STATUS_OK; node = node->next)
   {
-#if DEBUG_EXPR_EVAL
-    ne_warn ("%s", Commands[node->cmd].cmd);
-#endif
-    err = (*(Commands[node->cmd].eval_handler))(parse, node, &node);
-    if (err) break;
+    eval = Commands[node->cmd].eval_handler;
+    if (eval == literal_eval)
+    {
+      if (node->arg1.s != NULL)
+        err = emit_insn(prog, CS_INSN_LITERAL, node);
+    }
+    else if (eval == var_eval)
+    {
+      err = emit_insn(prog, CS_INSN_VAR, node);
+    }
+    else if (eval == if_eval && is_const_arg(&(node->arg1)))
+    {
+      /* Only the live branch, see fold_if */
+      if (arg_eval_bool(parse, &(node->arg1)))
+        err = compile_list(parse, prog, node->case_0);
+      else
+        err = compile_list(parse, prog, node->case_1);
+    }
+    else if (eval == if_eval)
+    {
+      test = prog->len;
+      err = emit_insn(prog, CS_INSN_TEST, node);
+      if (err) break;
+      err = compile_list(parse, prog, node->case_0);
+      if (err) break;
+      if (node->case_1 != NULL)
+      {
+        jump = prog->len;
+        err = emit_insn(prog, CS_INSN_JUMP, node);
+        if (err) break;
+        prog->code[test].target = prog->len;
+        err = compile_list(parse, prog, node->case_1);
+        prog->code[jump].target = prog->len;
+      }
+      else
+      {
+        prog->code[test].target = prog->len;
+      }
+    }
+    else if (eval == alt_eval)
+    {
+      test = prog->len;
+      err = emit_insn(prog, CS_INSN_ALT, node);
+      if (err) break;
+      err = compile_list(parse, prog, node->case_0);
+      prog->code[test].target = prog->len;
+    }
+    else if (eval == escape_eval)
+    {
+      err = compile_list(parse, prog, node->case_0);
+    }
+    else
+    {
+      /* def bodies are skipped here, but rendered by call */
+      if (eval != skip_eval)
+        err = emit_insn(prog, CS_INSN_NODE, node);
+      if (err == STATUS_OK)
+        err = compile_program(parse, node->case_0);
+      if (err == STATUS_OK)
+        err = compile_program(parse, node->case_1);
+    }
   }
   return nerr_pass(err);
 }
 
-static NEOERR *increase_stack_depth (CSPARSE *parse)
+/* Compile the list headed by node into node->prog */
+static NEOERR *compile_program (CSPARSE *parse, CSTREE *node)
 {
-  if (parse == NULL)
-    return nerr_raise (NERR_ASSERT,
-  "NULL parse object in increase_stack_depth");
+  NEOERR *err;
+  CS_PROGRAM *prog;
 
-  if(parse->stack_depth >= MAX_STACK_DEPTH)
-    return nerr_raise (NERR_MAX_RECURSION, "Stack depth too large.");
-  parse->stack_depth++;
+  if (node == NULL || node->prog != NULL) return STATUS_OK;
 
+  prog = (CS_PROGRAM *) calloc (1, sizeof (CS_PROGRAM));
+  if (prog == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for bytecode");
+  err = compile_list(parse, prog, node);
+  if (err == STATUS_OK)
+    err = emit_insn(prog, CS_INSN_END, NULL);
+  if (err)
+  {
+    dealloc_program(&prog);
+    return nerr_pass(err);
+  }
+  node->prog = prog;
   return STATUS_OK;
 }
 
-static NEOERR *decrease_stack_depth (CSPARSE *parse)
+static NEOERR *compile_bytecode (CSPARSE *parse)
 {
-  if (parse == NULL)
-    return nerr_raise (NERR_ASSERT,
-  "NULL parse object in decrease_stack_depth");
-
-  if(parse->stack_depth <= 0)
-      return nerr_raise (NERR_ASSERT, "Negative stack depth!!");
-  parse->stack_depth--;
+  NEOERR *err;
 
+  err = compile_program(parse, parse->tree);
+  if (err)
+  {
+    dealloc_programs(parse->tree);
+    return nerr_pass(err);
+  }
+  parse->bytecode_ready = 1;
   return STATUS_OK;
 }
 
-
-NEOERR *cs_render_internal (CSPARSE *parse, void *ctx, CSOUTFUNC cb)
+static NEOERR *run_program (CSPARSE *parse, CS_PROGRAM *prog)
 {
-  CSTREE *node;
+  NEOERR *err = STATUS_OK;
+  CS_INSN *code = prog->code;
+  CS_INSN *pc = code;
+  CSTREE *next;
+  CSARG val;
+  int eval_true;
 
-  if (parse->tree == NULL)
+  while (1)
+  {
+#if DEBUG_EXPR_EVAL
+    if (pc->node) ne_warn ("%s", Commands[pc->node->cmd].cmd);
+#endif
+    switch (pc->op)
+    {
+      case CS_INSN_END:
+        return STATUS_OK;
+      case CS_INSN_LITERAL:
+        err = literal_eval(parse, pc->node, &next);
+        pc++;
+        break;
+      case CS_INSN_VAR:
+        err = var_eval(parse, pc->node, &next);
+        pc++;
+        break;
+      case CS_INSN_TEST:
+        err = eval_expr(parse, &(pc->node->arg1), &val);
+        if (err) break;
+        eval_true = arg_eval_bool(parse, &val);
+        if (val.alloc) free(val.s);
+        pc = eval_true ? pc + 1 : code + pc->target;
+        break;
+      case CS_INSN_ALT:
+        /* as alt_eval */
+        parse->escaping.current = NEOS_ESCAPE_UNDEF;
+        err = eval_expr(parse, &(pc->node->arg1), &val);
+        if (err) break;
+        eval_true = arg_eval_bool(parse, &val);
+        if (eval_true)
+          err = var_eval_helper(parse, pc->node, &val,
+                                pc->node->arg1.argexpr);
+        if (val.alloc) free(val.s);
+        pc = eval_true ? code + pc->target : pc + 1;
+        break;
+      case CS_INSN_JUMP:
+        pc = code + pc->target;
+        break;
+      case CS_INSN_NODE:
+        err = (*(Commands[pc->node->cmd].eval_handler))(parse, pc->node,
+                                                        &next);
+        pc++;
+        break;
+    }
+    if (err) return nerr_pass(err);
+  }
+}
+
+/* **** Profiling ************************************************** */
+
+static UINT32 prof_entry_hash (const void *a)
+{
+  const CS_PROF_ENTRY *e = (const CS_PROF_ENTRY *) a;
+
+  return (UINT32)((size_t)e->node >> 4) * 31 + (UINT32)((size_t)e->caller >> 4);
+}
+
+static int prof_entry_comp (const void *a, const void *b)
+{
+  const CS_PROF_ENTRY *ea = (const CS_PROF_ENTRY *) a;
+  const CS_PROF_ENTRY *eb = (const CS_PROF_ENTRY *) b;
+
+  return (ea->node == eb->node && ea->caller == eb->caller &&
+          ea->linenum == eb->linenum && ea->cmd == eb->cmd);
+}
+
+static void profile_destroy (CS_PROFILE **prof)
+{
+  CS_PROFILE *my_prof = *prof;
+  CS_PROF_ENTRY *entry;
+  int x;
+
+  if (my_prof == NULL) return;
+  ne_hash_destroy(&(my_prof->entries));
+  for (x = 0; my_prof->order && x < uListLength(my_prof->order); x++)
+  {
+    uListGet(my_prof->order, x, (void **)&entry);
+    if (entry->name) free(entry->name);
+    if (entry->fname) free(entry->fname);
+    if (entry->macro) free(entry->macro);
+  }
+  uListDestroy(&(my_prof->order), ULIST_FREE);
+  free(my_prof);
+  *prof = NULL;
+}
+
+static NEOERR *profile_init (CS_PROFILE **prof)
+{
+  NEOERR *err;
+  CS_PROFILE *my_prof;
+
+  *prof = NULL;
+  my_prof = (CS_PROFILE *) calloc (1, sizeof (CS_PROFILE));
+  if (my_prof == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for profile");
+  err = ne_hash_init(&(my_prof->entries), prof_entry_hash, prof_entry_comp);
+  if (err == STATUS_OK)
+    err = uListInit(&(my_prof->order), 64, 0);
+  if (err)
+  {
+    profile_destroy(&my_prof);
+    return nerr_pass(err);
+  }
+  *prof = my_prof;
+  return STATUS_OK;
+}
+
+static NEOERR *profile_entry (CS_PROFILE *prof, CSTREE *node,
+                              CS_PROF_ENTRY **entry)
+{
+  NEOERR *err;
+  CS_PROF_ENTRY key;
+  CS_PROF_ENTRY *my_entry;
+
+  key.caller = prof->current;
+  key.node = node;
+  key.linenum = node->linenum;
+  key.cmd = node->cmd;
+  *entry = (CS_PROF_ENTRY *) ne_hash_lookup(prof->entries, &key);
+  if (*entry != NULL) return STATUS_OK;
+
+  my_entry = (CS_PROF_ENTRY *) calloc (1, sizeof (CS_PROF_ENTRY));
+  if (my_entry == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for profile");
+  my_entry->caller = prof->current;
+  my_entry->node = node;
+  my_entry->linenum = node->linenum;
+  my_entry->cmd = node->cmd;
+  my_entry->fname = strdup(node->fname ? node->fname : "string");
+  if (Commands[node->cmd].eval_handler == call_eval)
+  {
+    my_entry->macro = strdup(node->arg1.macro->name);
+    my_entry->name = sprintf_alloc("call %s (%s:%d)", node->arg1.macro->name,
+                                   my_entry->fname, node->linenum);
+  }
+  else
+  {
+    my_entry->name = sprintf_alloc("%s (%s:%d)", Commands[node->cmd].cmd,
+                                   my_entry->fname, node->linenum);
+  }
+  if (my_entry->fname == NULL || my_entry->name == NULL ||
+      (Commands[node->cmd].eval_handler == call_eval &&
+       my_entry->macro == NULL))
+  {
+    if (my_entry->fname) free(my_entry->fname);
+    if (my_entry->name) free(my_entry->name);
+    if (my_entry->macro) free(my_entry->macro);
+    free(my_entry);
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for profile");
+  }
+  err = uListAppend(prof->order, my_entry);
+  if (err)
+  {
+    free(my_entry->fname);
+    free(my_entry->name);
+    if (my_entry->macro) free(my_entry->macro);
+    free(my_entry);
+    return nerr_pass(err);
+  }
+  err = ne_hash_insert(prof->entries, my_entry, my_entry);
+  if (err) return nerr_pass(err);
+  *entry = my_entry;
+  return STATUS_OK;
+}
+
+/* The render_node loop, timing each node */
+static NEOERR *render_node_profiled (CSPARSE *parse, CSTREE *node)
+{
+  NEOERR *err = STATUS_OK;
+  CS_PROFILE *prof = parse->profile;
+  CS_PROF_ENTRY *caller = prof->current;
+  CS_PROF_ENTRY *entry;
+  NEOERR* (*eval)(CSPARSE *, CSTREE *, CSTREE **);
+  double child_time, start, elapsed;
+  long child_bytes, child_lookups, bytes, lookups;
+
+  while (node != NULL)
+  {
+    eval = Commands[node->cmd].eval_handler;
+    if (eval == skip_eval)
+    {
+      err = skip_eval(parse, node, &node);
+      if (err) break;
+      continue;
+    }
+    err = profile_entry(prof, node, &entry);
+    if (err) break;
+
+    /* Start a new frame for whatever this node renders */
+    child_time = prof->child_time;
+    child_bytes = prof->child_bytes;
+    child_lookups = prof->child_lookups;
+    prof->child_time = 0;
+    prof->child_bytes = 0;
+    prof->child_lookups = 0;
+    prof->current = entry;
+    bytes = prof->bytes;
+    lookups = prof->lookups;
+    start = ne_timef();
+
+    err = (*eval)(parse, node, &node);
+
+    elapsed = ne_timef() - start;
+    bytes = prof->bytes - bytes;
+    lookups = prof->lookups - lookups;
+    entry->count++;
+    entry->time += elapsed;
+    entry->self += elapsed - prof->child_time;
+    entry->bytes += bytes - prof->child_bytes;
+    entry->lookups += lookups - prof->child_lookups;
+
+    prof->current = caller;
+    prof->child_time = child_time + elapsed;
+    prof->child_bytes = child_bytes + bytes;
+    prof->child_lookups = child_lookups + lookups;
+    if (err) break;
+  }
+  return nerr_pass(err);
+}
+
+static long prof_usec (double t)
+{
+  return (long)(t * 1000000 + 0.5);
+}
+
+/* Append the caller chain of entry to str, outermost first */
+static NEOERR *prof_stack (STRING *str, CS_PROF_ENTRY *entry)
+{
+  NEOERR *err;
+
+  if (entry->caller)
+  {
+    err = prof_stack(str, entry->caller);
+    if (err) return nerr_pass(err);
+    err = string_append_char(str, ';');
+    if (err) return nerr_pass(err);
+  }
+  return nerr_pass(string_append(str, entry->name));
+}
+
+/* Add entry to the total for key, which is either its name or the macro
+ * it calls.  Time spent in a recursive call is already counted by the
+ * outermost one.  The totals borrow their strings from the entries. */
+static NEOERR *prof_add (NE_HASH *sums, ULIST *order, char *key,
+                         CS_PROF_ENTRY *entry)
+{
+  NEOERR *err;
+  CS_PROF_ENTRY *sum, *e;
+
+  sum = (CS_PROF_ENTRY *) ne_hash_lookup(sums, key);
+  if (sum == NULL)
+  {
+    sum = (CS_PROF_ENTRY *) calloc (1, sizeof (CS_PROF_ENTRY));
+    if (sum == NULL)
+      return nerr_raise (NERR_NOMEM, "Unable to allocate memory for profile");
+    sum->name = entry->name;
+    sum->fname = entry->fname;
+    sum->linenum = entry->linenum;
+    sum->cmd = entry->cmd;
+    sum->macro = entry->macro;
+    err = uListAppend(order, sum);
+    if (err)
+    {
+      free(sum);
+      return nerr_pass(err);
+    }
+    err = ne_hash_insert(sums, key, sum);
+    if (err) return nerr_pass(err);
+  }
+  sum->count += entry->count;
+  sum->self += entry->self;
+  sum->bytes += entry->bytes;
+  sum->lookups += entry->lookups;
+
+  for (e = entry->caller; e != NULL; e = e->caller)
+  {
+    if (key == entry->name && !strcmp(e->name, key)) break;
+    if (key == entry->macro && e->macro && !strcmp(e->macro, key)) break;
+  }
+  if (e == NULL) sum->time += entry->time;
+  return STATUS_OK;
+}
+
+/* Replace CS.Profile in parse->hdf with the results, see cs.h */
+static NEOERR *profile_export (CSPARSE *parse, CS_PROFILE *prof, double total)
+{
+  NEOERR *err;
+  NE_HASH *sums = NULL;
+  ULIST *nodes = NULL;
+  ULIST *macros = NULL;
+  CS_PROF_ENTRY *entry;
+  STRING stacks;
+  HDF *obj;
+  int x;
+
+  string_init(&stacks);
+  err = hdf_remove_tree(parse->hdf, "CS.Profile");
+  if (err == STATUS_OK)
+    err = hdf_get_node(parse->hdf, "CS.Profile", &obj);
+  if (err == STATUS_OK)
+    err = hdf_set_valuef(obj, "Time=%ld", prof_usec(total));
+  if (err == STATUS_OK)
+    err = ne_hash_init(&sums, ne_hash_str_hash, ne_hash_str_comp);
+  if (err == STATUS_OK)
+    err = uListInit(&nodes, uListLength(prof->order), 0);
+  if (err == STATUS_OK)
+    err = uListInit(&macros, 10, 0);
+
+  for (x = 0; err == STATUS_OK && x < uListLength(prof->order); x++)
+  {
+    uListGet(prof->order, x, (void **)&entry);
+    err = prof_add(sums, nodes, entry->name, entry);
+    if (err == STATUS_OK && entry->macro != NULL)
+      err = prof_add(sums, macros, entry->macro, entry);
+    if (err == STATUS_OK && prof_usec(entry->self) > 0)
+    {
+      err = prof_stack(&stacks, entry);
+      if (err == STATUS_OK)
+        err = string_appendf(&stacks, " %ld\n", prof_usec(entry->self));
+    }
+  }
+
+  for (x = 0; err == STATUS_OK && x < uListLength(nodes); x++)
+  {
+    uListGet(nodes, x, (void **)&entry);
+    err = hdf_set_valuef(obj, "Nodes.%d.File=%s", x, entry->fname);
+    if (err == STATUS_OK)
+      err = hdf_set_valuef(obj, "Nodes.%d.Line=%d", x, entry->linenum);
+    if (err == STATUS_OK)
+      err = hdf_set_valuef(obj, "Nodes.%d.Command=%s", x,
+                           Commands[entry->cmd].cmd);
+    if (err == STATUS_OK)
+      err = hdf_set_valuef(obj, "Nodes.%d.Count=%ld", x, entry->count);
+    if (err == STATUS_OK)
+      err = hdf_set_valuef(obj, "Nodes.%d.Time=%ld", x, prof_usec(entry->time));
+    if (err == STATUS_OK)
+      err = hdf_set_valuef(obj, "Nodes.%d.SelfTime=%ld", x,
+                           prof_usec(entry->self));
+    if (err == STATUS_OK)
+      err = hdf_set_valuef(obj, "Nodes.%d.Bytes=%ld", x, entry->bytes);
+    if (err == STATUS_OK)
+      err = hdf_set_valuef(obj, "Nodes.%d.Lookups=%ld", x, entry->lookups);
+  }
+  for (x = 0; err == STATUS_OK && x < uListLength(macros); x++)
+  {
+    uListGet(macros, x, (void **)&entry);
+    err = hdf_set_valuef(obj, "Macros.%d.Name=%s", x, entry->macro);
+    if (err == STATUS_OK)
+      err = hdf_set_valuef(obj, "Macros.%d.Count=%ld", x, entry->count);
+    if (err == STATUS_OK)
+      err = hdf_set_valuef(obj, "Macros.%d.Time=%ld", x,
+                           prof_usec(entry->time));
+  }
+  if (err == STATUS_OK)
+    err = hdf_set_value(obj, "Stacks", stacks.buf ? stacks.buf : "");
+
+  ne_hash_destroy(&sums);
+  uListDestroy(&nodes, ULIST_FREE);
+  uListDestroy(&macros, ULIST_FREE);
+  string_clear(&stacks);
+  return nerr_pass(err);
+}
+
+static NEOERR *render_node (CSPARSE *parse, CSTREE *node)
+{
+  NEOERR *err = STATUS_OK;
+
+  /* The profiler wants to see every node, so it doesn't use the bytecode */
+  if (parse->profile != NULL)
+    return nerr_pass(render_node_profiled(parse, node));
+  if (node != NULL && node->prog != NULL)
+    return nerr_pass(run_program(parse, node->prog));
+
+  while (node != NULL)
+  {
+#if DEBUG_EXPR_EVAL
+    ne_warn ("%s", Commands[node->cmd].cmd);
+#endif
+    err = (*(Commands[node->cmd].eval_handler))(parse, node, &node);
+    if (err) break;
+  }
+  return nerr_pass(err);
+}
+
+static NEOERR *increase_stack_depth (CSPARSE *parse)
+{
+  if (parse == NULL)
+    return nerr_raise (NERR_ASSERT,
+  "NULL parse object in increase_stack_depth");
+
+  if(parse->stack_depth >= MAX_STACK_DEPTH)
+    return nerr_raise (NERR_MAX_RECURSION, "Stack depth too large.");
+  parse->stack_depth++;
+
+  return STATUS_OK;
+}
+
+static NEOERR *decrease_stack_depth (CSPARSE *parse)
+{
+  if (parse == NULL)
+    return nerr_raise (NERR_ASSERT,
+  "NULL parse object in decrease_stack_depth");
+
+  if(parse->stack_depth <= 0)
+      return nerr_raise (NERR_ASSERT, "Negative stack depth!!");
+  parse->stack_depth--;
+
+  return STATUS_OK;
+}
+
+
+NEOERR *cs_render_internal (CSPARSE *parse, void *ctx, CSOUTFUNC cb,
+                            CSWRITEFUNC wcb)
+{
+  CSTREE *node;
+
+  if (parse->tree == NULL)
     return nerr_raise (NERR_ASSERT, "No parse tree exists");
 
-  parse->output_ctx = ctx;
-  parse->output_cb = cb;
+  if (parse->bytecode && !parse->bytecode_ready)
+  {
+    NEOERR *err = compile_bytecode(parse);
+    if (err) return nerr_pass(err);
+  }
+
+  parse->output_ctx = ctx;
+  parse->output_cb = cb;
+  parse->output_write = wcb;
+
+  node = parse->tree;
+  return nerr_pass (render_node(parse, node));
+}
+
+static NEOERR *render_top (CSPARSE *parse, void *ctx, CSOUTFUNC cb,
+                           CSWRITEFUNC wcb)
+{
+  NEOERR *err = STATUS_OK;
+  STRING escape_buf;
+  double start = 0;
+
+  /* Reset the auto escape parser. This will erase any
+     existing context due to any previous call to cs_render.
+  */
+  if (parse->auto_ctx.global_enabled == 1)
+  {
+    if (parse->auto_ctx.parser_ctx)
+      err = neos_auto_reset(parse->auto_ctx.parser_ctx);
+    else
+      err = neos_auto_init(&(parse->auto_ctx.parser_ctx));
+
+    if (err)
+      return nerr_pass(err);
+  }
+
+  TEMPLATE_LOCK();
+  parse->render_serial = ++RenderSerial;
+  TEMPLATE_UNLOCK();
+
+  /* Reset the total iterations between calls. */
+  parse->total_loop_iterations = 0;
+  parse->max_loop_iterations =
+      hdf_get_int_value(parse->hdf, "Config.MaxLoopIterations",
+                        DEFAULT_MAX_LOOP_ITERATIONS);
+
+  if (hdf_get_int_value(parse->hdf, "Config.EnableProfile", 0))
+  {
+    err = profile_init(&(parse->profile));
+    if (err) return nerr_pass(err);
+    start = ne_timef();
+  }
+
+  if (parse->reads)
+    cs_readset_clear(parse->reads);
+
+  /* A batch render brings its own, to keep between items */
+  if (parse->escape_buf == NULL)
+  {
+    string_init(&escape_buf);
+    parse->escape_buf = &escape_buf;
+  }
+  parse->arena = &(parse->render_arena);
+  err = cs_render_internal(parse, ctx, cb, wcb);
+  if (parse->profile)
+  {
+    if (err == STATUS_OK)
+      err = profile_export(parse, parse->profile, ne_timef() - start);
+    profile_destroy(&(parse->profile));
+  }
+  parse->render_stats.allocs = parse->arena->allocs;
+  parse->render_stats.peak = parse->arena->peak;
+  parse->render_stats.reserved = parse->arena->reserved;
+  ne_arena_clear(parse->arena);
+  parse->arena = NULL;
+  if (parse->escape_buf == &escape_buf)
+    string_clear(&escape_buf);
+  parse->escape_buf = NULL;
+
+  return nerr_pass(err);
+}
+
+NEOERR *cs_render (CSPARSE *parse, void *ctx, CSOUTFUNC cb)
+{
+  return nerr_pass(render_top(parse, ctx, cb, NULL));
+}
+
+NEOERR *cs_render_write (CSPARSE *parse, void *ctx, CSWRITEFUNC cb)
+{
+  return nerr_pass(render_top(parse, ctx, NULL, cb));
+}
+
+void cs_track_reads (CSPARSE *parse, CS_READSET *reads)
+{
+  parse->reads = reads;
+}
+
+/* **** Compiled Templates ***************************************** */
+
+static void dealloc_depend (void *data)
+{
+  CS_DEPEND *dep = (CS_DEPEND *) data;
+
+  free(dep->path);
+  free(dep);
+}
+
+static void dealloc_linclude (CS_LINCLUDE **memo)
+{
+  CS_LINCLUDE *my_memo = *memo;
+
+  if (my_memo == NULL) return;
+  cs_template_destroy(&(my_memo->tmpl));
+  free(my_memo->key);
+  free(my_memo);
+  *memo = NULL;
+}
+
+static NEOERR *compile_parse (CSPARSE **parse, CS_TEMPLATE **tmpl)
+{
+  NEOERR *err;
+  CSPARSE *my_parse = *parse;
+  CS_TEMPLATE *my_tmpl;
+
+  /* Renders share the tree, so it can't be compiled lazily */
+  if (my_parse->bytecode && !my_parse->bytecode_ready)
+  {
+    err = compile_bytecode(my_parse);
+    if (err) return nerr_pass(err);
+  }
+
+  my_tmpl = (CS_TEMPLATE *) calloc (1, sizeof (CS_TEMPLATE));
+  if (my_tmpl == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for CS_TEMPLATE");
+  my_tmpl->tag = strdup(my_parse->tag);
+  if (my_tmpl->tag == NULL)
+  {
+    free(my_tmpl);
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for CS_TEMPLATE");
+  }
+
+  /* These point into the HDF the template was parsed with, which need not
+   * outlive the template */
+  my_parse->tag = my_tmpl->tag;
+  my_parse->hdf = NULL;
+  my_parse->csdebug_js_template = NULL;
+  my_parse->output_ctx = NULL;
+  my_parse->output_cb = NULL;
+  my_parse->output_write = NULL;
+  my_parse->arena = NULL;
+  my_parse->escape_buf = NULL;
+  my_parse->profile = NULL;
+  my_parse->reads = NULL;
+
+  my_tmpl->parse = my_parse;
+  my_tmpl->refcount = 1;
+  *parse = NULL;
+  *tmpl = my_tmpl;
+  return STATUS_OK;
+}
+
+/* Set up a render context for a compiled parse.  Everything the render
+ * changes lives in render, the compiled parse is only read from. */
+static void init_render_parse (CSPARSE *render, CSPARSE *compiled)
+{
+  memset(render, 0, sizeof(CSPARSE));
+  render->tag = compiled->tag;
+  render->taglen = compiled->taglen;
+  render->tree = compiled->tree;
+  render->macros = compiled->macros;
+  render->functions = compiled->functions;
+  render->owner = compiled->owner;
+  render->global_hdf = compiled->global_hdf;
+  render->fileload = compiled->fileload;
+  render->fileload_ctx = compiled->fileload_ctx;
+  render->fragment_ctx = compiled->fragment_ctx;
+  render->fragment_get = compiled->fragment_get;
+  render->fragment_put = compiled->fragment_put;
+  render->audit_mode = compiled->audit_mode;
+  render->bytecode = compiled->bytecode;
+  render->bytecode_ready = compiled->bytecode_ready;
+  render->escaping = compiled->escaping;
+  render->cur_file_idx = -1;
+  render->auto_ctx = compiled->auto_ctx;
+  render->auto_ctx.parser_ctx = NULL;
+  ne_arena_init(&(render->render_arena), 0);
+}
+
+NEOERR *cs_compile (CSPARSE **parse, CS_TEMPLATE **tmpl)
+{
+  if (*parse == NULL || (*parse)->tree == NULL)
+    return nerr_raise (NERR_ASSERT, "No parse tree exists");
+  if ((*parse)->parent != NULL)
+    return nerr_raise (NERR_ASSERT, "Can't compile a child CSPARSE");
+
+  return nerr_pass(compile_parse(parse, tmpl));
+}
+
+CS_TEMPLATE *cs_template_ref (CS_TEMPLATE *tmpl)
+{
+  TEMPLATE_LOCK();
+  tmpl->refcount++;
+  TEMPLATE_UNLOCK();
+  return tmpl;
+}
+
+void cs_template_destroy (CS_TEMPLATE **tmpl)
+{
+  CS_TEMPLATE *my_tmpl = *tmpl;
+  int refcount;
+
+  if (my_tmpl == NULL) return;
+  *tmpl = NULL;
+
+  TEMPLATE_LOCK();
+  refcount = --my_tmpl->refcount;
+  TEMPLATE_UNLOCK();
+  if (refcount > 0) return;
+
+  cs_destroy(&(my_tmpl->parse));
+  if (my_tmpl->depends)
+    uListDestroyFunc(&(my_tmpl->depends), dealloc_depend);
+  free(my_tmpl->tag);
+  free(my_tmpl);
+}
+
+static int depend_changed (const char *path, time_t mtime, off_t size)
+{
+  struct stat s;
+
+  if (mtime == -1) return 1;
+  if (stat(path, &s) == -1) return 1;
+  return (s.st_mtime != mtime || s.st_size != size);
+}
+
+void cs_render_stats (CSPARSE *parse, CS_RENDER_STATS *stats)
+{
+  *stats = parse->render_stats;
+}
+
+void cs_template_render_stats (CS_TEMPLATE *tmpl, CS_RENDER_STATS *stats)
+{
+  TEMPLATE_LOCK();
+  *stats = tmpl->render_stats;
+  TEMPLATE_UNLOCK();
+}
+
+int cs_template_changed (CS_TEMPLATE *tmpl)
+{
+  CS_DEPEND *dep;
+  int x;
+
+  for (x = 0; x < uListLength(tmpl->depends); x++)
+  {
+    uListGet(tmpl->depends, x, (void **)&dep);
+    if (depend_changed(dep->path, dep->mtime, dep->size)) return 1;
+  }
+  return 0;
+}
+
+/* Set up render to render tmpl, see init_render_parse */
+static NEOERR *render_ctx_init (CS_TEMPLATE *tmpl, CSPARSE *render)
+{
+  NEOERR *err = STATUS_OK;
+  CSPARSE *parse = tmpl->parse;
+  char *fname;
+  int x;
+
+  /* All render time state lives in this CSPARSE, so any number of these can
+   * run at once. */
+  init_render_parse(render, parse);
+
+  /* lvar appends the names of the strings it parses to the file list, so
+   * it needs a copy */
+  if (render->auto_ctx.log_changes)
+  {
+    err = uListInit(&(render->file_list), uListLength(parse->file_list) + 1, 0);
+    for (x = 0; err == STATUS_OK && x < uListLength(parse->file_list); x++)
+    {
+      uListGet(parse->file_list, x, (void **)&fname);
+      fname = strdup(fname);
+      if (fname == NULL)
+        err = nerr_raise (NERR_NOMEM, "Unable to allocate memory for file list");
+      else
+        err = uListAppend(render->file_list, fname);
+    }
+  }
+  return nerr_pass(err);
+}
+
+static void render_ctx_clear (CSPARSE *render)
+{
+  ne_arena_destroy(&(render->render_arena));
+  if (render->file_list)
+    uListDestroy(&(render->file_list), ULIST_FREE);
+  if (render->auto_ctx.parser_ctx)
+    neos_auto_destroy(&(render->auto_ctx.parser_ctx));
+}
+
+static NEOERR *render_ctx (CS_TEMPLATE *tmpl, HDF *hdf, CS_READSET *reads,
+                           void *ctx, CSOUTFUNC cb, CSWRITEFUNC wcb)
+{
+  NEOERR *err;
+  CSPARSE render;
+
+  err = render_ctx_init(tmpl, &render);
+  render.hdf = hdf;
+  render.reads = reads;
+
+  if (err == STATUS_OK)
+  {
+    err = render_top(&render, ctx, cb, wcb);
+    TEMPLATE_LOCK();
+    tmpl->render_stats = render.render_stats;
+    TEMPLATE_UNLOCK();
+  }
+  render_ctx_clear(&render);
+
+  return nerr_pass(err);
+}
+
+NEOERR *cs_render_ctx (CS_TEMPLATE *tmpl, HDF *hdf, void *ctx, CSOUTFUNC cb)
+{
+  return nerr_pass(render_ctx(tmpl, hdf, NULL, ctx, cb, NULL));
+}
+
+NEOERR *cs_render_ctx_write (CS_TEMPLATE *tmpl, HDF *hdf, void *ctx,
+                             CSWRITEFUNC cb)
+{
+  return nerr_pass(render_ctx(tmpl, hdf, NULL, ctx, NULL, cb));
+}
+
+NEOERR *cs_render_ctx_reads (CS_TEMPLATE *tmpl, HDF *hdf, CS_READSET *reads,
+                             void *ctx, CSWRITEFUNC cb)
+{
+  return nerr_pass(render_ctx(tmpl, hdf, reads, ctx, NULL, cb));
+}
+
+/* cs_render_batch: each worker keeps one render context, and the
+ * buffers it renders into, for all the items it renders */
+typedef struct _batch_job
+{
+  CS_TEMPLATE *tmpl;
+  HDF **datasets;
+  int n;
+  void *ctx;
+  CSBATCHFUNC cb;
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_t lock;
+#endif
+  int next;             /* next item to render */
+  NEOERR *err;          /* the error which stopped the batch */
+} CS_BATCH_JOB;
+
+typedef struct _batch_worker
+{
+  CS_BATCH_JOB *job;
+  CSPARSE render;
+  STRING out;
+  STRING escape_buf;
+  int nfiles;           /* length of render.file_list between items */
+  int items;            /* items rendered */
+#ifdef HAVE_PTHREADS
+  pthread_t thread;
+  int started;
+#endif
+} CS_BATCH_WORKER;
+
+#ifdef HAVE_PTHREADS
+#define BATCH_LOCK(j) pthread_mutex_lock(&((j)->lock))
+#define BATCH_UNLOCK(j) pthread_mutex_unlock(&((j)->lock))
+#else
+#define BATCH_LOCK(j)
+#define BATCH_UNLOCK(j)
+#endif
+
+static NEOERR *batch_render_item (CS_BATCH_WORKER *w, int item)
+{
+  NEOERR *err;
+  CS_BATCH_JOB *job = w->job;
+  void *fname;
+
+  w->render.hdf = job->datasets[item];
+  w->render.escape_buf = &(w->escape_buf);
+  w->out.len = 0;
+  w->items++;
+  err = render_top(&(w->render), &(w->out), NULL, fragment_capture);
+  /* Forget the strings lvar parsed for this item */
+  while (w->render.file_list && uListLength(w->render.file_list) > w->nfiles)
+  {
+    uListPop(w->render.file_list, &fname);
+    free(fname);
+  }
+  if (err == STATUS_OK)
+    err = job->cb(job->ctx, item, w->out.buf ? w->out.buf : "", w->out.len);
+  if (err) return nerr_pass_ctx(err, "Batch item %d", item);
+  return STATUS_OK;
+}
+
+static void *batch_worker_run (void *arg)
+{
+  CS_BATCH_WORKER *w = (CS_BATCH_WORKER *) arg;
+  CS_BATCH_JOB *job = w->job;
+  NEOERR *err;
+  int item;
+
+  while (1)
+  {
+    BATCH_LOCK(job);
+    item = job->err ? job->n : job->next++;
+    BATCH_UNLOCK(job);
+    if (item >= job->n) break;
+
+    err = batch_render_item(w, item);
+    if (err)
+    {
+      BATCH_LOCK(job);
+      if (job->err == STATUS_OK)
+        job->err = err;
+      else
+        nerr_ignore(&err);
+      BATCH_UNLOCK(job);
+    }
+  }
+  return NULL;
+}
+
+static NEOERR *batch_worker_init (CS_BATCH_WORKER *w, CS_BATCH_JOB *job)
+{
+  NEOERR *err;
+
+  w->job = job;
+  string_init(&(w->out));
+  string_init(&(w->escape_buf));
+  err = render_ctx_init(job->tmpl, &(w->render));
+  if (w->render.file_list)
+    w->nfiles = uListLength(w->render.file_list);
+  return nerr_pass(err);
+}
+
+static void batch_worker_clear (CS_BATCH_WORKER *w)
+{
+  CS_TEMPLATE *tmpl = w->job->tmpl;
+
+  if (w->items)
+  {
+    TEMPLATE_LOCK();
+    tmpl->render_stats = w->render.render_stats;
+    TEMPLATE_UNLOCK();
+  }
+  render_ctx_clear(&(w->render));
+  string_clear(&(w->out));
+  string_clear(&(w->escape_buf));
+}
+
+NEOERR *cs_render_batch (CS_TEMPLATE *tmpl, HDF **datasets, int n,
+                         void *ctx, CSBATCHFUNC cb, int nthreads)
+{
+  NEOERR *err = STATUS_OK;
+  CS_BATCH_JOB job;
+  CS_BATCH_WORKER *workers;
+  int x, nworkers;
+
+  if (n <= 0) return STATUS_OK;
+
+#ifdef HAVE_PTHREADS
+  if (nthreads <= 0)
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if (nthreads > n) nthreads = n;
+  if (nthreads < 1) nthreads = 1;
+#ifndef HAVE_PTHREADS
+  nthreads = 1;
+#endif
+
+  memset(&job, 0, sizeof(job));
+  job.tmpl = tmpl;
+  job.datasets = datasets;
+  job.n = n;
+  job.ctx = ctx;
+  job.cb = cb;
+#ifdef HAVE_PTHREADS
+  if (pthread_mutex_init(&(job.lock), NULL))
+    return nerr_raise (NERR_LOCK, "Unable to create lock for batch render");
+#endif
+
+  workers = (CS_BATCH_WORKER *) calloc (nthreads, sizeof(CS_BATCH_WORKER));
+  if (workers == NULL)
+    err = nerr_raise (NERR_NOMEM, "Unable to allocate memory for batch render");
+  for (nworkers = 0; err == STATUS_OK && nworkers < nthreads; nworkers++)
+    err = batch_worker_init(&(workers[nworkers]), &job);
+
+  if (err == STATUS_OK)
+  {
+#ifdef HAVE_PTHREADS
+    /* If a thread can't be started, the others do its share */
+    for (x = 1; x < nworkers; x++)
+    {
+      workers[x].started = !pthread_create(&(workers[x].thread), NULL,
+                                           batch_worker_run, &(workers[x]));
+    }
+#endif
+    batch_worker_run(&(workers[0]));
+#ifdef HAVE_PTHREADS
+    for (x = 1; x < nworkers; x++)
+    {
+      if (workers[x].started) pthread_join(workers[x].thread, NULL);
+    }
+#endif
+    err = job.err;
+  }
+
+  if (workers != NULL)
+  {
+    for (x = 0; x < nworkers; x++)
+      batch_worker_clear(&(workers[x]));
+    free(workers);
+  }
+#ifdef HAVE_PTHREADS
+  pthread_mutex_destroy(&(job.lock));
+#endif
+  return nerr_pass(err);
+}
+
+/* **** Compiled Template Files ************************************ */
+
+/* cs_compile_to_file saves a compiled template as a file of fixed size
+ * records: every reference between them is a record index or an offset
+ * into the string table, so the file doesn't care where it is mapped.
+ * cs_load_compiled rebuilds the CSTREE/CSARG pointers in one pass over
+ * the records, but the text is used in place, and nothing is tokenized or
+ * run through parse_expr again.  Records are in host byte order and
+ * layout, a file from another platform, library version or Commands table
+ * is just ignored. */
+
+#define CSC_MAGIC "CSC\n"
+#define CSC_VERSION 1
+#define CSC_BYTE_ORDER 0x01020304
+#define CSC_LAYOUT ((UINT32)(sizeof(long int) | sizeof(time_t) << 8 | \
+                             sizeof(off_t) << 16))
+#define CSC_NONE ((UINT32)-1)
+#define CSC_ALIGN(x) (((x) + 7) & ~7)
+
+typedef struct _csc_section
+{
+  UINT32 offset;
+  UINT32 count;       /* records, or bytes for the string table */
+} CSC_SECTION;
+
+typedef struct _csc_arg
+{
+  UINT32 op_type;
+  INT32 escape_status;
+  INT32 has_path;     /* compile_var_path again on load */
+  UINT32 s;           /* string offsets */
+  UINT32 argexpr;
+  UINT32 function;    /* the function's name, looked up on load */
+  UINT32 macro;       /* macro index */
+  UINT32 expr1;       /* arg indices */
+  UINT32 expr2;
+  UINT32 next;
+  long int n;
+} CSC_ARG;
+
+typedef struct _csc_node
+{
+  INT32 cmd;
+  INT32 flags;
+  INT32 escape;
+  INT32 do_autoescape;
+  INT32 auto_text;    /* literal_auto_text again on load */
+  INT32 file_idx;
+  INT32 linenum;
+  INT32 colnum;
+  UINT32 fname;
+  UINT32 vargs;       /* arg index */
+  UINT32 case_0;      /* node indices */
+  UINT32 case_1;
+  UINT32 next;
+  CSC_ARG arg1;
+  CSC_ARG arg2;
+} CSC_NODE;
+
+typedef struct _csc_macro
+{
+  UINT32 name;
+  INT32 n_args;
+  UINT32 args;
+  UINT32 tree;        /* the def node */
+} CSC_MACRO;
+
+typedef struct _csc_depend
+{
+  UINT32 path;
+  time_t mtime;
+  off_t size;
+} CSC_DEPEND;
+
+typedef struct _csc_header
+{
+  char magic[4];
+  UINT32 version;
+  UINT32 byte_order;
+  UINT32 layout;
+  UINT32 commands;    /* ne_crc of the Commands names */
+  UINT32 size;        /* of the whole file */
+  UINT32 config;      /* cs_config_key of the HDF it was parsed with */
+  UINT32 tag;
+  UINT32 tree;
+  INT32 audit_mode;
+  INT32 bytecode;
+  CS_ECONTEXT escaping;
+  INT32 auto_global_enabled;
+  INT32 auto_enabled;
+  INT32 auto_log_changes;
+  INT32 auto_propagate_status;
+  CSC_SECTION nodes;
+  CSC_SECTION args;
+  CSC_SECTION macros; /* in parse->macros order */
+  CSC_SECTION files;  /* string offsets of parse->file_list */
+  CSC_SECTION depends;
+  CSC_SECTION strings;
+} CSC_HEADER;
+
+static UINT32 csc_commands (void)
+{
+  UINT32 crc = 0;
+  int x;
+
+  for (x = 0; Commands[x].cmd != NULL; x++)
+    crc ^= ne_crc((UINT8 *)Commands[x].cmd, Commands[x].cmdlen) + x;
+  return crc;
+}
+
+static UINT32 csc_ptr_hash (const void *a)
+{
+  return (UINT32)((unsigned long)a >> 4);
+}
+
+typedef struct _csc_writer
+{
+  NE_HASH *index;     /* CSTREE or CS_MACRO -> index + 1 */
+  NE_HASH *strs;      /* string -> offset + 1 */
+  ULIST *nodes;       /* in index order */
+  STRING args;        /* CSC_ARG records */
+  STRING strings;
+} CSC_WRITER;
+
+static NEOERR *csc_string (CSC_WRITER *w, const char *s, UINT32 *off)
+{
+  NEOERR *err;
+  long int v;
+
+  *off = CSC_NONE;
+  if (s == NULL) return STATUS_OK;
+  v = (long int) ne_hash_lookup(w->strs, (void *)s);
+  if (v)
+  {
+    *off = v - 1;
+    return STATUS_OK;
+  }
+  *off = w->strings.len;
+  err = string_appendn(&(w->strings), s, strlen(s) + 1);
+  if (err) return nerr_pass(err);
+  return nerr_pass(ne_hash_insert(w->strs, (void *)s, (void *)(long)(*off + 1)));
+}
+
+static UINT32 csc_index (CSC_WRITER *w, void *ptr)
+{
+  if (ptr == NULL) return CSC_NONE;
+  return (UINT32)((long int) ne_hash_lookup(w->index, ptr) - 1);
+}
+
+static NEOERR *csc_arg_ref (CSC_WRITER *w, CSARG *arg, UINT32 *idx);
+
+static NEOERR *csc_arg (CSC_WRITER *w, CSARG *arg, CSC_ARG *rec)
+{
+  NEOERR *err;
+
+  memset(rec, 0, sizeof(CSC_ARG));
+  rec->op_type = arg->op_type;
+  rec->escape_status = arg->escape_status;
+  rec->has_path = (arg->path != NULL);
+  rec->n = arg->n;
+  rec->macro = csc_index(w, arg->macro);
+  if (arg->macro && rec->macro == CSC_NONE)
+    return nerr_raise (NERR_ASSERT, "Macro %s isn't in the template",
+                       arg->macro->name);
+  err = csc_string(w, arg->s, &(rec->s));
+  if (err == STATUS_OK) err = csc_string(w, arg->argexpr, &(rec->argexpr));
+  if (err == STATUS_OK)
+    err = csc_string(w, arg->function ? arg->function->name : NULL,
+                     &(rec->function));
+  if (err == STATUS_OK) err = csc_arg_ref(w, arg->expr1, &(rec->expr1));
+  if (err == STATUS_OK) err = csc_arg_ref(w, arg->expr2, &(rec->expr2));
+  if (err == STATUS_OK) err = csc_arg_ref(w, arg->next, &(rec->next));
+  return nerr_pass(err);
+}
+
+/* Args outside a CSTREE go in the arg table, after the args they refer to */
+static NEOERR *csc_arg_ref (CSC_WRITER *w, CSARG *arg, UINT32 *idx)
+{
+  NEOERR *err;
+  CSC_ARG rec;
+
+  *idx = CSC_NONE;
+  if (arg == NULL) return STATUS_OK;
+  err = csc_arg(w, arg, &rec);
+  if (err) return nerr_pass(err);
+  *idx = w->args.len / sizeof(CSC_ARG);
+  return nerr_pass(string_appendn(&(w->args), (char *)&rec, sizeof(rec)));
+}
+
+static NEOERR *csc_number_nodes (CSC_WRITER *w, CSTREE *node)
+{
+  NEOERR *err;
+
+  while (node != NULL)
+  {
+    err = uListAppend(w->nodes, node);
+    if (err) return nerr_pass(err);
+    err = ne_hash_insert(w->index, node, (void *)(long)uListLength(w->nodes));
+    if (err) return nerr_pass(err);
+    err = csc_number_nodes(w, node->case_0);
+    if (err) return nerr_pass(err);
+    err = csc_number_nodes(w, node->case_1);
+    if (err) return nerr_pass(err);
+    node = node->next;
+  }
+  return STATUS_OK;
+}
+
+static NEOERR *csc_section (STRING *out, CSC_SECTION *sec, const void *data,
+                            size_t len, UINT32 count)
+{
+  NEOERR *err;
+  static const char pad[8] = "";
+
+  err = string_appendn(out, pad, CSC_ALIGN(out->len) - out->len);
+  if (err) return nerr_pass(err);
+  sec->offset = out->len;
+  sec->count = count;
+  if (len == 0) return STATUS_OK;
+  return nerr_pass(string_appendn(out, (const char *)data, len));
+}
+
+static NEOERR *csc_write (CSC_WRITER *w, CSPARSE *parse, ULIST *depends,
+                          const char *config, STRING *out)
+{
+  NEOERR *err;
+  CSC_HEADER hdr;
+  CSC_NODE *nodes = NULL;
+  CSC_MACRO *macros = NULL;
+  CSC_DEPEND *deps = NULL;
+  UINT32 *files = NULL;
+  CS_MACRO *macro;
+  CS_DEPEND *dep;
+  CSTREE *node;
+  char *fname;
+  int n_nodes, n_macros = 0, n_files, n_deps;
+  int x;
+
+  memset(&hdr, 0, sizeof(hdr));
+  err = csc_number_nodes(w, parse->tree);
+  if (err) return nerr_pass(err);
+  for (macro = parse->macros; macro; macro = macro->next)
+  {
+    if (csc_index(w, macro->tree) == CSC_NONE)
+      return nerr_raise (NERR_ASSERT, "Macro %s isn't in the template",
+                         macro->name);
+    err = ne_hash_insert(w->index, macro, (void *)(long)++n_macros);
+    if (err) return nerr_pass(err);
+  }
+  n_nodes = uListLength(w->nodes);
+  n_files = uListLength(parse->file_list);
+  n_deps = uListLength(depends);
 
-  node = parse->tree;
-  return nerr_pass (render_node(parse, node));
+  nodes = (CSC_NODE *) calloc (n_nodes, sizeof(CSC_NODE));
+  macros = (CSC_MACRO *) calloc (n_macros + 1, sizeof(CSC_MACRO));
+  files = (UINT32 *) calloc (n_files + 1, sizeof(UINT32));
+  deps = (CSC_DEPEND *) calloc (n_deps + 1, sizeof(CSC_DEPEND));
+  if (!nodes || !macros || !files || !deps)
+  {
+    err = nerr_raise (NERR_NOMEM,
+                      "Unable to allocate memory for compiled template");
+  }
+
+  for (x = 0; err == STATUS_OK && x < n_nodes; x++)
+  {
+    CSC_NODE *rec = &(nodes[x]);
+
+    uListGet(w->nodes, x, (void **)&node);
+    rec->cmd = node->cmd;
+    rec->flags = node->flags;
+    rec->escape = node->escape;
+    rec->do_autoescape = node->do_autoescape;
+    rec->auto_text = node->auto_text;
+    rec->file_idx = node->file_idx;
+    rec->linenum = node->linenum;
+    rec->colnum = node->colnum;
+    rec->case_0 = csc_index(w, node->case_0);
+    rec->case_1 = csc_index(w, node->case_1);
+    rec->next = csc_index(w, node->next);
+    err = csc_string(w, node->fname, &(rec->fname));
+    if (err == STATUS_OK) err = csc_arg_ref(w, node->vargs, &(rec->vargs));
+    if (err == STATUS_OK) err = csc_arg(w, &(node->arg1), &(rec->arg1));
+    if (err == STATUS_OK) err = csc_arg(w, &(node->arg2), &(rec->arg2));
+  }
+  for (macro = parse->macros, x = 0; err == STATUS_OK && macro;
+       macro = macro->next, x++)
+  {
+    macros[x].n_args = macro->n_args;
+    macros[x].tree = csc_index(w, macro->tree);
+    err = csc_string(w, macro->name, &(macros[x].name));
+    if (err == STATUS_OK) err = csc_arg_ref(w, macro->args, &(macros[x].args));
+  }
+  for (x = 0; err == STATUS_OK && x < n_files; x++)
+  {
+    uListGet(parse->file_list, x, (void **)&fname);
+    err = csc_string(w, fname, &(files[x]));
+  }
+  for (x = 0; err == STATUS_OK && x < n_deps; x++)
+  {
+    uListGet(depends, x, (void **)&dep);
+    deps[x].mtime = dep->mtime;
+    deps[x].size = dep->size;
+    err = csc_string(w, dep->path, &(deps[x].path));
+  }
+  if (err == STATUS_OK) err = csc_string(w, parse->tag, &(hdr.tag));
+  if (err == STATUS_OK) err = csc_string(w, config, &(hdr.config));
+
+  if (err == STATUS_OK)
+  {
+    memcpy(hdr.magic, CSC_MAGIC, sizeof(hdr.magic));
+    hdr.version = CSC_VERSION;
+    hdr.byte_order = CSC_BYTE_ORDER;
+    hdr.layout = CSC_LAYOUT;
+    hdr.commands = csc_commands();
+    hdr.tree = csc_index(w, parse->tree);
+    hdr.audit_mode = parse->audit_mode;
+    hdr.bytecode = parse->bytecode;
+    hdr.escaping = parse->escaping;
+    hdr.auto_global_enabled = parse->auto_ctx.global_enabled;
+    hdr.auto_enabled = parse->auto_ctx.enabled;
+    hdr.auto_log_changes = parse->auto_ctx.log_changes;
+    hdr.auto_propagate_status = parse->auto_ctx.propagate_status;
+
+    err = string_appendn(out, (char *)&hdr, sizeof(hdr));
+  }
+  if (err == STATUS_OK)
+    err = csc_section(out, &(hdr.nodes), nodes, n_nodes * sizeof(CSC_NODE),
+                      n_nodes);
+  if (err == STATUS_OK)
+    err = csc_section(out, &(hdr.args), w->args.buf, w->args.len,
+                      w->args.len / sizeof(CSC_ARG));
+  if (err == STATUS_OK)
+    err = csc_section(out, &(hdr.macros), macros,
+                      n_macros * sizeof(CSC_MACRO), n_macros);
+  if (err == STATUS_OK)
+    err = csc_section(out, &(hdr.files), files, n_files * sizeof(UINT32),
+                      n_files);
+  if (err == STATUS_OK)
+    err = csc_section(out, &(hdr.depends), deps, n_deps * sizeof(CSC_DEPEND),
+                      n_deps);
+  if (err == STATUS_OK)
+    err = csc_section(out, &(hdr.strings), w->strings.buf, w->strings.len,
+                      w->strings.len);
+  if (err == STATUS_OK)
+  {
+    hdr.size = out->len;
+    memcpy(out->buf, &hdr, sizeof(hdr));
+  }
+
+  free(nodes);
+  free(macros);
+  free(files);
+  free(deps);
+  return nerr_pass(err);
 }
 
-NEOERR *cs_render (CSPARSE *parse, void *ctx, CSOUTFUNC cb)
+/* Write to a temporary file and rename it, so a reader sees either the old
+ * or the new file, never a partial one */
+static NEOERR *csc_save (const char *path, STRING *out)
+{
+  char tpath[PATH_BUF_SIZE];
+  int fd, len = 0, r;
+
+  snprintf(tpath, sizeof(tpath), "%s.%d.tmp", path, (int)getpid());
+  fd = open(tpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    return nerr_raise_errno (NERR_IO, "Unable to open %s for writing", tpath);
+  while (len < out->len)
+  {
+    r = write(fd, out->buf + len, out->len - len);
+    if (r == -1)
+    {
+      if (errno == EINTR) continue;
+      close(fd);
+      unlink(tpath);
+      return nerr_raise_errno (NERR_IO, "Unable to write %s", tpath);
+    }
+    len += r;
+  }
+  if (close(fd) == -1)
+  {
+    unlink(tpath);
+    return nerr_raise_errno (NERR_IO, "Unable to write %s", tpath);
+  }
+  if (rename(tpath, path) == -1)
+  {
+    unlink(tpath);
+    return nerr_raise_errno (NERR_IO, "Unable to rename %s to %s", tpath,
+                             path);
+  }
+  return STATUS_OK;
+}
+
+NEOERR *cs_compile_to_file (CS_TEMPLATE *tmpl, HDF *hdf, const char *path)
+{
+  NEOERR *err;
+  CSC_WRITER w;
+  STRING out;
+  char *config = NULL;
+
+  if (tmpl->parse->hdf_parse_reads)
+    return nerr_raise (NERR_ASSERT,
+        "Template reads the HDF while parsing (evar: or include: of a "
+        "variable), and can't be saved to %s", path);
+
+  memset(&w, 0, sizeof(w));
+  string_init(&(w.args));
+  string_init(&(w.strings));
+  string_init(&out);
+  err = cs_config_key(hdf, &config);
+  if (err == STATUS_OK)
+    err = ne_hash_init(&(w.index), csc_ptr_hash, ne_hash_int_comp);
+  if (err == STATUS_OK)
+    err = ne_hash_init(&(w.strs), ne_hash_str_hash, ne_hash_str_comp);
+  if (err == STATUS_OK) err = uListInit(&(w.nodes), 100, 0);
+  if (err == STATUS_OK)
+    err = csc_write(&w, tmpl->parse, tmpl->depends, config, &out);
+  if (err == STATUS_OK) err = csc_save(path, &out);
+
+  if (config) free(config);
+  ne_hash_destroy(&(w.index));
+  ne_hash_destroy(&(w.strs));
+  if (w.nodes) uListDestroy(&(w.nodes), 0);
+  string_clear(&(w.args));
+  string_clear(&(w.strings));
+  string_clear(&out);
+  return nerr_pass(err);
+}
+
+static NEOERR *csc_map (const char *path, char **map, size_t *len)
+{
+#ifdef HAVE_MMAP
+  struct stat s;
+  int fd;
+
+  *map = NULL;
+  *len = 0;
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+  {
+    if (errno == ENOENT)
+      return nerr_raise (NERR_NOT_FOUND, "File %s not found", path);
+    return nerr_raise_errno (NERR_IO, "Unable to open %s", path);
+  }
+  if (fstat(fd, &s) == -1)
+  {
+    close(fd);
+    return nerr_raise_errno (NERR_IO, "Unable to stat %s", path);
+  }
+  if (s.st_size < (off_t) sizeof(CSC_HEADER))
+  {
+    close(fd);
+    return STATUS_OK;
+  }
+  *map = (char *) mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (*map == (char *) MAP_FAILED)
+  {
+    *map = NULL;
+    return nerr_raise_errno (NERR_IO, "Unable to map %s", path);
+  }
+  *len = s.st_size;
+  return STATUS_OK;
+#else
+  NEOERR *err;
+  int l;
+
+  *len = 0;
+  err = ne_load_file_len(path, map, &l);
+  if (err) return nerr_pass(err);
+  *len = l;
+  return STATUS_OK;
+#endif
+}
+
+static void csc_unmap (char *map, size_t len)
+{
+  if (map == NULL) return;
+#ifdef HAVE_MMAP
+  munmap(map, len);
+#else
+  free(map);
+#endif
+}
+
+typedef struct _csc_reader
+{
+  CSPARSE *parse;
+  char *map;
+  size_t len;
+  CSC_HEADER *hdr;
+  CSC_NODE *nodes;
+  CSC_ARG *args;
+  CSC_MACRO *macros;
+  UINT32 *files;
+  CSC_DEPEND *depends;
+  char *strings;
+  UINT8 *node_refs;   /* every node and table arg is referenced once */
+  UINT8 *arg_refs;
+} CSC_READER;
+
+static int csc_get_section (CSC_READER *r, CSC_SECTION *sec, size_t size,
+                            void **data)
+{
+  if (sec->offset % 8 || sec->offset > r->len) return 0;
+  if (sec->count > (r->len - sec->offset) / size) return 0;
+  *data = r->map + sec->offset;
+  return 1;
+}
+
+static char *csc_str (CSC_READER *r, UINT32 off)
+{
+  if (off == CSC_NONE) return NULL;
+  return r->strings + off;
+}
+
+static int csc_str_ok (CSC_READER *r, UINT32 off)
+{
+  return (off == CSC_NONE || off < r->hdr->strings.count);
+}
+
+static CS_FUNCTION *csc_function (CSC_READER *r, UINT32 off)
+{
+  CS_FUNCTION *csf;
+  char *name = csc_str(r, off);
+
+  for (csf = r->parse->functions; name && csf; csf = csf->next)
+  {
+    if (!strcmp(csf->name, name)) return csf;
+  }
+  return NULL;
+}
+
+static int csc_ref (UINT8 *refs, UINT32 count, UINT32 idx)
+{
+  if (idx == CSC_NONE) return 1;
+  if (idx >= count || refs[idx]) return 0;
+  refs[idx] = 1;
+  return 1;
+}
+
+static int csc_check_arg (CSC_READER *r, CSC_ARG *rec)
+{
+  UINT32 n_args = r->hdr->args.count;
+
+  if (!csc_str_ok(r, rec->s) || !csc_str_ok(r, rec->argexpr) ||
+      !csc_str_ok(r, rec->function))
+    return 0;
+  if (rec->has_path && rec->s == CSC_NONE) return 0;
+  /* The template uses a function which isn't registered this time */
+  if (rec->function != CSC_NONE && csc_function(r, rec->function) == NULL)
+    return 0;
+  if (rec->macro != CSC_NONE && rec->macro >= r->hdr->macros.count)
+    return 0;
+  return (csc_ref(r->arg_refs, n_args, rec->expr1) &&
+          csc_ref(r->arg_refs, n_args, rec->expr2) &&
+          csc_ref(r->arg_refs, n_args, rec->next));
+}
+
+/* Check everything in the file is in range, so building the tree from it
+ * can't fail other than for memory.  Returns 0 if the file can't be used. */
+static int csc_check (CSC_READER *r)
+{
+  CSC_HEADER *hdr = r->hdr;
+  UINT32 x;
+  int n_cmds;
+
+  if (memcmp(hdr->magic, CSC_MAGIC, sizeof(hdr->magic)) ||
+      hdr->version != CSC_VERSION || hdr->byte_order != CSC_BYTE_ORDER ||
+      hdr->layout != CSC_LAYOUT || hdr->commands != csc_commands() ||
+      hdr->size != r->len)
+    return 0;
+  if (!csc_get_section(r, &(hdr->nodes), sizeof(CSC_NODE),
+                       (void **)&(r->nodes)) ||
+      !csc_get_section(r, &(hdr->args), sizeof(CSC_ARG),
+                       (void **)&(r->args)) ||
+      !csc_get_section(r, &(hdr->macros), sizeof(CSC_MACRO),
+                       (void **)&(r->macros)) ||
+      !csc_get_section(r, &(hdr->files), sizeof(UINT32),
+                       (void **)&(r->files)) ||
+      !csc_get_section(r, &(hdr->depends), sizeof(CSC_DEPEND),
+                       (void **)&(r->depends)) ||
+      !csc_get_section(r, &(hdr->strings), 1, (void **)&(r->strings)))
+    return 0;
+  if (hdr->strings.count == 0 || r->strings[hdr->strings.count - 1] != '\0')
+    return 0;
+  if (hdr->tag == CSC_NONE || !csc_str_ok(r, hdr->tag) ||
+      hdr->config == CSC_NONE || !csc_str_ok(r, hdr->config))
+    return 0;
+
+  for (n_cmds = 0; Commands[n_cmds].cmd != NULL; n_cmds++);
+  if (!csc_ref(r->node_refs, hdr->nodes.count, hdr->tree) ||
+      hdr->tree == CSC_NONE)
+    return 0;
+  for (x = 0; x < hdr->nodes.count; x++)
+  {
+    CSC_NODE *rec = &(r->nodes[x]);
+
+    if (rec->cmd < 0 || rec->cmd >= n_cmds || !csc_str_ok(r, rec->fname) ||
+        !csc_check_arg(r, &(rec->arg1)) || !csc_check_arg(r, &(rec->arg2)) ||
+        !csc_ref(r->arg_refs, hdr->args.count, rec->vargs) ||
+        !csc_ref(r->node_refs, hdr->nodes.count, rec->case_0) ||
+        !csc_ref(r->node_refs, hdr->nodes.count, rec->case_1) ||
+        !csc_ref(r->node_refs, hdr->nodes.count, rec->next))
+      return 0;
+  }
+  for (x = 0; x < hdr->args.count; x++)
+  {
+    if (!csc_check_arg(r, &(r->args[x]))) return 0;
+  }
+  for (x = 0; x < hdr->macros.count; x++)
+  {
+    CSC_MACRO *rec = &(r->macros[x]);
+
+    if (rec->name == CSC_NONE || !csc_str_ok(r, rec->name) ||
+        rec->tree >= hdr->nodes.count ||
+        !csc_ref(r->arg_refs, hdr->args.count, rec->args))
+      return 0;
+  }
+  for (x = 0; x < hdr->files.count; x++)
+  {
+    if (r->files[x] == CSC_NONE || !csc_str_ok(r, r->files[x])) return 0;
+  }
+  for (x = 0; x < hdr->depends.count; x++)
+  {
+    if (r->depends[x].path == CSC_NONE ||
+        !csc_str_ok(r, r->depends[x].path))
+      return 0;
+  }
+  /* Anything not referenced would be leaked */
+  for (x = 0; x < hdr->nodes.count; x++)
+    if (!r->node_refs[x]) return 0;
+  for (x = 0; x < hdr->args.count; x++)
+    if (!r->arg_refs[x]) return 0;
+  return 1;
+}
+
+/* Returns 1 if the template's Config or any of its files have changed */
+static NEOERR *csc_stale (CSC_READER *r, int *stale)
+{
+  NEOERR *err;
+  char *config;
+  UINT32 x;
+
+  *stale = 1;
+  err = cs_config_key(r->parse->hdf, &config);
+  if (err) return nerr_pass(err);
+  if (strcmp(config, csc_str(r, r->hdr->config)))
+  {
+    free(config);
+    return STATUS_OK;
+  }
+  free(config);
+  for (x = 0; x < r->hdr->depends.count; x++)
+  {
+    CSC_DEPEND *dep = &(r->depends[x]);
+    if (depend_changed(csc_str(r, dep->path), dep->mtime, dep->size))
+      return STATUS_OK;
+  }
+  *stale = 0;
+  return STATUS_OK;
+}
+
+static void csc_link_arg (CSC_READER *r, CSC_ARG *rec, CSARG *arg,
+                          CSARG **args, CS_MACRO **macros)
+{
+  arg->op_type = rec->op_type;
+  arg->escape_status = rec->escape_status;
+  arg->n = rec->n;
+  arg->s = csc_str(r, rec->s);
+  if (rec->function != CSC_NONE) arg->function = csc_function(r, rec->function);
+  if (rec->macro != CSC_NONE) arg->macro = macros[rec->macro];
+  if (rec->expr1 != CSC_NONE) arg->expr1 = args[rec->expr1];
+  if (rec->expr2 != CSC_NONE) arg->expr2 = args[rec->expr2];
+  if (rec->next != CSC_NONE) arg->next = args[rec->next];
+}
+
+/* The parts of an arg which need allocating, once it is in the tree */
+static NEOERR *csc_fill_arg (CSC_READER *r, CSC_ARG *rec, CSARG *arg)
+{
+  if (rec->argexpr != CSC_NONE)
+  {
+    arg->argexpr = strdup(csc_str(r, rec->argexpr));
+    if (arg->argexpr == NULL)
+      return nerr_raise (NERR_NOMEM, "Unable to allocate memory for argexpr");
+  }
+  if (rec->has_path)
+    return nerr_pass(compile_var_path(r->parse, arg));
+  return STATUS_OK;
+}
+
+static NEOERR *csc_build (CSC_READER *r, CSTREE **tree, CS_MACRO **macro_list)
 {
   NEOERR *err = STATUS_OK;
+  CSC_HEADER *hdr = r->hdr;
+  CSTREE **nodes;
+  CSARG **args;
+  CS_MACRO **macros;
+  UINT32 x;
+  int ok;
+
+  *tree = NULL;
+  *macro_list = NULL;
+  nodes = (CSTREE **) calloc (hdr->nodes.count + 1, sizeof(CSTREE *));
+  args = (CSARG **) calloc (hdr->args.count + 1, sizeof(CSARG *));
+  macros = (CS_MACRO **) calloc (hdr->macros.count + 1, sizeof(CS_MACRO *));
+  ok = (nodes && args && macros);
+  for (x = 0; ok && x < hdr->nodes.count; x++)
+    ok = ((nodes[x] = (CSTREE *) calloc (1, sizeof(CSTREE))) != NULL);
+  for (x = 0; ok && x < hdr->args.count; x++)
+    ok = ((args[x] = (CSARG *) calloc (1, sizeof(CSARG))) != NULL);
+  for (x = 0; ok && x < hdr->macros.count; x++)
+    ok = ((macros[x] = (CS_MACRO *) calloc (1, sizeof(CS_MACRO))) != NULL);
+  if (!ok)
+  {
+    for (x = 0; nodes && x < hdr->nodes.count; x++) free(nodes[x]);
+    for (x = 0; args && x < hdr->args.count; x++) free(args[x]);
+    for (x = 0; macros && x < hdr->macros.count; x++) free(macros[x]);
+    free(nodes);
+    free(args);
+    free(macros);
+    return nerr_raise (NERR_NOMEM,
+                       "Unable to allocate memory for compiled template");
+  }
 
-  /* Reset the auto escape parser. This will erase any
-     existing context due to any previous call to cs_render.
-  */
-  if (parse->auto_ctx.global_enabled == 1)
+  /* Link everything up, so it can all be freed from the root from here on */
+  for (x = 0; x < hdr->nodes.count; x++)
   {
-    if (parse->auto_ctx.parser_ctx)
-      err = neos_auto_reset(parse->auto_ctx.parser_ctx);
+    CSC_NODE *rec = &(r->nodes[x]);
+    CSTREE *node = nodes[x];
+
+    node->cmd = rec->cmd;
+    node->flags = rec->flags;
+    node->escape = rec->escape;
+    node->do_autoescape = rec->do_autoescape;
+    node->file_idx = rec->file_idx;
+    node->linenum = rec->linenum;
+    node->colnum = rec->colnum;
+    if (rec->vargs != CSC_NONE) node->vargs = args[rec->vargs];
+    if (rec->case_0 != CSC_NONE) node->case_0 = nodes[rec->case_0];
+    if (rec->case_1 != CSC_NONE) node->case_1 = nodes[rec->case_1];
+    if (rec->next != CSC_NONE) node->next = nodes[rec->next];
+    csc_link_arg(r, &(rec->arg1), &(node->arg1), args, macros);
+    csc_link_arg(r, &(rec->arg2), &(node->arg2), args, macros);
+  }
+  for (x = 0; x < hdr->args.count; x++)
+    csc_link_arg(r, &(r->args[x]), args[x], args, macros);
+  for (x = 0; x < hdr->macros.count; x++)
+  {
+    CSC_MACRO *rec = &(r->macros[x]);
+
+    macros[x]->n_args = rec->n_args;
+    macros[x]->tree = nodes[rec->tree];
+    if (rec->args != CSC_NONE) macros[x]->args = args[rec->args];
+    macros[x]->next = macros[x + 1];
+  }
+  *tree = nodes[hdr->tree];
+  *macro_list = macros[0];
+
+  for (x = 0; err == STATUS_OK && x < hdr->nodes.count; x++)
+  {
+    CSC_NODE *rec = &(r->nodes[x]);
+    CSTREE *node = nodes[x];
+
+    if (rec->fname != CSC_NONE)
+    {
+      node->fname = strdup(csc_str(r, rec->fname));
+      if (node->fname == NULL)
+        err = nerr_raise (NERR_NOMEM, "Unable to allocate memory for node");
+    }
+    if (err == STATUS_OK) err = csc_fill_arg(r, &(rec->arg1), &(node->arg1));
+    if (err == STATUS_OK) err = csc_fill_arg(r, &(rec->arg2), &(node->arg2));
+    if (err == STATUS_OK && rec->auto_text)
+      err = literal_auto_text(r->parse, node);
+  }
+  for (x = 0; err == STATUS_OK && x < hdr->args.count; x++)
+    err = csc_fill_arg(r, &(r->args[x]), args[x]);
+  for (x = 0; err == STATUS_OK && x < hdr->macros.count; x++)
+  {
+    macros[x]->name = strdup(csc_str(r, r->macros[x].name));
+    if (macros[x]->name == NULL)
+      err = nerr_raise (NERR_NOMEM, "Unable to allocate memory for CS_MACRO");
+  }
+
+  free(nodes);
+  free(args);
+  free(macros);
+  if (err)
+  {
+    dealloc_node(tree);
+    dealloc_macro(macro_list);
+  }
+  return nerr_pass(err);
+}
+
+static NEOERR *csc_depends (CSC_READER *r, ULIST **depends)
+{
+  NEOERR *err;
+  CS_DEPEND *dep;
+  UINT32 x;
+
+  err = uListInit(depends, r->hdr->depends.count + 1, 0);
+  for (x = 0; err == STATUS_OK && x < r->hdr->depends.count; x++)
+  {
+    dep = (CS_DEPEND *) calloc (1, sizeof(CS_DEPEND));
+    if (dep) dep->path = strdup(csc_str(r, r->depends[x].path));
+    if (dep == NULL || dep->path == NULL)
+    {
+      if (dep) free(dep);
+      err = nerr_raise (NERR_NOMEM, "Unable to allocate memory for depend");
+      break;
+    }
+    dep->mtime = r->depends[x].mtime;
+    dep->size = r->depends[x].size;
+    err = uListAppend(*depends, dep);
+    if (err) dealloc_depend(dep);
+  }
+  if (err && *depends) uListDestroyFunc(depends, dealloc_depend);
+  return nerr_pass(err);
+}
+
+static NEOERR *csc_files (CSC_READER *r, ULIST **files)
+{
+  NEOERR *err;
+  char *fname;
+  UINT32 x;
+
+  err = uListInit(files, r->hdr->files.count + 1, 0);
+  for (x = 0; err == STATUS_OK && x < r->hdr->files.count; x++)
+  {
+    fname = strdup(csc_str(r, r->files[x]));
+    if (fname == NULL)
+    {
+      err = nerr_raise (NERR_NOMEM, "Unable to allocate memory for file list");
+      break;
+    }
+    err = uListAppend(*files, fname);
+    if (err) free(fname);
+  }
+  if (err && *files) uListDestroy(files, ULIST_FREE);
+  return nerr_pass(err);
+}
+
+NEOERR *cs_load_compiled (CSPARSE **parse, const char *path,
+                          CS_TEMPLATE **tmpl)
+{
+  NEOERR *err;
+  CSPARSE *my_parse = *parse;
+  CSC_READER r;
+  CSTREE *tree = NULL;
+  CS_MACRO *macros = NULL;
+  ULIST *depends = NULL;
+  ULIST *files = NULL;
+  int usable = 0, stale = 1;
+
+  *tmpl = NULL;
+  if (my_parse->parent != NULL || my_parse->macros != NULL ||
+      my_parse->tree->next != NULL || my_parse->tree->case_0 != NULL)
+    return nerr_raise (NERR_ASSERT,
+                       "cs_load_compiled needs a CSPARSE with no parse tree");
+
+  memset(&r, 0, sizeof(r));
+  r.parse = my_parse;
+  err = csc_map(path, &(r.map), &(r.len));
+  if (nerr_handle(&err, NERR_NOT_FOUND)) return STATUS_OK;
+  if (err) return nerr_pass(err);
+  if (r.map == NULL) return STATUS_OK;
+
+  r.hdr = (CSC_HEADER *) r.map;
+  if (r.len >= sizeof(CSC_HEADER) && r.hdr->nodes.count <= r.len &&
+      r.hdr->args.count <= r.len)
+  {
+    r.node_refs = (UINT8 *) calloc (r.hdr->nodes.count + 1, 1);
+    r.arg_refs = (UINT8 *) calloc (r.hdr->args.count + 1, 1);
+    if (r.node_refs == NULL || r.arg_refs == NULL)
+      err = nerr_raise (NERR_NOMEM,
+                        "Unable to allocate memory for compiled template");
     else
-      err = neos_auto_init(&(parse->auto_ctx.parser_ctx));
+      usable = csc_check(&r);
+    free(r.node_refs);
+    free(r.arg_refs);
+  }
+  if (err == STATUS_OK && usable) err = csc_stale(&r, &stale);
+  if (err || stale)
+  {
+    csc_unmap(r.map, r.len);
+    return nerr_pass(err);
+  }
 
-    if (err)
-      return nerr_pass(err);
+  err = csc_depends(&r, &depends);
+  if (err == STATUS_OK && r.hdr->auto_log_changes)
+    err = csc_files(&r, &files);
+  if (err == STATUS_OK) err = csc_build(&r, &tree, &macros);
+  if (err)
+  {
+    if (depends) uListDestroyFunc(&depends, dealloc_depend);
+    if (files) uListDestroy(&files, ULIST_FREE);
+    csc_unmap(r.map, r.len);
+    return nerr_pass(err);
   }
 
-  /* Reset the total iterations between calls. */
-  parse->total_loop_iterations = 0;
-  parse->max_loop_iterations =
-      hdf_get_int_value(parse->hdf, "Config.MaxLoopIterations",
-                        DEFAULT_MAX_LOOP_ITERATIONS);
+  /* From here on the parse owns it all */
+  dealloc_node(&(my_parse->tree));
+  my_parse->tree = tree;
+  my_parse->current = tree;
+  my_parse->next = &(tree->next);
+  my_parse->macros = macros;
+  my_parse->compiled_map = r.map;
+  my_parse->compiled_len = r.len;
+  my_parse->tag = csc_str(&r, r.hdr->tag);
+  my_parse->taglen = strlen(my_parse->tag);
+  my_parse->audit_mode = r.hdr->audit_mode;
+  my_parse->bytecode = r.hdr->bytecode;
+  my_parse->bytecode_ready = 0;
+  my_parse->escaping = r.hdr->escaping;
+  my_parse->auto_ctx.global_enabled = r.hdr->auto_global_enabled;
+  my_parse->auto_ctx.enabled = r.hdr->auto_enabled;
+  my_parse->auto_ctx.log_changes = r.hdr->auto_log_changes;
+  my_parse->auto_ctx.propagate_status = r.hdr->auto_propagate_status;
+  if (files)
+  {
+    if (my_parse->file_list) uListDestroy(&(my_parse->file_list), ULIST_FREE);
+    my_parse->file_list = files;
+  }
 
-  return nerr_pass(cs_render_internal(parse, ctx, cb));
+  err = compile_parse(parse, tmpl);
+  if (err)
+  {
+    uListDestroyFunc(&depends, dealloc_depend);
+    return nerr_pass(err);
+  }
+  (*tmpl)->depends = depends;
+  return STATUS_OK;
 }
 
 /* **** Functions ******************************************** */
@@ -4797,7 +8318,9 @@ static NEOERR * _builtin_subcount(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
 
   if (val.op_type & CS_TYPE_VAR)
   {
-    obj = var_lookup_obj (parse, val.s);
+    obj = var_lookup_obj (parse, val.s, val.path);
+    if (parse->reads)
+      record_read(parse, CS_READ_CHILDREN, val.s, val.path);
     if (obj != NULL)
     {
       obj = hdf_obj_child(obj);
@@ -4901,7 +8424,7 @@ static NEOERR * _builtin_name(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSA
 
   if (val.op_type & CS_TYPE_VAR)
   {
-    obj = var_lookup_obj (parse, val.s);
+    obj = var_lookup_obj (parse, val.s, val.path);
     if (obj != NULL)
       result->s = hdf_obj_name(obj);
   }
@@ -5076,18 +8599,15 @@ static NEOERR * _builtin_str_slice (CSPARSE *parse, CS_FUNCTION *csf, CSARG *arg
     free(s);
     return STATUS_OK;
   }
-  slice = (char *) malloc (sizeof(char) * (e-b+1));
+  slice = arg_alloc_string(parse, result, e-b);
   if (slice == NULL) {
     free(s);
     return nerr_raise(NERR_NOMEM, "Unable to allocate memory for string slice");
   }
-  strncpy(slice, s + b, e-b);
+  memcpy(slice, s + b, e-b);
   free(s);
   slice[e-b] = '\0';
 
-  result->s = slice;
-  result->alloc = 1;
-
   return STATUS_OK;
 }
 
@@ -5297,8 +8817,12 @@ static NEOERR *cs_init_internal (CSPARSE **parse, HDF *hdf, CSPARSE *parent)
 
   /* Read configuration value to determine whether to enable audit mode */
   my_parse->audit_mode = hdf_get_int_value(hdf, "Config.EnableAuditMode", 0);
+  my_parse->bytecode = hdf_get_int_value(hdf, "Config.EnableBytecode", 0);
+  my_parse->pin_config = hdf_get_int_value(hdf, "Config.PinConfig", 0);
+  my_parse->profile_mode = hdf_get_int_value(hdf, "Config.EnableProfile", 0);
 
   my_parse->err_list = NULL;
+  ne_arena_init(&(my_parse->render_arena), 0);
 
   if (parent == NULL)
   {
@@ -5339,6 +8863,7 @@ static NEOERR *cs_init_internal (CSPARSE **parse, HDF *hdf, CSPARSE *parent)
     /* Set global_hdf to be null */
     my_parse->global_hdf = NULL;
     my_parse->parent = NULL;
+    my_parse->owner = my_parse;
     my_parse->stack_depth = 0;
 
     my_parse->file_list = NULL;
@@ -5364,13 +8889,22 @@ static NEOERR *cs_init_internal (CSPARSE **parse, HDF *hdf, CSPARSE *parent)
     my_parse->global_hdf = parent->global_hdf;
     my_parse->fileload = parent->fileload;
     my_parse->fileload_ctx = parent->fileload_ctx;
+    my_parse->fragment_ctx = parent->fragment_ctx;
+    my_parse->fragment_get = parent->fragment_get;
+    my_parse->fragment_put = parent->fragment_put;
     /* This should be safe since locals handling is done entirely local to the
      * eval functions, not globally by the parse handling.  This should
      * pass the locals down to the new parse context to make locals work with
      * lvar */
     my_parse->locals = parent->locals;
     my_parse->parent = parent;
+    my_parse->owner = parent->owner;
     my_parse->stack_depth = parent->stack_depth;
+    my_parse->render_serial = parent->render_serial;
+    my_parse->arena = parent->arena;
+    my_parse->escape_buf = parent->escape_buf;
+    my_parse->profile = parent->profile;
+    my_parse->reads = parent->reads;
 
     my_parse->file_list = parent->file_list;
     my_parse->cur_file_idx = parent->cur_file_idx;
@@ -5399,6 +8933,17 @@ void cs_register_fileload(CSPARSE *parse, void *ctx, CSFILELOAD fileload) {
   }
 }
 
+void cs_register_fragments(CSPARSE *parse, void *ctx, CSFRAGGET get,
+                           CSFRAGPUT put)
+{
+  if (parse != NULL)
+  {
+    parse->fragment_ctx = ctx;
+    parse->fragment_get = get;
+    parse->fragment_put = put;
+  }
+}
+
 void cs_destroy (CSPARSE **parse)
 {
   CSPARSE *my_parse = *parse;
@@ -5412,6 +8957,20 @@ void cs_destroy (CSPARSE **parse)
   dealloc_macro(&my_parse->macros);
   dealloc_node(&(my_parse->tree));
   if (my_parse->parent == NULL) {
+    if (my_parse->lincludes)
+    {
+      CS_LINCLUDE *memo;
+      void *key = NULL;
+
+      /* The memoized lincludes reference our functions, so they go first */
+      while ((memo = ne_hash_next(my_parse->lincludes, &key)) != NULL)
+      {
+        ne_hash_remove(my_parse->lincludes, key);
+        dealloc_linclude(&memo);
+        key = NULL;
+      }
+      ne_hash_destroy(&(my_parse->lincludes));
+    }
     dealloc_function(&(my_parse->functions));
 
     if (my_parse->auto_ctx.log_changes)
@@ -5433,6 +8992,10 @@ void cs_destroy (CSPARSE **parse)
     }
   }
 
+  if (my_parse->compiled_map)
+    csc_unmap(my_parse->compiled_map, my_parse->compiled_len);
+  ne_arena_destroy(&(my_parse->render_arena));
+
   free(my_parse);
   *parse = NULL;
 }
@@ -5525,6 +9088,7 @@ static NEOERR *dump_node (CSPARSE *parse, CSTREE *node, int depth, void *ctx,
 
 NEOERR *cs_dump (CSPARSE *parse, void *ctx, CSOUTFUNC cb)
 {
+  NEOERR *err;
   CSTREE *node;
   char buf[4096];
 
@@ -5532,5 +9096,12 @@ NEOERR *cs_dump (CSPARSE *parse, void *ctx, CSOUTFUNC cb)
     return nerr_raise (NERR_ASSERT, "No parse tree exists");
 
   node = parse->tree;
-  return nerr_pass (dump_node (parse, node, 0, ctx, cb, buf, sizeof(buf)));
+  err = dump_node (parse, node, 0, ctx, cb, buf, sizeof(buf));
+  if (err) return nerr_pass(err);
+
+  snprintf (buf, sizeof(buf), "optimized: %d expressions folded, "
+            "%d Config variables pinned, %d dead branches removed, "
+            "%d literals merged\n", parse->opt_folded, parse->opt_pinned,
+            parse->opt_branches, parse->opt_literals);
+  return nerr_pass (cb (ctx, buf));
 }
@@ -0,0 +1,355 @@
+/*
+ * Copyright 2001-2004 Brandon Long
+ * All Rights Reserved.
+ *
+ * ClearSilver Templating System
+ *
+ * This code is made available under the terms of the ClearSilver License.
+ * http://www.clearsilver.net/license.hdf
+ *
+ */
+
+/*
+ * Read-sets, the record of what HDF a render read.
+ *
+ * A render's output only depends on the template and the values it
+ * reads, so two renders which read the same values give the same page.
+ * The renderer calls cs_readset_add for every variable it looks up, and
+ * this file keeps the distinct names in the order they were first read,
+ * each with a hash of what the HDF held there.  Hashing the list gives a
+ * digest which identifies the page, and hashing the list again against
+ * another HDF tells whether rendering with it would give the same page,
+ * without rendering it.
+ */
+
+#include "cs_config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "util/neo_misc.h"
+#include "util/neo_err.h"
+#include "util/neo_hash.h"
+#include "util/neo_str.h"
+#include "util/ulist.h"
+#include "cs.h"
+
+typedef struct _cs_read
+{
+  CS_READ_KIND kind;
+  int anchored;         /* path is a full HDF name */
+  UINT32 sig[2];        /* hash of what the HDF held there */
+  char path[1];
+} CS_READ;
+
+struct _cs_readset
+{
+  NE_HASH *seen;        /* anchored CS_READs, so each is only kept once */
+  ULIST *reads;         /* CS_READs in the order they were first made */
+  int partial;          /* some reads aren't anchored, so can't be replayed */
+  int broken;           /* a read couldn't be recorded */
+};
+
+/* Two 32 bit hashes side by side, FNV-1a and the one python uses for
+ * strings, so the digest has 64 bits */
+#define SIG_INIT(h) ((h)[0] = 2166136261U, (h)[1] = 0x345678)
+
+static void sig_bytes (UINT32 *h, const void *buf, size_t len)
+{
+  const unsigned char *p = (const unsigned char *) buf;
+
+  while (len--)
+  {
+    h[0] = (h[0] ^ *p) * 16777619U;
+    h[1] = (h[1] * 1000003U) ^ *p;
+    p++;
+  }
+}
+
+/* Strings are hashed with their NUL, so NULL (a lone 0xff) differs from "" */
+static void sig_str (UINT32 *h, const char *s)
+{
+  static const unsigned char none = 0xff;
+
+  if (s == NULL)
+    sig_bytes(h, &none, 1);
+  else
+    sig_bytes(h, s, strlen(s) + 1);
+}
+
+static void sig_node (UINT32 *h, CS_READ_KIND kind, HDF *obj)
+{
+  HDF_ATTR *attr;
+  HDF *child;
+
+  if (obj == NULL)
+  {
+    sig_bytes(h, "n", 1);
+    return;
+  }
+  sig_bytes(h, "y", 1);
+  if (kind == CS_READ_CHILDREN)
+  {
+    for (child = hdf_obj_child(obj); child; child = hdf_obj_next(child))
+      sig_str(h, hdf_obj_name(child));
+    sig_str(h, NULL);
+    return;
+  }
+  /* The value, and the name and attributes for name() and the escape
+   * status */
+  sig_str(h, hdf_obj_value(obj));
+  sig_str(h, hdf_obj_name(obj));
+  for (attr = hdf_obj_attr(obj); attr; attr = attr->next)
+  {
+    sig_str(h, attr->key);
+    sig_str(h, attr->value);
+  }
+  sig_str(h, NULL);
+}
+
+/* What a render against hdf and global_hdf would see at path.  Lookups
+ * fall back to the global HDF in slightly different ways, so both are
+ * included. */
+static void sig_path (UINT32 *sig, CS_READ_KIND kind, const char *path,
+                      HDF *hdf, HDF *global_hdf)
+{
+  SIG_INIT(sig);
+  sig_node(sig, kind, hdf ? hdf_get_obj(hdf, path) : NULL);
+  if (global_hdf != NULL)
+    sig_node(sig, kind, hdf_get_obj(global_hdf, path));
+}
+
+static UINT32 read_hash (const void *a)
+{
+  const CS_READ *r = (const CS_READ *) a;
+
+  return python_string_hash(r->path) ^ (UINT32) r->kind;
+}
+
+static int read_comp (const void *a, const void *b)
+{
+  const CS_READ *ra = (const CS_READ *) a;
+  const CS_READ *rb = (const CS_READ *) b;
+
+  return (ra->kind == rb->kind && !strcmp(ra->path, rb->path));
+}
+
+NEOERR *cs_readset_init (CS_READSET **reads)
+{
+  NEOERR *err;
+  CS_READSET *my_reads;
+
+  my_reads = (CS_READSET *) calloc (1, sizeof (CS_READSET));
+  if (my_reads == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for CS_READSET");
+
+  err = ne_hash_init(&(my_reads->seen), read_hash, read_comp);
+  if (err == STATUS_OK)
+    err = uListInit(&(my_reads->reads), 64, 0);
+  if (err)
+  {
+    cs_readset_destroy(&my_reads);
+    return nerr_pass(err);
+  }
+  *reads = my_reads;
+  return STATUS_OK;
+}
+
+void cs_readset_destroy (CS_READSET **reads)
+{
+  CS_READSET *my_reads = *reads;
+
+  if (my_reads == NULL) return;
+  ne_hash_destroy(&(my_reads->seen));
+  if (my_reads->reads)
+    uListDestroy(&(my_reads->reads), ULIST_FREE);
+  free(my_reads);
+  *reads = NULL;
+}
+
+void cs_readset_clear (CS_READSET *reads)
+{
+  CS_READ *r;
+
+  while (uListLength(reads->reads))
+  {
+    uListPop(reads->reads, (void **)&r);
+    if (r->anchored)
+      ne_hash_remove(reads->seen, r);
+    free(r);
+  }
+  reads->partial = 0;
+  reads->broken = 0;
+}
+
+static CS_READ *read_new (CS_READSET *reads, CS_READ_KIND kind,
+                          const char *path, int anchored)
+{
+  CS_READ *r;
+  size_t len = strlen(path);
+
+  r = (CS_READ *) malloc (sizeof(CS_READ) + len);
+  if (r == NULL)
+  {
+    reads->broken = 1;
+    return NULL;
+  }
+  r->kind = kind;
+  r->anchored = anchored;
+  memcpy(r->path, path, len + 1);
+  return r;
+}
+
+static void read_append (CS_READSET *reads, CS_READ *r)
+{
+  NEOERR *err;
+  void *last;
+
+  err = uListAppend(reads->reads, r);
+  if (err == STATUS_OK && r->anchored)
+  {
+    err = ne_hash_insert(reads->seen, r, r);
+    if (err) uListPop(reads->reads, &last);
+  }
+  if (err)
+  {
+    nerr_ignore(&err);
+    free(r);
+    reads->broken = 1;
+    return;
+  }
+  if (!r->anchored)
+    reads->partial = 1;
+}
+
+void cs_readset_add (CS_READSET *reads, CS_READ_KIND kind, const char *path,
+                     HDF *hdf, HDF *global_hdf)
+{
+  CS_READ *r;
+
+  r = read_new(reads, kind, path, 1);
+  if (r == NULL) return;
+  if (ne_hash_lookup(reads->seen, r) != NULL)
+  {
+    free(r);
+    return;
+  }
+  sig_path(r->sig, kind, path, hdf, global_hdf);
+  read_append(reads, r);
+}
+
+void cs_readset_add_node (CS_READSET *reads, CS_READ_KIND kind,
+                          const char *name, HDF *obj)
+{
+  CS_READ *r;
+
+  r = read_new(reads, kind, name, 0);
+  if (r == NULL) return;
+  SIG_INIT(r->sig);
+  sig_node(r->sig, kind, obj);
+  read_append(reads, r);
+}
+
+void cs_readset_add_fragment (CS_READSET *reads, const char *key,
+                              CS_FRAGMENT *frag)
+{
+  CS_READ *r;
+
+  r = read_new(reads, CS_READ_FRAGMENT, key, 0);
+  if (r == NULL) return;
+  SIG_INIT(r->sig);
+  sig_bytes(r->sig, frag->buf, frag->len);
+  read_append(reads, r);
+}
+
+/* Hash the list of reads, with sigs in place of the recorded ones if
+ * given */
+static void readset_digest (CS_READSET *reads, UINT32 *sigs, char *digest)
+{
+  UINT32 h[2], *sig;
+  unsigned char buf[9];
+  CS_READ *r;
+  int x, y;
+
+  SIG_INIT(h);
+  for (x = 0; x < uListLength(reads->reads); x++)
+  {
+    uListGet(reads->reads, x, (void **)&r);
+    sig = sigs ? sigs + 2 * x : r->sig;
+    /* Byte by byte, so the digest doesn't depend on the byte order */
+    buf[0] = (unsigned char) r->kind;
+    for (y = 0; y < 4; y++)
+    {
+      buf[1 + y] = (sig[0] >> (8 * y)) & 0xff;
+      buf[5 + y] = (sig[1] >> (8 * y)) & 0xff;
+    }
+    sig_str(h, r->path);
+    sig_bytes(h, buf, sizeof(buf));
+  }
+  /* Finish with the murmur3 mixer, so every bit of the digest depends on
+   * the whole input */
+  for (x = 0; x < 2; x++)
+  {
+    h[x] ^= h[x] >> 16;
+    h[x] *= 0x85ebca6bU;
+    h[x] ^= h[x] >> 13;
+    h[x] *= 0xc2b2ae35U;
+    h[x] ^= h[x] >> 16;
+  }
+  snprintf(digest, CS_DIGEST_LEN, "%08x%08x", h[0], h[1]);
+}
+
+int cs_readset_digest (CS_READSET *reads, char *digest)
+{
+  digest[0] = '\0';
+  if (reads->broken) return 0;
+  readset_digest(reads, NULL, digest);
+  return 1;
+}
+
+int cs_readset_replay (CS_READSET *reads, HDF *hdf, HDF *global_hdf,
+                       char *digest)
+{
+  UINT32 *sigs;
+  CS_READ *r;
+  int x, len;
+
+  digest[0] = '\0';
+  if (reads->broken || reads->partial) return 0;
+  len = uListLength(reads->reads);
+  sigs = (UINT32 *) malloc (2 * sizeof(UINT32) * (len ? len : 1));
+  if (sigs == NULL) return 0;
+  for (x = 0; x < len; x++)
+  {
+    uListGet(reads->reads, x, (void **)&r);
+    sig_path(sigs + 2 * x, r->kind, r->path, hdf, global_hdf);
+  }
+  readset_digest(reads, sigs, digest);
+  free(sigs);
+  return 1;
+}
+
+NEOERR *cs_readset_dump (CS_READSET *reads, void *ctx, CSOUTFUNC cb)
+{
+  NEOERR *err;
+  CS_READ *r;
+  char *line;
+  int x;
+
+  for (x = 0; x < uListLength(reads->reads); x++)
+  {
+    uListGet(reads->reads, x, (void **)&r);
+    line = sprintf_alloc("%s %s%s\n",
+                         r->kind == CS_READ_VALUE ? "value" :
+                         r->kind == CS_READ_CHILDREN ? "children" :
+                         "fragment", r->path,
+                         r->anchored ? "" : " (not anchored)");
+    if (line == NULL)
+      return nerr_raise (NERR_NOMEM, "Unable to allocate memory for dump");
+    err = cb(ctx, line);
+    free(line);
+    if (err) return nerr_pass(err);
+  }
+  return STATUS_OK;
+}
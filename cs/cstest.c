@@ -12,10 +12,12 @@
 #include "cs_config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include "util/neo_misc.h"
 #include "util/neo_hdf.h"
+#include "util/neo_str.h"
 #include "cs.h"
 
 static NEOERR *output (void *ctx, char *s)
@@ -24,6 +26,12 @@ static NEOERR *output (void *ctx, char *s)
   return STATUS_OK;
 }
 
+static NEOERR *write_output (void *ctx, const char *s, size_t len)
+{
+  fwrite (s, 1, len, stdout);
+  return STATUS_OK;
+}
+
 NEOERR *test_strfunc(const char *str, char **ret)
 {
   char *s = strdup(str);
@@ -40,12 +48,183 @@ NEOERR *test_strfunc(const char *str, char **ret)
   return STATUS_OK;
 }
 
+/* The store for cache: blocks, shared by every parse in the test */
+static CS_FRAGCACHE *Fragments = NULL;
+
+static NEOERR *init_parse(void *ctx, CSPARSE *parse)
+{
+  parse->global_hdf = (HDF *) ctx;
+  cs_register_fragcache(parse, Fragments);
+
+  /* register a test strfunc */
+  return nerr_pass(cs_register_strfunc(parse, "test_strfunc", test_strfunc));
+}
+
+/* Compile the template through a CS_CACHE, and then get it from the cache
+ * again, so the render uses a cached template. */
+static NEOERR *cache_compile(CS_CACHE *cache, HDF *hdf, HDF *global_hdf,
+                             char *cs_file, CS_TEMPLATE **tmpl)
+{
+  NEOERR *err;
+  CS_CACHE_STATS stats;
+
+  err = cs_cache_get(cache, hdf, cs_file, NULL, init_parse, global_hdf, tmpl);
+  if (err != STATUS_OK) return nerr_pass(err);
+  cs_template_destroy(tmpl);
+
+  err = cs_cache_get(cache, hdf, cs_file, NULL, init_parse, global_hdf, tmpl);
+  if (err != STATUS_OK) return nerr_pass(err);
+
+  cs_cache_stats(cache, &stats);
+  if (stats.hits != 1 && stats.uncacheable != 2)
+    return nerr_raise(NERR_ASSERT,
+        "Unexpected cache stats: %ld hits %ld misses %ld uncacheable",
+        stats.hits, stats.misses, stats.uncacheable);
+  return STATUS_OK;
+}
+
+/* Save the cached template with cs_compile_to_file, and load it back, so
+ * the render uses a template loaded with cs_load_compiled.  Templates
+ * which can't be saved are rendered from the cache. */
+static NEOERR *compiled_reload(HDF *hdf, HDF *global_hdf, char *path,
+                               CS_TEMPLATE **tmpl)
+{
+  NEOERR *err;
+  CSPARSE *parse = NULL;
+
+  if ((*tmpl)->parse->hdf_parse_reads) return STATUS_OK;
+
+  err = cs_compile_to_file(*tmpl, hdf, path);
+  if (err != STATUS_OK) return nerr_pass(err);
+  cs_template_destroy(tmpl);
+
+  err = cs_init(&parse, hdf);
+  if (err != STATUS_OK) return nerr_pass(err);
+  err = init_parse(global_hdf, parse);
+  if (err == STATUS_OK)
+    err = cs_load_compiled(&parse, path, tmpl);
+  if (err == STATUS_OK && *tmpl == NULL)
+    err = nerr_raise(NERR_ASSERT, "Compiled template %s wasn't loaded", path);
+  cs_destroy(&parse);
+  return nerr_pass(err);
+}
+
+static NEOERR *batch_output (void *ctx, int item, const char *s, size_t len)
+{
+  STRING *outputs = (STRING *) ctx;
+
+  return nerr_pass(string_appendn(&outputs[item], s, len));
+}
+
+/* Render the template with cs_render_batch against n copies of hdf, each
+ * with its number in Batch.Item, and print the outputs in order */
+static NEOERR *batch_render(CS_TEMPLATE *tmpl, HDF *hdf, int n)
+{
+  NEOERR *err = STATUS_OK;
+  HDF **datasets;
+  STRING *outputs;
+  int x;
+
+  datasets = (HDF **) calloc (n, sizeof(HDF *));
+  outputs = (STRING *) calloc (n, sizeof(STRING));
+  if (datasets == NULL || outputs == NULL)
+  {
+    free(datasets);
+    free(outputs);
+    return nerr_raise(NERR_NOMEM, "Unable to allocate memory for batch");
+  }
+  for (x = 0; err == STATUS_OK && x < n; x++)
+  {
+    string_init(&outputs[x]);
+    err = hdf_init(&datasets[x]);
+    if (err == STATUS_OK)
+      err = hdf_copy(datasets[x], "", hdf);
+    if (err == STATUS_OK)
+      err = hdf_set_int_value(datasets[x], "Batch.Item", x);
+  }
+  if (err == STATUS_OK)
+    err = cs_render_batch(tmpl, datasets, n, outputs, batch_output, 3);
+  for (x = 0; x < n; x++)
+  {
+    if (err == STATUS_OK)
+      printf ("== item %d\n%s", x, outputs[x].buf ? outputs[x].buf : "");
+    string_clear(&outputs[x]);
+    hdf_destroy(&datasets[x]);
+  }
+  free(datasets);
+  free(outputs);
+  return nerr_pass(err);
+}
+
 void usage(char *argv0)
 {
-  ne_warn("Usage: %s [-v] [-parse_must_fail] [-global_hdf <file.hdf>] "
+  ne_warn("Usage: %s [-v] [-stats] [-profile] [-reads] [-parse_must_fail] "
+          "[-cache] "
+          "[-bytecode] [-batch <count>] "
+          "[-compiled <file.csc>] [-global_hdf <file.hdf>] "
           "<file.hdf> <file.cs>", argv0);
 }
 
+/* Print the parts of CS.Profile which don't depend on timing */
+void dump_profile(HDF *hdf)
+{
+  HDF *obj;
+
+  printf ("\n-----------------------\nPROFILE\n");
+  for (obj = hdf_get_child(hdf, "CS.Profile.Nodes"); obj;
+       obj = hdf_obj_next(obj))
+  {
+    printf ("%s:%d %s count=%d bytes=%d lookups=%d\n",
+            hdf_get_value(obj, "File", ""), hdf_get_int_value(obj, "Line", 0),
+            hdf_get_value(obj, "Command", ""),
+            hdf_get_int_value(obj, "Count", 0),
+            hdf_get_int_value(obj, "Bytes", 0),
+            hdf_get_int_value(obj, "Lookups", 0));
+  }
+  for (obj = hdf_get_child(hdf, "CS.Profile.Macros"); obj;
+       obj = hdf_obj_next(obj))
+  {
+    printf ("macro %s count=%d\n", hdf_get_value(obj, "Name", ""),
+            hdf_get_int_value(obj, "Count", 0));
+  }
+}
+
+/* Print what the render read, and check replaying the reads gives the
+ * same digest, and a different one for an empty HDF */
+void dump_reads(CS_READSET *reads, HDF *hdf, HDF *global_hdf)
+{
+  NEOERR *err;
+  HDF *empty;
+  char digest[CS_DIGEST_LEN], replay[CS_DIGEST_LEN];
+
+  printf ("\n-----------------------\nREADS\n");
+  err = cs_readset_dump(reads, NULL, output);
+  if (err == STATUS_OK)
+    err = hdf_init(&empty);
+  if (err != STATUS_OK)
+  {
+    nerr_warn_error(err);
+    return;
+  }
+  if (!cs_readset_digest(reads, digest))
+  {
+    printf ("digest failed\n");
+  }
+  else if (!cs_readset_replay(reads, hdf, global_hdf, replay))
+  {
+    printf ("digest %s, can't be replayed\n", digest);
+  }
+  else
+  {
+    printf ("digest %s, replay %s", digest,
+            strcmp(digest, replay) ? "differs" : "matches");
+    cs_readset_replay(reads, empty, NULL, replay);
+    printf (", empty HDF %s\n",
+            strcmp(digest, replay) ? "differs" : "matches");
+  }
+  hdf_destroy(&empty);
+}
+
 int hdf_init_load_file_or_err(HDF **hdf, char *filename)
 {
   NEOERR *err;
@@ -147,11 +326,19 @@ int hdf_compare(HDF *hdf_a, HDF *hdf_b)
 int main (int argc, char *argv[])
 {
   NEOERR *err;
-  CSPARSE *parse;
+  CSPARSE *parse = NULL;
+  CS_TEMPLATE *tmpl = NULL;
   HDF *global_hdf = NULL;
   HDF *hdf;
   int verbose = 0;
+  int stats = 0;
+  int profile = 0;
   int parse_must_fail = 0;
+  CS_READSET *reads = NULL;
+  int bytecode = 0;
+  int batch = 0;
+  CS_CACHE *cache = NULL;
+  char *compiled_file = NULL;
   char *global_hdf_file = NULL;
   char *hdf_file, *cs_file;
   int arg_position = 1;
@@ -161,10 +348,61 @@ int main (int argc, char *argv[])
     {
       verbose = 1;
     }
+    else if (!strcmp(argv[arg_position], "-stats"))
+    {
+      stats = 1;
+    }
+    else if (!strcmp(argv[arg_position], "-profile"))
+    {
+      profile = 1;
+    }
+    else if (!strcmp(argv[arg_position], "-reads"))
+    {
+      if (reads == NULL)
+      {
+        err = cs_readset_init(&reads);
+        if (err != STATUS_OK)
+        {
+          nerr_warn_error(err);
+          return -1;
+        }
+      }
+    }
     else if (!strcmp(argv[arg_position], "-parse_must_fail"))
     {
       parse_must_fail = 1;
     }
+    else if (!strcmp(argv[arg_position], "-cache") ||
+             !strcmp(argv[arg_position], "-compiled") ||
+             !strcmp(argv[arg_position], "-batch"))
+    {
+      /* Batches render a compiled template, so they use the cache too */
+      if (!strcmp(argv[arg_position], "-compiled") ||
+          !strcmp(argv[arg_position], "-batch"))
+      {
+        if (++arg_position >= argc) {
+          usage(argv[0]);
+          return -1;
+        }
+        if (!strcmp(argv[arg_position - 1], "-batch"))
+          batch = atoi(argv[arg_position]);
+        else
+          compiled_file = argv[arg_position];
+      }
+      if (cache == NULL)
+      {
+        err = cs_cache_init(&cache, 0);
+        if (err != STATUS_OK)
+        {
+          nerr_warn_error(err);
+          return -1;
+        }
+      }
+    }
+    else if (!strcmp(argv[arg_position], "-bytecode"))
+    {
+      bytecode = 1;
+    }
     else if (!strcmp(argv[arg_position], "-global_hdf"))
     {
       if (++arg_position >= argc) {
@@ -192,6 +430,24 @@ int main (int argc, char *argv[])
   {
     return -1;
   }
+  if (bytecode)
+  {
+    err = hdf_set_value(hdf, "Config.EnableBytecode", "1");
+    if (err != STATUS_OK)
+    {
+      nerr_warn_error(err);
+      return -1;
+    }
+  }
+  if (profile)
+  {
+    err = hdf_set_value(hdf, "Config.EnableProfile", "1");
+    if (err != STATUS_OK)
+    {
+      nerr_warn_error(err);
+      return -1;
+    }
+  }
 
   if (global_hdf_file)
   {
@@ -201,24 +457,38 @@ int main (int argc, char *argv[])
     }
   }
 
-  printf ("Parsing %s\n", cs_file);
-  err = cs_init (&parse, hdf);
+  err = cs_fragcache_init(&Fragments, 0);
   if (err != STATUS_OK)
   {
     nerr_warn_error(err);
     return -1;
   }
-  parse->global_hdf = global_hdf;
 
-  /* register a test strfunc */
-  err = cs_register_strfunc(parse, "test_strfunc", test_strfunc);
-  if (err != STATUS_OK)
+  printf ("Parsing %s\n", cs_file);
+  if (cache)
   {
-    nerr_warn_error(err);
-    return -1;
+    err = cache_compile (cache, hdf, global_hdf, cs_file, &tmpl);
+    if (err == STATUS_OK && compiled_file)
+      err = compiled_reload (hdf, global_hdf, compiled_file, &tmpl);
   }
+  else
+  {
+    err = cs_init (&parse, hdf);
+    if (err != STATUS_OK)
+    {
+      nerr_warn_error(err);
+      return -1;
+    }
 
-  err = cs_parse_file (parse, cs_file);
+    err = init_parse(global_hdf, parse);
+    if (err != STATUS_OK)
+    {
+      nerr_warn_error(err);
+      return -1;
+    }
+
+    err = cs_parse_file (parse, cs_file);
+  }
   if (err != STATUS_OK)
   {
     if ( !parse_must_fail)
@@ -233,7 +503,23 @@ int main (int argc, char *argv[])
     }
   }
 
-  err = cs_render(parse, NULL, output);
+  if (tmpl && batch)
+  {
+    err = batch_render(tmpl, hdf, batch);
+  }
+  else if (tmpl && reads)
+  {
+    err = cs_render_ctx_reads(tmpl, hdf, reads, NULL, write_output);
+  }
+  else if (tmpl)
+  {
+    err = cs_render_ctx_write(tmpl, hdf, NULL, write_output);
+  }
+  else
+  {
+    cs_track_reads(parse, reads);
+    err = cs_render(parse, NULL, output);
+  }
   if (err != STATUS_OK)
   {
     if ( !parse_must_fail)
@@ -248,13 +534,40 @@ int main (int argc, char *argv[])
     }
   }
 
+  if (stats)
+  {
+    CS_RENDER_STATS rs;
+    CS_FRAGCACHE_STATS fs;
+
+    if (tmpl)
+      cs_template_render_stats(tmpl, &rs);
+    else
+      cs_render_stats(parse, &rs);
+    fprintf(stderr, "Render arena: %lu allocations, %lu bytes peak, "
+            "%lu bytes reserved\n", (unsigned long) rs.allocs,
+            (unsigned long) rs.peak, (unsigned long) rs.reserved);
+    cs_fragcache_stats(Fragments, &fs);
+    fprintf(stderr, "Fragments: %ld hits, %ld misses, %d entries, "
+            "%lu bytes\n", fs.hits, fs.misses, fs.entries,
+            (unsigned long) fs.bytes);
+  }
+
+  if (profile)
+    dump_profile(hdf);
+  if (reads)
+    dump_reads(reads, hdf, global_hdf);
+
   if (verbose)
   {
     printf ("\n-----------------------\nCS DUMP\n");
-    err = cs_dump(parse, NULL, output);
+    err = cs_dump(tmpl ? tmpl->parse : parse, NULL, output);
   }
 
   cs_destroy (&parse);
+  cs_template_destroy (&tmpl);
+  cs_cache_destroy (&cache);
+  cs_fragcache_destroy (&Fragments);
+  cs_readset_destroy (&reads);
 
   if (verbose)
   {
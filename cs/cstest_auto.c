@@ -1031,6 +1031,54 @@ NEOERR *test_propagate_escape_status()
   return nerr_pass(err);
 }
 
+/*
+ * A fragment replayed by cache: has to leave the auto escaper in the same
+ * state as rendering it did, here inside an href, where One is rejected
+ * as a URL.  Fragments are only used from plain HTML text, so the block
+ * inside the last href isn't cached at all.
+ */
+NEOERR *test_fragment_cache()
+{
+  HDF *hdf = NULL;
+  CSPARSE *parse = NULL;
+  CS_FRAGCACHE *cache = NULL;
+  CS_FRAGCACHE_STATS stats;
+  NEOERR *err;
+  char *expect = "<b>&lt;x&gt;</b><a href=\"#\">x</a><p>"
+                 "<b>&lt;x&gt;</b><a href=\"#\">y</a><p>"
+                 "<a href=\"#\">z</a>";
+
+  err = init_template(&hdf, &parse, "One=javascript:alert(1)\nTwo=<x>");
+  if (err) return nerr_pass(err);
+  err = cs_fragcache_init(&cache, 0);
+  if (err) return nerr_pass(err);
+  cs_register_fragcache(parse, cache);
+
+  err = parse_template(hdf, parse,
+      "<?cs cache:\"f\" ?><b><?cs var:Two ?></b><a href=\"<?cs /cache ?>"
+      "<?cs var:One ?>\">x</a><p>"
+      "<?cs cache:\"f\" ?>unused<?cs /cache ?><?cs var:One ?>\">y</a><p>"
+      "<a href=\"<?cs cache:\"g\" ?><?cs var:One ?><?cs /cache ?>\">z</a>",
+      1);
+  if (err) return nerr_pass(err);
+
+  err = render_template_check(hdf, parse, expect);
+  if (err) return nerr_pass(err);
+  err = render_template_check(hdf, parse, expect);
+  if (err) return nerr_pass(err);
+
+  cs_fragcache_stats(cache, &stats);
+  if (stats.hits != 3 || stats.misses != 1 || stats.entries != 1)
+    return nerr_raise(NERR_ASSERT,
+        "Unexpected fragment cache stats: %ld hits %ld misses %d entries",
+        stats.hits, stats.misses, stats.entries);
+
+  cs_destroy(&parse);
+  hdf_destroy(&hdf);
+  cs_fragcache_destroy(&cache);
+  return STATUS_OK;
+}
+
 NEOERR *run_extra_tests()
 {
   NEOERR* err;
@@ -1051,6 +1099,9 @@ NEOERR *run_extra_tests()
   if (err) return nerr_pass(err);
 
   err = test_propagate_escape_status();
+  if (err) return nerr_pass(err);
+
+  err = test_fragment_cache();
   return nerr_pass(err);
 }
 
@@ -0,0 +1,17 @@
+Strings built up with set:x = x + ..., which append in place
+<?cs set:Names = "" ?><?cs each:day = Days ?><?cs set:Names = Names + day.Abbr + "," ?><?cs /each ?>
+Names: <?cs var:Names ?>
+<?cs set:Twice = "ab" ?><?cs loop:x = #1, #3 ?><?cs set:Twice = Twice + Twice ?><?cs /loop ?>
+Twice: <?cs var:Twice ?>
+<?cs set:Count = "1" ?><?cs set:Count = Count + 1 ?><?cs set:Count = Count + "1" ?>
+Count: <?cs var:Count ?>
+<?cs set:Count = Count + #1 + "x" ?>
+Count: <?cs var:Count ?>
+<?cs set:Unset = Unset + "a" ?><?cs set:Unset = Unset + Missing ?>
+Unset: <?cs var:Unset ?>
+Link: <?cs set:My.Test = My.Test + "!" ?><?cs var:My.Test ?> <?cs var:Days.0.Abbr ?>
+<?cs def:build(s) ?><?cs loop:x = #1, #5 ?><?cs set:s = s + x ?><?cs /loop ?><?cs var:s ?><?cs /def ?>
+Local: <?cs call:build("n") ?>
+<?cs def:build_num(s) ?><?cs loop:x = #1, #3 ?><?cs set:s = s + "-" ?><?cs /loop ?><?cs var:s ?><?cs /def ?>
+Local number: <?cs call:build_num(#7) ?>
+<?cs loop:x = #1, #3 ?><?cs set:x = x + "a" ?><?cs var:x ?> <?cs /loop ?>
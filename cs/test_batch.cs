@@ -0,0 +1,4 @@
+Rendering a batch, item <?cs var:Batch.Item ?>
+<?cs if:Batch.Item % 2 ?>odd<?cs else ?>even<?cs /if ?>: <?cs each:d = Days ?><?cs if:name(d) == Batch.Item ?><?cs var:d.Abbr ?><?cs /if ?><?cs /each ?>
+<?cs lvar:csvar ?>
+<?cs set:Batch.Set = Batch.Item * 10 ?><?cs var:Batch.Set ?>
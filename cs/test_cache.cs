@@ -0,0 +1,13 @@
+Fragment cache
+<?cs set:Count = 0 ?>
+<?cs each:item = Days ?>
+<?cs cache:"header" ?><?cs set:Count = Count + #1 ?>header rendered <?cs var:Count ?> time(s)<?cs /cache ?>
+<?cs cache:"day." + item.Abbr 60 ?><?cs var:item.Abbr ?> is <?cs name:item ?><?cs /cache ?>
+<?cs /each ?>
+Count is <?cs var:Count ?>
+<?cs cache:Days.0.Abbr ?>keyed by a variable<?cs /cache ?>
+<?cs cache:Days.0.Abbr ?>not rendered<?cs /cache ?>
+<?cs cache:(#1 + #2) ?>keyed by a number<?cs /cache ?>
+<?cs cache:"3" ?>not rendered either<?cs /cache ?>
+<?cs cache:Missing.Var ?>no key, not cached<?cs /cache ?>
+<?cs cache:Missing.Var ?>no key, rendered again<?cs /cache ?>
@@ -0,0 +1,8 @@
+Constant expressions and branches, evaluated while parsing:
+<?cs var:"a" + "b" ?> <?cs var:1 + 2 * 3 ?> <?cs var:"12" + 1 ?> <?cs var:"12" + "1" ?> <?cs var:!0 ?> <?cs var:(4 - 1) * -2 ?> <?cs var:"x" == "x" ?>
+<?cs var:1 + My.Test ?> <?cs var:"pre" + My.Test2.Abbr ?> <?cs var:string.length("ab" + "cd") ?>
+<?cs if:1 == 1 ?>true<?cs else ?>false<?cs /if ?> <?cs if:0 ?>zero<?cs elif:"" ?>empty<?cs elif:2 > 1 ?>elif<?cs else ?>else<?cs /if ?>
+<?cs if:0 ?>never<?cs elif:My.Test ?>var <?cs var:My.Test ?><?cs else ?>else<?cs /if ?>
+<?cs if:0 ?><?cs def:inside(v) ?>macro <?cs var:v ?><?cs /def ?><?cs /if ?><?cs call:inside("kept") ?>
+<?cs if:1 ?><?cs each:o = Outside ?><?cs name:o ?><?cs /each ?><?cs /if ?>
+text <?cs # a comment ?>around <?cs # another ?>comments
@@ -0,0 +1,8 @@
+Each pass renders the same lincluded file, which is only parsed once:
+<?cs each:x = Foo.Bar.Baz ?><?cs linclude:"test_lincluded_each.cs" ?>
+<?cs /each ?>
+The same file under another escape mode is a different parse:
+<?cs escape:"html" ?><?cs each:x = Foo.Bar.Baz ?><?cs linclude:"test_lincluded_each.cs" ?>
+<?cs /each ?><?cs /escape ?>
+And again outside the loop:
+<?cs linclude:"test_lincluded_each.cs" ?>
@@ -0,0 +1 @@
+<?cs if:?x ?><?cs name:x ?> = <?cs var:x ?> <?cs /if ?><?cs var:Title ?>
@@ -0,0 +1,12 @@
+<?cs set:Config.RenderThreads = 4 ?>
+each_parallel matches each
+<?cs def:day(d, n) ?><?cs name:d ?>=<?cs var:d.Abbr ?>/<?cs var:n ?><?cs /def ?>
+<?cs each_parallel:d = Days ?><?cs if:first(d) ?>[<?cs /if ?><?cs call:day(d, #7) ?><?cs if:last(d) ?>]<?cs else ?>, <?cs /if ?><?cs /each ?>
+<?cs each:d = Days ?><?cs if:first(d) ?>[<?cs /if ?><?cs call:day(d, #7) ?><?cs if:last(d) ?>]<?cs else ?>, <?cs /if ?><?cs /each ?>
+nested loops and locals from outside
+<?cs loop:x = 1, 2 ?><?cs each_parallel:o = Outside ?><?cs var:x ?>.<?cs name:o ?>:<?cs each_parallel:i = o.Inside ?> <?cs var:i ?><?cs /each ?><?cs loop:y = 1, 3 ?> <?cs var:y ?><?cs /loop ?>
+<?cs /each ?><?cs /loop ?>
+a body which sets is rendered in order
+<?cs set:Count = 0 ?><?cs each_parallel:d = Days ?><?cs set:Count = Count + 1 ?><?cs var:Count ?> <?cs /each ?>
+empty and missing lists
+<?cs each_parallel:e = Empty ?>never<?cs /each ?><?cs each_parallel:e = No.Such.List ?>never<?cs /each ?>
@@ -0,0 +1,6 @@
+Profiling a render with Config.EnableProfile
+<?cs def:show(f) ?><?cs var:f.Name ?><?cs if:f.Type == "dir" ?>/ (<?cs each:s = f.Sub ?><?cs call:show(s) ?> <?cs /each ?>)<?cs /if ?><?cs /def ?>
+<?cs each:f = Files ?><?cs call:show(f) ?>
+<?cs /each ?>
+<?cs linclude:"test_lincluded_macro.cs" ?>
+<?cs var:Wow.Foo ?>
@@ -0,0 +1,10 @@
+Recording the HDF a render reads
+<?cs var:Title ?> <?cs var:Missing.Var ?> <?cs var:Title ?>
+<?cs each:o = Outside ?><?cs name:o ?>: <?cs each:i = o.Inside ?><?cs var:i ?> <?cs /each ?>
+<?cs /each ?>
+<?cs with:f = Files.0 ?><?cs var:f.Name ?> <?cs var:subcount(f.Sub) ?><?cs /with ?>
+<?cs def:show(d) ?><?cs var:d.Abbr ?> <?cs /def ?>
+<?cs call:show(Days.0) ?><?cs call:show(Days.1) ?>
+<?cs set:Local.X = Blah ?><?cs var:Local.X ?>
+<?cs if:Wow.Foo == 3 ?>three<?cs /if ?>
+<?cs linclude:"test_lincluded_macro.cs" ?>
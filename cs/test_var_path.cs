@@ -0,0 +1,9 @@
+Variable lookups through links, locals and hashed HDF levels:
+<?cs var:My.Test ?> <?cs var:My.Test2.Abbr ?> <?cs var:Outside.2.Inside.2 ?>
+<?cs loop:x = 0, 14 ?><?cs set:Big[x] = x * 2 ?><?cs set:Big[x].Name = "n" + x ?><?cs /loop ?>
+<?cs var:Big.0 ?> <?cs var:Big.11 ?> <?cs var:Big.14.Name ?> <?cs var:#Big.13 + 1 ?> <?cs alt:Big.15 ?>none<?cs /alt ?>
+<?cs each:b = Big ?><?cs if:b.Name == "n12" ?><?cs name:b ?>=<?cs var:b ?> <?cs /if ?><?cs /each ?>
+<?cs with:d = My.Test2 ?><?cs var:d.Abbr ?> <?cs var:d ?><?cs /with ?>
+<?cs def:show(v) ?><?cs var:v.Name ?> <?cs var:Big.12.Name ?><?cs /def ?><?cs call:show(Big.3) ?>
+<?cs set:My = "local" ?><?cs var:My ?> <?cs var:My.Test ?>
+<?cs var:subcount(Big) ?> <?cs var:Empty.Missing ?>.
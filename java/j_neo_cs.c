@@ -128,11 +128,11 @@ JNIEXPORT void JNICALL Java_org_clearsilver_jni_JniCs__1parseStr
 
 }
 
-static NEOERR *render_cb (void *ctx, char *buf)
+static NEOERR *render_cb (void *ctx, const char *buf, size_t len)
 {
   STRING *str= (STRING *)ctx;
 
-  return nerr_pass(string_append(str, buf));
+  return nerr_pass(string_appendn(str, buf, len));
 }
 
 
@@ -164,7 +164,7 @@ JNIEXPORT jstring JNICALL Java_org_clearsilver_jni_JniCs__1render
   }
 
   string_init(&str);
-  err = cs_render(cs, &str, render_cb);
+  err = cs_render_write(cs, &str, render_cb);
 
   if (use_cb == JNI_TRUE) cs_register_fileload(cs, NULL, NULL);
 
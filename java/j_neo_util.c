@@ -173,6 +173,92 @@ JNIEXPORT void JNICALL Java_org_clearsilver_jni_JniHdf__1setValue(
   }
 }
 
+JNIEXPORT jlong JNICALL Java_org_clearsilver_jni_JniHdf__1pathCompile(
+    JNIEnv *env, jclass objClass, jstring j_hdfname) {
+  HDF_PATH *path = NULL;
+  NEOERR *err;
+  const char *hdfname;
+
+  if (!j_hdfname) {
+    throwNullPointerException(env, "hdfname argument was null");
+    return 0;
+  }
+  hdfname = (*env)->GetStringUTFChars(env, j_hdfname, 0);
+  err = hdf_path_compile(&path, hdfname);
+  (*env)->ReleaseStringUTFChars(env, j_hdfname, hdfname);
+
+  if (err != STATUS_OK) {
+    // Throw an exception
+    jNeoErr(env, err);
+    return 0;
+  }
+  return (jlong)(uintptr_t) path;
+}
+
+JNIEXPORT void JNICALL Java_org_clearsilver_jni_JniHdf__1pathDestroy(
+    JNIEnv *env, jclass objClass, jlong path_ptr) {
+  HDF_PATH *path = (HDF_PATH *)(uintptr_t)path_ptr;
+  hdf_path_destroy(&path);
+}
+
+JNIEXPORT jint JNICALL Java_org_clearsilver_jni_JniHdf__1getIntValueP(
+    JNIEnv *env, jclass objClass, jlong hdf_obj_ptr, jlong path_ptr,
+    jint default_value) {
+  HDF *hdf = (HDF *)(uintptr_t)hdf_obj_ptr;
+  HDF_PATH *path = (HDF_PATH *)(uintptr_t)path_ptr;
+
+  return hdf_get_int_value_p(hdf, path, default_value);
+}
+
+JNIEXPORT jstring JNICALL Java_org_clearsilver_jni_JniHdf__1getValueP(
+    JNIEnv *env, jclass objClass, jlong hdf_obj_ptr, jlong path_ptr,
+    jstring j_default_value) {
+  HDF *hdf = (HDF *)(uintptr_t)hdf_obj_ptr;
+  HDF_PATH *path = (HDF_PATH *)(uintptr_t)path_ptr;
+  const char *r;
+  const char *default_value;
+  jstring retval;
+
+  if (!j_default_value) {
+    default_value = NULL;
+  } else {
+    default_value = (*env)->GetStringUTFChars(env, j_default_value, 0);
+  }
+
+  r = hdf_get_value_p(hdf, path, default_value);
+
+  retval = (r ? (*env)->NewStringUTF(env, r) : 0);
+  if (default_value) {
+    (*env)->ReleaseStringUTFChars(env, j_default_value, default_value);
+  }
+  return retval;
+}
+
+JNIEXPORT void JNICALL Java_org_clearsilver_jni_JniHdf__1setValueP(
+    JNIEnv *env, jclass objClass,
+    jlong hdf_obj_ptr, jlong path_ptr, jstring j_value) {
+  HDF *hdf = (HDF *)(uintptr_t)hdf_obj_ptr;
+  HDF_PATH *path = (HDF_PATH *)(uintptr_t)path_ptr;
+  NEOERR *err;
+  const char *value;
+
+  if (j_value) {
+    value = (*env)->GetStringUTFChars(env, j_value, 0);
+  } else {
+    value = NULL;
+  }
+  err = hdf_set_value_p(hdf, path, value);
+
+  if (value) {
+    (*env)->ReleaseStringUTFChars(env, j_value, value);
+  }
+
+  if (err != STATUS_OK) {
+    // Throw an exception
+    jNeoErr(env, err);
+  }
+}
+
 JNIEXPORT void JNICALL Java_org_clearsilver_jni_JniHdf__1removeTree(
     JNIEnv *env, jclass objClass,
     jlong hdf_obj_ptr, jstring j_hdfname) {
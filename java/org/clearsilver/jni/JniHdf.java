@@ -182,6 +182,30 @@ public class JniHdf implements HDF {
     _setValue(hdfptr,hdfname,value);
   }
 
+  /** Like getIntValue(String, int), but with a compiled name. */
+  public int getIntValue(JniHdfPath path, int default_value) {
+    if (hdfptr == 0) {
+      throw new NullPointerException("HDF is closed.");
+    }
+    return _getIntValueP(hdfptr,path.ptr(),default_value);
+  }
+
+  /** Like getValue(String, String), but with a compiled name. */
+  public String getValue(JniHdfPath path, String default_value) {
+    if (hdfptr == 0) {
+      throw new NullPointerException("HDF is closed.");
+    }
+    return _getValueP(hdfptr,path.ptr(),default_value);
+  }
+
+  /** Like setValue(String, String), but with a compiled name. */
+  public void setValue(JniHdfPath path, String value) {
+    if (hdfptr == 0) {
+      throw new NullPointerException("HDF is closed.");
+    }
+    _setValueP(hdfptr,path.ptr(),value);
+  }
+
   /** Remove the specified subtree. */
   public void removeTree(String hdfname) {
     if (hdfptr == 0) {
@@ -400,6 +424,12 @@ public class JniHdf implements HDF {
       String default_value);
   private static native void _setValue(long ptr, String hdfname,
       String hdf_value);
+  private static native int _getIntValueP(long ptr, long pathptr,
+      int default_value);
+  private static native String _getValueP(long ptr, long pathptr,
+      String default_value);
+  private static native void _setValueP(long ptr, long pathptr,
+      String hdf_value);
   private static native void _removeTree(long ptr, String hdfname);
   private static native void _setSymLink(long ptr, String hdf_name_src,
       String hdf_name_dest);
@@ -412,4 +442,8 @@ public class JniHdf implements HDF {
   private static native void _copy(long destptr, String hdfpath, long srcptr);
 
   private static native String _dump(long ptr);
+
+  // Used by JniHdfPath
+  static native long _pathCompile(String hdfname);
+  static native void _pathDestroy(long pathptr);
 }
@@ -0,0 +1,40 @@
+package org.clearsilver.jni;
+
+/**
+ * An HDF name compiled once, for looking up or setting the same name over
+ * and over with the JniHdf methods that take a JniHdfPath.  A compiled path
+ * doesn't belong to any HDF, and can be used with all of them.
+ */
+public class JniHdfPath {
+
+  long pathptr;  // stores the C HDF_PATH* pointer
+
+  static {
+    JNI.loadLibrary();
+  }
+
+  /** Compiles hdfname.  Throws a JNI exception if a component is empty. */
+  public JniHdfPath(String hdfname) {
+    pathptr = JniHdf._pathCompile(hdfname);
+  }
+
+  /** Frees the compiled path.  The path can't be used after this. */
+  public void close() {
+    if (pathptr != 0) {
+      JniHdf._pathDestroy(pathptr);
+      pathptr = 0;
+    }
+  }
+
+  protected void finalize() throws Throwable {
+    close();
+    super.finalize();
+  }
+
+  long ptr() {
+    if (pathptr == 0) {
+      throw new NullPointerException("HDF path is closed.");
+    }
+    return pathptr;
+  }
+}
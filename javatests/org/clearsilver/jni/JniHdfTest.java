@@ -16,4 +16,18 @@ public class JniHdfTest extends HdfTest {
   protected ClearsilverFactory newClearsilverFactory() {
     return new JniClearsilverFactory();
   }
+
+  public void testHdfPath() {
+    JniHdf jhdf = JniHdf.cast(hdf);
+    JniHdfPath path = new JniHdfPath("Numbers.2");
+    jhdf.setValue(path, "2");
+    assertEquals("2", jhdf.getValue("Numbers.2", "baz"));
+    assertEquals("2", jhdf.getValue(path, "baz"));
+    assertEquals(2, jhdf.getIntValue(path, -1));
+    path.close();
+    JniHdfPath missing = new JniHdfPath("Numbers.5");
+    assertEquals("baz", jhdf.getValue(missing, "baz"));
+    assertEquals(-1, jhdf.getIntValue(missing, -1));
+    missing.close();
+  }
 }
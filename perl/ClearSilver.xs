@@ -19,6 +19,7 @@ typedef struct {
 
 typedef perlHDF* ClearSilver__HDF;
 typedef perlCS* ClearSilver__CS;
+typedef HDF_PATH* ClearSilver__HDFPath;
 
 static char* g_sort_func_name;
 
@@ -32,9 +33,9 @@ static void debug(char* fmt, ...)
 #endif
 }
 
-static NEOERR *output (void *ctx, char *s)
+static NEOERR *output (void *ctx, const char *s, size_t len)
 {
-  sv_catpv((SV*)ctx, s);
+  sv_catpvn((SV*)ctx, s, len);
 
   return STATUS_OK;
 }
@@ -149,6 +150,32 @@ perlhdf_getValue(hdf, key, default_value)
     OUTPUT:
         RETVAL
 
+int
+perlhdf_setValueP(hdf, path, value)
+	ClearSilver::HDF hdf
+	ClearSilver::HDFPath path
+	char* value
+    CODE:
+        hdf->err = hdf_set_value_p(hdf->hdf, path, value);
+	if (hdf->err == STATUS_OK) {
+	    RETVAL = 0;
+	} else {
+	    RETVAL = 1;
+	}
+    OUTPUT:
+        RETVAL
+
+
+char*
+perlhdf_getValueP(hdf, path, default_value)
+	ClearSilver::HDF hdf
+	ClearSilver::HDFPath path
+	char* default_value
+    CODE:
+        RETVAL = hdf_get_value_p(hdf->hdf, path, default_value);
+    OUTPUT:
+        RETVAL
+
 
 int
 perlhdf_copy(hdf, name, src);
@@ -361,6 +388,35 @@ perlhdf_removeTree(hdf, name)
         RETVAL
 
 
+MODULE = ClearSilver		PACKAGE = ClearSilver::HDFPath	PREFIX = perlhdfpath_
+
+ClearSilver::HDFPath
+perlhdfpath_new(self, name)
+        char* self
+        char* name
+    PREINIT:
+	HDF_PATH* path;
+	NEOERR* err;
+    CODE:
+	debug("%s\n", self);
+	err = hdf_path_compile(&path, name);
+	if (err != STATUS_OK) {
+	  nerr_ignore(&err);
+	  RETVAL = NULL;
+	} else {
+	  RETVAL = path;
+	}
+    OUTPUT:
+        RETVAL
+
+void
+perlhdfpath_DESTROY(path)
+        ClearSilver::HDFPath path;
+    CODE:
+        debug("hdfpath_DESTROY:%x\n", path);
+        hdf_path_destroy(&path);
+
+
 MODULE = ClearSilver		PACKAGE = ClearSilver::CS	PREFIX = perlcs_
 
 ClearSilver::CS
@@ -402,7 +458,7 @@ perlcs_render(cs)
     CODE:
     {
 	SV *str = newSV(0);
-	cs->err = cs_render(cs->cs, str, output);
+	cs->err = cs_render_write(cs->cs, str, output);
 	if (cs->err == STATUS_OK) {
 	  ST(0) = sv_2mortal(str);
 	} else {
@@ -99,6 +99,16 @@ $str = $hdf->getValue("Data.2", "default"); # doesn't exist
 ($str eq "default") ? result($testnum, 1) : result($testnum, 0);     
 $testnum++;
 
+#
+# test HDFPath with setValueP() & getValueP()
+#
+$path = ClearSilver::HDFPath->new("Data.3");
+$hdf->setValueP($path, "Value3");
+$str = $hdf->getValueP($path, "default");
+($str eq "Value3" && $hdf->getValue("Data.3", "") eq "Value3") ?
+    result($testnum, 1) : result($testnum, 0);
+$testnum++;
+
 #
 # test copy tree
 # 
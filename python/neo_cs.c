@@ -136,11 +136,11 @@ static PyObject * p_cs_parse_str (PyObject *self, PyObject *args)
   return Py_None;
 }
 
-static NEOERR *render_cb (void *ctx, char *buf)
+static NEOERR *render_cb (void *ctx, const char *buf, size_t len)
 {
   STRING *str= (STRING *)ctx;
 
-  return nerr_pass(string_append(str, buf));
+  return nerr_pass(string_appendn(str, buf, len));
 }
 
 static PyObject * p_cs_render (PyObject *self, PyObject *args)
@@ -159,7 +159,7 @@ static PyObject * p_cs_render (PyObject *self, PyObject *args)
                                      "ClearSilver.WhiteSpaceStrip", 0);
 
   string_init(&str);
-  err = cs_render (co->data, &str, render_cb);
+  err = cs_render_write (co->data, &str, render_cb);
   if (err) return p_neo_error(err);
 
   if (ws_strip_level) {
@@ -141,6 +141,52 @@ HDF * p_object_to_hdf (PyObject *ho)
   return NULL;
 }
 
+/* A compiled HDF name, from neo_util.HDFPath(name), for the *P methods */
+typedef struct _HDFPathObject
+{
+   PyObject_HEAD
+   HDF_PATH *path;
+} HDFPathObject;
+
+static void p_hdf_path_dealloc (HDFPathObject *po);
+
+static PyTypeObject HDFPathObjectType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "HDFPathObjectType",	             /*tp_name*/
+  sizeof(HDFPathObject),	     /*tp_size*/
+  0,			             /*tp_itemsize*/
+  /* methods */
+  (destructor)p_hdf_path_dealloc,    /*tp_dealloc*/
+};
+
+static void p_hdf_path_dealloc (HDFPathObject *po)
+{
+  hdf_path_destroy (&(po->path));
+  PyObject_DEL(po);
+}
+
+static PyObject * p_hdf_path_compile (PyObject *self, PyObject *args)
+{
+  HDFPathObject *po;
+  HDF_PATH *path;
+  char *name;
+  NEOERR *err;
+
+  if (!PyArg_ParseTuple(args, "s:HDFPath(name)", &name))
+    return NULL;
+
+  err = hdf_path_compile (&path, name);
+  if (err) return p_neo_error (err);
+  po = PyObject_NEW (HDFPathObject, &HDFPathObjectType);
+  if (po == NULL)
+  {
+    hdf_path_destroy (&path);
+    return NULL;
+  }
+  po->path = path;
+  return (PyObject *) po;
+}
+
 static PyObject * p_hdf_init (PyObject *self, PyObject *args)
 {
   HDF *hdf = NULL;
@@ -181,6 +227,43 @@ static PyObject * p_hdf_get_value (PyObject *self, PyObject *args)
   return rv;
 }
 
+static PyObject * p_hdf_get_int_value_p (PyObject *self, PyObject *args)
+{
+  HDFObject *ho = (HDFObject *)self;
+  HDFPathObject *po;
+  int d = 0;
+
+  if (!PyArg_ParseTuple(args, "O!i:getIntValueP(path, default)",
+                        &HDFPathObjectType, &po, &d))
+    return NULL;
+
+  return Py_BuildValue ("i", hdf_get_int_value_p (ho->data, po->path, d));
+}
+
+static PyObject * p_hdf_get_value_p (PyObject *self, PyObject *args)
+{
+  HDFObject *ho = (HDFObject *)self;
+  HDFPathObject *po;
+  char *d = NULL;
+
+  if (!PyArg_ParseTuple(args, "O!s:getValueP(path, default)",
+                        &HDFPathObjectType, &po, &d))
+    return NULL;
+
+  return Py_BuildValue ("s", hdf_get_value_p (ho->data, po->path, d));
+}
+
+static PyObject * p_hdf_get_obj_p (PyObject *self, PyObject *args)
+{
+  HDFObject *ho = (HDFObject *)self;
+  HDFPathObject *po;
+
+  if (!PyArg_ParseTuple(args, "O!:getObjP(path)", &HDFPathObjectType, &po))
+    return NULL;
+
+  return p_hdf_to_object (hdf_get_obj_p (ho->data, po->path), self);
+}
+
 static PyObject * p_hdf_get_obj (PyObject *self, PyObject *args)
 {
   HDFObject *ho = (HDFObject *)self;
@@ -388,6 +471,26 @@ static PyObject * p_hdf_set_value (PyObject *self, PyObject *args)
   return rv;
 }
 
+static PyObject * p_hdf_set_value_p (PyObject *self, PyObject *args)
+{
+  HDFObject *ho = (HDFObject *)self;
+  HDFPathObject *po;
+  PyObject *rv;
+  char *value;
+  NEOERR *err;
+
+  if (!PyArg_ParseTuple(args, "O!s:setValueP(path, value)",
+                        &HDFPathObjectType, &po, &value))
+    return NULL;
+
+  err = hdf_set_value_p (ho->data, po->path, value);
+  if (err) return p_neo_error(err);
+
+  rv = Py_None;
+  Py_INCREF(rv);
+  return rv;
+}
+
 static PyObject * p_hdf_set_attr (PyObject *self, PyObject *args)
 {
   HDFObject *ho = (HDFObject *)self;
@@ -615,6 +718,9 @@ static PyMethodDef HDFMethods[] =
   {"getIntValue", p_hdf_get_int_value, METH_VARARGS, NULL},
   {"getValue", p_hdf_get_value, METH_VARARGS, NULL},
   {"getObj", p_hdf_get_obj, METH_VARARGS, NULL},
+  {"getIntValueP", p_hdf_get_int_value_p, METH_VARARGS, NULL},
+  {"getValueP", p_hdf_get_value_p, METH_VARARGS, NULL},
+  {"getObjP", p_hdf_get_obj_p, METH_VARARGS, NULL},
   {"getChild", p_hdf_get_child, METH_VARARGS, NULL},
   {"getAttrs", p_hdf_get_attr, METH_VARARGS, NULL},
   {"child", p_hdf_obj_child, METH_VARARGS, NULL},
@@ -624,6 +730,7 @@ static PyMethodDef HDFMethods[] =
   {"top", p_hdf_obj_top, METH_VARARGS, NULL},
   {"attrs", p_hdf_obj_attr, METH_VARARGS, NULL},
   {"setValue", p_hdf_set_value, METH_VARARGS, NULL},
+  {"setValueP", p_hdf_set_value_p, METH_VARARGS, NULL},
   {"setAttr", p_hdf_set_attr, METH_VARARGS, NULL},
   {"readFile", p_hdf_read_file, METH_VARARGS, NULL},
 #ifndef NEO_UTIL_DISABLE_WRITE_FILE
@@ -726,6 +833,7 @@ static PyObject * p_time_compact (PyObject *self, PyObject *args)
 static PyMethodDef ModuleMethods[] =
 {
   {"HDF", p_hdf_init, METH_VARARGS, NULL},
+  {"HDFPath", p_hdf_path_compile, METH_VARARGS, NULL},
   {"escape", p_escape, METH_VARARGS, NULL},
   {"unescape", p_unescape, METH_VARARGS, NULL},
   {"time_expand", p_time_expand, METH_VARARGS, NULL},
@@ -771,6 +879,8 @@ DL_EXPORT(void) initneo_util(void)
   HDFObjectType.tp_methods = HDFMethods;
   if (PyType_Ready(&HDFObjectType) < 0)
     return MOD_ERROR_VAL;
+  if (PyType_Ready(&HDFPathObjectType) < 0)
+    return MOD_ERROR_VAL;
 
 #if PY_MAJOR_VERSION >= 3
   m = PyModule_Create(&ModuleDef);
@@ -80,6 +80,20 @@ class ClearsilverPythonWrapperTestCase(unittest.TestCase):
     assert hdf.getAttrs("Numbers") == [('type', 'integers'), ('k', 'v')]
     assert hdf_num.attrs() == [('type', 'integers'), ('k', 'v')]
 
+  def testHdfPath(self):
+    hdf = neo_util.HDF()
+    path = neo_util.HDFPath("Numbers.2")
+    hdf.setValueP(path, "2")
+    assert hdf.getValue("Numbers.2", "baz") == "2"
+    assert hdf.getValueP(path, "baz") == "2"
+    assert hdf.getIntValueP(path, -1) == 2
+    assert hdf.getObjP(path).name() == "2"
+    missing = neo_util.HDFPath("Numbers.5")
+    assert hdf.getValueP(missing, "baz") == "baz"
+    assert hdf.getIntValueP(missing, -1) == -1
+    assert hdf.getObjP(missing) is None
+    self.assertRaises(neo_util.Error, neo_util.HDFPath, "Numbers..2")
+
   def testMemorySafety(self):
     # This is meant to be run with ASAN and checks that
     # certain use-after-frees are not present.
@@ -86,11 +86,11 @@ static VALUE c_parse_str (VALUE self, VALUE oString)
   return self;
 }
 
-static NEOERR *render_cb (void *ctx, char *buf)
+static NEOERR *render_cb (void *ctx, const char *buf, size_t len)
 {
   STRING *str= (STRING *)ctx;
 
-  return nerr_pass(string_append(str, buf));
+  return nerr_pass(string_appendn(str, buf, len));
 }
 
 static VALUE c_render (VALUE self)
@@ -103,7 +103,7 @@ static VALUE c_render (VALUE self)
   Data_Get_Struct(self, CSPARSE, cs);
 
   string_init(&str);
-  err = cs_render (cs, &str, render_cb);
+  err = cs_render_write (cs, &str, render_cb);
   if (err) Srb_raise(r_neo_error(err));
 
   rv = rb_str_new2(str.buf);
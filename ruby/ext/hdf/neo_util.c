@@ -16,6 +16,7 @@
 
 VALUE mNeotonic;
 static VALUE cHdf;
+static VALUE cHdfPath;
 VALUE eHdfError;
 static ID id_to_s;
 
@@ -190,6 +191,65 @@ static VALUE h_get_value (VALUE self, VALUE oName, VALUE oDefault)
   return rv;
 }
 
+/* Neo::HdfPath.new(name) compiles name for the *_p methods */
+static void hp_free(HDF_PATH *path) {
+  hdf_path_destroy(&path);
+}
+
+static VALUE hp_new(VALUE class, VALUE oName)
+{
+  HDF_PATH *path;
+  NEOERR *err;
+
+  err = hdf_path_compile (&path, STR2CSTR(oName));
+  if (err) Srb_raise(r_neo_error(err));
+  return Data_Wrap_Struct(class, 0, hp_free, path);
+}
+
+static VALUE h_set_value_p (VALUE self, VALUE oPath, VALUE oValue)
+{
+  t_hdfh *hdfh;
+  HDF_PATH *path;
+  char *value;
+  NEOERR *err;
+
+  Data_Get_Struct(self, t_hdfh, hdfh);
+  Data_Get_Struct(oPath, HDF_PATH, path);
+
+  if ( TYPE(oValue) == T_STRING )
+    value=STR2CSTR(oValue);
+  else
+    value=STR2CSTR(rb_funcall(oValue,id_to_s,0));
+
+  err = hdf_set_value_p (hdfh->hdf, path, value);
+
+  if (err) Srb_raise(r_neo_error(err));
+
+  return self;
+}
+
+static VALUE h_get_int_value_p (VALUE self, VALUE oPath, VALUE oDefault)
+{
+  t_hdfh *hdfh;
+  HDF_PATH *path;
+
+  Data_Get_Struct(self, t_hdfh, hdfh);
+  Data_Get_Struct(oPath, HDF_PATH, path);
+
+  return INT2NUM(hdf_get_int_value_p (hdfh->hdf, path, NUM2INT(oDefault)));
+}
+
+static VALUE h_get_value_p (VALUE self, VALUE oPath, VALUE oDefault)
+{
+  t_hdfh *hdfh;
+  HDF_PATH *path;
+
+  Data_Get_Struct(self, t_hdfh, hdfh);
+  Data_Get_Struct(oPath, HDF_PATH, path);
+
+  return rb_str_new2(hdf_get_value_p (hdfh->hdf, path, STR2CSTR(oDefault)));
+}
+
 static VALUE h_get_child (VALUE self, VALUE oName)
 {
   t_hdfh *hdfh,*hdfh_new;
@@ -598,6 +658,9 @@ void Init_hdf() {
   rb_define_method(cHdf, "put", h_set_value, 2);
   rb_define_method(cHdf, "get_int_value", h_get_int_value, 2);
   rb_define_method(cHdf, "get_value", h_get_value, 2);
+  rb_define_method(cHdf, "set_value_p", h_set_value_p, 2);
+  rb_define_method(cHdf, "get_int_value_p", h_get_int_value_p, 2);
+  rb_define_method(cHdf, "get_value_p", h_get_value_p, 2);
   rb_define_method(cHdf, "get_child", h_get_child, 1);
   rb_define_method(cHdf, "get_obj", h_get_obj, 1);
   rb_define_method(cHdf, "get_node", h_get_node, 1);
@@ -617,6 +680,9 @@ void Init_hdf() {
   rb_define_method(cHdf, "copy", h_copy, 2);
   rb_define_method(cHdf, "set_symlink", h_set_symlink, 2);
 
+  cHdfPath = rb_define_class_under(mNeotonic, "HdfPath", rb_cObject);
+  rb_define_singleton_method(cHdfPath, "new", hp_new, 1);
+
   rb_define_singleton_method(cHdf, "escape", h_escape, 3);
   rb_define_singleton_method(cHdf, "unescape", h_unescape, 3);
 
@@ -37,3 +37,7 @@ c.parse_string(s)
 
 print c.render
 
+p=Neo::HdfPath.new "party.4"
+h.set_value_p p, "cake"
+print h.get_value_p(p, "none"), " ", h.get_value("party.4", "none"), "\n"
+print h.get_value_p(Neo::HdfPath.new("party.9"), "none"), "\n"
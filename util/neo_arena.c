@@ -0,0 +1,211 @@
+/*
+ * Copyright 2001-2004 Brandon Long
+ * All Rights Reserved.
+ *
+ * ClearSilver Templating System
+ *
+ * This code is made available under the terms of the ClearSilver License.
+ * http://www.clearsilver.net/license.hdf
+ *
+ */
+
+#include "cs_config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include "neo_misc.h"
+#include "neo_err.h"
+#include "neo_arena.h"
+
+#ifndef va_copy
+#ifdef __va_copy
+# define va_copy(dest,src) __va_copy(dest,src)
+#else
+# define va_copy(dest,src) ((dest) = (src))
+#endif
+#endif
+
+/* Every allocation is aligned to this, which is enough for any of the
+ * types we store (pointers, longs, doubles, structs of those).  Strings
+ * need no alignment, so they are packed in without any padding. */
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(x) (((x) + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1))
+#define ARENA_HEADER ARENA_ROUND(sizeof(NE_ARENA_BLOCK))
+#define ARENA_DATA(b) ((char *)(b) + ARENA_HEADER)
+
+void ne_arena_init (NE_ARENA *arena, size_t block_size)
+{
+  memset(arena, 0, sizeof(NE_ARENA));
+  arena->block_size = block_size ? block_size : NE_ARENA_BLOCK_SIZE;
+}
+
+static void *arena_alloc (NE_ARENA *arena, size_t len, int aligned)
+{
+  NE_ARENA_BLOCK *block = arena->blocks;
+  size_t used = 0;
+  void *ptr;
+
+  if (len == 0) len = 1;
+  if (block != NULL)
+    used = aligned ? ARENA_ROUND(block->used) : block->used;
+
+  if (block == NULL || used > block->size || block->size - used < len)
+  {
+    /* Blocks given back by ne_arena_release are reused before going
+     * back to malloc, so a loop which marks and releases every
+     * iteration doesn't allocate a block each time around. */
+    if (arena->spare && len <= arena->spare->size)
+    {
+      block = arena->spare;
+      arena->spare = block->next;
+    }
+    else
+    {
+      size_t size = arena->block_size;
+      if (len > size) size = len;
+      block = (NE_ARENA_BLOCK *) malloc(ARENA_HEADER + size);
+      if (block == NULL) return NULL;
+      block->size = size;
+      arena->reserved += ARENA_HEADER + size;
+    }
+    block->used = 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    used = 0;
+  }
+
+  ptr = ARENA_DATA(block) + used;
+  arena->bytes += used - block->used + len;
+  block->used = used + len;
+  arena->allocs++;
+  if (arena->bytes > arena->peak) arena->peak = arena->bytes;
+  return ptr;
+}
+
+void *ne_arena_alloc (NE_ARENA *arena, size_t len)
+{
+  return arena_alloc(arena, len, 1);
+}
+
+void *ne_arena_calloc (NE_ARENA *arena, size_t len)
+{
+  void *ptr = ne_arena_alloc(arena, len);
+  if (ptr != NULL) memset(ptr, 0, len);
+  return ptr;
+}
+
+char *ne_arena_strndup (NE_ARENA *arena, const char *s, size_t len)
+{
+  char *r = (char *) arena_alloc(arena, len + 1, 0);
+  if (r == NULL) return NULL;
+  memcpy(r, s, len);
+  r[len] = '\0';
+  return r;
+}
+
+char *ne_arena_strdup (NE_ARENA *arena, const char *s)
+{
+  return ne_arena_strndup(arena, s, strlen(s));
+}
+
+char *ne_arena_vsprintf (NE_ARENA *arena, const char *fmt, va_list ap)
+{
+  char buf[256];
+  char *r;
+  va_list tmp;
+  int len;
+
+  va_copy(tmp, ap);
+  len = vsnprintf(buf, sizeof(buf), fmt, tmp);
+  va_end(tmp);
+  if (len < 0) return NULL;
+
+  r = (char *) arena_alloc(arena, len + 1, 0);
+  if (r == NULL) return NULL;
+  if (len < (int)sizeof(buf))
+    memcpy(r, buf, len + 1);
+  else
+    vsnprintf(r, len + 1, fmt, ap);
+  return r;
+}
+
+char *ne_arena_sprintf (NE_ARENA *arena, const char *fmt, ...)
+{
+  va_list ap;
+  char *r;
+
+  va_start(ap, fmt);
+  r = ne_arena_vsprintf(arena, fmt, ap);
+  va_end(ap);
+  return r;
+}
+
+void ne_arena_mark (NE_ARENA *arena, NE_ARENA_MARK *mark)
+{
+  mark->block = arena->blocks;
+  mark->used = mark->block ? mark->block->used : 0;
+  mark->bytes = arena->bytes;
+}
+
+void ne_arena_release (NE_ARENA *arena, NE_ARENA_MARK *mark)
+{
+  NE_ARENA_BLOCK *block;
+
+  while ((block = arena->blocks) != NULL && block != mark->block)
+  {
+    arena->blocks = block->next;
+    if (block->size == arena->block_size)
+    {
+      block->next = arena->spare;
+      arena->spare = block;
+    }
+    else
+    {
+      arena->reserved -= ARENA_HEADER + block->size;
+      free(block);
+    }
+  }
+  if (block != NULL)
+    block->used = mark->used;
+  arena->bytes = mark->bytes;
+}
+
+void ne_arena_clear (NE_ARENA *arena)
+{
+  NE_ARENA_MARK start;
+  NE_ARENA_BLOCK *block, *next;
+
+  memset(&start, 0, sizeof(start));
+  ne_arena_release(arena, &start);
+
+  /* Everything is on the spare list now, keep just one block */
+  if (arena->spare != NULL)
+  {
+    for (block = arena->spare->next; block; block = next)
+    {
+      next = block->next;
+      arena->reserved -= ARENA_HEADER + block->size;
+      free(block);
+    }
+    arena->spare->next = NULL;
+  }
+  arena->allocs = 0;
+  arena->bytes = 0;
+  arena->peak = 0;
+}
+
+void ne_arena_destroy (NE_ARENA *arena)
+{
+  NE_ARENA_BLOCK *block, *next;
+
+  ne_arena_clear(arena);
+  for (block = arena->spare; block; block = next)
+  {
+    next = block->next;
+    free(block);
+  }
+  arena->spare = NULL;
+  arena->reserved = 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2001-2004 Brandon Long
+ * All Rights Reserved.
+ *
+ * ClearSilver Templating System
+ *
+ * This code is made available under the terms of the ClearSilver License.
+ * http://www.clearsilver.net/license.hdf
+ *
+ */
+
+/*
+ * NE_ARENA is a simple bump allocator.  Memory is handed out from a
+ * chain of blocks and is never freed individually; instead the whole
+ * arena is cleared (or rolled back to a mark) at once.  It is meant for
+ * short lived scratch data with a well defined lifetime, such as the
+ * temporary strings created while rendering a template.
+ */
+
+#ifndef __NEO_ARENA_H_
+#define __NEO_ARENA_H_ 1
+
+__BEGIN_DECLS
+
+#include <stdarg.h>
+#include "util/neo_misc.h"
+#include "util/neo_err.h"
+
+#define NE_ARENA_BLOCK_SIZE 4096
+
+typedef struct _ne_arena_block
+{
+  struct _ne_arena_block *next;
+  size_t size;
+  size_t used;
+} NE_ARENA_BLOCK;
+
+typedef struct _ne_arena
+{
+  NE_ARENA_BLOCK *blocks;     /* current block first */
+  NE_ARENA_BLOCK *spare;      /* released blocks kept for reuse */
+  size_t block_size;
+
+  /* statistics */
+  size_t allocs;              /* number of allocations since clear */
+  size_t bytes;               /* bytes currently handed out */
+  size_t peak;                /* high water mark of bytes */
+  size_t reserved;            /* bytes currently malloc'd for blocks */
+} NE_ARENA;
+
+typedef struct _ne_arena_mark
+{
+  NE_ARENA_BLOCK *block;
+  size_t used;
+  size_t bytes;
+} NE_ARENA_MARK;
+
+/*
+ * Function: ne_arena_init - initialize an arena
+ * Description: ne_arena_init prepares an NE_ARENA structure for use.  No
+ *              memory is allocated until the first ne_arena_alloc call.
+ * Input: arena - pointer to the NE_ARENA to initialize
+ *        block_size - size of each block, or 0 for NE_ARENA_BLOCK_SIZE
+ * Output: None
+ * Return: None
+ */
+void ne_arena_init (NE_ARENA *arena, size_t block_size);
+
+/*
+ * Function: ne_arena_alloc - allocate memory from an arena
+ * Description: ne_arena_alloc returns len bytes of memory aligned for
+ *              any type.  The memory remains valid until the arena is
+ *              cleared, destroyed or released past this allocation.
+ *              Allocations larger than the block size get a block of
+ *              their own.
+ * Input: arena - the arena to allocate from
+ *        len - number of bytes
+ * Output: None
+ * Return: a pointer to the memory, or NULL if out of memory
+ */
+void *ne_arena_alloc (NE_ARENA *arena, size_t len);
+
+/* Like ne_arena_alloc, but the memory is zero filled */
+void *ne_arena_calloc (NE_ARENA *arena, size_t len);
+
+/* Copy len bytes of s into the arena, adding a terminating NUL.  The
+ * strings made by these and the sprintf functions are not aligned. */
+char *ne_arena_strndup (NE_ARENA *arena, const char *s, size_t len);
+char *ne_arena_strdup (NE_ARENA *arena, const char *s);
+
+/* sprintf into memory allocated from the arena, returns NULL on failure */
+char *ne_arena_sprintf (NE_ARENA *arena, const char *fmt, ...)
+                        ATTRIBUTE_PRINTF(2,3);
+char *ne_arena_vsprintf (NE_ARENA *arena, const char *fmt, va_list ap);
+
+/*
+ * Function: ne_arena_mark - remember the current arena position
+ * Description: ne_arena_mark stores the current position of the arena
+ *              in mark.  A later ne_arena_release with the same mark
+ *              frees everything allocated in between, which lets a
+ *              caller bound the memory used by a loop.
+ * Input: arena - the arena
+ * Output: mark - the position
+ * Return: None
+ */
+void ne_arena_mark (NE_ARENA *arena, NE_ARENA_MARK *mark);
+void ne_arena_release (NE_ARENA *arena, NE_ARENA_MARK *mark);
+
+/*
+ * Function: ne_arena_clear - release all allocations
+ * Description: ne_arena_clear frees all the memory handed out by the
+ *              arena, but keeps the first block around so that an arena
+ *              which is reused (ie, once per render) doesn't go back to
+ *              malloc every time.  The allocation statistics other than
+ *              reserved start over.
+ * Input: arena - the arena
+ * Output: None
+ * Return: None
+ */
+void ne_arena_clear (NE_ARENA *arena);
+
+/* Free all memory held by the arena */
+void ne_arena_destroy (NE_ARENA *arena);
+
+__END_DECLS
+
+#endif /* __NEO_ARENA_H_ */
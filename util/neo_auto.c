@@ -13,6 +13,7 @@
 #include "streamhtmlparser/htmlparser.h"
 #include "neo_err.h"
 #include "neo_str.h"
+#include "neo_scan.h"
 #include "neo_auto.h"
 
 struct _neos_auto_ctx {
@@ -38,21 +39,27 @@ static struct _neos_content_map
   {NULL, -1},
 };
 
+/* The escaping routines look for these with neos_scan, see neo_scan.h for
+ * how the sets are specified. */
+
 /* Characters to escape when html escaping is needed */
-static char *HTML_CHARS_LIST    = "&<>\"'\r";
+static NEOS_SCANSET HTML_CHARS = {"&<>\"'\r", 0, 255};
 
 /* Characters to escape when html escaping an unquoted
-   attribute value */
-static char *HTML_UNQUOTED_LIST = "&<>\"'=";
+   attribute value, and the control and space characters which are
+   dropped (IS_CTRL_CHAR and IS_SPACE below) */
+static NEOS_SCANSET HTML_UNQUOTED_CHARS = {"&<>\"'=\x7f", 0x21, 255};
 
-/* Characters to escape when javascript escaping is needed */
-static char *JS_CHARS_LIST       = "&<>\"'\r\n\t/\\;";
+/* Characters to escape when javascript escaping is needed, as well as
+   all the control characters */
+static NEOS_SCANSET JS_CHARS = {"&<>\"'\r\n\t/\\;\x7f", 32, 255};
 
 /* Characters to escape when json escaping is needed */
-static char *JSON_CHARS_LIST       = "&<>\"'\b\f\r\n\t/\\";
+static NEOS_SCANSET JSON_CHARS = {"&<>\"'\b\f\r\n\t/\\", 32, 255};
 
 /* Characters to escape when unquoted javascript attribute is escaped */
-static char *JS_ATTR_UNQUOTED_LIST = "&<>\"'/\\;=\t\n\v\f\r ";
+static NEOS_SCANSET JS_ATTR_UNQUOTED_CHARS =
+  {"&<>\"'/\\;=\t\n\v\f\r \x7f", 32, 255};
 
 /* Length of a unicode encoded character in JSON (\uXXXX) */
 static int JSON_UNICODE_ENCODING_LEN = 6;
@@ -105,101 +112,83 @@ static char *CSS_SAFE_CHARS = "_.,!#%-";
  * variable, these new functions do an initial pass to determine if escaping is
  * needed. If not, the input string itself is returned, and no extraneous
  * memory allocation or copying is done.
+ *
+ * When the input does need escaping, the output is appended to a STRING
+ * supplied by the caller, which can reuse it for every variable.  *esc is
+ * then set to where the output starts in out->buf.
  */
 
 /* TODO(mugdha): Consolidate these functions with the ones in neo_str.c. */
 
+/* Point esc at the output appended to out since it was start bytes long.
+ * string_appendn always leaves a NUL terminated buf, even if the output
+ * is empty. */
+static NEOERR *auto_escape_done (STRING *out, int start, char **esc)
+{
+  NEOERR *err;
+
+  if (out->buf == NULL)
+  {
+    err = string_appendn (out, "", 0);
+    if (err) return nerr_pass(err);
+  }
+  *esc = out->buf + start;
+  return STATUS_OK;
+}
+
 /* Function: neos_auto_html_escape - HTML escapes input if necessary.
  * Description: This function scans through in, looking for HTML metacharacters.
  *              If any metacharacters are found, the input is HTML escaped and
- *              the resulting output returned in *esc.
+ *              the result appended to out.
  * Input: in -> input string
+ *        out -> STRING to append the escaped input to
  *        quoted -> should be 0 if the input string appears on an HTML attribute
  *                  and is not quoted.
  * Output: esc -> pointer to output string. Could point back to input string
  *                if the input does not need modification.
- *         do_free -> will be 1 if *esc should be freed. If it is 0, *esc
- *                    points to in.
  */
-static NEOERR *neos_auto_html_escape (const char *in, char **esc,
-                                      int quoted, int *do_free)
+static NEOERR *neos_auto_html_escape (const char *in, STRING *out, char **esc,
+                                      int quoted)
 {
-  unsigned int newlen = 0;
-  int modify = 0;
-  unsigned int l = 0;
-  char *tmp = NULL;
-  char *metachars = HTML_CHARS_LIST;
+  NEOERR *err;
+  NEOS_SCANSET *metachars = &HTML_CHARS;
+  int start = out->len;
+  int len = strlen(in);
+  int run = 0;
+  int l;
 
-  *do_free = 0;
+  *esc = (char *)in;
 
   if (!quoted)
-    metachars = HTML_UNQUOTED_LIST;
+    metachars = &HTML_UNQUOTED_CHARS;
 
   /*
      Check if there are any characters that need escaping. In the majority of
      cases, this will be false and we can just quit the function immediately
   */
-  while (in[l])
-  {
-    if (!quoted && (IS_CTRL_CHAR(in[l]) || IS_SPACE(in[l])))
-    {
-      modify = 1;
-    }
-    else
-    {
-      if (IN_LIST(metachars, in[l]))
-      {
-        newlen += strlen(HTML_CHAR_MAP[(int)in[l]]);
-        modify = 1;
-      }
-      else
-        newlen += 1;
-    }
-
-    l++;
-  }
-
-  if (!modify) {
-    *esc = (char *)in;
+  l = neos_scan(metachars, in, len);
+  if (l == len)
     return STATUS_OK;
-  }
 
   /*
-     There are some HTML metacharacters. Allocate a new string and do escaping
-     in that string.
+     There are some HTML metacharacters. Copy the runs of characters between
+     them to out, escaping the metacharacters and dropping the others.
   */
-  (*esc) = (char *) malloc(newlen + 1);
-  if (*esc == NULL)
-    return nerr_raise (NERR_NOMEM, "Unable to allocate memory to escape %s",
-                       in);
-  *do_free = 1;
-
-  tmp = *esc;
-  l = 0;
-  while (in[l])
+  while (l < len)
   {
-    if (!quoted && (IS_CTRL_CHAR(in[l]) || IS_SPACE(in[l])))
-    {
-      /* Ignore this character */
-    }
-    else
-    {
-      if (IN_LIST(metachars, in[l]))
-      {
-        strncpy(tmp, HTML_CHAR_MAP[(int)in[l]],
-                strlen(HTML_CHAR_MAP[(int)in[l]]));
-        tmp += strlen(HTML_CHAR_MAP[(int)in[l]]);
-      }
-      else
-      {
-        *tmp++ = in[l];
-      }
-    }
-    l++;
+    err = string_appendn(out, in + run, l - run);
+    /* Control and space characters in an unquoted attribute are ignored */
+    if (err == STATUS_OK &&
+        (quoted || !(IS_CTRL_CHAR(in[l]) || IS_SPACE(in[l]))))
+      err = string_append(out, HTML_CHAR_MAP[(int)in[l]]);
+    if (err) return nerr_pass(err);
+    run = l + 1;
+    l = run + neos_scan(metachars, in + run, len - run);
   }
-  (*esc)[newlen] = '\0';
+  err = string_appendn(out, in + run, l - run);
+  if (err) return nerr_pass(err);
 
-  return STATUS_OK;
+  return nerr_pass(auto_escape_done(out, start, esc));
 }
 
 /* Function: neos_auto_url_validate - Verify that the input is a valid URL.
@@ -207,63 +196,53 @@ static NEOERR *neos_auto_html_escape (const char *in, char **esc,
  *              allowed URI schemes, specified in AUTO_URL_PROTOCOLS.
  *              In addition, the input is html escaped.
  * Input: in -> input string
+ *        out -> STRING to append the escaped input to
  *        quoted -> should be 0 if the input string appears on an HTML attribute
  *                  and is not quoted. Will be passed through to the html
  *                  escaping function.
  * Output: esc -> pointer to output string. Could point back to input string
  *                if the input does not need modification.
- *         do_free -> will be 1 if *esc should be freed. If it is 0, *esc
- *                    points to in.
  */
-static NEOERR *neos_auto_url_validate (const char *in, char **esc,
-                                       int quoted, int *do_free)
+static NEOERR *neos_auto_url_validate (const char *in, STRING *out, char **esc,
+                                       int quoted)
 {
-  char *replacement;
-
-  *do_free = 0;
+  NEOERR *err;
+  int start = out->len;
 
   if (neos_has_secure_protocol(in))
-    return nerr_pass(neos_auto_html_escape(in, esc, quoted, do_free));
+    return nerr_pass(neos_auto_html_escape(in, out, esc, quoted));
 
   /* 'in' contains an unsupported scheme, replace with '#' */
-  replacement = (char *) malloc(2);
-  if (replacement == NULL)
-    return nerr_raise (NERR_NOMEM,
-                       "Unable to allocate memory to escape %s", in);
-
-  replacement[0] = '#';
-  replacement[1] = '\0';
-  *esc = replacement;
-  *do_free = 1;
-  return STATUS_OK;
+  err = string_append_char(out, '#');
+  if (err) return nerr_pass(err);
+  return nerr_pass(auto_escape_done(out, start, esc));
 }
 
 /* Function: neos_auto_check_number - Verify that in points to a number.
  * Description: This function scans through in and validates that it contains
  *              a number. Digits, decimal points and spaces are ok. If the
- *              input is not a valid number, output is set to "null". A pointer
- *              to the output is returned in *esc.
+ *              input is not a valid number, "null" is appended to out.
  * Input: in -> input string
+ *        out -> STRING to append the output to
  *
  * Output: esc -> pointer to output string. Will point back to input string
- *                if the input is a valid number. Otherwise, points to '_'.
- *         do_free -> will be 1 if *esc should be freed. If it is 0, *esc
- *                    points to in.
+ *                if the input is a valid number. Otherwise, points to "null".
  */
-static NEOERR *neos_auto_check_number (const char *in, char **esc, int *do_free)
+static NEOERR *neos_auto_check_number (const char *in, STRING *out, char **esc)
 {
+  NEOERR *err;
   size_t i;
   int inlen;
   int valid;
+  int start = out->len;
 
-  *do_free = 0;
+  *esc = (char *)in;
 
   inlen = strlen(in);
   valid = 1;
 
   /* Permit boolean literals */
   if ((strcmp(in, "true") == 0) || (strcmp(in, "false") == 0)) {
-    *esc = (char *)in;
     return STATUS_OK;
   }
 
@@ -293,180 +272,150 @@ static NEOERR *neos_auto_check_number (const char *in, char **esc, int *do_free)
     }
   }
 
-  if (!valid) {
-    char *tmp_esc;
-    tmp_esc = (char *) malloc(5);
-    if (tmp_esc == NULL)
-      return nerr_raise (NERR_NOMEM,
-                         "Unable to allocate memory to escape %s", in);
-
-    strcpy(tmp_esc, "null");
-    *esc = tmp_esc;
-    *do_free = 1;
-  }
-  else
-    *esc = (char *)in;
+  if (valid)
+    return STATUS_OK;
 
-  return STATUS_OK;
+  err = string_append(out, "null");
+  if (err) return nerr_pass(err);
+  return nerr_pass(auto_escape_done(out, start, esc));
 }
 
+/* Append in to out, leaving out the characters for which safe(in[l]) is
+ * false */
+#define AUTO_STRIP(in, out, safe) \
+  do { \
+    int run = 0; \
+    for (l = 0; in[l]; l++) { \
+      if (safe) continue; \
+      err = string_appendn(out, (const char *)in + run, l - run); \
+      if (err) return nerr_pass(err); \
+      run = l + 1; \
+    } \
+    err = string_appendn(out, (const char *)in + run, l - run); \
+    if (err) return nerr_pass(err); \
+  } while (0)
+
+#define CSS_SAFE(c, quoted) (isalnum(c) || (c == ' ' && quoted) || \
+                             IN_LIST(CSS_SAFE_CHARS, c) || c >= 0x80)
+
 /* Function: neos_auto_css_validate - Verify that in points to safe css subset.
  * Description: This function verifies that 'in' points to a safe subset of
  *              characters that are ok to use as the value of a style property.
  *              Alphanumeric characters, space (0x20), non-ascii characters and
  *              _.,!#%- are allowed.
- *              All other characters are stripped out. A pointer to the
- *              output is returned in *esc.
+ *              All other characters are stripped out, and the result
+ *              appended to out.
  * Input: in -> input string
+ *        out -> STRING to append the output to
  *
  * Output: esc -> pointer to output string. Will point back to input string
  *                if the input is not modified.
- *         do_free -> will be 1 if *esc should be freed. If it is 0, *esc
- *                    points to in.
  */
-static NEOERR *neos_auto_css_validate (const unsigned char *in, char **esc,
-                                       int quoted, int *do_free)
+static NEOERR *neos_auto_css_validate (const unsigned char *in, STRING *out,
+                                       char **esc, int quoted)
 {
+  NEOERR *err;
+  int start = out->len;
   int l = 0;
 
-  *do_free = 0;
-  while (in[l] &&
-         (isalnum(in[l]) || (in[l] == ' ' && quoted) || 
-          IN_LIST(CSS_SAFE_CHARS, in[l]) || in[l] >= 0x80)) {
+  *esc = (char *)in;
+  while (in[l] && CSS_SAFE(in[l], quoted)) {
     l++;
   }
 
   if (!in[l]) {
     /* while() looped successfully through all characters in 'in'.
        'in' is safe to use as is */
-    *esc = (char *)in;
-  }
-  else {
-    /* Create a new string, stripping out all dangerous characters from 'in' */
-    int i = 0;
-    char *s;
-    s = (char *) malloc(strlen((const char *)in) + 1);
-    if (s == NULL)
-      return nerr_raise (NERR_NOMEM,
-                         "Unable to allocate memory to escape %s", in);
-
-    l = 0;
-    while (in[l]) {
-      /* Strip out all except a whitelist of characters */
-      if (isalnum(in[l]) || (in[l] == ' ' && quoted) ||
-          IN_LIST(CSS_SAFE_CHARS, in[l]) || in[l] >= 0x80) {
-        s[i++] = in[l];
-      }
-
-      l++;
-    }
-    s[i] = '\0';
-    *esc = s;
-    *do_free = 1;
+    return STATUS_OK;
   }
 
-  return STATUS_OK;
+  /* Strip out all except a whitelist of characters */
+  AUTO_STRIP(in, out, CSS_SAFE(in[l], quoted));
+  return nerr_pass(auto_escape_done(out, start, esc));
 }
 
 /* Function: neos_auto_json_escape - Escapes input for json if necessary.
  * Description: This function scans through in, looking for json
  *              metacharacters. If any are found, the input is escaped and
- *              the resulting output returned in *esc.
+ *              the result appended to out.
  * Input: in -> input string
+ *        out -> STRING to append the escaped input to
  * Output: esc -> pointer to output string. Could point back to input string
  *                if the input does not need modification.
- *         do_free -> will be 1 if *esc should be freed. If it is 0, *esc
- *                    points to in.
  */
-static NEOERR *neos_auto_json_escape (const char *in, char **esc, int *do_free)
+static NEOERR *neos_auto_json_escape (const char *in, STRING *out, char **esc)
 {
-  int nl = 0;
-  int l = 0;
-  char *s;
-
-  *do_free = 0;
-  while (in[l])
-  {
-    if (IN_LIST(JSON_CHARS_LIST, in[l]) || (in[l] > 0 && in[l] < 32)) {
-      if (in[l] == '"' || in[l] == '\\' || in[l] == '/' ||
-          in[l] == '\b' || in[l] == '\f' || in[l] == '\n' ||
-          in[l] == '\r' || in[l] == '\t') {
-        nl += JSON_SHORT_ENCODING_LEN;
-      } else {
-        nl += JSON_UNICODE_ENCODING_LEN;
-      }
-    } else {
-       nl += 1;
-    }
-    l++;
-  }
-
-  if (nl == l) {
-    *esc = (char *)in;
+  NEOERR *err;
+  int start = out->len;
+  int run = 0;
+  int l;
+  char enc[7];
+  int in_len = strlen(in);
+  int len;
+
+  *esc = (char *)in;
+  l = neos_scan(&JSON_CHARS, in, in_len);
+  if (l == in_len)
     return STATUS_OK;
-  }
-
-  s = (char *) malloc(nl + 1);
-  if (s == NULL)
-    return nerr_raise (NERR_NOMEM, "Unable to allocate memory to escape %s",
-                       in);
 
-  l = 0;
-  nl = 0;
-  while (in[l])
+  while (l < in_len)
   {
-   if (IN_LIST(JSON_CHARS_LIST, in[l]) || (in[l] > 0 && in[l] < 32)) {
+    enc[0] = '\\';
+    len = JSON_SHORT_ENCODING_LEN;
     switch(in[l]) {
-      case '"':  s[nl++] = '\\'; s[nl++] = '"'; break;
-      case '\\': s[nl++] = '\\'; s[nl++] = '\\'; break;
-      case '/':  s[nl++] = '\\'; s[nl++] = '/'; break;
-      case '\b': s[nl++] = '\\'; s[nl++] = 'b'; break;
-      case '\f': s[nl++] = '\\'; s[nl++] = 'f'; break;
-      case '\n': s[nl++] = '\\'; s[nl++] = 'n'; break;
-      case '\r': s[nl++] = '\\'; s[nl++] = 'r'; break;
-      case '\t': s[nl++] = '\\'; s[nl++] = 't'; break;
+      case '"':  enc[1] = '"'; break;
+      case '\\': enc[1] = '\\'; break;
+      case '/':  enc[1] = '/'; break;
+      case '\b': enc[1] = 'b'; break;
+      case '\f': enc[1] = 'f'; break;
+      case '\n': enc[1] = 'n'; break;
+      case '\r': enc[1] = 'r'; break;
+      case '\t': enc[1] = 't'; break;
       default: // \uXXXX escaping for all other characters
-        s[nl++] = '\\';
-        s[nl++] = 'u';
-        s[nl++] = '0';
-        s[nl++] = '0';
-        s[nl++] = "0123456789ABCDEF"[(in[l] >> 4) & 0xF];
-        s[nl++] = "0123456789ABCDEF"[in[l] & 0xF];
+        enc[1] = 'u';
+        enc[2] = '0';
+        enc[3] = '0';
+        enc[4] = "0123456789ABCDEF"[(in[l] >> 4) & 0xF];
+        enc[5] = "0123456789ABCDEF"[in[l] & 0xF];
+        len = JSON_UNICODE_ENCODING_LEN;
         break;
     }
-   } else {
-     s[nl++] = in[l];
-   }
-    l++;
+    err = string_appendn(out, in + run, l - run);
+    if (err == STATUS_OK)
+      err = string_appendn(out, enc, len);
+    if (err) return nerr_pass(err);
+    run = l + 1;
+    l = run + neos_scan(&JSON_CHARS, in + run, in_len - run);
   }
-  s[nl] = '\0';
+  err = string_appendn(out, in + run, l - run);
+  if (err) return nerr_pass(err);
 
-  *esc = (char *)s;
-  *do_free = 1;
-  return STATUS_OK;
+  return nerr_pass(auto_escape_done(out, start, esc));
 }
 
 /* Function: neos_auto_js_escape - Javascript escapes input if necessary.
  * Description: This function scans through in, looking for javascript
  *              metacharacters. If any are found, the input is js escaped and
- *              the resulting output returned in *esc.
+ *              the result appended to out.
  * Input: in -> input string
+ *        out -> STRING to append the escaped input to
  *        attr_quoted -> should be 0 if the input string appears on an JS
  *                       attribute and the entire attribute is not quoted.
  * Output: esc -> pointer to output string. Could point back to input string
  *                if the input does not need modification.
- *         do_free -> will be 1 if *esc should be freed. If it is 0, *esc
- *                    points to in.
  */
-static NEOERR *neos_auto_js_escape (const char *in, char **esc,
-                                    int attr_quoted, int *do_free)
+static NEOERR *neos_auto_js_escape (const char *in, STRING *out, char **esc,
+                                    int attr_quoted)
 {
-  int nl = 0;
-  int l = 0;
-  char *s;
-  char *metachars = JS_CHARS_LIST;
-
-  *do_free = 0;
+  NEOERR *err;
+  int start = out->len;
+  int run = 0;
+  int l;
+  char enc[4];
+  NEOS_SCANSET *metachars = &JS_CHARS;
+  int len = strlen(in);
+
+  *esc = (char *)in;
   /*
     attr_quoted can be false if
     - a variable inside a javascript attribute is being escaped
@@ -475,110 +424,68 @@ static NEOERR *neos_auto_js_escape (const char *in, char **esc,
     The variable could be used to inject additional attributes on the tag.
   */
   if (!attr_quoted)
-    metachars = JS_ATTR_UNQUOTED_LIST;
-
-  while (in[l])
-  {
-    if (IN_LIST(metachars, in[l]) || (in[l] > 0 && in[l] < 32) ||
-        (in[l] == 0x7f))
-    {
-      nl += 3;
-    }
-    l++;
-  }
+    metachars = &JS_ATTR_UNQUOTED_CHARS;
 
-  if (nl == 0) {
-    *esc = (char *)in;
+  l = neos_scan(metachars, in, len);
+  if (l == len)
     return STATUS_OK;
-  }
-
-  nl += l;
-  s = (char *) malloc(nl + 1);
-  if (s == NULL)
-    return nerr_raise (NERR_NOMEM, "Unable to allocate memory to escape %s",
-                       in);
 
-  l = 0;
-  nl = 0;
-  while (in[l])
+  while (l < len)
   {
-    if (IN_LIST(metachars, in[l]) || (in[l] > 0 && in[l] < 32) ||
-        (in[l] == 0x7f))
-    {
-      s[nl++] = '\\';
-      s[nl++] = 'x';
-      s[nl++] = "0123456789ABCDEF"[(in[l] >> 4) & 0xF];
-      s[nl++] = "0123456789ABCDEF"[in[l] & 0xF];
-      l++;
-    }
-    else
-    {
-      s[nl++] = in[l++];
-    }
+    enc[0] = '\\';
+    enc[1] = 'x';
+    enc[2] = "0123456789ABCDEF"[(in[l] >> 4) & 0xF];
+    enc[3] = "0123456789ABCDEF"[in[l] & 0xF];
+    err = string_appendn(out, in + run, l - run);
+    if (err == STATUS_OK)
+      err = string_appendn(out, enc, 4);
+    if (err) return nerr_pass(err);
+    run = l + 1;
+    l = run + neos_scan(metachars, in + run, len - run);
   }
-  s[nl] = '\0';
+  err = string_appendn(out, in + run, l - run);
+  if (err) return nerr_pass(err);
 
-  *esc = (char *)s;
-  *do_free = 1;
-  return STATUS_OK;
+  return nerr_pass(auto_escape_done(out, start, esc));
 }
 
+#define TAG_SAFE(c) (isalnum(c) || c == ':' || c == '_' || c == '-')
+
 /* Function: neos_auto_tag_validate - Force in to valid tag or attribute name.
  * Description: This function scans through in, looking for characters that are
  *              illegal in a tag or attribute name. It uses the same regular
  *              expression as the htmlparser - [A-Za-z0-9_:-]. All other
- *              characters are stripped out.
+ *              characters are stripped out, and the result appended to out.
  * Input: in -> input string
+ *        out -> STRING to append the output to
  *
  * Output: esc -> pointer to output string. Could point back to input string
  *                if the input does not need modification.
- *         do_free -> will be 1 if *esc should be freed. If it is 0, *esc
- *                    points to in.
  */
-static NEOERR *neos_auto_tag_validate (const char *in, char **esc, int *do_free)
+static NEOERR *neos_auto_tag_validate (const char *in, STRING *out, char **esc)
 {
+  NEOERR *err;
+  int start = out->len;
   int l = 0;
 
-  *do_free = 0;
-  while (in[l] &&
-         (isalnum(in[l]) || in[l] == ':' || in[l] == '_' || in[l] == '-')) {
+  *esc = (char *)in;
+  while (in[l] && TAG_SAFE(in[l])) {
     l++;
   }
 
   if (!in[l]) {
     /* while() looped successfully through all characters in 'in'.
        'in' is safe to use as is */
-    *esc = (char *)in;
-  }
-  else {
-    /* Create a new string, stripping out all dangerous characters from 'in' */
-    int i = 0;
-    char *s;
-    s = (char *) malloc(strlen(in) + 1);
-    if (s == NULL)
-      return nerr_raise (NERR_NOMEM,
-                         "Unable to allocate memory to escape %s", in);
-
-    l = 0;
-    while (in[l]) {
-      /* Strip out all except a whitelist of characters */
-      if (isalnum(in[l]) || in[l] == ':' || in[l] == '_' || in[l] == '-') {
-        s[i++] = in[l];
-      }
-
-      l++;
-    }
-
-    s[i] = '\0';
-    *esc = s;
-    *do_free = 1;
+    return STATUS_OK;
   }
 
-  return STATUS_OK;
+  /* Strip out all except a whitelist of characters */
+  AUTO_STRIP(in, out, TAG_SAFE(in[l]));
+  return nerr_pass(auto_escape_done(out, start, esc));
 }
 
-NEOERR *neos_auto_escape(NEOS_AUTO_CTX *ctx, const char* str, char **esc,
-                         int *do_free)
+NEOERR *neos_auto_escape_to(NEOS_AUTO_CTX *ctx, const char* str, STRING *out,
+                            char **esc)
 {
   htmlparser_ctx *hctx;
   int st;
@@ -593,8 +500,8 @@ NEOERR *neos_auto_escape(NEOS_AUTO_CTX *ctx, const char* str, char **esc,
   if (!esc)
     return nerr_raise(NERR_ASSERT, "esc is NULL");
 
-  if (!do_free)
-    return nerr_raise(NERR_ASSERT, "do_free is NULL");
+  if (!out)
+    return nerr_raise(NERR_ASSERT, "out is NULL");
 
   hctx = ctx->hctx;
   st = htmlparser_state(hctx);
@@ -602,7 +509,7 @@ NEOERR *neos_auto_escape(NEOS_AUTO_CTX *ctx, const char* str, char **esc,
 
   /* Inside an HTML tag or attribute name */
   if (st == HTMLPARSER_STATE_ATTR || st == HTMLPARSER_STATE_TAG) {
-    return nerr_pass(neos_auto_tag_validate(str, esc, do_free));
+    return nerr_pass(neos_auto_tag_validate(str, out, esc));
   }
 
   /* Inside an HTML attribute value */
@@ -614,20 +521,20 @@ NEOERR *neos_auto_escape(NEOS_AUTO_CTX *ctx, const char* str, char **esc,
     switch (type) {
       case HTMLPARSER_ATTR_REGULAR:
         /* <input value="<?cs var: Blah ?>"> : */
-        return nerr_pass(neos_auto_html_escape(str, esc,
-                                               attr_quoted, do_free));
+        return nerr_pass(neos_auto_html_escape(str, out, esc,
+                                               attr_quoted));
 
       case HTMLPARSER_ATTR_URI:
         if (htmlparser_value_index(hctx) == 0)
           /* <a href="<?cs var:MyUrl ?>"> : Validate URI scheme of MyUrl */
-          return nerr_pass(neos_auto_url_validate(str, esc,
-                                                  attr_quoted, do_free));
+          return nerr_pass(neos_auto_url_validate(str, out, esc,
+                                                  attr_quoted));
         else
           /* <a href="http://www.blah.com?x=<?cs var: MyQuery ?>">:
             MyQuery is not at start of URL, so it only needs html escaping.
           */
-          return nerr_pass(neos_auto_html_escape(str, esc,
-                                                 attr_quoted, do_free));
+          return nerr_pass(neos_auto_html_escape(str, out, esc,
+                                               attr_quoted));
 
       case HTMLPARSER_ATTR_JS:
         if (htmlparser_is_js_quoted(hctx))
@@ -638,8 +545,8 @@ NEOERR *neos_auto_escape(NEOS_AUTO_CTX *ctx, const char* str, char **esc,
             Note: neos_auto_js_escape() hex encodes all html metacharacters.
             Therefore it is safe to not do an HTML escape around this.
           */
-          return nerr_pass(neos_auto_js_escape(str, esc, attr_quoted,
-                                               do_free));
+          return nerr_pass(neos_auto_js_escape(str, out, esc,
+                                               attr_quoted));
         else
           /* <input onclick="alert(<?cs var:Blah ?>);"> OR
              <input onclick=alert(<?cs var:Blah ?>);> :
@@ -648,13 +555,13 @@ NEOERR *neos_auto_escape(NEOS_AUTO_CTX *ctx, const char* str, char **esc,
             inject arbitrary javascript. Only reason to omit the quotes is if
             the variable is intended to be a number.
           */
-          return nerr_pass(neos_auto_check_number(str, esc, do_free));
+          return nerr_pass(neos_auto_check_number(str, out, esc));
         break;
 
       case HTMLPARSER_ATTR_STYLE:
         /* <input style="border:<?cs var: FancyBorder ?>"> : */
-        return nerr_pass(neos_auto_css_validate((unsigned char*)str, esc,
-                                                attr_quoted, do_free));
+        return nerr_pass(neos_auto_css_validate((unsigned char*)str, out,
+                                                esc, attr_quoted));
 
       default:
         return nerr_raise(NERR_ASSERT, 
@@ -665,8 +572,8 @@ NEOERR *neos_auto_escape(NEOS_AUTO_CTX *ctx, const char* str, char **esc,
 
   if (st == HTMLPARSER_STATE_CSS_FILE || 
       (st == HTMLPARSER_STATE_TEXT && tag && strcmp(tag, "style") == 0)) {
-    return nerr_pass(neos_auto_css_validate((const unsigned char*)str, esc,
-                                            1, do_free));
+    return nerr_pass(neos_auto_css_validate((const unsigned char*)str, out,
+                                            esc, 1));
   }
 
   /* Inside javascript. Do JS escaping */
@@ -677,19 +584,45 @@ NEOERR *neos_auto_escape(NEOS_AUTO_CTX *ctx, const char* str, char **esc,
          They will also get stripped out if they are not numbers.
       */
       if (ctx->is_json) {
-        return nerr_pass(neos_auto_json_escape(str, esc, do_free));
+        return nerr_pass(neos_auto_json_escape(str, out, esc));
       } else {
-        return nerr_pass(neos_auto_js_escape(str, esc, 1, do_free));
+        return nerr_pass(neos_auto_js_escape(str, out, esc, 1));
       }
     else
       /* <script> var a = "<?cs var: Blah ?>"; </script> */
-      return nerr_pass(neos_auto_check_number(str, esc, do_free));
+      return nerr_pass(neos_auto_check_number(str, out, esc));
   }
 
   /* Default is assumed to be HTML body */
   /* <b>Hello <?cs var: UserName ?></b> : */
-  return nerr_pass(neos_auto_html_escape(str, esc, 1, do_free));
+  return nerr_pass(neos_auto_html_escape(str, out, esc, 1));
+
+}
+
+NEOERR *neos_auto_escape(NEOS_AUTO_CTX *ctx, const char* str, char **esc,
+                         int *do_free)
+{
+  NEOERR *err;
+  STRING out;
+
+  if (!do_free)
+    return nerr_raise(NERR_ASSERT, "do_free is NULL");
 
+  *do_free = 0;
+  string_init(&out);
+  err = neos_auto_escape_to(ctx, str, &out, esc);
+  if (err)
+  {
+    string_clear(&out);
+    return nerr_pass(err);
+  }
+  /* Anything escaped starts at the beginning of out, which the caller
+   * now owns */
+  if (*esc != str)
+    *do_free = 1;
+  else
+    string_clear(&out);
+  return STATUS_OK;
 }
 
 NEOERR *neos_auto_parse_var(NEOS_AUTO_CTX *ctx, const char *str, int len)
@@ -758,6 +691,59 @@ NEOERR *neos_auto_parse(NEOS_AUTO_CTX *ctx, const char *str, int len)
   return STATUS_OK;
 }
 
+/* Elements whose content isn't parsed as HTML */
+static const char *CDataTags[] = {
+  "script", "style", "title", "textarea", "xmp", NULL
+};
+
+int neos_auto_in_text(NEOS_AUTO_CTX *ctx)
+{
+  const char *tag;
+  int x;
+
+  if (htmlparser_state(ctx->hctx) != HTMLPARSER_STATE_TEXT ||
+      htmlparser_in_js(ctx->hctx))
+    return 0;
+
+  tag = htmlparser_tag(ctx->hctx);
+  if (tag == NULL) return 1;
+  for (x = 0; CDataTags[x] != NULL; x++)
+  {
+    if (strcasecmp(tag, CDataTags[x]) == 0) return 0;
+  }
+  return 1;
+}
+
+NEOERR *neos_auto_parse_text(const char *str, int len, NEOS_AUTO_CTX **pctx)
+{
+  NEOERR *err;
+  NEOS_AUTO_CTX *ctx;
+
+  if (!pctx)
+    return nerr_raise(NERR_ASSERT, "pctx is NULL");
+  *pctx = NULL;
+
+  err = neos_auto_init(&ctx);
+  if (err)
+  {
+    neos_auto_destroy(&ctx);
+    return nerr_pass(err);
+  }
+  err = neos_auto_parse(ctx, str, len);
+  if (err != STATUS_OK || neos_auto_in_text(ctx))
+  {
+    neos_auto_destroy(&ctx);
+    return nerr_pass(err);
+  }
+  *pctx = ctx;
+  return STATUS_OK;
+}
+
+void neos_auto_copy(NEOS_AUTO_CTX *dst, NEOS_AUTO_CTX *src)
+{
+  htmlparser_copy(dst->hctx, src->hctx);
+}
+
 NEOERR *neos_auto_set_content_type(NEOS_AUTO_CTX *ctx, const char *type)
 {
   struct _neos_content_map *esc;
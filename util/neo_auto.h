@@ -35,6 +35,24 @@ typedef struct _neos_auto_ctx NEOS_AUTO_CTX;
 NEOERR *neos_auto_escape(NEOS_AUTO_CTX *ctx, const char* str,
                          char **esc, int *do_free);
 
+/*
+ * Function: neos_auto_escape_to - Escape input into a caller's buffer.
+ * Description: Like neos_auto_escape, but instead of allocating a new
+ *              string for the escaped output, it is appended to out, so a
+ *              caller escaping many strings can reuse one buffer.
+ * Input: ctx -> an object specifying the currrent auto-escape context.
+ *        str -> input string which will be escaped.
+ *        out -> STRING the escaped string is appended to.
+ *
+ * Output: esc -> str if it needs no escaping, and out is unchanged.
+ *         Otherwise, the start of the escaped string within out->buf, which
+ *         is only valid until out is next changed.
+ * Returns: NERR_NOMEM if unable to allocate memory for output.
+ *          NERR_ASSERT if any of the supplied pointers are NULL.
+ */
+NEOERR *neos_auto_escape_to(NEOS_AUTO_CTX *ctx, const char* str,
+                            STRING *out, char **esc);
+
 /*
  * Function: neos_auto_parse_var - Parse input if parser is in interesting state.
  * Description: neos_auto_parse_var takes an auto-escape context, which contains
@@ -65,6 +83,50 @@ NEOERR *neos_auto_parse_var(NEOS_AUTO_CTX *ctx, const char *str, int len);
  */
 NEOERR *neos_auto_parse(NEOS_AUTO_CTX *ctx, const char *str, int len);
 
+/*
+ * Function: neos_auto_in_text - Check if the parser is in plain HTML text.
+ * Description: Returns true if the parser is in HTML body text, outside of
+ *              any tag, comment, or script, style, title or textarea
+ *              element.  How text is parsed from this state doesn't depend
+ *              on anything before it, which is what lets a template
+ *              precompute the effect of its literals with
+ *              neos_auto_parse_text.
+ * Input: ctx -> an object specifying the currrent auto-escape context.
+ *
+ * Output: None
+ * Returns: 1 if in plain text, 0 otherwise.
+ */
+int neos_auto_in_text(NEOS_AUTO_CTX *ctx);
+
+/*
+ * Function: neos_auto_parse_text - Precompute the parse of a literal.
+ * Description: Parses str with a new context, starting in plain HTML text.
+ *              Whenever neos_auto_in_text is true, parsing str again would
+ *              leave the parser in the returned state, so neos_auto_copy
+ *              can be used instead.
+ * Input: str -> input string to parse.
+ *        len -> length of str.
+ *
+ * Output: pctx -> NULL if str also ends in plain HTML text, so parsing it
+ *                 from there changes nothing which matters.  Otherwise, a
+ *                 new NEOS_AUTO_CTX holding the state after str.
+ * Returns: NERR_ASSERT if the htmlparser fails to parse str.
+ *          NERR_NOMEM if unable to allocate memory for *pctx.
+ */
+NEOERR *neos_auto_parse_text(const char *str, int len, NEOS_AUTO_CTX **pctx);
+
+/*
+ * Function: neos_auto_copy - Copy the state of one context to another.
+ * Description: Copies the htmlparser state of src to dst.  The content type
+ *              of dst is left as is.
+ * Input: dst -> the context to update.
+ *        src -> the context to copy from.
+ *
+ * Output: None.
+ * Returns: None.
+ */
+void neos_auto_copy(NEOS_AUTO_CTX *dst, NEOS_AUTO_CTX *src);
+
 /*
  * Function: neos_auto_init - Create and initialize a NEOS_AUTO_CTX object.
  * Description: Returns an initialized NEOS_AUTO_CTX object, by internally
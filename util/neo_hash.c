@@ -13,32 +13,57 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "neo_misc.h"
 #include "neo_err.h"
 #include "neo_hash.h"
 
+/* The table starts small, since every HDF level with more than
+ * FORCE_HASH_AT children gets one, and doubles when more than 3/4
+ * of the slots are taken. */
+#define HASH_INIT_SIZE 32
+
 static NEOERR *_hash_resize(NE_HASH *hash);
-static NE_HASHNODE **_hash_lookup_node (NE_HASH *hash, void *key, UINT32 *hashv);
+static void _hash_place (NE_HASH *hash, void *key, void *value, UINT32 hashv);
+static int _hash_lookup_slot (NE_HASH *hash, void *key, UINT32 hashv);
+
+/* How far the entry in slot x is from its bucket */
+#define HASH_DIST(hash, x) \
+  (((x) - (hash)->hashes[x]) & ((hash)->size - 1))
+
+static NEOERR *_hash_alloc(NE_HASH *hash, UINT32 size)
+{
+  hash->hashes = (UINT32 *) calloc (size, sizeof(UINT32));
+  hash->nodes = (NE_HASHNODE *) malloc (size * sizeof(NE_HASHNODE));
+  if (hash->hashes == NULL || hash->nodes == NULL)
+  {
+    free(hash->hashes);
+    free(hash->nodes);
+    return nerr_raise(NERR_NOMEM, "Unable to allocate memory for NE_HASHNODES");
+  }
+  hash->size = size;
+  return STATUS_OK;
+}
 
 NEOERR *ne_hash_init (NE_HASH **hash, NE_HASH_FUNC hash_func, NE_COMP_FUNC comp_func)
 {
+  NEOERR *err;
   NE_HASH *my_hash = NULL;
 
   my_hash = (NE_HASH *) calloc(1, sizeof(NE_HASH));
   if (my_hash == NULL)
     return nerr_raise(NERR_NOMEM, "Unable to allocate memory for NE_HASH");
 
-  my_hash->size = 256;
   my_hash->num = 0;
   my_hash->hash_func = hash_func;
   my_hash->comp_func = comp_func;
 
-  my_hash->nodes = (NE_HASHNODE **) calloc (my_hash->size, sizeof(NE_HASHNODE *));
-  if (my_hash->nodes == NULL)
+  err = _hash_alloc(my_hash, HASH_INIT_SIZE);
+  if (err != STATUS_OK)
   {
     free(my_hash);
-    return nerr_raise(NERR_NOMEM, "Unable to allocate memory for NE_HASHNODES");
+    return nerr_pass(err);
   }
 
   *hash = my_hash;
@@ -49,226 +74,250 @@ NEOERR *ne_hash_init (NE_HASH **hash, NE_HASH_FUNC hash_func, NE_COMP_FUNC comp_
 void ne_hash_destroy (NE_HASH **hash)
 {
   NE_HASH *my_hash;
-  NE_HASHNODE *node, *next;
-  int x;
 
   if (hash == NULL || *hash == NULL)
     return;
 
   my_hash = *hash;
 
-  for (x = 0; x < my_hash->size; x++)
-  {
-    node = my_hash->nodes[x];
-    while (node)
-    {
-      next = node->next;
-      free(node);
-      node = next;
-    }
-  }
+  free(my_hash->hashes);
   free(my_hash->nodes);
-  my_hash->nodes = NULL;
   free(my_hash);
   *hash = NULL;
 }
 
 NEOERR *ne_hash_insert(NE_HASH *hash, void *key, void *value)
 {
+  NEOERR *err;
   UINT32 hashv;
-  NE_HASHNODE **node;
+  int x;
 
-  node = _hash_lookup_node(hash, key, &hashv);
+  hashv = hash->hash_func(key);
+  x = _hash_lookup_slot(hash, key, hashv);
 
-  if (*node)
+  if (x >= 0)
   {
-    (*node)->value = value;
+    hash->nodes[x].value = value;
+    return STATUS_OK;
   }
-  else
+
+  /* Grow before placing the new entry, so a failure leaves the hash as
+   * it was */
+  if ((hash->num + 1) * 4 > hash->size * 3)
   {
-    *node = (NE_HASHNODE *) malloc(sizeof(NE_HASHNODE));
-    if (node == NULL)
-      return nerr_raise(NERR_NOMEM, "Unable to allocate NE_HASHNODE");
-
-    (*node)->hashv = hashv;
-    (*node)->key = key;
-    (*node)->value = value;
-    (*node)->next = NULL;
+    err = _hash_resize(hash);
+    if (err) return nerr_pass(err);
   }
+  _hash_place(hash, key, value, hashv);
   hash->num++;
 
-  return _hash_resize(hash);
+  return STATUS_OK;
 }
 
 void *ne_hash_lookup(NE_HASH *hash, void *key)
 {
-  NE_HASHNODE *node;
+  int x;
+
+  x = _hash_lookup_slot(hash, key, hash->hash_func(key));
+
+  return (x >= 0) ? hash->nodes[x].value : NULL;
+}
+
+void *ne_hash_lookup_hashv(NE_HASH *hash, void *key, UINT32 hashv)
+{
+  int x;
 
-  node = *_hash_lookup_node(hash, key, NULL);
+  x = _hash_lookup_slot(hash, key, hashv);
 
-  return (node) ? node->value : NULL;
+  return (x >= 0) ? hash->nodes[x].value : NULL;
 }
 
 void *ne_hash_remove(NE_HASH *hash, void *key)
 {
-  NE_HASHNODE **node, *rem;
-  void *value = NULL;
+  UINT32 next, mask;
+  void *value;
+  int x;
+
+  x = _hash_lookup_slot(hash, key, hash->hash_func(key));
+  if (x < 0)
+    return NULL;
+
+  value = hash->nodes[x].value;
+  mask = hash->size - 1;
 
-  node = _hash_lookup_node(hash, key, NULL);
-  if (*node)
+  /* Shift the entries after it back a slot, up to the first one that is
+   * already in its own bucket, instead of leaving a tombstone */
+  next = (x + 1) & mask;
+  while (hash->hashes[next] && HASH_DIST(hash, next))
   {
-    rem = *node;
-    *node = rem->next;
-    value = rem->value;
-    free(rem);
-    hash->num--;
+    hash->hashes[x] = hash->hashes[next];
+    hash->nodes[x] = hash->nodes[next];
+    x = next;
+    next = (x + 1) & mask;
   }
+  hash->hashes[x] = 0;
+  hash->num--;
+
   return value;
 }
 
 int ne_hash_has_key(NE_HASH *hash, void *key)
 {
-  NE_HASHNODE *node;
-
-  node = *_hash_lookup_node(hash, key, NULL);
-
-  if (node) return 1;
-  return 0;
+  return _hash_lookup_slot(hash, key, hash->hash_func(key)) >= 0;
 }
 
 void *ne_hash_next(NE_HASH *hash, void **key)
 {
-  NE_HASHNODE **node = 0;
-  UINT32 hashv, bucket;
+  UINT32 hashv, x = 0;
+  int slot;
 
   if (*key)
   {
-    node = _hash_lookup_node(hash, *key, NULL);
+    hashv = hash->hash_func(*key);
+    slot = _hash_lookup_slot(hash, *key, hashv);
 
-    if (*node)
-    {
-      bucket = (*node)->hashv & (hash->size - 1);
-    }
+    if (slot >= 0)
+      x = slot + 1;
     else
-    {
-      hashv = hash->hash_func(*key);
-      bucket = hashv & (hash->size - 1);
-    }
-  }
-  else
-  {
-    bucket = 0;
-  }
-
-  if (node && *node)
-  {
-    if ((*node)->next)
-    {
-      *key = (*node)->next->key;
-      return (*node)->next->value;
-    }
-    bucket++;
+      x = hashv & (hash->size - 1);
   }
 
-  while (bucket < hash->size)
+  while (x < hash->size)
   {
-    if (hash->nodes[bucket])
+    if (hash->hashes[x])
     {
-      *key = hash->nodes[bucket]->key;
-      return hash->nodes[bucket]->value;
+      *key = hash->nodes[x].key;
+      return hash->nodes[x].value;
     }
-    bucket++;
+    x++;
   }
 
   return NULL;
 }
 
-static NE_HASHNODE **_hash_lookup_node (NE_HASH *hash, void *key, UINT32 *o_hashv)
+/* Returns the slot holding key, or -1 */
+static int _hash_lookup_slot (NE_HASH *hash, void *key, UINT32 hashv)
 {
-  UINT32 hashv, bucket;
-  NE_HASHNODE **node;
+  UINT32 mask = hash->size - 1;
+  UINT32 x, h, dist = 0;
 
-  hashv = hash->hash_func(key);
-  if (o_hashv) *o_hashv = hashv;
-  bucket = hashv & (hash->size - 1);
-  /* ne_warn("Lookup %s %d %d", key, hashv, bucket); */
-
-  node = &(hash->nodes[bucket]);
-
-  if (hash->comp_func)
+  hashv |= NE_HASH_USED;
+  x = hashv & mask;
+  while (1)
   {
-    while (*node && !(hash->comp_func((*node)->key, key)))
-      node = &(*node)->next;
+    h = hash->hashes[x];
+    /* Empty, or an entry closer to its bucket than we'd be to ours: it
+     * would have been placed here, so it isn't in the table */
+    if (h == 0 || ((x - h) & mask) < dist)
+      return -1;
+    /* Only compare keys whose hash matches.  No comp_func means we're
+     * doing pointer comparisons */
+    if (h == hashv && (hash->comp_func ?
+                       hash->comp_func(hash->nodes[x].key, key) :
+                       hash->nodes[x].key == key))
+      return x;
+    x = (x + 1) & mask;
+    dist++;
   }
-  else
+}
+
+/* Robin Hood placement: walking from the bucket, the new entry takes the
+ * slot of the first entry that is closer to its own bucket, which then
+ * moves on looking for a slot in turn.  This keeps the probe lengths
+ * short and even, and lets lookups stop early. */
+static void _hash_place (NE_HASH *hash, void *key, void *value, UINT32 hashv)
+{
+  NE_HASHNODE entry, tmp;
+  UINT32 mask = hash->size - 1;
+  UINT32 x, h, dist = 0;
+
+  entry.key = key;
+  entry.value = value;
+  hashv |= NE_HASH_USED;
+  x = hashv & mask;
+
+  while ((h = hash->hashes[x]) != 0)
   {
-    /* No comp_func means we're doing pointer comparisons */
-    while (*node && (*node)->key != key)
-      node = &(*node)->next;
+    if (((x - h) & mask) < dist)
+    {
+      tmp = hash->nodes[x];
+      hash->nodes[x] = entry;
+      hash->hashes[x] = hashv;
+      entry = tmp;
+      hashv = h;
+      dist = (x - h) & mask;
+    }
+    x = (x + 1) & mask;
+    dist++;
   }
-
-  /* ne_warn("Node %x", node); */
-  return node;
+  hash->hashes[x] = hashv;
+  hash->nodes[x] = entry;
 }
 
-/* Ok, we're doing some weirdness here... */
 static NEOERR *_hash_resize(NE_HASH *hash)
 {
-  NE_HASHNODE **new_nodes;
-  NE_HASHNODE *entry, *prev;
-  int x, next_bucket;
-  int orig_size = hash->size;
-  UINT32 hash_mask;
+  NEOERR *err;
+  NE_HASHNODE *old_nodes;
+  UINT32 *old_hashes;
+  UINT32 old_size, x;
 
-  if (hash->size > hash->num)
-    return STATUS_OK;
+  old_hashes = hash->hashes;
+  old_nodes = hash->nodes;
+  old_size = hash->size;
 
   /* We always double in size */
-  new_nodes = (NE_HASHNODE **) realloc (hash->nodes, (hash->size*2) * sizeof(NE_HASHNODE));
-  if (new_nodes == NULL)
-    return nerr_raise(NERR_NOMEM, "Unable to allocate memory to resize NE_HASH");
-
-  hash->nodes = new_nodes;
-  orig_size = hash->size;
-  hash->size = hash->size*2;
+  err = _hash_alloc(hash, old_size * 2);
+  if (err)
+  {
+    hash->hashes = old_hashes;
+    hash->nodes = old_nodes;
+    return nerr_pass(err);
+  }
 
-  /* Initialize new parts */
-  for (x = orig_size; x < hash->size; x++)
+  for (x = 0; x < old_size; x++)
   {
-    hash->nodes[x] = NULL;
+    if (old_hashes[x])
+      _hash_place(hash, old_nodes[x].key, old_nodes[x].value, old_hashes[x]);
   }
+  free(old_hashes);
+  free(old_nodes);
+
+  return STATUS_OK;
+}
 
-  hash_mask = hash->size - 1;
+/* Multiply and xor-shift over 64 bit words, with the 64 bit finalizer
+ * from MurmurHash3 so that the low bits we use for the bucket depend on
+ * every byte. */
+#define HASH_MUL1 0x9e3779b97f4a7c15ULL
+#define HASH_MUL2 0xff51afd7ed558ccdULL
 
-  for (x = 0; x < orig_size; x++)
+UINT32 ne_hash_bytes(const void *data, UINT32 len)
+{
+  const unsigned char *p = (const unsigned char *) data;
+  uint64_t h = HASH_MUL1 ^ ((uint64_t) len * HASH_MUL2);
+  uint64_t w;
+
+  while (len >= 8)
   {
-    prev = NULL;
-    next_bucket = x + orig_size;
-    for (entry = hash->nodes[x]; 
-	 entry; 
-	 entry = prev ? prev->next : hash->nodes[x]) 
-    {
-      if ((entry->hashv & hash_mask) != x)
-      {
-	if (prev)
-	{
-	  prev->next = entry->next;
-	}
-	else
-	{
-	  hash->nodes[x] = entry->next;
-	}
-	entry->next = hash->nodes[next_bucket];
-	hash->nodes[next_bucket] = entry;
-      }
-      else
-      {
-	prev = entry;
-      }
-    }
+    memcpy(&w, p, 8);
+    h = (h ^ w) * HASH_MUL1;
+    h ^= h >> 29;
+    p += 8;
+    len -= 8;
   }
-  
-  return STATUS_OK;
+  if (len)
+  {
+    w = 0;
+    memcpy(&w, p, len);
+    h = (h ^ w) * HASH_MUL1;
+    h ^= h >> 29;
+  }
+
+  h ^= h >> 33;
+  h *= HASH_MUL2;
+  h ^= h >> 33;
+
+  return (UINT32) h;
 }
 
 int ne_hash_str_comp(const void *a, const void *b)
@@ -278,7 +327,7 @@ int ne_hash_str_comp(const void *a, const void *b)
 
 UINT32 ne_hash_str_hash(const void *a)
 {
-  return ne_crc((unsigned char *)a, strlen((const char *)a));
+  return ne_hash_bytes(a, strlen((const char *)a));
 }
 
 int ne_hash_int_comp(const void *a, const void *b)
@@ -20,12 +20,18 @@ __BEGIN_DECLS
 typedef UINT32 (*NE_HASH_FUNC)(const void *);
 typedef int (*NE_COMP_FUNC)(const void *, const void *);
 
+/* The table is open addressed: each entry is stored directly in the
+ * nodes array, in the first free slot at or after bucket
+ * (hashv & (size - 1)), Robin Hood style.  The hash of each slot's
+ * entry is kept apart in the hashes array, so probing only touches the
+ * keys whose hash matches; NE_HASH_USED is set in it so that 0 marks an
+ * empty slot. */
+#define NE_HASH_USED 0x80000000
+
 typedef struct _NE_HASHNODE
 {
   void *key;
   void *value;
-  UINT32 hashv;
-  struct _NE_HASHNODE *next;
 } NE_HASHNODE;
 
 typedef struct _HASH
@@ -33,7 +39,8 @@ typedef struct _HASH
   UINT32 size;
   UINT32 num;
 
-  NE_HASHNODE **nodes;
+  UINT32 *hashes;
+  NE_HASHNODE *nodes;
   NE_HASH_FUNC hash_func;
   NE_COMP_FUNC comp_func;
 } NE_HASH;
@@ -42,10 +49,19 @@ NEOERR *ne_hash_init (NE_HASH **hash, NE_HASH_FUNC hash_func, NE_COMP_FUNC comp_
 void ne_hash_destroy (NE_HASH **hash);
 NEOERR *ne_hash_insert(NE_HASH *hash, void *key, void *value);
 void *ne_hash_lookup(NE_HASH *hash, void *key);
+/* Like ne_hash_lookup, but with hashv = hash->hash_func(key) computed
+ * earlier by the caller */
+void *ne_hash_lookup_hashv(NE_HASH *hash, void *key, UINT32 hashv);
 int ne_hash_has_key(NE_HASH *hash, void *key);
 void *ne_hash_remove(NE_HASH *hash, void *key);
+/* Removing an entry moves others around, so after an ne_hash_remove
+ * start iterating over with *key == NULL */
 void *ne_hash_next(NE_HASH *hash, void **key);
 
+/* Hash len bytes of data, eight at a time.  This is what
+ * ne_hash_str_hash and the HDF child index use. */
+UINT32 ne_hash_bytes(const void *data, UINT32 len);
+
 int ne_hash_str_comp(const void *a, const void *b);
 UINT32 ne_hash_str_hash(const void *a);
 
@@ -26,11 +26,40 @@
 #include "neo_hdf.h"
 #include "neo_str.h"
 #include "neo_files.h"
+#include "neo_arena.h"
 #include "ulist.h"
 
 static NEOERR* hdf_read_file_internal (HDF *hdf, const char *path,
                                        int include_handle);
 
+/* Node names are interned per data set: all the nodes with a given name
+ * share one copy of it, which follows an HDF_ATOM caching its hash.  Two
+ * nodes have the same name exactly when their name pointers are equal.
+ * Lookups by a (part of a) dotted name still compare the string, since
+ * finding its interned copy first would cost as much as the compare. */
+typedef struct _hdf_atom
+{
+  const char *name;
+  int len;
+  UINT32 hash;
+  int refs;
+} HDF_ATOM;
+
+#define HDF_NAME_ATOM(n) (((HDF_ATOM *)(n)) - 1)
+
+static int hash_atom_comp(const void *a, const void *b)
+{
+  HDF_ATOM *aa = (HDF_ATOM *)a;
+  HDF_ATOM *ab = (HDF_ATOM *)b;
+
+  return (aa->len == ab->len) && !memcmp(aa->name, ab->name, aa->len);
+}
+
+static UINT32 hash_atom_hash(const void *a)
+{
+  return ((HDF_ATOM *)a)->hash;
+}
+
 /* Ok, in order to use the hash, we have to support n-len strings
  * instead of null terminated strings (since in set_value and walk_hdf
  * we are merely using part of the HDF name for lookup, and that might
@@ -40,6 +69,8 @@ static NEOERR* hdf_read_file_internal (HDF *hdf, const char *path,
  * Since HASH doesn't maintain any data placed in it, merely pointers to
  * it, we use the HDF node itself as the key, and have specific
  * comp/hash functions which just use the name/name_len as the key.
+ * hash_hdf_hash is only used on nodes, whose names are interned, so
+ * lookups with a name segment must use ne_hash_lookup_hashv.
  */
 
 static int hash_hdf_comp(const void *a, const void *b)
@@ -47,19 +78,164 @@ static int hash_hdf_comp(const void *a, const void *b)
   HDF *ha = (HDF *)a;
   HDF *hb = (HDF *)b;
 
-  return (ha->name_len == hb->name_len) && !strncmp(ha->name, hb->name, ha->name_len);
+  return (ha->name == hb->name) || ((ha->name_len == hb->name_len) &&
+      !memcmp(ha->name, hb->name, ha->name_len));
 }
 
 static UINT32 hash_hdf_hash(const void *a)
 {
   HDF *ha = (HDF *)a;
-  return ne_crc((UINT8 *)(ha->name), ha->name_len);
+  return HDF_NAME_ATOM(ha->name)->hash;
+}
+
+UINT32 hdf_seg_hash (const char *name, int len)
+{
+  return ne_hash_bytes(name, len);
+}
+
+/* A data set created with hdf_init_arena allocates its nodes, names,
+ * values and attributes from the arena, and never frees them
+ * individually, so alloc_value is never set on its nodes.  The hash
+ * tables for large levels still use malloc, so we keep track of them
+ * to destroy along with the arena. */
+typedef struct _hdf_arena
+{
+  NE_ARENA arena;
+  ULIST *hashes;
+} HDF_ARENA;
+
+#define HDF_ARENA_BLOCK_SIZE (64 * 1024)
+
+struct _hdf_shared
+{
+  NE_HASH *names;     /* HDF_ATOMs of all the node names */
+  HDF_ARENA *arena;   /* only for hdf_init_arena */
+  int frozen;         /* set by hdf_freeze, no more changes allowed */
+};
+
+static HDF_ARENA *_hdf_arena (HDF *hdf)
+{
+  if (hdf == NULL || hdf->top == NULL) return NULL;
+  return hdf->top->shared->arena;
+}
+
+static int _hdf_frozen (HDF *hdf)
+{
+  return (hdf != NULL && hdf->top != NULL && hdf->top->shared->frozen);
+}
+
+static void *_hdf_calloc (HDF_ARENA *arena, size_t len)
+{
+  if (arena != NULL) return ne_arena_calloc(&(arena->arena), len);
+  return calloc(1, len);
+}
+
+static char *_hdf_strndup (HDF_ARENA *arena, const char *s, size_t len)
+{
+  char *r;
+
+  if (arena != NULL) return ne_arena_strndup(&(arena->arena), s, len);
+  r = (char *) malloc (len + 1);
+  if (r == NULL) return NULL;
+  memcpy(r, s, len);
+  r[len] = '\0';
+  return r;
+}
+
+static void _hdf_free (HDF_ARENA *arena, void *ptr)
+{
+  if (arena == NULL) free(ptr);
+}
+
+/* Return a reference to the interned copy of name in *ret, adding it to
+ * the table if this is the first node with that name */
+static NEOERR *_hdf_name_intern (HDF *top, const char *name, int len,
+                                 char **ret)
+{
+  NEOERR *err;
+  HDF_SHARED *shared = top->shared;
+  HDF_ATOM key, *atom;
+
+  key.name = name;
+  key.len = len;
+  key.hash = hdf_seg_hash(name, len);
+  if (shared->names == NULL)
+  {
+    err = ne_hash_init(&(shared->names), hash_atom_hash, hash_atom_comp);
+    if (err) return nerr_pass(err);
+  }
+  atom = (HDF_ATOM *) ne_hash_lookup_hashv(shared->names, &key, key.hash);
+  if (atom == NULL)
+  {
+    atom = (HDF_ATOM *) _hdf_calloc(shared->arena, sizeof(HDF_ATOM) + len + 1);
+    if (atom == NULL)
+      return nerr_raise (NERR_NOMEM,
+	  "Unable to allocate memory for hdf element: %s", name);
+    atom->name = (char *)(atom + 1);
+    memcpy(atom + 1, name, len);
+    atom->len = len;
+    atom->hash = key.hash;
+    err = ne_hash_insert(shared->names, atom, atom);
+    if (err)
+    {
+      _hdf_free(shared->arena, atom);
+      return nerr_pass(err);
+    }
+  }
+  atom->refs++;
+  *ret = (char *)atom->name;
+  return STATUS_OK;
+}
+
+static void _hdf_name_release (HDF *top, char *name)
+{
+  HDF_ATOM *atom = HDF_NAME_ATOM(name);
+
+  if (--atom->refs > 0 || top->shared->arena != NULL) return;
+  ne_hash_remove(top->shared->names, atom);
+  free(atom);
+}
+
+/* Make value the value of node, following the dupl/wf ownership rules
+ * of _set_value.  An arena data set takes a copy of a buffer it would
+ * own (and frees the buffer), so its values all live in the arena.
+ * Returns -1 if out of memory, in which case the node is unchanged. */
+static int _store_value (HDF *node, HDF_ARENA *arena, const char *value,
+                         int dupl, int wf)
+{
+  char *copy;
+
+  if (value == NULL)
+  {
+    node->alloc_value = 0;
+    node->value = NULL;
+  }
+  else if (dupl || (wf && arena != NULL))
+  {
+    copy = _hdf_strndup(arena, value, strlen(value));
+    if (copy == NULL) return -1;
+    if (!dupl) free((char *)value);
+    node->alloc_value = (arena == NULL);
+    node->value = copy;
+  }
+  else
+  {
+    node->alloc_value = wf;
+    /* We're overriding the const of value here for the set_buf case
+     * where we overrode the char * to const char * earlier, since
+     * alloc_value actually keeps track of the const-ness for us */
+    node->value = (char *)value;
+  }
+  return 0;
 }
 
 static NEOERR *_alloc_hdf (HDF **hdf, const char *name, size_t nlen,
                            const char *value, int dupl, int wf, HDF *top)
 {
-  *hdf = calloc (1, sizeof (HDF));
+  NEOERR *err;
+  HDF_ARENA *arena = top ? top->shared->arena : NULL;
+
+  *hdf = _hdf_calloc (arena, sizeof (HDF));
   if (*hdf == NULL)
   {
     return nerr_raise (NERR_NOMEM, "Unable to allocate memory for hdf element");
@@ -70,39 +246,23 @@ static NEOERR *_alloc_hdf (HDF **hdf, const char *name, size_t nlen,
   if (name != NULL)
   {
     (*hdf)->name_len = nlen;
-    (*hdf)->name = (char *) malloc (nlen + 1);
-    if ((*hdf)->name == NULL)
+    err = _hdf_name_intern (top, name, nlen, &((*hdf)->name));
+    if (err != STATUS_OK)
     {
-      free((*hdf));
+      _hdf_free(arena, (*hdf));
       (*hdf) = NULL;
-      return nerr_raise (NERR_NOMEM,
-	  "Unable to allocate memory for hdf element: %s", name);
+      return nerr_pass (err);
     }
-    strncpy((*hdf)->name, name, nlen);
-    (*hdf)->name[nlen] = '\0';
   }
   if (value != NULL)
   {
-    if (dupl)
+    if (_store_value(*hdf, arena, value, dupl, wf))
     {
-      (*hdf)->alloc_value = 1;
-      (*hdf)->value = strdup(value);
-      if ((*hdf)->value == NULL)
-      {
-	free((*hdf)->name);
-	free((*hdf));
-	(*hdf) = NULL;
-	return nerr_raise (NERR_NOMEM,
-	    "Unable to allocate memory for hdf element %s", name);
-      }
-    }
-    else
-    {
-      (*hdf)->alloc_value = wf;
-      /* We're overriding the const of value here for the set_buf case
-       * where we overrode the char * to const char * earlier, since
-       * alloc_value actually keeps track of the const-ness for us */
-      (*hdf)->value = (char *)value;
+      if ((*hdf)->name != NULL) _hdf_name_release(top, (*hdf)->name);
+      _hdf_free(arena, (*hdf));
+      (*hdf) = NULL;
+      return nerr_raise (NERR_NOMEM,
+	  "Unable to allocate memory for hdf element %s", name);
     }
   }
   return STATUS_OK;
@@ -144,7 +304,7 @@ static void _dealloc_hdf (HDF **hdf)
   }
   if (myhdf->name != NULL)
   {
-    free (myhdf->name);
+    _hdf_name_release (myhdf->top, myhdf->name);
     myhdf->name = NULL;
   }
   if (myhdf->value != NULL)
@@ -180,19 +340,103 @@ NEOERR* hdf_init (HDF **hdf)
   if (err != STATUS_OK)
     return nerr_pass (err);
 
+  my_hdf->shared = (HDF_SHARED *) calloc (1, sizeof (HDF_SHARED));
+  if (my_hdf->shared == NULL)
+  {
+    free(my_hdf);
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for hdf element");
+  }
+  my_hdf->top = my_hdf;
+
+  *hdf = my_hdf;
+
+  return STATUS_OK;
+}
+
+NEOERR* hdf_init_arena (HDF **hdf)
+{
+  NEOERR *err;
+  HDF_SHARED *shared;
+  HDF_ARENA *arena;
+  HDF *my_hdf;
+
+  *hdf = NULL;
+
+  err = nerr_init();
+  if (err != STATUS_OK)
+    return nerr_pass (err);
+
+  shared = (HDF_SHARED *) calloc (1, sizeof (HDF_SHARED));
+  if (shared == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for hdf arena");
+  arena = (HDF_ARENA *) calloc (1, sizeof (HDF_ARENA));
+  if (arena == NULL)
+  {
+    free(shared);
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for hdf arena");
+  }
+  shared->arena = arena;
+  ne_arena_init(&(arena->arena), HDF_ARENA_BLOCK_SIZE);
+  err = uListInit(&(arena->hashes), 10, 0);
+  if (err != STATUS_OK)
+  {
+    free(arena);
+    free(shared);
+    return nerr_pass (err);
+  }
+
+  my_hdf = (HDF *) ne_arena_calloc (&(arena->arena), sizeof (HDF));
+  if (my_hdf == NULL)
+  {
+    uListDestroy(&(arena->hashes), 0);
+    free(arena);
+    free(shared);
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for hdf element");
+  }
+
   my_hdf->top = my_hdf;
+  my_hdf->shared = shared;
 
   *hdf = my_hdf;
 
   return STATUS_OK;
 }
 
+static void _dealloc_hdf_arena (HDF_ARENA *arena)
+{
+  NE_HASH *hash;
+  int x;
+
+  for (x = 0; x < uListLength(arena->hashes); x++)
+  {
+    uListGet(arena->hashes, x, (void *)&hash);
+    ne_hash_destroy(&hash);
+  }
+  uListDestroy(&(arena->hashes), 0);
+  ne_arena_destroy(&(arena->arena));
+  free(arena);
+}
+
 void hdf_destroy (HDF **hdf)
 {
+  HDF_SHARED *shared;
+
   if (*hdf == NULL) return;
   if ((*hdf)->top == (*hdf))
   {
-    _dealloc_hdf(hdf);
+    shared = (*hdf)->shared;
+    if (shared->arena != NULL)
+    {
+      _dealloc_hdf_arena(shared->arena);
+      *hdf = NULL;
+    }
+    else
+    {
+      /* every node has let go of its name by the time the top goes */
+      _dealloc_hdf(hdf);
+    }
+    ne_hash_destroy(&(shared->names));
+    free(shared);
   }
 }
 
@@ -244,13 +488,13 @@ static int _walk_hdf (HDF *hdf, const char *name, HDF **node)
     {
       hash_key.name = (char *)n;
       hash_key.name_len = x;
-      hp = ne_hash_lookup(parent->hash, &hash_key);
+      hp = ne_hash_lookup_hashv(parent->hash, &hash_key, hdf_seg_hash(n, x));
     }
     else
     {
       while (hp != NULL)
       {
-	if (hp->name && (x == hp->name_len) && !strncmp(hp->name, n, x))
+	if (hp->name && (x == hp->name_len) && !memcmp(hp->name, n, x))
 	{
 	  break;
 	}
@@ -293,6 +537,94 @@ static int _walk_hdf (HDF *hdf, const char *name, HDF **node)
   return 0;
 }
 
+/* _walk_hdf for a pre-split name, see hdf_get_obj_segs.  Links still hold
+ * their target as a string, so those are walked with _walk_hdf. */
+static int _walk_hdf_segs (HDF *hdf, const HDF_SEG *segs, int nsegs,
+                           HDF **node)
+{
+  HDF *parent = NULL;
+  HDF *hp = hdf;
+  HDF hash_key;
+  int x = 0;
+  int r;
+
+  *node = NULL;
+
+  if (hdf == NULL) return -1;
+  if (nsegs == 0)
+  {
+    *node = hdf;
+    return 0;
+  }
+
+  if (hdf->link)
+  {
+    r = _walk_hdf (hdf->top, hdf->value, &hp);
+    if (r) return r;
+    if (hp)
+    {
+      parent = hp;
+      hp = hp->child;
+    }
+  }
+  else
+  {
+    parent = hdf;
+    hp = hdf->child;
+  }
+  if (hp == NULL)
+  {
+    return -1;
+  }
+
+  while (1)
+  {
+    if (parent && parent->hash)
+    {
+      hash_key.name = (char *)segs[x].name;
+      hash_key.name_len = segs[x].len;
+      hp = ne_hash_lookup_hashv(parent->hash, &hash_key, segs[x].hash);
+    }
+    else
+    {
+      while (hp != NULL)
+      {
+	if (hp->name && (segs[x].len == hp->name_len) &&
+	    !memcmp(hp->name, segs[x].name, segs[x].len))
+	{
+	  break;
+	}
+	else
+	{
+	  hp = hp->next;
+	}
+      }
+    }
+    if (hp == NULL)
+    {
+      return -1;
+    }
+    if (++x == nsegs) break;
+
+    if (hp->link)
+    {
+      r = _walk_hdf (hp->top, hp->value, &hp);
+      if (r) {
+	return r;
+      }
+    }
+    parent = hp;
+    hp = hp->child;
+  }
+  if (hp->link)
+  {
+    return _walk_hdf (hp->top, hp->value, node);
+  }
+
+  *node = hp;
+  return 0;
+}
+
 int hdf_get_int_value (HDF *hdf, const char *name, int defval)
 {
   HDF *node;
@@ -385,6 +717,115 @@ HDF* hdf_get_obj (HDF *hdf, const char *name)
   return obj;
 }
 
+HDF* hdf_get_obj_segs (HDF *hdf, const HDF_SEG *segs, int nsegs)
+{
+  HDF *obj;
+
+  _walk_hdf_segs(hdf, segs, nsegs, &obj);
+  return obj;
+}
+
+/* A compiled name: a copy of the name split into segments pointing into
+ * it, so set can still follow links by name. */
+struct _hdf_path
+{
+  char *name;
+  int nsegs;
+  HDF_SEG segs[1];
+};
+
+NEOERR* hdf_path_compile (HDF_PATH **path, const char *name)
+{
+  HDF_PATH *my_path;
+  char *n, *s;
+  int nsegs = 0;
+  int len, x;
+
+  *path = NULL;
+  if (name == NULL) name = "";
+  len = strlen(name);
+  if (len)
+  {
+    nsegs = 1;
+    for (n = (char *)name; *n; n++)
+    {
+      if (*n == '.') nsegs++;
+    }
+  }
+
+  /* The copy of the name goes after the segments */
+  my_path = (HDF_PATH *) malloc (sizeof(HDF_PATH) + nsegs * sizeof(HDF_SEG) +
+                                 len + 1);
+  if (my_path == NULL)
+    return nerr_raise(NERR_NOMEM, "Unable to allocate path for %s", name);
+  my_path->name = (char *)(my_path->segs + nsegs + 1);
+  memcpy(my_path->name, name, len + 1);
+  my_path->nsegs = nsegs;
+
+  n = my_path->name;
+  for (x = 0; x < nsegs; x++)
+  {
+    s = strchr(n, '.');
+    my_path->segs[x].name = n;
+    my_path->segs[x].len = (s == NULL) ? strlen(n) : s - n;
+    if (my_path->segs[x].len == 0)
+    {
+      free(my_path);
+      return nerr_raise(NERR_ASSERT, "Unable to compile Empty component %s",
+                        name);
+    }
+    my_path->segs[x].hash = hdf_seg_hash(n, my_path->segs[x].len);
+    if (s != NULL) n = s + 1;
+  }
+
+  *path = my_path;
+  return STATUS_OK;
+}
+
+void hdf_path_destroy (HDF_PATH **path)
+{
+  if (path == NULL || *path == NULL)
+    return;
+  free(*path);
+  *path = NULL;
+}
+
+HDF* hdf_get_obj_p (HDF *hdf, const HDF_PATH *path)
+{
+  HDF *obj;
+
+  _walk_hdf_segs(hdf, path->segs, path->nsegs, &obj);
+  return obj;
+}
+
+char* hdf_get_value_p (HDF *hdf, const HDF_PATH *path, const char *defval)
+{
+  HDF *node;
+
+  if ((_walk_hdf_segs(hdf, path->segs, path->nsegs, &node) == 0) &&
+      (node->value != NULL))
+  {
+    return node->value;
+  }
+  return (char *)defval;
+}
+
+int hdf_get_int_value_p (HDF *hdf, const HDF_PATH *path, int defval)
+{
+  HDF *node;
+  int v;
+  char *n;
+
+  if ((_walk_hdf_segs(hdf, path->segs, path->nsegs, &node) == 0) &&
+      (node->value != NULL))
+  {
+    v = strtol (node->value, &n, 10);
+    if (node->value == n) v = defval;
+    return v;
+  }
+  return defval;
+}
+
 HDF* hdf_get_child (HDF *hdf, const char *name)
 {
   HDF *obj;
@@ -406,10 +847,15 @@ NEOERR* hdf_set_attr (HDF *hdf, const char *name, const char *key,
 {
   HDF *obj;
   HDF_ATTR *attr, *last;
+  HDF_ARENA *arena;
 
   _walk_hdf(hdf, name, &obj);
   if (obj == NULL)
     return nerr_raise(NERR_ASSERT, "Unable to set attribute on non-existent node");
+  if (_hdf_frozen(obj))
+    return nerr_raise(NERR_ASSERT, "Unable to set attribute %s on frozen hdf",
+                      key);
+  arena = _hdf_arena(obj);
 
   if (obj->attr != NULL)
   {
@@ -419,7 +865,7 @@ NEOERR* hdf_set_attr (HDF *hdf, const char *name, const char *key,
     {
       if (!strcmp(attr->key, key))
       {
-	if (attr->value) free(attr->value);
+	if (attr->value) _hdf_free(arena, attr->value);
 	/* a set of NULL deletes the attr */
 	if (value == NULL)
 	{
@@ -427,11 +873,11 @@ NEOERR* hdf_set_attr (HDF *hdf, const char *name, const char *key,
 	    obj->attr = attr->next;
 	  else
 	    last->next = attr->next;
-	  free(attr->key);
-	  free(attr);
+	  _hdf_free(arena, attr->key);
+	  _hdf_free(arena, attr);
 	  return STATUS_OK;
 	}
-	attr->value = strdup(value);
+	attr->value = _hdf_strndup(arena, value, strlen(value));
 	if (attr->value == NULL)
 	  return nerr_raise(NERR_NOMEM, "Unable to set attr %s to %s", key, value);
 	return STATUS_OK;
@@ -439,7 +885,7 @@ NEOERR* hdf_set_attr (HDF *hdf, const char *name, const char *key,
       last = attr;
       attr = attr->next;
     }
-    last->next = (HDF_ATTR *) calloc(1, sizeof(HDF_ATTR));
+    last->next = (HDF_ATTR *) _hdf_calloc(arena, sizeof(HDF_ATTR));
     if (last->next == NULL)
       return nerr_raise(NERR_NOMEM, "Unable to set attr %s to %s", key, value);
     attr = last->next;
@@ -447,13 +893,13 @@ NEOERR* hdf_set_attr (HDF *hdf, const char *name, const char *key,
   else
   {
     if (value == NULL) return STATUS_OK;
-    obj->attr = (HDF_ATTR *) calloc(1, sizeof(HDF_ATTR));
+    obj->attr = (HDF_ATTR *) _hdf_calloc(arena, sizeof(HDF_ATTR));
     if (obj->attr == NULL)
       return nerr_raise(NERR_NOMEM, "Unable to set attr %s to %s", key, value);
     attr = obj->attr;
   }
-  attr->key = strdup(key);
-  attr->value = strdup(value);
+  attr->key = _hdf_strndup(arena, key, strlen(key));
+  attr->value = _hdf_strndup(arena, value, strlen(value));
   if (attr->key == NULL || attr->value == NULL)
     return nerr_raise(NERR_NOMEM, "Unable to set attr %s to %s", key, value);
 
@@ -511,7 +957,7 @@ char* hdf_obj_value (HDF *hdf)
   return hdf->value;
 }
 
-void _merge_attr (HDF_ATTR *dest, HDF_ATTR *src)
+void _merge_attr (HDF_ATTR *dest, HDF_ATTR *src, HDF_ARENA *arena)
 {
   HDF_ATTR *da, *ld;
   HDF_ATTR *sa, *ls;
@@ -528,7 +974,7 @@ void _merge_attr (HDF_ATTR *dest, HDF_ATTR *src)
     {
       if (!strcmp(da->key, sa->key))
       {
-	if (da->value) free(da->value);
+	if (da->value) _hdf_free(arena, da->value);
 	da->value = sa->value;
 	sa->value = NULL;
 	found = 1;
@@ -551,16 +997,54 @@ void _merge_attr (HDF_ATTR *dest, HDF_ATTR *src)
       sa = sa->next;
     }
   }
-  _dealloc_hdf_attr(&src);
+  if (arena == NULL) _dealloc_hdf_attr(&src);
+}
+
+static NEOERR * _copy_attr (HDF_ATTR **dest, HDF_ATTR *src, HDF_ARENA *arena);
+
+/* Give attr, a malloc'd list from the parser or hdf_copy, to node.  An
+ * arena data set keeps a copy in its arena and frees the list. */
+static NEOERR* _attach_attr (HDF *node, HDF_ARENA *arena, HDF_ATTR *attr)
+{
+  NEOERR *err;
+  HDF_ATTR *copy;
+
+  if (attr == NULL) return STATUS_OK;
+  if (arena != NULL)
+  {
+    err = _copy_attr(&copy, attr, arena);
+    if (err) return nerr_pass(err);
+    _dealloc_hdf_attr(&attr);
+    attr = copy;
+  }
+  if (node->attr == NULL)
+  {
+    node->attr = attr;
+  }
+  else
+  {
+    _merge_attr(node->attr, attr, arena);
+  }
+  return STATUS_OK;
 }
 
 NEOERR* _hdf_hash_level(HDF *hdf)
 {
   NEOERR *err;
   HDF *child;
+  HDF_ARENA *arena = _hdf_arena(hdf);
 
   err = ne_hash_init(&(hdf->hash), hash_hdf_hash, hash_hdf_comp);
   if (err) return nerr_pass(err);
+  if (arena != NULL)
+  {
+    err = uListAppend(arena->hashes, hdf->hash);
+    if (err)
+    {
+      ne_hash_destroy(&(hdf->hash));
+      return nerr_pass(err);
+    }
+  }
 
   child = hdf->child;
   while (child)
@@ -572,14 +1056,19 @@ NEOERR* _hdf_hash_level(HDF *hdf)
   return STATUS_OK;
 }
 
-static NEOERR* _set_value (HDF *hdf, const char *name, const char *value,
-                           int dupl, int wf, int lnk, HDF_ATTR *attr,
-                           HDF **set_node)
+/* segs, if not NULL, is name split by hdf_path_compile, and only saves
+ * hashing each segment again.  Links are followed by name. */
+static NEOERR* _set_value_segs (HDF *hdf, const char *name,
+                                const HDF_SEG *segs, const char *value,
+                                int dupl, int wf, int lnk, HDF_ATTR *attr,
+                                HDF **set_node)
 {
   NEOERR *err;
   HDF *hn, *hp, *hs;
   HDF hash_key;
+  HDF_ARENA *arena;
   int x = 0;
+  int seg = 0;
   const char *s = name;
   const char *n = name;
   int count = 0;
@@ -589,19 +1078,18 @@ static NEOERR* _set_value (HDF *hdf, const char *name, const char *value,
   {
     return nerr_raise(NERR_ASSERT, "Unable to set %s on NULL hdf", name);
   }
+  if (_hdf_frozen(hdf))
+  {
+    return nerr_raise(NERR_ASSERT, "Unable to set %s on frozen hdf", name);
+  }
+  arena = _hdf_arena(hdf);
 
   /* HACK: allow setting of this node by passing an empty name */
   if (name == NULL || name[0] == '\0')
   {
     /* handle setting attr first */
-    if (hdf->attr == NULL)
-    {
-      hdf->attr = attr;
-    }
-    else
-    {
-      _merge_attr(hdf->attr, attr);
-    }
+    err = _attach_attr(hdf, arena, attr);
+    if (err) return nerr_pass(err);
     /* set link flag */
     if (lnk) hdf->link = 1;
     else hdf->link = 0;
@@ -611,28 +1099,18 @@ static NEOERR* _set_value (HDF *hdf, const char *name, const char *value,
       if (set_node != NULL) *set_node = hdf;
       return STATUS_OK;
     }
+    hdf->value_cap = 0;
     if (hdf->alloc_value)
     {
       free(hdf->value);
       hdf->value = NULL;
     }
-    if (value == NULL)
+    if (_store_value(hdf, arena, value, dupl, wf))
     {
       hdf->alloc_value = 0;
       hdf->value = NULL;
-    }
-    else if (dupl)
-    {
-      hdf->alloc_value = 1;
-      hdf->value = strdup(value);
-      if (hdf->value == NULL)
-	return nerr_raise (NERR_NOMEM, "Unable to duplicate value %s for %s",
-	    value, name);
-    }
-    else
-    {
-      hdf->alloc_value = wf;
-      hdf->value = (char *)value;
+      return nerr_raise (NERR_NOMEM, "Unable to duplicate value %s for %s",
+	  value, name);
     }
     if (set_node != NULL) *set_node = hdf;
     return STATUS_OK;
@@ -656,7 +1134,8 @@ static NEOERR* _set_value (HDF *hdf, const char *name, const char *value,
     strcpy(new_name, hdf->value);
     strcat(new_name, ".");
     strcat(new_name, name);
-    err = _set_value (hdf->top, new_name, value, dupl, wf, lnk, attr, set_node);
+    err = _set_value_segs (hdf->top, new_name, NULL, value, dupl, wf, lnk,
+                           attr, set_node);
     free(new_name);
     return nerr_pass(err);
   }
@@ -674,7 +1153,7 @@ static NEOERR* _set_value (HDF *hdf, const char *name, const char *value,
 
     if ((hs == NULL && hp == hn->child) || (hs && hs->next == hp))
     {
-      if (hp && hp->name && (x == hp->name_len) && !strncmp (hp->name, n, x))
+      if (hp && hp->name && (x == hp->name_len) && !memcmp (hp->name, n, x))
       {
 	goto skip_search;
       }
@@ -688,14 +1167,15 @@ static NEOERR* _set_value (HDF *hdf, const char *name, const char *value,
     {
       hash_key.name = (char *)n;
       hash_key.name_len = x;
-      hp = ne_hash_lookup(hn->hash, &hash_key);
+      hp = ne_hash_lookup_hashv(hn->hash, &hash_key,
+                                segs ? segs[seg].hash : hdf_seg_hash(n, x));
       hs = hn->last_child;
     }
     else
     {
       while (hp != NULL)
       {
-	if (hp->name && (x == hp->name_len) && !strncmp(hp->name, n, x))
+	if (hp->name && (x == hp->name_len) && !memcmp(hp->name, n, x))
 	{
 	  break;
 	}
@@ -730,7 +1210,8 @@ skip_search:
 	if (err) return nerr_pass(err);
         if (lnk) hp->link = 1;
         else hp->link = 0;
-        hp->attr = attr;
+        err = _attach_attr(hp, arena, attr);
+        if (err) return nerr_pass(err);
       }
       if (hn->child == NULL)
 	hn->child = hp;
@@ -756,38 +1237,22 @@ skip_search:
       /* If there is a matching node and we're at the end of the HDF
        * name, then we update the value of the node */
       /* handle setting attr first */
-      if (hp->attr == NULL)
-      {
-	hp->attr = attr;
-      }
-      else
-      {
-	_merge_attr(hp->attr, attr);
-      }
+      err = _attach_attr(hp, arena, attr);
+      if (err) return nerr_pass(err);
       if (hp->value != value)
       {
+	hp->value_cap = 0;
 	if (hp->alloc_value)
 	{
 	  free(hp->value);
 	  hp->value = NULL;
 	}
-	if (value == NULL)
+	if (_store_value(hp, arena, value, dupl, wf))
 	{
 	  hp->alloc_value = 0;
 	  hp->value = NULL;
-	}
-	else if (dupl)
-	{
-	  hp->alloc_value = 1;
-	  hp->value = strdup(value);
-	  if (hp->value == NULL)
-	    return nerr_raise (NERR_NOMEM, "Unable to duplicate value %s for %s",
-		value, name);
-	}
-	else
-	{
-	  hp->alloc_value = wf;
-	  hp->value = (char *)value;
+	  return nerr_raise (NERR_NOMEM, "Unable to duplicate value %s for %s",
+	      value, name);
 	}
       }
       if (lnk) hp->link = 1;
@@ -802,7 +1267,8 @@ skip_search:
       }
       strcpy(new_name, hp->value);
       strcat(new_name, s);
-      err = _set_value (hdf->top, new_name, value, dupl, wf, lnk, attr, set_node);
+      err = _set_value_segs (hdf->top, new_name, NULL, value, dupl, wf,
+                             lnk, attr, set_node);
       free(new_name);
       return nerr_pass(err);
     }
@@ -812,6 +1278,7 @@ skip_search:
       break;
     /* Otherwise, we need to find the next part of the namespace */
     n = s + 1;
+    seg++;
     s = strchr (n, '.');
     x = (s != NULL) ? s - n : strlen(n);
     if (x == 0)
@@ -824,11 +1291,25 @@ skip_search:
   return STATUS_OK;
 }
 
+static NEOERR* _set_value (HDF *hdf, const char *name, const char *value,
+                           int dupl, int wf, int lnk, HDF_ATTR *attr,
+                           HDF **set_node)
+{
+  return _set_value_segs (hdf, name, NULL, value, dupl, wf, lnk, attr,
+                          set_node);
+}
+
 NEOERR* hdf_set_value (HDF *hdf, const char *name, const char *value)
 {
   return nerr_pass(_set_value (hdf, name, value, 1, 1, 0, NULL, NULL));
 }
 
+NEOERR* hdf_set_value_p (HDF *hdf, const HDF_PATH *path, const char *value)
+{
+  return nerr_pass(_set_value_segs (hdf, path->name, path->segs, value, 1, 1,
+                                    0, NULL, NULL));
+}
+
 NEOERR* hdf_set_value_attr (HDF *hdf, const char *name, const char *value,
                             HDF_ATTR *attr)
 {
@@ -853,6 +1334,74 @@ NEOERR* hdf_set_buf (HDF *hdf, const char *name, char *value)
   return nerr_pass(_set_value (hdf, name, value, 0, 1, 0, NULL, NULL));
 }
 
+NEOERR* hdf_append_value (HDF *hdf, const char *name, const char *value)
+{
+  NEOERR *err;
+  HDF *node = hdf;
+  HDF_ARENA *arena = _hdf_arena(hdf);
+  const char *old;
+  size_t len, old_len, cap;
+  char *buf;
+
+  if (value == NULL || value[0] == '\0') return STATUS_OK;
+  if (_hdf_frozen(hdf))
+    return nerr_raise(NERR_ASSERT, "Unable to append to %s on frozen hdf",
+                      name);
+  len = strlen(value);
+
+  if (name != NULL && name[0] != '\0' && _walk_hdf(hdf, name, &node) == -1)
+    node = NULL;
+  if (node != NULL && node->value_cap && !node->link)
+  {
+    if (node->value_len + len + 1 > node->value_cap)
+    {
+      cap = node->value_cap * 2;
+      if (cap < node->value_len + len + 1) cap = node->value_len + len + 1;
+      if (arena != NULL)
+      {
+        /* the old buffer stays in the arena until hdf_destroy */
+        buf = (char *) ne_arena_alloc (&(arena->arena), cap);
+        if (buf != NULL) memcpy(buf, node->value, node->value_len + 1);
+      }
+      else
+      {
+        buf = (char *) realloc (node->value, cap);
+      }
+      if (buf == NULL)
+        return nerr_raise (NERR_NOMEM, "Unable to append to %s", name);
+      node->value = buf;
+      node->value_cap = cap;
+    }
+    memcpy(node->value + node->value_len, value, len + 1);
+    node->value_len += len;
+    return STATUS_OK;
+  }
+
+  /* Start a buffer with room to grow */
+  old = node ? hdf_obj_value(node) : NULL;
+  old_len = old ? strlen(old) : 0;
+  cap = (old_len + len + 1) * 2;
+  if (arena != NULL)
+    buf = (char *) ne_arena_alloc (&(arena->arena), cap);
+  else
+    buf = (char *) malloc (cap);
+  if (buf == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to append to %s", name);
+  if (old_len) memcpy(buf, old, old_len);
+  memcpy(buf + old_len, value, len + 1);
+
+  /* A buffer in the arena is stored as is, rather than owned */
+  err = _set_value (hdf, name, buf, 0, arena == NULL, 0, NULL, &node);
+  if (err)
+  {
+    _hdf_free(arena, buf);
+    return nerr_pass(err);
+  }
+  node->value_len = old_len + len;
+  node->value_cap = cap;
+  return STATUS_OK;
+}
+
 NEOERR* hdf_set_copy (HDF *hdf, const char *dest, const char *src)
 {
   HDF *node;
@@ -919,6 +1468,8 @@ NEOERR *hdf_sort_obj (HDF *h, int (*compareFunc)(const void *, const void *))
   int x;
 
   if (h == NULL) return STATUS_OK;
+  if (_hdf_frozen(h))
+    return nerr_raise(NERR_ASSERT, "Unable to sort frozen hdf");
   c = h->child;
   if (c == NULL) return STATUS_OK;
 
@@ -955,6 +1506,10 @@ NEOERR* hdf_remove_tree (HDF *hdf, const char *name)
   const char *n = name;
 
   if (hdf == NULL) return STATUS_OK;
+  if (_hdf_frozen(hdf))
+  {
+    return nerr_raise(NERR_ASSERT, "Unable to remove %s from frozen hdf", name);
+  }
 
   hp = hdf->child;
   if (hp == NULL)
@@ -973,7 +1528,7 @@ NEOERR* hdf_remove_tree (HDF *hdf, const char *name)
   {
     while (hp != NULL)
     {
-      if (hp->name && (x == hp->name_len) && !strncmp(hp->name, n, x))
+      if (hp->name && (x == hp->name_len) && !memcmp(hp->name, n, x))
       {
       break;
       }
@@ -1017,30 +1572,32 @@ NEOERR* hdf_remove_tree (HDF *hdf, const char *name)
   }
   lp->last_hp = NULL;
   lp->last_hs = NULL;
-  _dealloc_hdf (&hp);
+  /* an arena data set frees the removed nodes in hdf_destroy */
+  if (_hdf_arena(hdf) == NULL)
+    _dealloc_hdf (&hp);
 
   return STATUS_OK;
 }
 
-static NEOERR * _copy_attr (HDF_ATTR **dest, HDF_ATTR *src)
+static NEOERR * _copy_attr (HDF_ATTR **dest, HDF_ATTR *src, HDF_ARENA *arena)
 {
   HDF_ATTR *copy, *last = NULL;
 
   *dest = NULL;
   while (src != NULL)
   {
-    copy = (HDF_ATTR *)malloc(sizeof(HDF_ATTR));
+    copy = (HDF_ATTR *)_hdf_calloc(arena, sizeof(HDF_ATTR));
     if (copy == NULL)
     {
-      _dealloc_hdf_attr(dest);
+      if (arena == NULL) _dealloc_hdf_attr(dest);
       return nerr_raise(NERR_NOMEM, "Unable to allocate copy of HDF_ATTR");
     }
-    copy->key = strdup(src->key);
-    copy->value = strdup(src->value);
+    copy->key = _hdf_strndup(arena, src->key, strlen(src->key));
+    copy->value = _hdf_strndup(arena, src->value, strlen(src->value));
     copy->next = NULL;
     if ((copy->key == NULL) || (copy->value == NULL))
     {
-      _dealloc_hdf_attr(dest);
+      if (arena == NULL) _dealloc_hdf_attr(dest);
       return nerr_raise(NERR_NOMEM, "Unable to allocate copy of HDF_ATTR");
     }
     if (last) {
@@ -1068,7 +1625,7 @@ static NEOERR * _copy_nodes (HDF *dest, HDF *src)
   st = src->child;
   while (st != NULL)
   {
-    err = _copy_attr(&attr_copy, st->attr);
+    err = _copy_attr(&attr_copy, st->attr, NULL);
     if (err) return nerr_pass(err);
     err = _set_value(dest, st->name, st->value, 1, 1, st->link, attr_copy, &dt);
     if (err) {
@@ -1098,6 +1655,51 @@ NEOERR* hdf_copy (HDF *dest, const char *name, HDF *src)
   return nerr_pass (_copy_nodes (node, src));
 }
 
+/* The copy is made depth first into a new arena, so a node, its children
+ * and their names end up next to each other, and _set_value gives every
+ * level with more than FORCE_HASH_AT children its hash on the way.  After
+ * that, lookups only read the data set, so any number of threads can share
+ * it. */
+NEOERR* hdf_freeze (HDF **hdf)
+{
+  NEOERR *err;
+  HDF *src = *hdf;
+  HDF *frozen;
+  HDF_ATTR *attr_copy;
+
+  if (src == NULL || src->top != src)
+    return nerr_raise(NERR_ASSERT, "Unable to freeze, not the top of an hdf");
+  if (src->shared->frozen) return STATUS_OK;
+
+  err = hdf_init_arena (&frozen);
+  if (err) return nerr_pass(err);
+  err = _copy_attr(&attr_copy, src->attr, NULL);
+  if (err == STATUS_OK)
+  {
+    err = _set_value(frozen, NULL, src->value, 1, 1, 0, attr_copy, NULL);
+    if (err) _dealloc_hdf_attr(&attr_copy);
+  }
+  if (err == STATUS_OK)
+    err = _copy_nodes(frozen, src);
+  if (err)
+  {
+    hdf_destroy(&frozen);
+    return nerr_pass(err);
+  }
+  frozen->fileload_ctx = src->fileload_ctx;
+  frozen->fileload = src->fileload;
+  frozen->shared->frozen = 1;
+
+  hdf_destroy(hdf);
+  *hdf = frozen;
+  return STATUS_OK;
+}
+
+int hdf_is_frozen (HDF *hdf)
+{
+  return _hdf_frozen(hdf);
+}
+
 /* BUG: currently, this only prints something if there is a value...
  * but we now allow attributes on nodes with no value... */
 
@@ -65,6 +65,7 @@ __BEGIN_DECLS
 #define FORCE_HASH_AT 10
 
 typedef struct _hdf HDF;
+typedef struct _hdf_shared HDF_SHARED;
 
 /* HDFFILELOAD is a callback function to intercept file load requests and
  * provide templates via another mechanism.  This way you can load templates
@@ -81,6 +82,19 @@ typedef struct _hdf HDF;
 typedef NEOERR* (*HDFFILELOAD)(void *ctx, HDF *hdf, const char *filename,
                               char **contents);
 
+/* One segment of a dotted HDF name, with its hash precomputed by
+ * hdf_seg_hash.  A name split into an array of these can be looked up
+ * repeatedly with hdf_get_obj_segs without rescanning or rehashing it. */
+typedef struct _hdf_seg
+{
+  const char *name;  /* not NUL terminated */
+  int len;
+  UINT32 hash;
+} HDF_SEG;
+
+/* A name compiled by hdf_path_compile, for the _p functions */
+typedef struct _hdf_path HDF_PATH;
+
 typedef struct _attr
 {
   char *key;
@@ -100,6 +114,11 @@ struct _hdf
   struct _hdf *next;
   struct _hdf *child;
 
+  /* Set by hdf_append_value, which grows value in place: the length of
+   * value, and the size of its buffer (0 if it wasn't grown that way) */
+  size_t value_len;
+  size_t value_cap;
+
   /* the following fields are used to implement a cache */
   struct _hdf *last_hp;
   struct _hdf *last_hs;
@@ -114,6 +133,11 @@ struct _hdf
    * load method */
   void *fileload_ctx;
   HDFFILELOAD fileload;
+
+  /* Only set on the head node, state shared by the whole data set, such
+   * as the table of interned node names: every node with a given name
+   * shares one copy of it. */
+  HDF_SHARED *shared;
 };
 
 /*
@@ -126,6 +150,24 @@ struct _hdf
  */
 NEOERR* hdf_init (HDF **hdf);
 
+/*
+ * Function: hdf_init_arena - Initialize an arena backed HDF data set
+ * Description: hdf_init_arena is like hdf_init, but the data set
+ *              allocates its nodes, names, values and attributes from
+ *              a few large blocks instead of with malloc, and
+ *              hdf_destroy frees them all at once.  This makes loading
+ *              and destroying a large data set much cheaper.  Memory
+ *              for a value which is replaced, or a tree which is
+ *              removed, is not reclaimed until hdf_destroy, so this is
+ *              best suited to data sets which are loaded and then
+ *              mostly read.  A buffer passed to hdf_set_buf is copied
+ *              into the arena and freed immediately.
+ * Input: hdf - pointer to an HDF pointer
+ * Output: hdf - allocated hdf node
+ * Returns: NERR_NOMEM - unable to allocate memory for dataset
+ */
+NEOERR* hdf_init_arena (HDF **hdf);
+
 /*
  * Function: hdf_destroy - deallocate an HDF data set
  * Description: hdf_destroy is used to deallocate all memory associated
@@ -140,6 +182,39 @@ NEOERR* hdf_init (HDF **hdf);
  */
 void hdf_destroy (HDF **hdf);
 
+/*
+ * Function: hdf_freeze - make an HDF data set read-only
+ * Description: hdf_freeze replaces an HDF data set with a compacted,
+ *              read-only copy of it.  The copy is arena backed (see
+ *              hdf_init_arena), with its nodes laid out depth first and
+ *              the hash on every large level already built.  Once
+ *              frozen, everything which would change the data set
+ *              (hdf_set_*, hdf_append_value, hdf_set_attr,
+ *              hdf_remove_tree, hdf_sort_obj, hdf_read_*, and so on)
+ *              fails with NERR_ASSERT, and nothing else changes it, so
+ *              any number of threads can read it at once with
+ *              hdf_get_* and hdf_obj_*, or render against it as the
+ *              global_hdf of their own CSPARSE.  Freezing a frozen
+ *              data set does nothing.  Any pointer into the old data
+ *              set is invalid afterwards, so freeze before handing out
+ *              nodes.
+ * Input: hdf - pointer to the top node of an HDF data set
+ * Output: hdf - the frozen copy; the old data set is destroyed
+ * Returns: NERR_ASSERT if hdf is not the top of a data set,
+ *          NERR_NOMEM
+ */
+NEOERR* hdf_freeze (HDF **hdf);
+
+/*
+ * Function: hdf_is_frozen - check whether a data set is frozen
+ * Description: hdf_is_frozen returns whether the data set hdf is part
+ *              of has been frozen with hdf_freeze.
+ * Input: hdf -> a node in an HDF data set
+ * Output: None
+ * Returns: 1 if frozen, 0 otherwise
+ */
+int hdf_is_frozen (HDF *hdf);
+
 /*
  * Function: hdf_get_int_value - Return the integer value of a point in
  *           the data set
@@ -236,6 +311,71 @@ NEOERR* hdf_get_copy (HDF *hdf, const char *name, char **value,
  */
 HDF* hdf_get_obj (HDF *hdf, const char *name);
 
+/*
+ * Function: hdf_get_obj_segs - return the HDF data set node at a
+ *           pre-split location
+ * Description: hdf_get_obj_segs is hdf_get_obj for a name which has
+ *              already been split into segments, ie "A.B.C" as the three
+ *              segments A, B and C.  Use hdf_seg_hash to fill in the hash
+ *              of each segment.
+ * Input: hdf -> the dataset node to start from
+ *        segs -> the segments of the name
+ *        nsegs -> the number of segments
+ * Output: None
+ * Returns: the pointer to the named node, or NULL if it doesn't exist
+ */
+HDF* hdf_get_obj_segs (HDF *hdf, const HDF_SEG *segs, int nsegs);
+
+/*
+ * Function: hdf_seg_hash - hash a single segment of an HDF name
+ * Description: hdf_seg_hash returns the hash the HDF child index uses for
+ *              the given segment, for use in an HDF_SEG.
+ * Input: name -> the segment, need not be NUL terminated
+ *        len -> the length of the segment
+ * Output: None
+ * Returns: the hash value
+ */
+UINT32 hdf_seg_hash (const char *name, int len);
+
+/*
+ * Function: hdf_path_compile - compile an HDF name for repeated use
+ * Description: hdf_path_compile splits name into its segments and hashes
+ *              each one, so that the _p versions of the get and set
+ *              functions can look it up again and again without doing
+ *              that each time.  The path doesn't depend on any data set,
+ *              and can be used with any of them.
+ * Input: name -> the name to compile, ie "A.B.C"
+ * Output: path -> the compiled path, free with hdf_path_destroy
+ * Returns: NERR_NOMEM, NERR_ASSERT if name has an empty component
+ */
+NEOERR* hdf_path_compile (HDF_PATH **path, const char *name);
+
+/*
+ * Function: hdf_path_destroy - free a path from hdf_path_compile
+ * Description: hdf_path_destroy frees the path and sets it to NULL
+ * Input: path -> the path to free
+ * Output: None
+ * Returns: None
+ */
+void hdf_path_destroy (HDF_PATH **path);
+
+/*
+ * Function: hdf_get_obj_p, hdf_get_value_p, hdf_get_int_value_p - look
+ *           up a compiled path
+ * Description: These are hdf_get_obj, hdf_get_value and
+ *              hdf_get_int_value for a name compiled with
+ *              hdf_path_compile.
+ * Input: hdf -> the dataset node to start from
+ *        path -> the compiled name to walk to
+ *        defval -> value to return if the node doesn't exist or has no
+ *                  value
+ * Output: None
+ * Returns: as the versions which take a name
+ */
+HDF* hdf_get_obj_p (HDF *hdf, const HDF_PATH *path);
+char* hdf_get_value_p (HDF *hdf, const HDF_PATH *path, const char *defval);
+int hdf_get_int_value_p (HDF *hdf, const HDF_PATH *path, int defval);
+
 /*
  * Function: hdf_get_node - Similar to hdf_get_obj except all the nodes
  *           are created if the don't exist.
@@ -369,6 +509,18 @@ char* hdf_obj_value (HDF *hdf);
  */
 NEOERR* hdf_set_value (HDF *hdf, const char *name, const char *value);
 
+/*
+ * Function: hdf_set_value_p - set the value of a compiled path
+ * Description: hdf_set_value_p is hdf_set_value for a name compiled with
+ *              hdf_path_compile.
+ * Input: hdf -> the dataset node to start from
+ *        path -> the compiled name to set
+ *        value -> the value to set, copied as by hdf_set_value
+ * Output: None
+ * Returns: NERR_NOMEM
+ */
+NEOERR* hdf_set_value_p (HDF *hdf, const HDF_PATH *path, const char *value);
+
 /*
  * Function: hdf_set_valuef - Set the value of a named node
  * Description: hdf_set_valuef is a convenience function that wraps
@@ -441,6 +593,22 @@ NEOERR* hdf_set_copy (HDF *hdf, const char *dest, const char *src);
 
 NEOERR* hdf_set_buf (HDF *hdf, const char *name, char *value);
 
+/*
+ * Function: hdf_append_value - Append to the value of a node
+ * Description: hdf_append_value sets the named node to its current value
+ *              (as hdf_get_value would return it) followed by value.
+ *              The node's buffer is given room to grow, and appending
+ *              to it again appends in place, so building up a value a
+ *              piece at a time takes time linear in its final length
+ *              instead of quadratic.
+ * Input: hdf -> the hdf dataset node
+ *        name -> the name to walk to, NULL or "" for hdf itself
+ *        value -> the string to append, NULL appends nothing
+ * Output: None
+ * Returns: NERR_NOMEM - unable to allocate a node or the value
+ */
+NEOERR* hdf_append_value (HDF *hdf, const char *name, const char *value);
+
 /*
  * Function: hdf_set_symlink - Set part of the tree to link to another
  * Description: hdf_set_symlink creates a link between two sections of
@@ -0,0 +1,246 @@
+/*
+ * Copyright 2001-2004 Brandon Long
+ * All Rights Reserved.
+ *
+ * ClearSilver Templating System
+ *
+ * This code is made available under the terms of the ClearSilver License.
+ * http://www.clearsilver.net/license.hdf
+ *
+ */
+
+#include "cs_config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "neo_misc.h"
+#include "neo_scan.h"
+
+/* The vector kernels are compiled with per function target attributes,
+ * so the rest of the library doesn't need to be built with -mavx2 and
+ * still runs on older CPUs. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || \
+     (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && \
+    (defined(__clang__) || __GNUC__ > 4 || \
+     (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+#define SCAN_ATOMIC 1
+#endif
+
+/* What the CPU supports, -1 until we've asked */
+static int ScanCPULevel = -1;
+static int ScanLimit = NEOS_SCAN_AVX2;
+
+static int scan_cpu_level (void)
+{
+  if (ScanCPULevel < 0)
+  {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      ScanCPULevel = NEOS_SCAN_AVX2;
+    else if (__builtin_cpu_supports("sse2"))
+      ScanCPULevel = NEOS_SCAN_SSE2;
+    else
+      ScanCPULevel = NEOS_SCAN_SCALAR;
+#else
+    ScanCPULevel = NEOS_SCAN_SCALAR;
+#endif
+  }
+  return ScanCPULevel;
+}
+
+NEOS_SCAN_LEVEL neos_scan_level (void)
+{
+  int level = scan_cpu_level();
+  return (NEOS_SCAN_LEVEL)(level < ScanLimit ? level : ScanLimit);
+}
+
+void neos_scan_set_level (NEOS_SCAN_LEVEL level)
+{
+  ScanLimit = level;
+}
+
+#define SCAN_NONE 0
+#define SCAN_BUSY 1
+#define SCAN_READY 2
+
+#define MAP_SET(m, c) ((m)[(c) >> 3] |= 1 << ((c) & 7))
+#define MAP_HAS(m, c) ((m)[(c) >> 3] & (1 << ((c) & 7)))
+
+static void scan_compile (const NEOS_SCANSET *set, NEOS_SCANTABLES *t)
+{
+  const unsigned char *p;
+  int c;
+
+  memset(t, 0, sizeof(NEOS_SCANTABLES));
+  for (p = (const unsigned char *)set->chars; *p; p++)
+    MAP_SET(t->map, *p);
+  for (c = 0; c < set->below && c < 256; c++)
+    MAP_SET(t->map, c);
+  for (c = set->above + 1; c < 256; c++)
+    MAP_SET(t->map, c);
+  t->nchars = (const char *)p - set->chars;
+
+  /* The AVX2 kernel classifies bytes with two 16 entry lookup tables
+   * indexed by the low and high nibble of each byte, so it handles any set
+   * of ASCII bytes in the same time.  Bytes >= 0x80 have to be all in or
+   * all out of the set. */
+  t->high = MAP_HAS(t->map, 0x80) ? 1 : 0;
+  t->nibble = 1;
+  for (c = 0x81; c < 256; c++)
+  {
+    if ((MAP_HAS(t->map, c) ? 1 : 0) != t->high)
+      t->nibble = 0;
+  }
+  for (c = 0; c < 8; c++)
+    t->hi[c] = 1 << c;
+  for (c = 0; c < 0x80; c++)
+  {
+    if (MAP_HAS(t->map, c))
+      t->lo[c & 0xf] |= 1 << (c >> 4);
+  }
+}
+
+/* Return the tables for set, building them the first time.  The set is
+ * marked busy while one thread builds them, any others which get here in
+ * the meantime build a private copy. */
+static const NEOS_SCANTABLES *scan_tables (NEOS_SCANSET *set,
+                                           NEOS_SCANTABLES *local)
+{
+#ifdef SCAN_ATOMIC
+  int state = __atomic_load_n(&set->state, __ATOMIC_ACQUIRE);
+
+  if (state == SCAN_READY)
+    return &set->tables;
+  if (state == SCAN_NONE &&
+      __atomic_compare_exchange_n(&set->state, &state, SCAN_BUSY, 0,
+                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+  {
+    scan_compile(set, &set->tables);
+    __atomic_store_n(&set->state, SCAN_READY, __ATOMIC_RELEASE);
+    return &set->tables;
+  }
+#endif
+  scan_compile(set, local);
+  return local;
+}
+
+static size_t scan_scalar (const NEOS_SCANTABLES *t, const unsigned char *s,
+                           size_t len)
+{
+  size_t x;
+
+  for (x = 0; x < len; x++)
+  {
+    if (MAP_HAS(t->map, s[x])) break;
+  }
+  return x;
+}
+
+#ifdef SCAN_X86
+
+/* Compare each 16 byte block against every byte in the set, which is
+ * only worthwhile for short lists. */
+#define SCAN_SSE2_MAX_CHARS 16
+
+__attribute__((target("sse2")))
+static size_t scan_sse2 (const NEOS_SCANSET *set, const NEOS_SCANTABLES *t,
+                         const unsigned char *s, size_t len)
+{
+  __m128i want[SCAN_SSE2_MAX_CHARS];
+  __m128i below, above, v, hit;
+  int n, nchars = t->nchars;
+  size_t x;
+  unsigned int m;
+
+  for (n = 0; n < nchars; n++)
+    want[n] = _mm_set1_epi8(set->chars[n]);
+  /* c < below is c <= below - 1, and c > above is c >= above + 1, and
+   * there are unsigned min/max instructions but no unsigned compares */
+  below = _mm_set1_epi8((char)(set->below - 1));
+  above = _mm_set1_epi8((char)(set->above + 1));
+
+  for (x = 0; ; x += 16)
+  {
+    /* The last block overlaps the one before it rather than reading past
+     * the end, the bytes we've already looked at are known not to match */
+    if (x + 16 > len)
+    {
+      if (x >= len) return len;
+      x = len - 16;
+    }
+    v = _mm_loadu_si128((const __m128i *)(s + x));
+    hit = _mm_setzero_si128();
+    for (n = 0; n < nchars; n++)
+      hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, want[n]));
+    if (set->below > 0)
+      hit = _mm_or_si128(hit, _mm_cmpeq_epi8(_mm_max_epu8(v, below), below));
+    if (set->above < 255)
+      hit = _mm_or_si128(hit, _mm_cmpeq_epi8(_mm_min_epu8(v, above), above));
+    m = (unsigned int)_mm_movemask_epi8(hit);
+    if (m) return x + __builtin_ctz(m);
+  }
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2 (const NEOS_SCANTABLES *t, const unsigned char *s,
+                         size_t len)
+{
+  __m256i lo_t, hi_t, nibble, zero, v, hit;
+  size_t x;
+  unsigned int m;
+
+  lo_t = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)t->lo));
+  hi_t = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)t->hi));
+  nibble = _mm256_set1_epi8(0x0f);
+  zero = _mm256_setzero_si256();
+
+  for (x = 0; ; x += 32)
+  {
+    if (x + 32 > len)
+    {
+      if (x >= len) return len;
+      x = len - 32;
+    }
+    v = _mm256_loadu_si256((const __m256i *)(s + x));
+    hit = _mm256_and_si256(
+        _mm256_shuffle_epi8(lo_t, _mm256_and_si256(v, nibble)),
+        _mm256_shuffle_epi8(hi_t,
+          _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+    m = ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hit, zero));
+    if (t->high)
+      m |= (unsigned int)_mm256_movemask_epi8(v);
+    if (m) return x + __builtin_ctz(m);
+  }
+}
+
+#endif /* SCAN_X86 */
+
+size_t neos_scan (NEOS_SCANSET *set, const char *s, size_t len)
+{
+  const unsigned char *buf = (const unsigned char *)s;
+  const NEOS_SCANTABLES *t;
+  NEOS_SCANTABLES local;
+#ifdef SCAN_X86
+  NEOS_SCAN_LEVEL level;
+#endif
+
+  t = scan_tables(set, &local);
+#ifdef SCAN_X86
+  if (len >= 16)
+  {
+    level = neos_scan_level();
+    if (level >= NEOS_SCAN_AVX2 && len >= 32 && t->nibble)
+      return scan_avx2(t, buf, len);
+    if (level >= NEOS_SCAN_SSE2 && t->nchars <= SCAN_SSE2_MAX_CHARS)
+      return scan_sse2(set, t, buf, len);
+  }
+#endif
+  return scan_scalar(t, buf, len);
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2001-2004 Brandon Long
+ * All Rights Reserved.
+ *
+ * ClearSilver Templating System
+ *
+ * This code is made available under the terms of the ClearSilver License.
+ * http://www.clearsilver.net/license.hdf
+ *
+ */
+
+/*
+ * neos_scan finds the first byte of a buffer which belongs to a small set
+ * of bytes, which is the inner loop of all the escaping routines: most
+ * of the input is copied through unchanged, and only the occasional
+ * metacharacter needs work.  On x86 the scan is done 16 or 32 bytes at
+ * a time with SSE2 or AVX2, picked at runtime based on what the CPU
+ * supports.  Elsewhere, or for short buffers, a plain loop is used.
+ */
+
+#ifndef __NEO_SCAN_H_
+#define __NEO_SCAN_H_ 1
+
+__BEGIN_DECLS
+
+#include "util/neo_misc.h"
+
+/* Lookup tables built from a NEOS_SCANSET */
+typedef struct _neos_scantables
+{
+  unsigned char map[32];      /* bitmap of the bytes in the set */
+  unsigned char lo[16];       /* low and high nibble tables for AVX2 */
+  unsigned char hi[16];
+  int nchars;                 /* strlen(chars) */
+  int nibble;                 /* lo and hi can be used for this set */
+  int high;                   /* all the bytes >= 0x80 are in the set */
+} NEOS_SCANTABLES;
+
+/* A set of bytes to scan for.  A byte c is in the set if it appears in
+ * chars, or if c < below, or if c > above.  Use below = 0 and above = 255
+ * for a set which is just the list in chars.  Sets are normally static
+ * and only list the first three fields in their initializer, the tables
+ * are built the first time the set is used. */
+typedef struct _neos_scanset
+{
+  const char *chars;
+  int below;
+  int above;
+
+  int state;
+  NEOS_SCANTABLES tables;
+} NEOS_SCANSET;
+
+typedef enum
+{
+  NEOS_SCAN_SCALAR = 0,
+  NEOS_SCAN_SSE2 = 1,
+  NEOS_SCAN_AVX2 = 2
+} NEOS_SCAN_LEVEL;
+
+/*
+ * Function: neos_scan - find the first byte in a set
+ * Description: neos_scan looks through the first len bytes of s for a
+ *              byte which is in set.  Only the len bytes are read, s
+ *              does not have to be NUL terminated.  It is safe to use
+ *              the same set from several threads at once.
+ * Input: set - the bytes to look for
+ *        s - the buffer to scan
+ *        len - the length of s
+ * Output: None
+ * Return: the offset of the first byte in the set, or len if there is
+ *         none
+ */
+size_t neos_scan (NEOS_SCANSET *set, const char *s, size_t len);
+
+/*
+ * Function: neos_scan_level - the implementation used by neos_scan
+ * Description: neos_scan_level returns the fastest kernel the CPU
+ *              supports, unless a lower one was requested with
+ *              neos_scan_set_level.
+ * Input: None
+ * Output: None
+ * Return: the NEOS_SCAN_LEVEL in use
+ */
+NEOS_SCAN_LEVEL neos_scan_level (void);
+
+/* Limit neos_scan to the given level, which is mostly useful for testing
+ * and benchmarking the kernels against each other.  Levels the CPU
+ * doesn't support are ignored. */
+void neos_scan_set_level (NEOS_SCAN_LEVEL level);
+
+__END_DECLS
+
+#endif /* __NEO_SCAN_H_ */
@@ -21,6 +21,7 @@
 #include "neo_misc.h"
 #include "neo_err.h"
 #include "neo_str.h"
+#include "neo_scan.h"
 #include "ulist.h"
 
 #ifndef va_copy
@@ -624,106 +625,83 @@ char *repr_string_alloc (const char *s)
   return rs;
 }
 
-NEOERR *neos_js_escape (const char *in, char **esc)
+/* Characters escaped by neos_js_escape and neos_json_escape.
+ * RFC 4627 says only reverse-solidus, quotation mark and control characters
+ * must be escaped in JSON, but we want other characters escaped for safety.
+ */
+static NEOS_SCANSET JSEscapedChars = {"/\"'\\><&;", 32, 255};
+
+/* Append in to out, replacing each character in JSEscapedChars with
+ * prefix followed by its value in hex */
+static NEOERR *hex_escape_to (STRING *out, const char *in, const char *prefix)
 {
-  int nl = 0;
-  int l = 0;
-  unsigned char *buf = (unsigned char *)in;
-  unsigned char *s;
+  NEOERR *err;
+  const unsigned char *buf = (const unsigned char *)in;
+  char hex[3];
+  int len = strlen(in);
+  int run = 0;
+  int l;
 
-  while (buf[l])
+  for (l = neos_scan(&JSEscapedChars, in, len); l < len;
+       l = run + neos_scan(&JSEscapedChars, in + run, len - run))
   {
-    if (buf[l] == '/' || buf[l] == '"' || buf[l] == '\'' ||
-        buf[l] == '\\' || buf[l] == '>' || buf[l] == '<' ||
-        buf[l] == '&' || buf[l] == ';' || buf[l] < 32)
-    {
-      nl += 3;
-    }
-    nl++;
-    l++;
+    err = string_appendn (out, in + run, l - run);
+    if (err) return nerr_pass(err);
+    err = string_append (out, prefix);
+    if (err) return nerr_pass(err);
+    hex[0] = "0123456789ABCDEF"[(buf[l] >> 4) & 0xF];
+    hex[1] = "0123456789ABCDEF"[buf[l] & 0xF];
+    hex[2] = '\0';
+    err = string_appendn (out, hex, 2);
+    if (err) return nerr_pass(err);
+    run = l + 1;
   }
+  return nerr_pass(string_appendn (out, in + run, l - run));
+}
 
-  s = (unsigned char *) malloc (sizeof(unsigned char) * (nl + 1));
-  if (s == NULL)
-    return nerr_raise (NERR_NOMEM, "Unable to allocate memory to escape %s",
-        buf);
-
-  nl = 0; l = 0;
-  while (buf[l])
+/* Used by the functions which return a newly allocated string, buf is
+ * never NULL even if nothing was appended to the STRING */
+static NEOERR *escape_alloc_done (NEOERR *err, STRING *out_s, char **esc)
+{
+  if (err == STATUS_OK && out_s->buf == NULL)
+    err = string_append (out_s, "");
+  if (err)
   {
-    if (buf[l] == '/' || buf[l] == '"' || buf[l] == '\'' ||
-        buf[l] == '\\' || buf[l] == '>' || buf[l] == '<' ||
-        buf[l] == '&' || buf[l] == ';' || buf[l] < 32)
-    {
-      s[nl++] = '\\';
-      s[nl++] = 'x';
-      s[nl++] = "0123456789ABCDEF"[(buf[l] >> 4) & 0xF];
-      s[nl++] = "0123456789ABCDEF"[buf[l] & 0xF];
-      l++;
-    }
-    else
-    {
-      s[nl++] = buf[l++];
-    }
+    string_clear (out_s);
+    return nerr_pass(err);
   }
-  s[nl] = '\0';
-
-  *esc = (char *)s;
+  *esc = out_s->buf;
   return STATUS_OK;
 }
 
-static int is_json_escaped_char(unsigned char c) {
-  // RFC 4627 says only reverse-solidus, quotation mark and control characters
-  // must be escaped in JSON, but we want other characters escaped for safety.
-  return (c == '/' || c == '"' || c == '\'' || c == '\\' ||
-          c == '>' || c == '<' || c == '&' || c == ';' || c < 32);
+NEOERR *neos_js_escape_to (STRING *out, const char *in)
+{
+  return nerr_pass(hex_escape_to(out, in, "\\x"));
 }
 
-NEOERR *neos_json_escape (const char *in, char **esc)
+NEOERR *neos_js_escape (const char *in, char **esc)
 {
-  int new_length = 0;
-  int length = 0;
-  unsigned char *buf = (unsigned char *)in;
-  unsigned char *s;
+  STRING out_s;
 
-  while (buf[length])
-  {
-    if (is_json_escaped_char(buf[length]))
-    {
-      new_length += 5;
-    }
-    new_length++;
-    length++;
-  }
+  *esc = NULL;
+  string_init(&out_s);
+  return nerr_pass(escape_alloc_done(neos_js_escape_to(&out_s, in),
+                                     &out_s, esc));
+}
 
-  s = (unsigned char *) malloc (sizeof(unsigned char) * (new_length + 1));
-  if (s == NULL) {
-    return nerr_raise (NERR_NOMEM, "Unable to allocate memory to escape %s",
-        buf);
-  }
+NEOERR *neos_json_escape_to (STRING *out, const char *in)
+{
+  return nerr_pass(hex_escape_to(out, in, "\\u00"));
+}
 
-  new_length = 0; length = 0;
-  while (buf[length])
-  {
-    if (is_json_escaped_char(buf[length]))
-    {
-      s[new_length++] = '\\';
-      s[new_length++] = 'u';
-      s[new_length++] = '0';
-      s[new_length++] = '0';
-      s[new_length++] = "0123456789ABCDEF"[(buf[length] >> 4) & 0xF];
-      s[new_length++] = "0123456789ABCDEF"[buf[length] & 0xF];
-      length++;
-    }
-    else
-    {
-      s[new_length++] = buf[length++];
-    }
-  }
-  s[new_length] = '\0';
+NEOERR *neos_json_escape (const char *in, char **esc)
+{
+  STRING out_s;
 
-  *esc = (char *)s;
-  return STATUS_OK;
+  *esc = NULL;
+  string_init(&out_s);
+  return nerr_pass(escape_alloc_done(neos_json_escape_to(&out_s, in),
+                                     &out_s, esc));
 }
 
 /* List of all characters that must be escaped
@@ -734,170 +712,178 @@ static char QueryReservedChars[] = "$&+,/:;=?@ \"<>#%{}|\\^~[]`'";
 static char CssReservedChars[] = "\n\r\"'()*<>\\";
 #define IN_LIST(l, c) (strchr(l, c) != NULL)
 
+/* The characters escaped in query strings include all the non-printable
+ * ones, but URLs in CSS only escape the list. */
+static NEOS_SCANSET QueryReservedSet = {QueryReservedChars, 32, 126};
+static NEOS_SCANSET CssReservedSet = {CssReservedChars, 0, 255};
+
+/* Make a NEOS_SCANSET with other added to the reserved characters, chars
+ * needs room for 256 bytes. */
+static void url_escape_set (NEOS_SCANSET *set, char *chars,
+                            const NEOS_SCANSET *reserved, const char *other)
+{
+  const char *lists[2];
+  const char *p;
+  int n = 0;
+  int x;
+
+  /* Each byte only once */
+  lists[0] = reserved->chars;
+  lists[1] = other;
+  for (x = 0; x < 2; x++)
+  {
+    for (p = lists[x]; *p; p++)
+    {
+      if (memchr(chars, *p, n) == NULL)
+        chars[n++] = *p;
+    }
+  }
+  chars[n] = '\0';
+
+  memset(set, 0, sizeof(NEOS_SCANSET));
+  set->chars = chars;
+  set->below = reserved->below;
+  set->above = reserved->above;
+}
+
 /*
  * Apply URL escaping to 'in' and return result in 'esc'.
  * The parameters 'reserved' and 'other' indicate which characters to escape.
- * If 'escape_non_printable' is non zero, all characters < 0x20 and > 0x7E
- * will also be escaped.
  * If map_space_to_plus is true, then ' ' will be mapped to '+'. Else it will be
  * mapped to "%20".
  */
-static NEOERR *url_escape_helper (const char *in, char **esc, char *reserved,
-                                  const char *other, int escape_non_printable,
+static NEOERR *url_escape_helper (STRING *out, const char *in,
+                                  NEOS_SCANSET *reserved, const char *other,
                                   int map_space_to_plus)
 {
-  int nl = 0;
-  int l = 0;
-  int x = 0;
-  unsigned char *buf = (unsigned char *)in;
-  unsigned char *uother = (unsigned char *)other;
-  unsigned char *s;
-  int match = 0;
+  NEOERR *err;
+  const unsigned char *buf = (const unsigned char *)in;
+  NEOS_SCANSET *set = reserved;
+  NEOS_SCANSET other_set;
+  char chars[256];
+  char hex[4];
+  int len = strlen(in);
+  int run = 0;
+  int l;
 
-  while (buf[l])
+  if (other != NULL && other[0] != '\0')
   {
-    if (IN_LIST(reserved, buf[l]) || 
-        (escape_non_printable && (buf[l] < 32 || buf[l] > 126)))
-    {
-      nl += 2;
-    }
-    else if (uother)
-    {
-      x = 0;
-      while (uother[x])
-      {
-        if (uother[x] == buf[l])
-        {
-          nl +=2;
-          break;
-        }
-        x++;
-      }
-    }
-    nl++;
-    l++;
+    url_escape_set(&other_set, chars, reserved, other);
+    set = &other_set;
   }
-
-  s = (unsigned char *) malloc (sizeof(unsigned char) * (nl + 1));
-  if (s == NULL)
-    return nerr_raise (NERR_NOMEM, "Unable to allocate memory to escape %s",
-      buf);
-
-  nl = 0; l = 0;
-  while (buf[l])
+  for (l = neos_scan(set, in, len); l < len;
+       l = run + neos_scan(set, in + run, len - run))
   {
-    match = 0;
-    if (map_space_to_plus && buf[l] == ' ' && IN_LIST(reserved, buf[l]))
+    err = string_appendn (out, in + run, l - run);
+    if (err) return nerr_pass(err);
+    if (map_space_to_plus && buf[l] == ' ' &&
+        IN_LIST(reserved->chars, buf[l]))
     {
-      s[nl++] = '+';
-      l++;
+      err = string_append_char (out, '+');
     }
     else
     {
-      if (IN_LIST(reserved, buf[l]) ||
-          (escape_non_printable && (buf[l] < 32 || buf[l] > 126)))
-      {
-        match = 1;
-      }
-      else if (uother)
-      {
-        x = 0;
-        while (uother[x])
-        {
-          if (uother[x] == buf[l])
-          {
-            match = 1;
-            break;
-          }
-          x++;
-        }
-      }
-      if (match)
-      {
-        s[nl++] = '%';
-        s[nl++] = "0123456789ABCDEF"[buf[l] / 16];
-        s[nl++] = "0123456789ABCDEF"[buf[l] % 16];
-        l++;
-      }
-      else
-      {
-        s[nl++] = buf[l++];
-      }
+      hex[0] = '%';
+      hex[1] = "0123456789ABCDEF"[buf[l] / 16];
+      hex[2] = "0123456789ABCDEF"[buf[l] % 16];
+      hex[3] = '\0';
+      err = string_appendn (out, hex, 3);
     }
+    if (err) return nerr_pass(err);
+    run = l + 1;
   }
-  s[nl] = '\0';
+  return nerr_pass(string_appendn (out, in + run, l - run));
+}
 
-  *esc = (char *)s;
-  return STATUS_OK;
+NEOERR *neos_url_escape_to (STRING *out, const char *in, const char *other)
+{
+  return nerr_pass(url_escape_helper(out, in, &QueryReservedSet, other, 1));
 }
 
 NEOERR *neos_url_escape (const char *in, char **esc,
                          const char *other)
 {
-  return url_escape_helper(in, esc, QueryReservedChars, other, 1, 1);
+  STRING out_s;
+
+  *esc = NULL;
+  string_init(&out_s);
+  return nerr_pass(escape_alloc_done(neos_url_escape_to(&out_s, in, other),
+                                     &out_s, esc));
 }
 
 NEOERR *neos_url_escape_rfc2396(const char *in, char **esc,
                                 const char *other)
 {
-  return url_escape_helper(in, esc, QueryReservedChars, other, 1, 0);
+  STRING out_s;
+
+  *esc = NULL;
+  string_init(&out_s);
+  return nerr_pass(escape_alloc_done(
+          url_escape_helper(&out_s, in, &QueryReservedSet, other, 0),
+          &out_s, esc));
 }
 
-NEOERR *neos_html_escape (const char *src, int slen,
-                          char **out)
+static NEOS_SCANSET HTMLEscapedChars = {"&<>\"'\r", 0, 255};
+
+NEOERR *neos_html_escape_to (STRING *out, const char *src, int slen)
 {
   NEOERR *err = STATUS_OK;
-  STRING out_s;
   int x;
-  char *ptr;
-
-  string_init(&out_s);
-  err = string_append (&out_s, "");
-  if (err) return nerr_pass (err);
-  *out = NULL;
+  int l;
 
   x = 0;
   while (x < slen)
   {
-    ptr = strpbrk(src + x, "&<>\"'\r");
-    if (ptr == NULL || (ptr-src >= slen))
+    l = x + neos_scan(&HTMLEscapedChars, src + x, slen - x);
+    if (l >= slen)
     {
-      err = string_appendn (&out_s, src + x, slen-x);
+      err = string_appendn (out, src + x, slen-x);
       x = slen;
     }
     else
     {
-      err = string_appendn (&out_s, src + x, (ptr - src) - x);
+      err = string_appendn (out, src + x, l - x);
       if (err != STATUS_OK) break;
-      x = ptr - src;
+      x = l;
       if (src[x] == '&')
-        err = string_append (&out_s, "&amp;");
+        err = string_append (out, "&amp;");
       else if (src[x] == '<')
-        err = string_append (&out_s, "&lt;");
+        err = string_append (out, "&lt;");
       else if (src[x] == '>')
-        err = string_append (&out_s, "&gt;");
+        err = string_append (out, "&gt;");
       else if (src[x] == '"')
-        err = string_append (&out_s, "&quot;");
+        err = string_append (out, "&quot;");
       else if (src[x] == '\'')
-        err = string_append (&out_s, "&#39;");
+        err = string_append (out, "&#39;");
       else if (src[x] != '\r')
         err = nerr_raise (NERR_ASSERT, "src[x] == '%c'", src[x]);
       x++;
     }
     if (err != STATUS_OK) break;
   }
-  if (err)
-  {
-    string_clear (&out_s);
-    return nerr_pass (err);
-  }
-  *out = out_s.buf;
-  return STATUS_OK;
+  return nerr_pass(err);
+}
+
+NEOERR *neos_html_escape (const char *src, int slen,
+                          char **out)
+{
+  STRING out_s;
+
+  *out = NULL;
+  string_init(&out_s);
+  return nerr_pass(escape_alloc_done(neos_html_escape_to(&out_s, src, slen),
+                                     &out_s, out));
 }
 
 static NEOERR *css_url_escape(const char *in, char **esc)
 {
-  return url_escape_helper(in, esc, CssReservedChars, NULL, 0, 1);
+  STRING out_s;
+
+  *esc = NULL;
+  string_init(&out_s);
+  return nerr_pass(escape_alloc_done(
+          url_escape_helper(&out_s, in, &CssReservedSet, NULL, 1),
+          &out_s, esc));
 }
 
 char *URL_PROTOCOLS[] = {"http://", "https://", "ftp://", "mailto:"};
@@ -1028,3 +1014,46 @@ NEOERR *neos_var_escape (NEOS_ESCAPE context,
   return nerr_raise(NERR_ASSERT, "unknown escape context supplied: %d",
     context);
 }
+
+NEOERR *neos_var_escape_to (NEOS_ESCAPE context, const char *in,
+                            STRING *out, char **esc)
+{
+  NEOERR *err;
+  int start = out->len;
+  int len;
+
+  *esc = (char *)in;
+
+  /* Most values have nothing in them to escape, and are passed through
+   * without being copied */
+  if (context == NEOS_ESCAPE_NONE ||
+      context == NEOS_ESCAPE_FUNCTION)
+    return STATUS_OK;
+
+  len = strlen(in);
+  /* The same order of precedence as neos_var_escape */
+  if (context & NEOS_ESCAPE_URL)
+  {
+    if (neos_scan(&QueryReservedSet, in, len) == len) return STATUS_OK;
+    err = neos_url_escape_to(out, in, NULL);
+  }
+  else if (context & NEOS_ESCAPE_SCRIPT)
+  {
+    if (neos_scan(&JSEscapedChars, in, len) == len) return STATUS_OK;
+    err = neos_js_escape_to(out, in);
+  }
+  else if (context & NEOS_ESCAPE_HTML)
+  {
+    if (neos_scan(&HTMLEscapedChars, in, len) == len) return STATUS_OK;
+    err = neos_html_escape_to(out, in, len);
+  }
+  else
+  {
+    return nerr_raise(NERR_ASSERT, "unknown escape context supplied: %d",
+                      context);
+  }
+  if (err) return nerr_pass(err);
+
+  *esc = out->buf + start;
+  return STATUS_OK;
+}
@@ -125,6 +125,21 @@ NEOERR *neos_json_escape (const char *in, char **esc);
 NEOERR *neos_html_escape (const char *src, int slen,
                           char **out);
 
+/* Versions of the above which append the escaped string to out instead
+ * of allocating a new one, so a caller can reuse one buffer for many
+ * strings.  If these fail, out may hold part of the escaped string. */
+NEOERR *neos_url_escape_to (STRING *out, const char *in, const char *other);
+NEOERR *neos_js_escape_to (STRING *out, const char *in);
+NEOERR *neos_json_escape_to (STRING *out, const char *in);
+NEOERR *neos_html_escape_to (STRING *out, const char *src, int slen);
+
+/* Like neos_var_escape, but if nothing in in needs escaping for context,
+ * *esc is set to in itself and out is left alone.  Otherwise the escaped
+ * string is appended to out, and *esc points to it inside out->buf (so
+ * it is only valid until out is next changed). */
+NEOERR *neos_var_escape_to (NEOS_ESCAPE context, const char *in,
+                            STRING *out, char **esc);
+
 /* Returns non-zero if input is a URI with a secure protocol scheme.
    Currently allows "http://", "https://", "ftp://", "mailto:",
    schemeless (//, /) and relative URLs.
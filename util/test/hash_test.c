@@ -2,9 +2,12 @@
 #include "cs_config.h"
 #include <unistd.h>
 #include <string.h>
+#include <sys/time.h>
 #include "util/neo_misc.h"
 #include "util/neo_err.h"
 #include "util/neo_hash.h"
+#include "util/neo_str.h"
+#include "util/neo_rand.h"
 
 void dump_string_hash(NE_HASH *hash)
 {
@@ -13,11 +16,11 @@ void dump_string_hash(NE_HASH *hash)
 
   for (x = 0; x < hash->size; x++)
   {
-    ne_warn("Node %d", x);
-    for (node = hash->nodes[x]; node; node = node->next)
-    {
-      ne_warn("  %s = %s [%8x | %d]", (char *)node->key, (char *)node->value, node->hashv, node->hashv & (hash->size - 1));
-    }
+    if (hash->hashes[x] == 0) continue;
+    node = &(hash->nodes[x]);
+    ne_warn("Node %d: %s = %s [%8x | %d]", x, (char *)node->key,
+            (char *)node->value, hash->hashes[x],
+            hash->hashes[x] & (hash->size - 1));
   }
 }
 
@@ -135,10 +138,162 @@ NEOERR *hash_next_test()
   return STATUS_OK;
 }
 
+NEOERR *hash_remove_test()
+{
+  NEOERR *err = STATUS_OK;
+  NE_HASH *hs;
+  char **keys;
+  void *key = NULL;
+  int x, count = 0, num = 5000;
+
+  ne_warn("Running hash_remove_test");
+
+  keys = (char **) calloc(num, sizeof(char *));
+  if (keys == NULL)
+    return nerr_raise(NERR_NOMEM, "Unable to allocate keys");
+  err = ne_hash_init(&hs, ne_hash_str_hash, ne_hash_str_comp);
+  if (err)
+  {
+    free(keys);
+    return nerr_pass(err);
+  }
+
+  for (x = 0; x < num && err == STATUS_OK; x++)
+  {
+    keys[x] = sprintf_alloc("key%d", x);
+    if (keys[x] == NULL)
+      err = nerr_raise(NERR_NOMEM, "Unable to allocate key");
+    else
+      err = ne_hash_insert(hs, keys[x], keys[x]);
+  }
+  /* Inserting an existing key only replaces its value */
+  if (err == STATUS_OK)
+    err = ne_hash_insert(hs, keys[0], keys[1]);
+  if (err == STATUS_OK && (hs->num != num || ne_hash_lookup(hs, "key0") != keys[1]))
+    err = nerr_raise(NERR_ASSERT, "Replacing key0 changed the hash");
+
+  for (x = 0; x < num && err == STATUS_OK; x += 2)
+  {
+    if (ne_hash_remove(hs, keys[x]) == NULL)
+      err = nerr_raise(NERR_ASSERT, "Unable to remove %s", keys[x]);
+  }
+  for (x = 0; x < num && err == STATUS_OK; x++)
+  {
+    if ((ne_hash_lookup(hs, keys[x]) != NULL) != (x & 1))
+      err = nerr_raise(NERR_ASSERT, "Lookup of %s after removal", keys[x]);
+  }
+  while (err == STATUS_OK && ne_hash_next(hs, &key) != NULL)
+  {
+    if (atoi((char *)key + 3) % 2 == 0)
+      err = nerr_raise(NERR_ASSERT, "Removed %s still in hash", (char *)key);
+    count++;
+  }
+  if (err == STATUS_OK && (count != num / 2 || hs->num != num / 2))
+    err = nerr_raise(NERR_ASSERT, "Found %d of %d keys", count, num / 2);
+
+  ne_hash_destroy(&hs);
+  for (x = 0; x < num; x++)
+    free(keys[x]);
+  free(keys);
+  return nerr_pass(err);
+}
+
+/* Not a correctness test: reports how long inserts, lookups and removes
+ * take with n string keys, to compare hash implementations with.  The
+ * keys are looked up in a different order than they were inserted, as
+ * they usually are. */
+NEOERR *hash_bench(int num, int reps)
+{
+  NEOERR *err = STATUS_OK;
+  NE_HASH *hs;
+  char **keys, **misses;
+  char *tmp;
+  long found = 0;
+  double tstart, tend;
+  int x, y, r;
+
+  keys = (char **) calloc(num, sizeof(char *));
+  misses = (char **) calloc(num, sizeof(char *));
+  if (keys == NULL || misses == NULL)
+    return nerr_raise(NERR_NOMEM, "Unable to allocate keys");
+  for (x = 0; x < num; x++)
+  {
+    keys[x] = sprintf_alloc("Posts.%d.Comments", x);
+    misses[x] = sprintf_alloc("Posts.%d.Missing", x);
+    if (keys[x] == NULL || misses[x] == NULL)
+      return nerr_raise(NERR_NOMEM, "Unable to allocate keys");
+  }
+
+  tstart = ne_timef();
+  for (r = 0; r < reps && err == STATUS_OK; r++)
+  {
+    err = ne_hash_init(&hs, ne_hash_str_hash, ne_hash_str_comp);
+    for (x = 0; x < num && err == STATUS_OK; x++)
+      err = ne_hash_insert(hs, keys[x], keys[x]);
+    if (r < reps - 1)
+      ne_hash_destroy(&hs);
+  }
+  tend = ne_timef();
+  if (err) return nerr_pass(err);
+  ne_warn("%d inserts: %5.1fns each", num, (tend - tstart) * 1e9 / num / reps);
+
+  for (x = num - 1; x > 0; x--)
+  {
+    y = neo_rand(x + 1);
+    tmp = keys[x];
+    keys[x] = keys[y];
+    keys[y] = tmp;
+  }
+
+  tstart = ne_timef();
+  for (r = 0; r < reps; r++)
+    for (x = 0; x < num; x++)
+      if (ne_hash_lookup(hs, keys[x])) found++;
+  tend = ne_timef();
+  ne_warn("%ld lookups of existing keys: %5.1fns each", found,
+          (tend - tstart) * 1e9 / num / reps);
+
+  found = 0;
+  tstart = ne_timef();
+  for (r = 0; r < reps; r++)
+    for (x = 0; x < num; x++)
+      if (ne_hash_lookup(hs, misses[x]) == NULL) found++;
+  tend = ne_timef();
+  ne_warn("%ld lookups of missing keys: %5.1fns each", found,
+          (tend - tstart) * 1e9 / num / reps);
+
+  tstart = ne_timef();
+  for (x = 0; x < num; x++)
+    ne_hash_remove(hs, keys[x]);
+  tend = ne_timef();
+  ne_warn("%d removes: %5.1fns each", num, (tend - tstart) * 1e9 / num);
+
+  ne_hash_destroy(&hs);
+  for (x = 0; x < num; x++)
+  {
+    free(keys[x]);
+    free(misses[x]);
+  }
+  free(keys);
+  free(misses);
+  return STATUS_OK;
+}
+
 int main(int argc, char **argv)
 {
   NEOERR *err;
 
+  if (argc > 1)
+  {
+    err = hash_bench(atoi(argv[1]), argc > 2 ? atoi(argv[2]) : 10);
+    if (err)
+    {
+      nerr_log_error(err);
+      return -1;
+    }
+    return 0;
+  }
+
   err = dictionary_test();
   if (err)
   {
@@ -154,6 +309,14 @@ int main(int argc, char **argv)
     printf("FAIL\n");
     return -1;
   }
+
+  err = hash_remove_test();
+  if (err)
+  {
+    nerr_log_error(err);
+    printf("FAIL\n");
+    return -1;
+  }
   printf("PASS\n");
   return 0;
 }
@@ -0,0 +1,141 @@
+
+#include "cs_config.h"
+#include <unistd.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "util/neo_misc.h"
+#include "util/neo_hdf.h"
+#include "util/neo_str.h"
+
+/* Loads an HDF file into a fresh data set reps times, with hdf_init and
+ * with hdf_init_arena, and checks that both build the same data set.
+ * With -m or -a only one kind is loaded, so that the peak memory of
+ * each can be compared in separate runs. */
+
+typedef NEOERR* (*INIT_FUNC)(HDF **hdf);
+
+static NEOERR *change (HDF *hdf)
+{
+  NEOERR *err;
+  char *buf;
+  int x;
+
+  err = hdf_read_string(hdf,
+      "Changed.Attr [foo, bar=\"a b\"] = 1\n"
+      "Changed.Link : Changed.Attr\n"
+      "Changed.Attr [bar=2, baz] = 2\n");
+  if (err) return nerr_pass(err);
+  err = hdf_set_attr(hdf, "Changed.Attr", "foo", NULL);
+  if (err) return nerr_pass(err);
+  err = hdf_set_attr(hdf, "Changed.Attr", "qux", "3");
+  if (err) return nerr_pass(err);
+  for (x = 0; x < 50; x++)
+  {
+    err = hdf_set_valuef(hdf, "Changed.Wide.%d=%d", x, x);
+    if (err) return nerr_pass(err);
+    err = hdf_append_value(hdf, "Changed.Append", "piece ");
+    if (err) return nerr_pass(err);
+  }
+  err = hdf_set_value(hdf, "Changed.Wide.7", "overwritten");
+  if (err) return nerr_pass(err);
+  err = hdf_remove_tree(hdf, "Changed.Wide.20");
+  if (err) return nerr_pass(err);
+  buf = strdup("a buffer");
+  if (buf == NULL) return nerr_raise(NERR_NOMEM, "Unable to allocate buffer");
+  err = hdf_set_buf(hdf, "Changed.Buf", buf);
+  if (err)
+  {
+    free(buf);
+    return nerr_pass(err);
+  }
+  err = hdf_set_value(hdf, "Changed.Link.Child", "via link");
+  if (err) return nerr_pass(err);
+  return nerr_pass(hdf_copy(hdf, "Copied", hdf_get_obj(hdf, "Changed")));
+}
+
+static NEOERR *load (INIT_FUNC init, const char *file, int reps,
+                     char **dump)
+{
+  NEOERR *err = STATUS_OK;
+  HDF *hdf;
+  int x;
+  double tstart, tend;
+
+  tstart = ne_timef();
+  for (x = 0; x < reps; x++)
+  {
+    err = init(&hdf);
+    if (err) return nerr_pass(err);
+    err = hdf_read_file(hdf, file);
+    if (err == STATUS_OK && dump != NULL && x == 0)
+    {
+      err = change(hdf);
+      if (err == STATUS_OK)
+	err = hdf_write_string(hdf, dump);
+    }
+    hdf_destroy(&hdf);
+    if (err) return nerr_pass(err);
+  }
+  tend = ne_timef();
+  ne_warn("%s: %d loads in %5.3fs, %5.4fs/load",
+      init == hdf_init ? "hdf_init" : "hdf_init_arena", reps,
+      tend - tstart, (tend - tstart) / reps);
+  return STATUS_OK;
+}
+
+int main(int argc, char *argv[])
+{
+  NEOERR *err;
+  struct rusage usage;
+  char *file = "test.hdf";
+  char *dump = NULL, *dump_arena = NULL;
+  char *only = NULL;
+  int reps = 100;
+
+  if (argc > 1 && argv[1][0] == '-')
+  {
+    only = argv[1];
+    argc--;
+    argv++;
+  }
+  if (argc > 1)
+    file = argv[1];
+  if (argc > 2)
+    reps = atoi(argv[2]);
+
+  if (only == NULL || !strcmp(only, "-m"))
+  {
+    err = load(hdf_init, file, reps, only ? NULL : &dump);
+    if (err != STATUS_OK)
+    {
+      nerr_log_error(err);
+      return -1;
+    }
+  }
+  if (only == NULL || !strcmp(only, "-a"))
+  {
+    err = load(hdf_init_arena, file, reps, only ? NULL : &dump_arena);
+    if (err != STATUS_OK)
+    {
+      nerr_log_error(err);
+      return -1;
+    }
+  }
+
+  getrusage(RUSAGE_SELF, &usage);
+  ne_warn("peak rss %ldKB", usage.ru_maxrss);
+
+  if (only == NULL)
+  {
+    if (strcmp(dump, dump_arena))
+    {
+      ne_warn("hdf_init and hdf_init_arena data sets differ");
+      return -1;
+    }
+    free(dump);
+    free(dump_arena);
+  }
+
+  return 0;
+}
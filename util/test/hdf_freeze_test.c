@@ -0,0 +1,265 @@
+
+#include "cs_config.h"
+#include <unistd.h>
+#include <string.h>
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+#include "util/neo_misc.h"
+#include "util/neo_hdf.h"
+
+/* Freezes a data set and checks that it reads the same as before, that
+ * nothing can change it any more, and that several threads can read it at
+ * once.  Run under a thread sanitizer to check the reads really are
+ * read-only. */
+
+#define NUM_THREADS 8
+
+static const char *Names[] = { "A.B.C", "A.B", "Link.C", "Link", "Wide.7",
+                               "Wide.49.Value", "Root.Missing", "Wide.99",
+                               NULL };
+
+static NEOERR *setup (HDF **hdf)
+{
+  NEOERR *err;
+  int x;
+
+  err = hdf_init(hdf);
+  if (err) return nerr_pass(err);
+  err = hdf_read_string(*hdf,
+      "A.B.C [type=int] = 42\n"
+      "A.B = b\n"
+      "Link : A.B\n"
+      "Multi << EOM\nline one\nline two\nEOM\n");
+  for (x = 0; x < 50 && err == STATUS_OK; x++)
+    err = hdf_set_valuef(*hdf, "Wide.%d.Value=%d", x, x);
+  if (err == STATUS_OK)
+    err = hdf_set_value(*hdf, NULL, "root");
+  if (err == STATUS_OK)
+    err = hdf_set_attr(*hdf, NULL, "top", "1");
+  if (err) hdf_destroy(hdf);
+  return nerr_pass(err);
+}
+
+/* Each of these must fail with NERR_ASSERT on a frozen data set */
+static NEOERR *check_changes (HDF *hdf)
+{
+  NEOERR *err;
+  HDF *node, *other;
+  char *buf;
+  int x;
+
+  err = hdf_init(&other);
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(other, "Other", "other");
+  if (err)
+  {
+    hdf_destroy(&other);
+    return nerr_pass(err);
+  }
+  buf = strdup("buf");
+  node = hdf_get_obj(hdf, "A.B");
+
+  for (x = 0; x < 15; x++)
+  {
+    switch (x)
+    {
+      case 0: err = hdf_set_value(hdf, "A.B", "changed"); break;
+      case 1: err = hdf_set_value(hdf, "New", "new"); break;
+      case 2: err = hdf_set_value(node, NULL, "changed"); break;
+      case 3: err = hdf_set_int_value(hdf, "A.B.C", 1); break;
+      case 4: err = hdf_set_buf(hdf, "A.B", buf); break;
+      case 5: err = hdf_set_symlink(hdf, "Link", "Wide"); break;
+      case 6: err = hdf_append_value(hdf, "A.B", "more"); break;
+      case 7: err = hdf_set_attr(hdf, "A.B.C", "type", NULL); break;
+      case 8: err = hdf_remove_tree(hdf, "Wide"); break;
+      case 9: err = hdf_sort_obj(hdf, NULL); break;
+      case 10: err = hdf_read_string(hdf, "A.B = read"); break;
+      case 11: err = hdf_copy(hdf, "A", other); break;
+      case 12: err = hdf_set_value(hdf, "Link.C", "via link"); break;
+      case 13: err = hdf_get_node(hdf, "Missing", &node); break;
+      case 14: err = hdf_set_copy(hdf, "A.B", "Wide.1.Value"); break;
+    }
+    if (!nerr_handle(&err, NERR_ASSERT))
+    {
+      if (err) nerr_log_error(err);
+      err = nerr_raise(NERR_ASSERT, "Change %d to a frozen hdf didn't fail", x);
+      break;
+    }
+  }
+  free(buf);
+  hdf_destroy(&other);
+  if (err) return nerr_pass(err);
+
+  /* an existing node doesn't need a change */
+  err = hdf_get_node(hdf, "A.B", &node);
+  if (err) return nerr_pass(err);
+  if (strcmp(hdf_obj_value(node), "b"))
+    return nerr_raise(NERR_ASSERT, "hdf_get_node found %s", node->value);
+  return STATUS_OK;
+}
+
+static NEOERR *check_values (HDF *hdf)
+{
+  HDF *orig;
+  NEOERR *err;
+  int x;
+
+  err = setup(&orig);
+  if (err) return nerr_pass(err);
+  for (x = 0; Names[x]; x++)
+  {
+    if (strcmp(hdf_get_value(orig, Names[x], "none"),
+               hdf_get_value(hdf, Names[x], "none")))
+    {
+      err = nerr_raise(NERR_ASSERT, "%s is %s after freezing", Names[x],
+                       hdf_get_value(hdf, Names[x], "none"));
+      break;
+    }
+  }
+  hdf_destroy(&orig);
+  return nerr_pass(err);
+}
+
+#ifdef HAVE_PTHREADS
+typedef struct _reader
+{
+  pthread_t thread;
+  HDF *hdf;
+  HDF *orig;
+  int errors;
+} READER;
+
+static void *reader (void *arg)
+{
+  READER *r = (READER *) arg;
+  HDF *obj;
+  int x, y;
+
+  for (x = 0; x < 2000; x++)
+  {
+    for (y = 0; Names[y]; y++)
+    {
+      if (strcmp(hdf_get_value(r->orig, Names[y], "none"),
+                 hdf_get_value(r->hdf, Names[y], "none")))
+        r->errors++;
+    }
+    for (obj = hdf_obj_child(hdf_get_obj(r->hdf, "Wide")), y = 0; obj;
+         obj = hdf_obj_next(obj), y++)
+    {
+      if (hdf_get_int_value(obj, "Value", -1) != y) r->errors++;
+    }
+  }
+  return NULL;
+}
+
+static NEOERR *check_threads (HDF *hdf)
+{
+  NEOERR *err;
+  READER readers[NUM_THREADS];
+  int x, errors = 0;
+
+  for (x = 0; x < NUM_THREADS; x++)
+  {
+    readers[x].hdf = hdf;
+    readers[x].errors = 0;
+    err = setup(&(readers[x].orig));
+    if (err) return nerr_pass(err);
+    if (pthread_create(&(readers[x].thread), NULL, reader, &readers[x]))
+      return nerr_raise_errno(NERR_SYSTEM, "Unable to create thread");
+  }
+  for (x = 0; x < NUM_THREADS; x++)
+  {
+    pthread_join(readers[x].thread, NULL);
+    errors += readers[x].errors;
+    hdf_destroy(&(readers[x].orig));
+  }
+  if (errors)
+    return nerr_raise(NERR_ASSERT, "%d bad reads from threads", errors);
+  return STATUS_OK;
+}
+#endif
+
+static NEOERR *freeze_test (void)
+{
+  NEOERR *err;
+  HDF *hdf, *was;
+  char *dump = NULL, *frozen_dump = NULL;
+
+  err = setup(&hdf);
+  if (err) return nerr_pass(err);
+
+  do {
+    err = hdf_write_string(hdf, &dump);
+    if (err) break;
+    err = hdf_freeze(&hdf);
+    if (err) break;
+    if (!hdf_is_frozen(hdf) || !hdf_is_frozen(hdf_get_obj(hdf, "A.B")))
+    {
+      err = nerr_raise(NERR_ASSERT, "Data set isn't frozen");
+      break;
+    }
+    err = hdf_write_string(hdf, &frozen_dump);
+    if (err) break;
+    if (strcmp(dump, frozen_dump))
+    {
+      err = nerr_raise(NERR_ASSERT, "Frozen data set differs:\n%s\n%s",
+                       dump, frozen_dump);
+      break;
+    }
+    if (hdf_get_obj(hdf, "Wide")->hash == NULL)
+    {
+      err = nerr_raise(NERR_ASSERT, "Wide level of frozen data set isn't hashed");
+      break;
+    }
+    if (strcmp(hdf_obj_value(hdf), "root") || hdf_obj_attr(hdf) == NULL)
+    {
+      err = nerr_raise(NERR_ASSERT, "Top node of frozen data set differs");
+      break;
+    }
+    err = check_values(hdf);
+    if (err) break;
+    err = check_changes(hdf);
+    if (err) break;
+
+    /* freezing again does nothing, and only the top can be frozen */
+    was = hdf;
+    err = hdf_freeze(&hdf);
+    if (err) break;
+    if (was != hdf)
+    {
+      err = nerr_raise(NERR_ASSERT, "Froze a frozen data set again");
+      break;
+    }
+    was = hdf_get_obj(hdf, "A");
+    err = hdf_freeze(&was);
+    if (!nerr_handle(&err, NERR_ASSERT))
+    {
+      err = nerr_raise(NERR_ASSERT, "Froze a node which isn't the top");
+      break;
+    }
+#ifdef HAVE_PTHREADS
+    err = check_threads(hdf);
+#endif
+  } while (0);
+
+  if (dump) free(dump);
+  if (frozen_dump) free(frozen_dump);
+  hdf_destroy(&hdf);
+  return nerr_pass(err);
+}
+
+int main(int argc, char *argv[])
+{
+  NEOERR *err;
+
+  err = freeze_test();
+  if (err != STATUS_OK)
+  {
+    nerr_log_error(err);
+    printf("FAIL\n");
+    return -1;
+  }
+  printf("PASS\n");
+  return 0;
+}
@@ -0,0 +1,120 @@
+
+#include "cs_config.h"
+#include <unistd.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "util/neo_misc.h"
+#include "util/neo_hdf.h"
+#include "util/neo_str.h"
+
+/* Builds an array-like data set (Posts.0.Title, Posts.1.Title, ...), where
+ * the same child names repeat in every element, and times looking nodes
+ * up in it.  Run it with different libraries to compare their memory use
+ * and lookup speed. */
+
+static const char *Fields[] = { "Title", "Author", "Date", "Url", "Summary",
+                                "Body", "Score", "Tags", NULL };
+
+int main(int argc, char *argv[])
+{
+  NEOERR *err;
+  HDF *hdf;
+  struct rusage usage;
+  char name[256];
+  char **hits, **misses;
+  int posts = 20000;
+  int reps = 10;
+  int x, y, r, nhits = 0, nmisses = 0;
+  long found = 0;
+  double tstart, tend;
+
+  if (argc > 1)
+    posts = atoi(argv[1]);
+  if (argc > 2)
+    reps = atoi(argv[2]);
+  if (posts < 1 || posts > 1000000)
+  {
+    ne_warn("usage: hdf_names_test [posts [reps]]");
+    return -1;
+  }
+
+  err = hdf_init(&hdf);
+  if (err != STATUS_OK)
+  {
+    nerr_log_error(err);
+    return -1;
+  }
+
+  tstart = ne_timef();
+  for (x = 0; x < posts; x++)
+  {
+    for (y = 0; Fields[y]; y++)
+    {
+      snprintf(name, sizeof(name), "Posts.%d.%s", x, Fields[y]);
+      err = hdf_set_value(hdf, name, "some value");
+      if (err) break;
+    }
+    for (y = 0; y < 5 && err == STATUS_OK; y++)
+    {
+      snprintf(name, sizeof(name), "Posts.%d.Comments.%d.Text", x, y);
+      err = hdf_set_value(hdf, name, "a comment");
+    }
+    if (err != STATUS_OK)
+    {
+      nerr_log_error(err);
+      return -1;
+    }
+  }
+  tend = ne_timef();
+  getrusage(RUSAGE_SELF, &usage);
+  ne_warn("built %d posts in %5.3fs, peak rss %ldKB", posts, tend - tstart,
+          usage.ru_maxrss);
+
+  hits = (char **) calloc(posts * 10, sizeof(char *));
+  misses = (char **) calloc(posts * 2, sizeof(char *));
+  if (hits == NULL || misses == NULL) return -1;
+  for (x = 0; x < posts; x++)
+  {
+    for (y = 0; Fields[y]; y++)
+      hits[nhits++] = sprintf_alloc("Posts.%d.%s", x, Fields[y]);
+    hits[nhits++] = sprintf_alloc("Posts.%d.Comments.4.Text", x);
+    misses[nmisses++] = sprintf_alloc("Posts.%d.Missing", x);
+    misses[nmisses++] = sprintf_alloc("Posts.%d.Comments.9.Text", x);
+  }
+
+  tstart = ne_timef();
+  for (r = 0; r < reps; r++)
+  {
+    for (x = 0; x < nhits; x++)
+    {
+      if (hdf_get_value(hdf, hits[x], NULL)) found++;
+    }
+  }
+  tend = ne_timef();
+  ne_warn("%ld lookups of existing nodes in %5.3fs", found, tend - tstart);
+
+  found = 0;
+  tstart = ne_timef();
+  for (r = 0; r < reps; r++)
+  {
+    for (x = 0; x < nmisses; x++)
+    {
+      if (hdf_get_value(hdf, misses[x], NULL) == NULL) found++;
+    }
+  }
+  tend = ne_timef();
+  ne_warn("%ld lookups of missing nodes in %5.3fs", found, tend - tstart);
+
+  for (x = 0; x < nhits; x++) free(hits[x]);
+  for (x = 0; x < nmisses; x++) free(misses[x]);
+  free(hits);
+  free(misses);
+
+  tstart = ne_timef();
+  hdf_destroy(&hdf);
+  tend = ne_timef();
+  ne_warn("destroyed in %5.3fs", tend - tstart);
+
+  return 0;
+}
@@ -0,0 +1,189 @@
+
+#include "cs_config.h"
+#include <unistd.h>
+#include <string.h>
+#include <sys/time.h>
+#include "util/neo_misc.h"
+#include "util/neo_hdf.h"
+
+/* Checks that compiled paths find and set the same nodes as the names
+ * they were compiled from, and times looking up a deep name both ways. */
+
+static const char *Names[] = { "", "A", "A.B", "A.B.C", "Wide.7.Value",
+                               "Wide.23.Value", "Link.C", "Link.New.Child",
+                               "Missing", "A.B.Missing", NULL };
+
+static NEOERR *check (HDF *hdf)
+{
+  NEOERR *err;
+  HDF_PATH *path;
+  const char *a, *b;
+  int x;
+
+  for (x = 0; Names[x]; x++)
+  {
+    err = hdf_path_compile(&path, Names[x]);
+    if (err) return nerr_pass(err);
+    a = hdf_get_value(hdf, Names[x], "none");
+    b = hdf_get_value_p(hdf, path, "none");
+    if (strcmp(a, b) || hdf_get_obj(hdf, Names[x]) != hdf_get_obj_p(hdf, path)
+        || hdf_get_int_value(hdf, Names[x], -1) !=
+           hdf_get_int_value_p(hdf, path, -1))
+    {
+      hdf_path_destroy(&path);
+      return nerr_raise(NERR_ASSERT, "%s: %s != %s", Names[x], a, b);
+    }
+    hdf_path_destroy(&path);
+  }
+  return STATUS_OK;
+}
+
+static NEOERR *setup (HDF **hdf)
+{
+  NEOERR *err;
+  int x;
+
+  err = hdf_init(hdf);
+  if (err) return nerr_pass(err);
+  for (x = 0; x < 30 && err == STATUS_OK; x++)
+    err = hdf_set_valuef(*hdf, "Wide.%d.Value=%d", x, x);
+  if (err == STATUS_OK)
+    err = hdf_read_string(*hdf, "A.B.C = 42\nA.B = b\nLink : A.B\n");
+  if (err) hdf_destroy(hdf);
+  return nerr_pass(err);
+}
+
+static NEOERR *path_test (void)
+{
+  NEOERR *err;
+  HDF *hdf, *hdf2;
+  HDF_PATH *path;
+  char *dump, *dump2;
+  int x;
+
+  err = setup(&hdf);
+  if (err) return nerr_pass(err);
+  err = setup(&hdf2);
+  if (err)
+  {
+    hdf_destroy(&hdf);
+    return nerr_pass(err);
+  }
+
+  err = check(hdf);
+
+  /* Setting through paths builds the same data set, links included */
+  for (x = 0; Names[x] && err == STATUS_OK; x++)
+  {
+    err = hdf_path_compile(&path, Names[x]);
+    if (err) break;
+    err = hdf_set_value(hdf, Names[x], Names[x]);
+    if (err == STATUS_OK)
+      err = hdf_set_value_p(hdf2, path, Names[x]);
+    hdf_path_destroy(&path);
+  }
+  if (err == STATUS_OK)
+    err = check(hdf);
+  if (err == STATUS_OK)
+    err = hdf_write_string(hdf, &dump);
+  if (err == STATUS_OK)
+  {
+    err = hdf_write_string(hdf2, &dump2);
+    if (err == STATUS_OK)
+    {
+      if (strcmp(dump, dump2))
+        err = nerr_raise(NERR_ASSERT, "Set by path differs:\n%s\n%s", dump,
+                         dump2);
+      free(dump2);
+    }
+    free(dump);
+  }
+  hdf_destroy(&hdf);
+  hdf_destroy(&hdf2);
+  if (err) return nerr_pass(err);
+
+  err = hdf_path_compile(&path, "A..B");
+  if (err == STATUS_OK || path != NULL)
+  {
+    hdf_path_destroy(&path);
+    return nerr_raise(NERR_ASSERT, "Compiled a path with an empty component");
+  }
+  nerr_ignore(&err);
+  return STATUS_OK;
+}
+
+static NEOERR *path_bench (int reps)
+{
+  NEOERR *err;
+  HDF *hdf;
+  HDF_PATH *path;
+  const char *name = "Page.Section.Articles.Article.Title";
+  double tstart, tend;
+  long found = 0;
+  int x;
+
+  err = hdf_init(&hdf);
+  if (err) return nerr_pass(err);
+  for (x = 0; x < 50 && err == STATUS_OK; x++)
+  {
+    err = hdf_set_valuef(hdf, "Page.Section%d=%d", x, x);
+    if (err == STATUS_OK)
+      err = hdf_set_valuef(hdf, "Page.Section.Articles.Article.Field%d=%d",
+                           x, x);
+  }
+  if (err == STATUS_OK)
+    err = hdf_set_value(hdf, name, "title");
+  if (err == STATUS_OK)
+    err = hdf_path_compile(&path, name);
+  if (err)
+  {
+    hdf_destroy(&hdf);
+    return nerr_pass(err);
+  }
+
+  tstart = ne_timef();
+  for (x = 0; x < reps; x++)
+    if (hdf_get_value(hdf, name, NULL)) found++;
+  tend = ne_timef();
+  ne_warn("%ld hdf_get_value in %5.3fs", found, tend - tstart);
+
+  found = 0;
+  tstart = ne_timef();
+  for (x = 0; x < reps; x++)
+    if (hdf_get_value_p(hdf, path, NULL)) found++;
+  tend = ne_timef();
+  ne_warn("%ld hdf_get_value_p in %5.3fs", found, tend - tstart);
+
+  tstart = ne_timef();
+  for (x = 0; x < reps && err == STATUS_OK; x++)
+    err = hdf_set_value(hdf, name, "title");
+  tend = ne_timef();
+  ne_warn("%d hdf_set_value in %5.3fs", reps, tend - tstart);
+
+  tstart = ne_timef();
+  for (x = 0; x < reps && err == STATUS_OK; x++)
+    err = hdf_set_value_p(hdf, path, "title");
+  tend = ne_timef();
+  ne_warn("%d hdf_set_value_p in %5.3fs", reps, tend - tstart);
+
+  hdf_path_destroy(&path);
+  hdf_destroy(&hdf);
+  return nerr_pass(err);
+}
+
+int main(int argc, char *argv[])
+{
+  NEOERR *err;
+
+  err = path_test();
+  if (err == STATUS_OK)
+    err = path_bench(argc > 1 ? atoi(argv[1]) : 1000000);
+  if (err != STATUS_OK)
+  {
+    nerr_log_error(err);
+    printf("FAIL\n");
+    return -1;
+  }
+  printf("PASS\n");
+  return 0;
+}
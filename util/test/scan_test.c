@@ -0,0 +1,271 @@
+#include "cs_config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "util/neo_misc.h"
+#include "util/neo_err.h"
+#include "util/neo_str.h"
+#include "util/neo_scan.h"
+#include "test_macros.h"
+
+static NEOS_SCANSET Sets[] = {
+  {"&<>\"'\r", 0, 255},                          /* html */
+  {"/\"'\\><&;", 32, 255},                       /* js */
+  {"&<>\"'/\\;=\t\n\v\f\r \x7f", 32, 255},       /* js unquoted attr */
+  {"$&+,/:;=?@ \"<>#%{}|\\^~[]`'", 32, 126},     /* url */
+  {"\n\r\"'()*<>\\", 0, 255},                    /* css url */
+  {"<", 0, 255},
+  {"a\xe9", 0, 255},                             /* non-ASCII */
+  {"", 0x90, 255},
+  {"", 0, 0x7f},
+};
+#define NUM_SETS (sizeof(Sets) / sizeof(Sets[0]))
+
+static char *Levels[] = {"scalar", "sse2", "avx2"};
+
+static size_t ref_scan (NEOS_SCANSET *set, const char *s, size_t len)
+{
+  size_t x;
+  int c;
+
+  for (x = 0; x < len; x++)
+  {
+    c = (unsigned char) s[x];
+    if (c < set->below || c > set->above) break;
+    if (c && strchr(set->chars, c) != NULL) break;
+  }
+  return x;
+}
+
+/* Check every kernel against the simple loop above on random buffers of
+ * all the lengths around the 16 and 32 byte block sizes, with the
+ * buffer at the very end of a malloc'd block so reads past the end show
+ * up under valgrind or ASan. */
+static void check_scan (void)
+{
+  int level, top = neos_scan_level();
+  size_t len, x, got, want;
+  unsigned int i, iter;
+  char *buf;
+
+  for (level = 0; level <= top; level++)
+  {
+    neos_scan_set_level((NEOS_SCAN_LEVEL) level);
+    for (len = 0; len < 100; len++)
+    {
+      buf = (char *) malloc(len + 1);
+      for (iter = 0; iter < 200; iter++)
+      {
+        for (x = 0; x < len; x++)
+        {
+          /* mostly letters, so the first hit moves around */
+          if (rand() % 8)
+            buf[x] = 'b' + rand() % 20;
+          else
+            buf[x] = 1 + rand() % 255;
+        }
+        for (i = 0; i < NUM_SETS; i++)
+        {
+          got = neos_scan(&Sets[i], buf, len);
+          want = ref_scan(&Sets[i], buf, len);
+          if (got != want)
+          {
+            ne_warn("FAIL: %s set %d len %d got %d want %d", Levels[level],
+                    i, (int)len, (int)got, (int)want);
+            exit(-1);
+          }
+        }
+      }
+      free(buf);
+    }
+  }
+  neos_scan_set_level(NEOS_SCAN_AVX2);
+}
+
+/* The escapers have to give the same answer at every level */
+static void check_escape (void)
+{
+  char *in = "<a href=\"/x?a=1&b=2\">it's a \"test\"</a>\r\n"
+             "plain text long enough for the vector kernels; done";
+  char *want[4], *got;
+  int level, top = neos_scan_level();
+
+  neos_scan_set_level(NEOS_SCAN_SCALAR);
+  DIE_NOT_OK(neos_html_escape(in, strlen(in), &want[0]));
+  DIE_NOT_OK(neos_js_escape(in, &want[1]));
+  DIE_NOT_OK(neos_json_escape(in, &want[2]));
+  DIE_NOT_OK(neos_url_escape(in, &want[3], "pl\xe9"));
+  CHECK_STREQ(want[0], "&lt;a href=&quot;/x?a=1&amp;b=2&quot;&gt;it&#39;s a "
+              "&quot;test&quot;&lt;/a&gt;\n"
+              "plain text long enough for the vector kernels; done");
+  for (level = 1; level <= top; level++)
+  {
+    neos_scan_set_level((NEOS_SCAN_LEVEL) level);
+    DIE_NOT_OK(neos_html_escape(in, strlen(in), &got));
+    CHECK_STREQ(got, want[0]);
+    free(got);
+    DIE_NOT_OK(neos_js_escape(in, &got));
+    CHECK_STREQ(got, want[1]);
+    free(got);
+    DIE_NOT_OK(neos_json_escape(in, &got));
+    CHECK_STREQ(got, want[2]);
+    free(got);
+    DIE_NOT_OK(neos_url_escape(in, &got, "pl\xe9"));
+    CHECK_STREQ(got, want[3]);
+    free(got);
+  }
+  for (level = 0; level < 4; level++)
+    free(want[level]);
+  neos_scan_set_level(NEOS_SCAN_AVX2);
+}
+
+static double now (void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Build a corpus of about size bytes by repeating the pieces in random
+ * order */
+static char *make_corpus (char **pieces, int count, int size)
+{
+  char *buf = (char *) malloc(size + 1);
+  int len = 0, l;
+  char *p;
+
+  while (len < size)
+  {
+    p = pieces[rand() % count];
+    l = strlen(p);
+    if (len + l > size) l = size - len;
+    memcpy(buf + len, p, l);
+    len += l;
+  }
+  buf[len] = '\0';
+  return buf;
+}
+
+static char *HTMLPieces[] = {
+  "<div class=\"item\">", "</div>\n", "<a href=\"/view?id=12&amp;s=1\">",
+  "</a>", "<span>", "</span>", "Posted by ", "in reply to the ",
+  "<td align=\"right\">", "</td>", "the quick brown fox jumps ",
+  "over the lazy dog. ", "<br/>", "&nbsp;", "It's ",
+};
+
+static char *TextPieces[] = {
+  "the ", "of ", "and ", "a ", "to ", "in ", "is ", "you ", "that ", "it ",
+  "he ", "was ", "for ", "on ", "are ", "as ", "with ", "his ", "they ",
+  "I ", "at ", "be ", "this ", "have ", "from ", "or ", "one ", "had ",
+  "by ", "word ", "but ", "not ", "what ", "all ", "were ", "we ", "when ",
+  "your ", "can ", "said ", "there ", "use ", "an ", "each ", "which ",
+  "she ", "do ", "how ", "their ", "if ", "will ", "up ", "other ",
+  "about ", "out ", "many ", "then ", "them ", "these ", "so ", "some ",
+  "her ", "would ", "make ", "like ", "him ", "into ", "time ", "has ",
+  "look ", "two ", "more ", "write ", "go ", "see ", "number ", "no ",
+  "way ", "could ", "people ", "my ", "than ", "first ", "water ", "been ",
+  "call ", "who ", "oil ", "its ", "now ", "find ", "long ", "down ",
+  "day ", "did ", "get ", "come ", "made ", "may ", "part ", "Tom's ",
+  "\"quoted\" ", "A&B ", "1 < 2 ", "\n",
+};
+
+/* For comparison, the way the escapers used to look for the next
+ * character to escape */
+static size_t strpbrk_scan (const char *s, size_t len)
+{
+  char *p = strpbrk(s, "&<>\"'\r");
+  return p ? (size_t)(p - s) : len;
+}
+
+static void bench_corpus (const char *name, char *corpus, int reps)
+{
+  int set_ids[] = {0, 1, 3};
+  char *set_names[] = {"html", "js", "url"};
+  size_t len = strlen(corpus);
+  size_t x, total;
+  double start, t;
+  int i, r, level, top = neos_scan_level();
+  STRING out;
+
+  for (i = 0; i < 3; i++)
+  {
+    for (level = 0; level <= top; level++)
+    {
+      neos_scan_set_level((NEOS_SCAN_LEVEL) level);
+      total = 0;
+      start = now();
+      for (r = 0; r < reps; r++)
+      {
+        for (x = 0; x < len; x++)
+        {
+          x += neos_scan(&Sets[set_ids[i]], corpus + x, len - x);
+          total++;
+        }
+      }
+      t = now() - start;
+      printf("%-5s scan %-4s %-6s %8.1f MB/s  (%d hits)\n", name,
+             set_names[i], Levels[level],
+             len * (double)reps / t / 1000000.0, (int)(total / reps));
+    }
+  }
+
+  total = 0;
+  start = now();
+  for (r = 0; r < reps; r++)
+  {
+    for (x = 0; x < len; x++)
+    {
+      x += strpbrk_scan(corpus + x, len - x);
+      total++;
+    }
+  }
+  t = now() - start;
+  printf("%-5s scan html strpbrk %7.1f MB/s  (%d hits)\n", name,
+         len * (double)reps / t / 1000000.0, (int)(total / reps));
+
+  for (level = 0; level <= top; level++)
+  {
+    neos_scan_set_level((NEOS_SCAN_LEVEL) level);
+    string_init(&out);
+    start = now();
+    for (r = 0; r < reps; r++)
+    {
+      out.len = 0;
+      DIE_NOT_OK(neos_html_escape_to(&out, corpus, len));
+    }
+    t = now() - start;
+    printf("%-5s neos_html_escape_to %-6s %8.1f MB/s\n", name, Levels[level],
+           len * (double)reps / t / 1000000.0);
+    string_clear(&out);
+  }
+  neos_scan_set_level(NEOS_SCAN_AVX2);
+}
+
+static void bench (void)
+{
+  char *corpus;
+
+  printf("neos_scan level: %s\n", Levels[neos_scan_level()]);
+  corpus = make_corpus(HTMLPieces,
+                       sizeof(HTMLPieces) / sizeof(HTMLPieces[0]), 1 << 20);
+  bench_corpus("html", corpus, 50);
+  free(corpus);
+  corpus = make_corpus(TextPieces,
+                       sizeof(TextPieces) / sizeof(TextPieces[0]), 1 << 20);
+  bench_corpus("text", corpus, 50);
+  free(corpus);
+}
+
+int main(int argc, char *argv[])
+{
+  srand(1);
+  check_scan();
+  check_escape();
+  if (argc > 1 && !strcmp(argv[1], "-bench"))
+    bench();
+  else
+    ne_warn("PASS");
+  return 0;
+}